@@ -9,7 +9,9 @@
 
 #include "skeinwrap.h"
 
+#ifndef EKEY_ENGINE
 static unsigned char keybuf[44]; /* 12 bytes serial, 32 bytes secret */
+#endif
 
 void 
 PrepareSkein(EKeySkein *skein,
@@ -17,6 +19,10 @@ PrepareSkein(EKeySkein *skein,
               const unsigned char *secret,
               const char *personalisation)
 {
+#ifdef EKEY_ENGINE
+  /* the host engine library may key connections from several threads */
+  unsigned char keybuf[44];
+#endif
   int i;
   for (i = 0; i < 12; ++i) keybuf[i] = serial[i];
   for (i = 0; i < 32; ++i) keybuf[i + 12] = secret[i];
@@ -0,0 +1,563 @@
+/* daemon/capture.c
+ *
+ * Entropy key stream capture and replay
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef EKEY_OS_LINUX
+#include <sys/timerfd.h>
+#endif
+
+#include "pem.h"
+#include "util.h"
+#include "stream.h"
+#include "capture.h"
+
+/** Milliseconds a replay waits for the host to make a recorded write before
+ * deciding the connection has diverged from the capture and skipping it.
+ */
+#define REPLAY_SYNC_TIMEOUT 1000
+
+/** Length of the nonce carried in a keying request. */
+#define REPLAY_NONCE_LEN 12
+
+/** A stream being recorded. */
+typedef struct capture_s {
+    struct capture_s *next;
+    int fd; /**< The recorded stream's file descriptor. */
+    FILE *out; /**< The capture file. */
+    uint64_t start; /**< Monotonic time recording started. */
+    estream_read_fn *read; /**< The stream's own read function. */
+    estream_write_fn *write; /**< The stream's own write function. */
+    estream_close_fn *close; /**< The stream's own close function. */
+} capture_t;
+
+static capture_t *captures;
+
+static capture_t *
+find_capture(int fd)
+{
+    capture_t *cap;
+
+    for (cap = captures; cap != NULL; cap = cap->next) {
+        if (cap->fd == fd)
+            return cap;
+    }
+    return NULL;
+}
+
+static void
+capture_put(capture_t *cap, uint8_t type, const void *buf, size_t count)
+{
+    uint8_t hdr[CAPTURE_HDR_LEN];
+    uint32_t offset = (uint32_t)(monotonic_ms() - cap->start);
+
+    if (cap->out == NULL)
+        return;
+
+    hdr[0] = offset >> 24;
+    hdr[1] = offset >> 16;
+    hdr[2] = offset >> 8;
+    hdr[3] = offset;
+    hdr[4] = type;
+    hdr[5] = count >> 8;
+    hdr[6] = count;
+
+    if ((fwrite(hdr, sizeof(hdr), 1, cap->out) != 1) ||
+        (fwrite(buf, count, 1, cap->out) != 1)) {
+        syslog(LOG_ERR, "Capture write failed, recording stopped");
+        fclose(cap->out);
+        cap->out = NULL;
+    }
+}
+
+static ssize_t
+capture_read(int fd, void *buf, size_t count)
+{
+    capture_t *cap = find_capture(fd);
+    ssize_t rd;
+
+    if (cap == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* records carry at most 64k, the framer never asks for that much */
+    if (count > 0xffff)
+        count = 0xffff;
+
+    rd = cap->read(fd, buf, count);
+    if (rd > 0)
+        capture_put(cap, CAPTURE_READ, buf, rd);
+
+    return rd;
+}
+
+static ssize_t
+capture_write(int fd, const void *buf, size_t count)
+{
+    capture_t *cap = find_capture(fd);
+    ssize_t wr;
+
+    if (cap == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (count > 0xffff)
+        count = 0xffff;
+
+    wr = cap->write(fd, buf, count);
+    if (wr > 0)
+        capture_put(cap, CAPTURE_WRITE, buf, wr);
+
+    return wr;
+}
+
+static int
+capture_close(int fd)
+{
+    capture_t **prev;
+    capture_t *cap;
+    estream_close_fn *close_fn;
+
+    for (prev = &captures; *prev != NULL; prev = &(*prev)->next) {
+        if ((*prev)->fd == fd)
+            break;
+    }
+
+    cap = *prev;
+    if (cap == NULL)
+        return close(fd);
+
+    *prev = cap->next;
+    close_fn = cap->close;
+
+    if (cap->out != NULL)
+        fclose(cap->out);
+    free(cap);
+
+    return (close_fn != NULL) ? close_fn(fd) : 0;
+}
+
+/* exported function documented in capture.h */
+bool
+estream_record(estream_state_t *stream, const char *fname)
+{
+    struct stat sbuf;
+    capture_t *cap;
+    int fd;
+
+    if (stream == NULL) {
+        errno = EBADF;
+        return false;
+    }
+
+    if (find_capture(stream->fd) != NULL) {
+        errno = EBUSY;
+        return false;
+    }
+
+    /* a capture holds the key's traffic, keep it private to the daemon and
+     * do not let it be pointed at someone else's file
+     */
+    fd = open(fname, O_WRONLY | O_CREAT | O_NOCTTY | O_NOFOLLOW,
+              S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return false;
+
+    if ((fstat(fd, &sbuf) == -1) || !S_ISREG(sbuf.st_mode) ||
+        (sbuf.st_uid != geteuid())) {
+        close(fd);
+        errno = EPERM;
+        return false;
+    }
+
+    if ((fchmod(fd, S_IRUSR | S_IWUSR) == -1) || (ftruncate(fd, 0) == -1)) {
+        close(fd);
+        return false;
+    }
+
+    cap = calloc(1, sizeof(*cap));
+    if (cap == NULL) {
+        close(fd);
+        return false;
+    }
+
+    cap->out = fdopen(fd, "wb");
+    if (cap->out == NULL) {
+        close(fd);
+        free(cap);
+        return false;
+    }
+
+    if (fwrite(CAPTURE_MAGIC, strlen(CAPTURE_MAGIC), 1, cap->out) != 1) {
+        fclose(cap->out);
+        free(cap);
+        return false;
+    }
+
+    cap->fd = stream->fd;
+    cap->start = monotonic_ms();
+    cap->read = stream->estream_read;
+    cap->write = stream->estream_write;
+    cap->close = stream->estream_close;
+
+    cap->next = captures;
+    captures = cap;
+
+    stream->estream_read = capture_read;
+    stream->estream_write = capture_write;
+    stream->estream_close = capture_close;
+    stream->passable = false; /* the recording cannot follow it */
+
+    syslog(LOG_INFO, "Recording %s to %s", stream->uri, fname);
+
+    return true;
+}
+
+#ifdef EKEY_OS_LINUX
+
+/** A capture being replayed. */
+typedef struct replay_s {
+    struct replay_s *next;
+    int tfd; /**< Timer, readable when the replay may be read; the stream fd. */
+    estream_state_t *stream; /**< The stream the replay is presented as. */
+    bool fast; /**< Ignore recorded timestamps. */
+
+    const uint8_t *map; /**< The mapped capture file. */
+    size_t size; /**< Size of the capture file. */
+    size_t off; /**< Offset of the next record header. */
+
+    uint8_t type; /**< Type of the current record, 0 at end of capture. */
+    uint32_t due; /**< Recorded offset of the current record. */
+    const uint8_t *data; /**< Unconsumed data of the current record. */
+    size_t left; /**< Length of \a data. */
+
+    uint64_t start; /**< Monotonic time the replay started. */
+    uint64_t wait_since; /**< Monotonic time the current write became due. */
+    uint64_t bytes; /**< Bytes returned to the reader. */
+    uint8_t nonce[REPLAY_NONCE_LEN]; /**< Nonce of the recorded keying request. */
+} replay_t;
+
+static replay_t *replays;
+
+static replay_t *
+find_replay(int fd)
+{
+    replay_t *replay;
+
+    for (replay = replays; replay != NULL; replay = replay->next) {
+        if (replay->tfd == fd)
+            return replay;
+    }
+    return NULL;
+}
+
+/** Arm the replay timer to fire at a monotonic time in milliseconds.
+ *
+ * A time in the past makes the stream readable immediately.
+ */
+static void
+replay_arm(replay_t *replay, uint64_t when)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = when / 1000;
+    its.it_value.tv_nsec = (when % 1000) * 1000000;
+    if ((its.it_value.tv_sec == 0) && (its.it_value.tv_nsec == 0))
+        its.it_value.tv_nsec = 1; /* zero would disarm the timer */
+
+    timerfd_settime(replay->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/** Arm the timer for when the current record next needs attention. */
+static void
+replay_schedule(replay_t *replay)
+{
+    switch (replay->type) {
+    case CAPTURE_WRITE:
+        replay_arm(replay, replay->wait_since + REPLAY_SYNC_TIMEOUT);
+        break;
+
+    case CAPTURE_READ:
+        if (!replay->fast) {
+            replay_arm(replay, replay->start + replay->due);
+            break;
+        }
+        /* fall through */
+
+    default:
+        replay_arm(replay, 0);
+        break;
+    }
+}
+
+/** Move on to the next record in the capture. */
+static void
+replay_advance(replay_t *replay)
+{
+    const uint8_t *hdr = replay->map + replay->off;
+    size_t len;
+
+    replay->stream->nonce = NULL;
+
+    if (replay->off + CAPTURE_HDR_LEN > replay->size) {
+        replay->type = 0;
+        return;
+    }
+
+    len = (hdr[5] << 8) | hdr[6];
+    if (replay->off + CAPTURE_HDR_LEN + len > replay->size) {
+        syslog(LOG_WARNING, "Replay %s: capture is truncated", replay->stream->uri);
+        replay->type = 0;
+        return;
+    }
+
+    replay->due = ((uint32_t)hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+    replay->type = hdr[4];
+    replay->data = hdr + CAPTURE_HDR_LEN;
+    replay->left = len;
+    replay->off += CAPTURE_HDR_LEN + len;
+
+    if (replay->type == CAPTURE_WRITE) {
+        replay->wait_since = monotonic_ms();
+
+        /* a keying request; the recorded reply is only valid for its nonce */
+        if ((len >= 1 + PEM64_CHARS_NEEDED(REPLAY_NONCE_LEN)) &&
+            (replay->data[0] == 'K')) {
+            pem64_decode_bytes((const char *)replay->data + 1,
+                               PEM64_CHARS_NEEDED(REPLAY_NONCE_LEN),
+                               replay->nonce);
+            replay->stream->nonce = replay->nonce;
+        }
+    } else if (replay->type != CAPTURE_READ) {
+        syslog(LOG_WARNING, "Replay %s: bad record type %u", replay->stream->uri, replay->type);
+        replay->type = 0;
+    }
+}
+
+static ssize_t
+replay_read(int fd, void *buf, size_t count)
+{
+    replay_t *replay = find_replay(fd);
+    uint64_t expirations;
+    uint64_t now;
+
+    if (replay == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* clear the timer's readability, it is rearmed below as required */
+    if (read(fd, &expirations, sizeof(expirations)) < 0) {
+        /* nothing pending */
+    }
+
+    now = monotonic_ms();
+
+    if (replay->type == CAPTURE_WRITE) {
+        if ((now - replay->wait_since) < REPLAY_SYNC_TIMEOUT) {
+            replay_schedule(replay);
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+        syslog(LOG_WARNING, "Replay %s: host did not make recorded write, skipped",
+               replay->stream->uri);
+        replay_advance(replay);
+    }
+
+    if (replay->type == 0) {
+        /* end of capture */
+        return 0;
+    }
+
+    if (!replay->fast && ((replay->start + replay->due) > now)) {
+        replay_schedule(replay);
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    if (count > replay->left)
+        count = replay->left;
+
+    memcpy(buf, replay->data, count);
+    replay->data += count;
+    replay->left -= count;
+    replay->bytes += count;
+
+    /* look ahead so a keying request's nonce is known before the host
+     * handles the bytes just returned
+     */
+    if (replay->left == 0)
+        replay_advance(replay);
+
+    replay_schedule(replay);
+
+    return count;
+}
+
+static ssize_t
+replay_write(int fd, const void *buf, size_t count)
+{
+    replay_t *replay = find_replay(fd);
+
+    if (replay == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* the host's write stands in for the recorded one */
+    if (replay->type == CAPTURE_WRITE) {
+        replay_advance(replay);
+        replay_schedule(replay);
+    }
+
+    return count;
+}
+
+static int
+replay_close(int fd)
+{
+    replay_t **prev;
+    replay_t *replay;
+    uint64_t elapsed;
+
+    for (prev = &replays; *prev != NULL; prev = &(*prev)->next) {
+        if ((*prev)->tfd == fd)
+            break;
+    }
+
+    replay = *prev;
+    if (replay == NULL)
+        return close(fd);
+
+    *prev = replay->next;
+
+    elapsed = monotonic_ms() - replay->start;
+    syslog(LOG_INFO, "Replay %s %s: %llu bytes in %llums (%llu bytes/s)",
+           replay->stream->uri, (replay->type == 0) ? "complete" : "stopped",
+           (unsigned long long)replay->bytes, (unsigned long long)elapsed,
+           (unsigned long long)((replay->bytes * 1000) / (elapsed ? elapsed : 1)));
+
+    munmap((void *)replay->map, replay->size);
+    free(replay);
+
+    return close(fd);
+}
+
+/* exported function documented in capture.h */
+estream_state_t *
+estream_replay_open(const char *fname, bool fast)
+{
+    const char *prefix = fast ? REPLAY_FAST_PREFIX : REPLAY_PREFIX;
+    estream_state_t *stream_state;
+    replay_t *replay;
+    struct stat sbuf;
+    void *map;
+    int fd;
+    int saved_errno;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &sbuf) == -1) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    if ((size_t)sbuf.st_size < strlen(CAPTURE_MAGIC)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    if (memcmp(map, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+        munmap(map, sbuf.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    replay = calloc(1, sizeof(*replay));
+    stream_state = calloc(1, sizeof(estream_state_t));
+    if ((replay == NULL) || (stream_state == NULL)) {
+        free(replay);
+        free(stream_state);
+        munmap(map, sbuf.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    replay->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (replay->tfd == -1) {
+        saved_errno = errno;
+        free(replay);
+        free(stream_state);
+        munmap(map, sbuf.st_size);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    stream_state->uri = malloc(strlen(prefix) + strlen(fname) + 1);
+    if (stream_state->uri != NULL) {
+        strcpy(stream_state->uri, prefix);
+        strcat(stream_state->uri, fname);
+    }
+    stream_state->fd = replay->tfd;
+    stream_state->estream_read = replay_read;
+    stream_state->estream_write = replay_write;
+    stream_state->estream_close = replay_close;
+    stream_state->simulated = true;
+
+    replay->stream = stream_state;
+    replay->fast = fast;
+    replay->map = map;
+    replay->size = sbuf.st_size;
+    replay->off = strlen(CAPTURE_MAGIC);
+    replay->start = monotonic_ms();
+
+    replay->next = replays;
+    replays = replay;
+
+    replay_advance(replay);
+    replay_schedule(replay);
+
+    return stream_state;
+}
+
+#else
+
+/* exported function documented in capture.h */
+estream_state_t *
+estream_replay_open(const char *fname, bool fast)
+{
+    /* replay is paced by a timerfd */
+    errno = ENOSYS;
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,74 @@
+/* daemon/capture.h
+ *
+ * Entropy key stream capture and replay
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_CAPTURE_H
+#define DAEMON_CAPTURE_H
+
+#include <stdbool.h>
+
+#include "stream.h"
+
+/** Prefix of stream names which replay a capture at its recorded pace. */
+#define REPLAY_PREFIX "replay:"
+
+/** Prefix of stream names which replay a capture as fast as it is read. */
+#define REPLAY_FAST_PREFIX "replay-fast:"
+
+/** Magic number at the start of every capture file. */
+#define CAPTURE_MAGIC "EKEYCAP1"
+
+/** Record of bytes read from the key. */
+#define CAPTURE_READ 'R'
+
+/** Record of bytes written to the key. */
+#define CAPTURE_WRITE 'W'
+
+/** Length of a record header.
+ *
+ * A capture file is ::CAPTURE_MAGIC followed by records, each a header of a
+ * 32 bit big endian millisecond offset from the start of the capture, a
+ * record type (::CAPTURE_READ or ::CAPTURE_WRITE) and a 16 bit big endian
+ * data length, followed by the data.
+ */
+#define CAPTURE_HDR_LEN 7
+
+/** Record all traffic on a stream to a capture file.
+ *
+ * Recording should start before anything has been read from the stream so
+ * that the capture can be replayed from the start of a connection.
+ * Recording stops when the stream is closed.
+ *
+ * @param stream The stream to record.
+ * The capture file is created readable only by the daemon.  An existing
+ * file is replaced only if it is a regular file the daemon owns, and a
+ * symbolic link is never followed.
+ *
+ * @param fname The capture file to create.
+ * @return true on success, false on failure, with errno set.
+ */
+extern bool estream_record(estream_state_t *stream, const char *fname);
+
+/** Open a stream which replays a capture file.
+ *
+ * Bytes read from the key are returned in the order they were recorded,
+ * either paced to the original timestamps or as fast as they are read.
+ * Each recorded write to the key holds the replay until the host makes a
+ * write of its own, keeping the replay in step with the connection.  While
+ * a keying request is due the stream's nonce is set to the recorded one so
+ * the key's recorded response is valid.
+ *
+ * The stream file descriptor becomes readable whenever data may be read.
+ *
+ * @param fname The capture file.
+ * @param fast true to ignore the recorded timestamps.
+ * @return The stream handle or NULL and errno set.
+ */
+extern estream_state_t *estream_replay_open(const char *fname, bool fast);
+
+#endif
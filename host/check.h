@@ -0,0 +1,44 @@
+/* daemon/check.h
+ *
+ * Checks run by make check.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_CHECK_H
+#define DAEMON_CHECK_H
+
+#include <stdio.h>
+
+/** Number of checks which have failed. */
+static int failures;
+
+/** Check a condition holds, reporting where it did not. */
+#define CHECK(cond) do {                                        \
+        if (!(cond)) {                                          \
+            fprintf(stderr, "%s:%d: check failed: %s\n",        \
+                    __FILE__, __LINE__, #cond);                 \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+/** Report the outcome of a test's checks.
+ *
+ * @param name The name of the test.
+ * @return The test's exit status.
+ */
+static inline int
+check_result(const char *name)
+{
+    if (failures != 0) {
+        fprintf(stderr, "%s: %d checks failed\n", name, failures);
+        return 1;
+    }
+
+    printf("%s: all checks passed\n", name);
+    return 0;
+}
+
+#endif
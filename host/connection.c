@@ -22,6 +22,9 @@
 #include "skeinwrap.h"
 #include "util.h"
 #include "nonce.h"
+#ifndef EKEY_ENGINE
+#include "seed.h"
+#endif
 
 #include "stream.h"
 #include "frame.h"
@@ -40,13 +43,82 @@
 /* The minimum number of bytes in a shannon info frame to allow updates */
 #define MIN_SHANNON_SIZE 100
 
-typedef ekey_state_t (*pkt_handler_t)(econ_state_t *state, uint8_t *buf, size_t count);
+/* Debiased generator estimates, in hundredths of a shannon per byte, at or
+ * above which a key is fully healthy and at or below which it is given no
+ * health at all.  Healthy keys report around 300.
+ */
+#define HEALTH_GOOD_SHANNONS 250
+#define HEALTH_POOR_SHANNONS 150
 
-pkt_handler_t pkt_handlers[ESTATE_SIZE][PKTTYPE_SIZE];
+typedef ekey_state_t (*pkt_handler_t)(econ_state_t *state, uint8_t *buf, size_t count);
 
 #define SHARED_KEY_DEFAULT "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
 
-uint8_t default_session_key[32];
+/** Shared key the MAC is checked with until a session key is set. */
+static const uint8_t default_session_key[32];
+
+/** Find the long term key for a connection's serial number.
+ *
+ * @param state The connection, whose keyring is used if it has one.
+ * @return A copy of the key, which the caller frees, or NULL if unknown.
+ */
+static uint8_t *
+econ_ltkey(econ_state_t *state)
+{
+#ifdef EKEY_ENGINE
+    return keydb_ltkey(state->keydb, state->snum);
+#else
+    if (state->keydb != NULL)
+        return keydb_ltkey(state->keydb, state->snum);
+    return snum_to_ltkey(state->snum);
+#endif
+}
+
+/** Record a completed rekey round trip.
+ *
+ * @param state The current connection state.
+ * @param rtt Milliseconds from the keying request to the key packet.
+ */
+static void
+econ_rekey_rtt(econ_state_t *state, uint64_t rtt)
+{
+    int bucket = 0;
+
+    while ((bucket < (ECON_RTT_BUCKETS - 1)) && (rtt >= (8ULL << bucket)))
+        bucket++;
+
+    state->rekey_rtt[bucket]++;
+    state->rekey_rtt_last = rtt;
+    if (rtt > state->rekey_rtt_max)
+        state->rekey_rtt_max = rtt;
+    state->rekey_rtt_total += rtt;
+    state->rekey_sent_ms = 0;
+}
+
+/** Change state machine state, accounting the time spent in the old state.
+ *
+ * @param state The current connection state.
+ * @param next The state to change to.
+ */
+static void
+econ_set_state(econ_state_t *state, ekey_state_t next)
+{
+    uint64_t now;
+
+    if (next == state->current_state)
+        return;
+
+    trace_event(state->eframer->trace, TRACE_STATE, state->current_state, next);
+
+    now = monotonic_ms();
+    state->state_ms[state->current_state] += now - state->state_since_ms;
+    state->state_since_ms = now;
+    state->current_state = next;
+
+    /* a closed key produces nothing until it is reopened */
+    if ((next == ESTATE_CLOSE) && (state->down_since_ms == 0))
+        state->down_since_ms = now;
+}
 
 /** Null packet handler
  *
@@ -77,6 +149,8 @@ reset_pkt_handler(econ_state_t *state, uint8_t *buf, size_t count)
 {
     char reset[] = {0x3};
     estream_write(state->key_stream, reset, 1);
+    state->rekey_sent_ms = 0;
+    trace_event(state->eframer->trace, TRACE_RESET, 0, 0);
     epkt_setsessionkey(state->epkt, state->snum, default_session_key);
 
     state->con_reset++; /* Update the connection statistics */
@@ -140,6 +214,31 @@ badkey_count_pkt_handler(econ_state_t *state, uint8_t *buf, size_t count)
 
 
 
+/** Update the health of a key from its latest estimates.
+ *
+ * The health follows the weaker of the two debiased generators between
+ * the poor and good thresholds, and is zero while the key reports a
+ * failure or before it has reported any estimates.
+ */
+static void
+update_key_health(econ_state_t *state)
+{
+    uint32_t weakest;
+
+    weakest = state->key_dbsd_entl;
+    if (state->key_dbsd_entr < weakest)
+        weakest = state->key_dbsd_entr;
+
+    if ((state->key_badness != '0') || (weakest <= HEALTH_POOR_SHANNONS)) {
+        state->key_health = 0;
+    } else if (weakest >= HEALTH_GOOD_SHANNONS) {
+        state->key_health = 100;
+    } else {
+        state->key_health = ((weakest - HEALTH_POOR_SHANNONS) * 100) /
+            (HEALTH_GOOD_SHANNONS - HEALTH_POOR_SHANNONS);
+    }
+}
+
 /** Information packet handler
  *
  * Handler for packets containing information from the entropy device.
@@ -205,6 +304,8 @@ info_pkt_handler(econ_state_t *state, uint8_t *buf, size_t count)
                 state->key_dbsd_entr = (dbsd_est_r * 100) / dbsd_bytes_r;
             }
 
+            update_key_health(state);
+
             count = 0;
             break;
 
@@ -257,25 +358,32 @@ keyreq_pkt_handler(econ_state_t *state, uint8_t *buf, size_t count)
         state->nonce = malloc(state->nonce_len);
     }
 
-    if (!fill_nonce(state->nonce + sizeof(uint32_t),
-                    state->nonce_len - sizeof(uint32_t))) {
-        char *serialnumber = econ_getsnum(state);
-
-        if (serialnumber != NULL) {
-            syslog(LOG_ERR, "%s: Unable to prepare nonce for keying.  Key no longer trusted.", serialnumber);
-            free(serialnumber);
-        } else {
-            syslog(LOG_ERR, "UnknownKey: Unable to prepare nonce for keying.  Key no longer trusted.");
+    if (state->key_stream->nonce != NULL) {
+        /* replaying a capture, the recorded reply needs the recorded nonce */
+        memcpy(state->nonce, state->key_stream->nonce, state->nonce_len);
+    } else {
+        if (!fill_nonce(state->nonce + sizeof(uint32_t),
+                        state->nonce_len - sizeof(uint32_t))) {
+            char *serialnumber = econ_getsnum(state);
+
+            if (serialnumber != NULL) {
+                syslog(LOG_ERR, "%s: Unable to prepare nonce for keying.  Key no longer trusted.", serialnumber);
+                free(serialnumber);
+            } else {
+                syslog(LOG_ERR, "UnknownKey: Unable to prepare nonce for keying.  Key no longer trusted.");
+            }
+            return ESTATE_UNTRUSTED;
         }
-        return ESTATE_UNTRUSTED;
+        *(uint32_t *)state->nonce = state->con_nonces;
     }
-    *(uint32_t *)state->nonce = state->con_nonces;
 
     pem64_encode_bytes(state->nonce, 12, sbuf + 1);
     sbuf[0] = 'K';
     sbuf[17] = '.';
 
     estream_write(state->key_stream, sbuf, 18);
+    state->rekey_sent_ms = monotonic_ms();
+    trace_event(state->eframer->trace, TRACE_REKEY_SENT, 0, state->con_nonces);
 
     state->con_nonces++;
     state->keyreq_counter = 0;
@@ -360,6 +468,11 @@ key_pkt_handler(econ_state_t *state, uint8_t *buf, size_t count)
     PrepareSkein(&state->session_state, state->snum, session_key, EKEY_SKEIN_PERSONALISATION_EES);
 
     state->con_rekeys++;
+    trace_event(state->eframer->trace, TRACE_REKEY_DONE, 0,
+                (state->rekey_sent_ms != 0) ?
+                (uint32_t)(monotonic_ms() - state->rekey_sent_ms) : 0);
+    if (state->rekey_sent_ms != 0)
+        econ_rekey_rtt(state, monotonic_ms() - state->rekey_sent_ms);
 
 #ifdef SBQS_MESSAGES
     printf("DEBUG Rekeying completed\n");
@@ -385,6 +498,7 @@ entropy_pkt_handler(econ_state_t *state, uint8_t *buf, size_t count)
     EKeySkein session_state;
     short seq_num;
     unsigned char randbuffer_encbytes[32];
+    ssize_t written;
     int loop;
 
     seq_num = epkt_get_pemsubcode(state->epkt);
@@ -403,8 +517,55 @@ entropy_pkt_handler(econ_state_t *state, uint8_t *buf, size_t count)
         buf[loop] ^= randbuffer_encbytes[loop];
     }
 
-    /* send data to output stream */
-    estream_write(state->op_stream, buf, count);
+    if (state->down_since_ms != 0) {
+        uint64_t down = monotonic_ms() - state->down_since_ms;
+
+        state->con_downtime_ms += down;
+        state->down_since_ms = 0;
+        syslog(LOG_INFO, "Entropy from %s resumed after %ums",
+               state->key_stream->uri, (unsigned int)down);
+    }
+
+    if (state->entropy_fn != NULL) {
+        /* an application using the engine takes the entropy itself */
+        state->entropy_fn(state, buf, count, state->entropy_pw);
+        written = count;
+#ifndef EKEY_ENGINE
+    } else {
+        size_t taken = 0;
+
+        /* a healthy key refreshes the seed file, the seed is credited
+         * once when it is used so what it takes is not also sent to the
+         * output now
+         */
+        if ((state->key_health >= 100) && !state->key_stream->simulated)
+            taken = seed_divert(buf, count);
+
+        written = taken;
+        if (taken < count) {
+            /* send the rest to the output stream, credited by this key's
+             * health, a replayed or simulated key is never credited
+             */
+            estream_health(state->op_stream,
+                           state->key_stream->simulated ? 0 : state->key_health);
+            written = estream_write(state->op_stream, buf + taken,
+                                    count - taken);
+            if (written >= 0)
+                written += taken;
+        }
+#else
+    } else {
+        written = -1;
+#endif
+    }
+    trace_event_stamped(state->eframer->trace, TRACE_SINK_WRITE,
+                        (written != (ssize_t)count), count);
+
+    if (state->con_entropy == 0) {
+        state->con_first_entropy = (uint32_t)(monotonic_ms() - state->con_open_ms);
+        syslog(LOG_INFO, "First entropy from %s after %ums",
+               state->key_stream->uri, state->con_first_entropy);
+    }
 
     /* update statistics */
     state->con_entropy += count;
@@ -464,7 +625,7 @@ snum_pkt_handler(econ_state_t *state, uint8_t *snum, size_t count)
     if (state->ltkey != NULL)
         free(state->ltkey);
 
-    state->ltkey = snum_to_ltkey(state->snum);
+    state->ltkey = econ_ltkey(state);
 
     if (state->ltkey == NULL) {
         /* we cannot generate session keys without the private long term
@@ -478,57 +639,54 @@ snum_pkt_handler(econ_state_t *state, uint8_t *snum, size_t count)
     return ESTATE_SESSION;
 }
 
-/** Sets the default handler for connection state machine.
+/** Every packet type handled by \a h, used to fill a state's row. */
+#define ALL_PKTTYPES(h)                                                 \
+    [PKTTYPE_NONE] = h, [PKTTYPE_KEYREJECTED] = h, [PKTTYPE_SNUM] = h,  \
+    [PKTTYPE_INFO] = h, [PKTTYPE_WARN] = h, [PKTTYPE_ENTROPY] = h,      \
+    [PKTTYPE_KEYREQ] = h, [PKTTYPE_KEY] = h, [PKTTYPE_LTREKEYMAC] = h,  \
+    [PKTTYPE_LTREKEY] = h
+
+/** Connection state machine.
  *
- * @param state The state being setup.
+ * Indexed by the current state and the type of the packet received, each
+ * entry is the handler which yields the next state.  Packets which are not
+ * expected reset the connection, except in the states which ignore the key.
  */
-static pkt_handler_t
-default_handler_for(int state)
-{
-    switch (state) {
-    case ESTATE_CLOSE:
-    case ESTATE_UNTRUSTED:
-    case ESTATE_KEYED_BAD:
-        return null_pkt_handler;
-    }
-
-    return reset_pkt_handler;
-}
-
-/** Initialise connection state machine.
- */
-static void
-init_states(void)
-{
-    int state;
-    int pkttype;
-
-    /* initialy we populate the entire state system with the reset response */
-    for (state = 0; state < ESTATE_SIZE; state++) {
-        for (pkttype = 0; pkttype < PKTTYPE_SIZE; pkttype++) {
-            pkt_handlers[state][pkttype] = default_handler_for(state);
-        }
-    }
-
-    pkt_handlers[ESTATE_INIT][PKTTYPE_SNUM] = snum_pkt_handler;
-
-    pkt_handlers[ESTATE_SESSION][PKTTYPE_INFO] = info_pkt_handler;
-    pkt_handlers[ESTATE_SESSION][PKTTYPE_KEYREQ] = keyreq_pkt_handler;
-
-    pkt_handlers[ESTATE_SESSION_SENT][PKTTYPE_KEYREQ] = keyreq_count_pkt_handler;
-    pkt_handlers[ESTATE_SESSION_SENT][PKTTYPE_INFO] = info_pkt_handler;
-    pkt_handlers[ESTATE_SESSION_SENT][PKTTYPE_KEY] = key_pkt_handler;
-
-    pkt_handlers[ESTATE_KEYED_FIRST][PKTTYPE_ENTROPY] = entropy_pkt_handler;
-    pkt_handlers[ESTATE_KEYED_FIRST][PKTTYPE_INFO] = info_pkt_handler;
-    pkt_handlers[ESTATE_KEYED_FIRST][PKTTYPE_KEYREJECTED] = badkey_pkt_handler;
-
-    pkt_handlers[ESTATE_KEYED_BAD][PKTTYPE_KEYREQ] = badkey_count_pkt_handler;
-
-    pkt_handlers[ESTATE_KEYED][PKTTYPE_ENTROPY] = entropy_pkt_handler;
-    pkt_handlers[ESTATE_KEYED][PKTTYPE_INFO] = info_pkt_handler;
-    pkt_handlers[ESTATE_KEYED][PKTTYPE_KEYREQ] = keyreq_pkt_handler;
-}
+static const pkt_handler_t pkt_handlers[ESTATE_SIZE][PKTTYPE_SIZE] = {
+    [ESTATE_INIT] = {
+        ALL_PKTTYPES(reset_pkt_handler),
+        [PKTTYPE_SNUM] = snum_pkt_handler,
+    },
+    [ESTATE_CLOSE] = { ALL_PKTTYPES(null_pkt_handler) },
+    [ESTATE_UNTRUSTED] = { ALL_PKTTYPES(null_pkt_handler) },
+    [ESTATE_SESSION] = {
+        ALL_PKTTYPES(reset_pkt_handler),
+        [PKTTYPE_INFO] = info_pkt_handler,
+        [PKTTYPE_KEYREQ] = keyreq_pkt_handler,
+    },
+    [ESTATE_SESSION_SENT] = {
+        ALL_PKTTYPES(reset_pkt_handler),
+        [PKTTYPE_KEYREQ] = keyreq_count_pkt_handler,
+        [PKTTYPE_INFO] = info_pkt_handler,
+        [PKTTYPE_KEY] = key_pkt_handler,
+    },
+    [ESTATE_KEYED_FIRST] = {
+        ALL_PKTTYPES(reset_pkt_handler),
+        [PKTTYPE_ENTROPY] = entropy_pkt_handler,
+        [PKTTYPE_INFO] = info_pkt_handler,
+        [PKTTYPE_KEYREJECTED] = badkey_pkt_handler,
+    },
+    [ESTATE_KEYED_BAD] = {
+        ALL_PKTTYPES(null_pkt_handler),
+        [PKTTYPE_KEYREQ] = badkey_count_pkt_handler,
+    },
+    [ESTATE_KEYED] = {
+        ALL_PKTTYPES(reset_pkt_handler),
+        [PKTTYPE_ENTROPY] = entropy_pkt_handler,
+        [PKTTYPE_INFO] = info_pkt_handler,
+        [PKTTYPE_KEYREQ] = keyreq_pkt_handler,
+    },
+};
 
 /** Create a new connection to an entropy key.
  *
@@ -542,32 +700,128 @@ econ_open(const char *key_path, estream_state_t *op_stream)
     econ_state_t *state;
     estream_state_t *key_stream;
 
-    init_states();
-
     key_stream = estream_open(key_path);
     if (key_stream == NULL) {
         perror("Input: ");
         return NULL;
     }
 
-    state = calloc(1, sizeof(econ_state_t));
-    if (state == NULL) {
+    state = econ_attach(key_path, key_stream, op_stream);
+    if (state == NULL)
         estream_close(key_stream);
+
+    return state;
+}
+
+/* exported interface documented in connection.h */
+econ_state_t *
+econ_attach(const char *key_path, estream_state_t *key_stream,
+            estream_state_t *op_stream)
+{
+    econ_state_t *state;
+
+    state = calloc(1, sizeof(econ_state_t));
+    if (state == NULL)
+        return NULL;
+
+    state->key_path = strdup(key_path);
+    if (state->key_path == NULL) {
+        free(state);
         return NULL;
     }
 
     state->key_stream = key_stream;
     state->op_stream = op_stream;
     state->eframer = eframe_open(state->key_stream);
+    if (state->eframer != NULL)
+        state->eframer->trace = trace_open(); /* no tracing if NULL */
     state->epkt = epkt_open(state->eframer);
     state->current_state = ESTATE_INIT;
-    state->key_badness = 0;                 /* efm_ok, see control.lua */
+    state->key_badness = '0';               /* efm_ok, see control.lua */
 
     state->con_start = time(NULL);
+    state->con_open_ms = monotonic_ms();
+    state->state_since_ms = state->con_open_ms;
+    state->last_pkt_ms = state->con_open_ms;
 
     return state;
 }
 
+/* exported interface documented in connection.h */
+bool
+econ_reopen(econ_state_t *state)
+{
+    estream_state_t *key_stream;
+    eframe_state_t *eframer;
+    epkt_state_t *epkt;
+
+    key_stream = estream_open(state->key_path);
+    if (key_stream == NULL)
+        return false;
+
+    eframer = eframe_open(key_stream);
+    epkt = epkt_open(eframer);
+    if ((eframer == NULL) || (epkt == NULL)) {
+        if (epkt == NULL)
+            eframe_close(eframer);
+        else
+            epkt_close(epkt);
+        estream_close(key_stream);
+        errno = ENOMEM;
+        return false;
+    }
+
+    /* the trace carries on across the reopen */
+    if (state->eframer != NULL) {
+        eframer->trace = state->eframer->trace;
+        state->eframer->trace = NULL;
+    } else {
+        eframer->trace = trace_open();
+    }
+
+    epkt_close(state->epkt); /* closes the framer too */
+    if (state->key_stream != NULL)
+        estream_close(state->key_stream);
+
+    state->key_stream = key_stream;
+    state->eframer = eframer;
+    state->epkt = epkt;
+    state->rekey_sent_ms = 0;
+    state->keyreq_counter = 0;
+    state->last_pkt_ms = monotonic_ms();
+    state->stall_reset_ms = 0;
+    state->con_reopens++;
+
+    trace_event(state->eframer->trace, TRACE_RESET, 1, 0);
+    econ_set_state(state, ESTATE_INIT);
+
+    return true;
+}
+
+/* exported interface documented in connection.h */
+void
+econ_close_stream(econ_state_t *state)
+{
+    econ_set_state(state, ESTATE_CLOSE);
+    if (state->key_stream != NULL) {
+        estream_close(state->key_stream);
+        state->key_stream = NULL;
+    }
+    state->stall_reset_ms = 0;
+}
+
+/* exported interface documented in connection.h */
+void
+econ_stall_reset(econ_state_t *state)
+{
+    if (state->down_since_ms == 0)
+        state->down_since_ms = state->last_pkt_ms;
+
+    state->con_stalls++;
+    state->stall_reset_ms = monotonic_ms();
+    econ_set_state(state, reset_pkt_handler(state, NULL, 0));
+}
+
 /** Run the state machine against the ekey input stream and write to the output
  * entropy stream.
  *
@@ -578,6 +832,7 @@ int econ_run(econ_state_t *con_state)
 {
     int res;
     uint8_t data[128];
+    pkt_handler_t handler;
 
     if (con_state->current_state == ESTATE_CLOSE) {
         /* State machine is in closedown, do not run. */
@@ -586,7 +841,7 @@ int econ_run(econ_state_t *con_state)
 
     res = epkt_read(con_state->epkt, data, 128);
     if (res == 0) {
-        con_state->current_state = ESTATE_CLOSE;
+        econ_set_state(con_state, ESTATE_CLOSE);
     } else if (res < 0) {
         /* errors */
         switch (errno) {
@@ -597,12 +852,22 @@ int econ_run(econ_state_t *con_state)
 
         default:
             perror("epkt_read");
-            con_state->current_state = ESTATE_CLOSE;
+            econ_set_state(con_state, ESTATE_CLOSE);
             break;
         }
     } else {
         con_state->con_pkts++;
-        con_state->current_state = pkt_handlers[con_state->current_state][con_state->epkt->pkt_type](con_state, data, res);
+        con_state->last_pkt_ms = monotonic_ms();
+        handler = pkt_handlers[con_state->current_state][con_state->epkt->pkt_type];
+
+        /* entropy the key sent which cannot be used, including packets
+         * failing their MAC, is lost to the reset or rekey in progress
+         */
+        if ((con_state->epkt->frame->frame[2] == 'E') &&
+            (handler != entropy_pkt_handler))
+            con_state->con_lost_entropy += res;
+
+        econ_set_state(con_state, handler(con_state, data, res));
     }
 
     return res;
@@ -660,6 +925,317 @@ econ_getsnum(econ_state_t *state)
     return serial_str;
 }
 
+/** Version of the saved connection state, changed whenever its layout is. */
+#define ECON_SAVE_VERSION 1
+
+/** Connection state saved to hand a key to an upgraded daemon.
+ *
+ * The serial number and nonce follow.  Monotonic times are carried over
+ * unchanged as the clock is shared by every process.
+ */
+typedef struct {
+    uint32_t version; /**< ECON_SAVE_VERSION. */
+    uint32_t size; /**< Size of this structure. */
+    uint32_t current_state;
+    uint32_t snum_len;
+    uint32_t nonce_len;
+    uint32_t keyreq_counter;
+    bool stream_open; /**< The key's stream was open. */
+    bool has_trace;
+    bool has_mac; /**< The packet MAC key has been set by a rekey. */
+    char key_badness;
+    EKeySkein session_state;
+    EKeySkein mac_state;
+
+    /* the partial frame and framer and packet statistics */
+    uint8_t frame[EFRAME_LEN];
+    int32_t frame_used;
+    uint64_t byte_last;
+    uint32_t framing_errors;
+    uint32_t frames_ok;
+    uint32_t pkt_error;
+    uint32_t pkt_ok;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+
+    uint64_t last_pkt_ms;
+    uint64_t stall_reset_ms;
+    uint64_t reopen_at_ms;
+    uint32_t reopen_backoff_ms;
+
+    int64_t con_start;
+    uint64_t con_open_ms;
+    uint32_t con_first_entropy;
+    uint32_t con_pkts;
+    uint32_t con_reset;
+    uint32_t con_nonces;
+    uint32_t con_rekeys;
+    uint64_t con_entropy;
+    uint64_t con_lost_entropy;
+    uint32_t con_reopens;
+    uint32_t con_stalls;
+    uint64_t down_since_ms;
+    uint64_t con_downtime_ms;
+    uint64_t state_since_ms;
+    uint64_t state_ms[ESTATE_SIZE];
+    uint64_t rekey_sent_ms;
+    uint32_t rekey_rtt[ECON_RTT_BUCKETS];
+    uint32_t rekey_rtt_last;
+    uint32_t rekey_rtt_max;
+    uint64_t rekey_rtt_total;
+    uint32_t key_temp;
+    uint32_t key_voltage;
+    uint32_t fips_frame_rate;
+    uint32_t fips_frame_num;
+    int64_t fips_frame_time;
+    uint32_t key_raw_entl;
+    uint32_t key_raw_entr;
+    uint32_t key_raw_entx;
+    uint32_t key_dbsd_entl;
+    uint32_t key_dbsd_entr;
+    uint32_t key_health;
+
+    trace_ring_t trace;
+} econ_saved_t;
+
+/* exported interface, documented in connection.h */
+void *
+econ_save(econ_state_t *state, size_t *len)
+{
+    econ_saved_t *sv;
+    uint8_t *tail;
+
+    *len = sizeof(*sv) + state->snum_len + state->nonce_len;
+    sv = calloc(1, *len);
+    if (sv == NULL)
+        return NULL;
+
+    sv->version = ECON_SAVE_VERSION;
+    sv->size = sizeof(*sv);
+    sv->current_state = state->current_state;
+    sv->snum_len = (state->snum != NULL) ? state->snum_len : 0;
+    sv->nonce_len = (state->nonce != NULL) ? state->nonce_len : 0;
+    sv->keyreq_counter = state->keyreq_counter;
+    sv->stream_open = (state->key_stream != NULL);
+    sv->key_badness = state->key_badness;
+    memcpy(&sv->session_state, &state->session_state, sizeof(EKeySkein));
+
+    if (state->eframer != NULL) {
+        memcpy(sv->frame, state->eframer->frame, EFRAME_LEN);
+        sv->frame_used = state->eframer->used;
+        sv->byte_last = state->eframer->byte_last;
+        sv->framing_errors = state->eframer->framing_errors;
+        sv->frames_ok = state->eframer->frames_ok;
+        if (state->eframer->trace != NULL) {
+            sv->has_trace = true;
+            memcpy(&sv->trace, state->eframer->trace, sizeof(trace_ring_t));
+        }
+    }
+    if (state->epkt != NULL) {
+        sv->pkt_error = state->epkt->pkt_error;
+        sv->pkt_ok = state->epkt->pkt_ok;
+        if (state->epkt->sk_mac != NULL) {
+            sv->has_mac = true;
+            memcpy(&sv->mac_state, state->epkt->sk_mac, sizeof(EKeySkein));
+        }
+    }
+    if (state->key_stream != NULL) {
+        sv->bytes_read = state->key_stream->bytes_read;
+        sv->bytes_written = state->key_stream->bytes_written;
+    }
+
+    sv->last_pkt_ms = state->last_pkt_ms;
+    sv->stall_reset_ms = state->stall_reset_ms;
+    sv->reopen_at_ms = state->reopen_at_ms;
+    sv->reopen_backoff_ms = state->reopen_backoff_ms;
+
+    sv->con_start = state->con_start;
+    sv->con_open_ms = state->con_open_ms;
+    sv->con_first_entropy = state->con_first_entropy;
+    sv->con_pkts = state->con_pkts;
+    sv->con_reset = state->con_reset;
+    sv->con_nonces = state->con_nonces;
+    sv->con_rekeys = state->con_rekeys;
+    sv->con_entropy = state->con_entropy;
+    sv->con_lost_entropy = state->con_lost_entropy;
+    sv->con_reopens = state->con_reopens;
+    sv->con_stalls = state->con_stalls;
+    sv->down_since_ms = state->down_since_ms;
+    sv->con_downtime_ms = state->con_downtime_ms;
+    sv->state_since_ms = state->state_since_ms;
+    memcpy(sv->state_ms, state->state_ms, sizeof(sv->state_ms));
+    sv->rekey_sent_ms = state->rekey_sent_ms;
+    memcpy(sv->rekey_rtt, state->rekey_rtt, sizeof(sv->rekey_rtt));
+    sv->rekey_rtt_last = state->rekey_rtt_last;
+    sv->rekey_rtt_max = state->rekey_rtt_max;
+    sv->rekey_rtt_total = state->rekey_rtt_total;
+    sv->key_temp = state->key_temp;
+    sv->key_voltage = state->key_voltage;
+    sv->fips_frame_rate = state->fips_frame_rate;
+    sv->fips_frame_num = state->fips_frame_num;
+    sv->fips_frame_time = state->fips_frame_time;
+    sv->key_raw_entl = state->key_raw_entl;
+    sv->key_raw_entr = state->key_raw_entr;
+    sv->key_raw_entx = state->key_raw_entx;
+    sv->key_dbsd_entl = state->key_dbsd_entl;
+    sv->key_dbsd_entr = state->key_dbsd_entr;
+    sv->key_health = state->key_health;
+
+    tail = (uint8_t *)(sv + 1);
+    if (sv->snum_len > 0)
+        memcpy(tail, state->snum, sv->snum_len);
+    if (sv->nonce_len > 0)
+        memcpy(tail + sv->snum_len, state->nonce, sv->nonce_len);
+
+    return sv;
+}
+
+/* exported interface, documented in connection.h */
+econ_state_t *
+econ_restore(const char *key_path, const void *data, size_t len, int fd,
+             estream_state_t *op_stream)
+{
+    const econ_saved_t *sv = data;
+    const uint8_t *tail = (const uint8_t *)(sv + 1);
+    econ_state_t *state;
+
+    if ((len < sizeof(*sv)) ||
+        (sv->version != ECON_SAVE_VERSION) || (sv->size != sizeof(*sv)) ||
+        (len != (sizeof(*sv) + sv->snum_len + sv->nonce_len)) ||
+        (sv->current_state >= ESTATE_SIZE) ||
+        ((sv->frame_used < 0) || (sv->frame_used > EFRAME_LEN))) {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    state = calloc(1, sizeof(econ_state_t));
+    if (state == NULL)
+        return NULL;
+
+    state->key_path = strdup(key_path);
+    if (sv->snum_len > 0) {
+        state->snum = malloc(sv->snum_len);
+        if (state->snum != NULL) {
+            memcpy(state->snum, tail, sv->snum_len);
+            state->snum_len = sv->snum_len;
+            state->ltkey = econ_ltkey(state);
+        }
+    }
+    if (sv->nonce_len > 0) {
+        state->nonce = malloc(sv->nonce_len);
+        if (state->nonce != NULL) {
+            memcpy(state->nonce, tail + sv->snum_len, sv->nonce_len);
+            state->nonce_len = sv->nonce_len;
+        }
+    }
+
+    if ((state->key_path == NULL) ||
+        ((sv->snum_len > 0) && (state->snum == NULL)) ||
+        ((sv->nonce_len > 0) && (state->nonce == NULL))) {
+        errno = ENOMEM;
+        econ_close(state);
+        return NULL;
+    }
+
+    /* past serial number checking the long term key is needed to rekey */
+    if ((state->ltkey == NULL) && (sv->current_state >= ESTATE_SESSION)) {
+        errno = ENOENT;
+        econ_close(state);
+        return NULL;
+    }
+
+    if (fd != -1) {
+        state->key_stream = estream_adopt(key_path, fd);
+        state->eframer = eframe_open(state->key_stream);
+        state->epkt = epkt_open(state->eframer);
+        if (state->epkt == NULL) {
+            if (state->eframer != NULL)
+                eframe_close(state->eframer);
+            state->eframer = NULL;
+            if (state->key_stream != NULL)
+                free(state->key_stream->uri);
+            free(state->key_stream);
+            state->key_stream = NULL;
+            errno = ENOMEM;
+            econ_close(state);
+            return NULL;
+        }
+
+        memcpy(state->eframer->frame, sv->frame, EFRAME_LEN);
+        state->eframer->used = sv->frame_used;
+        state->eframer->byte_last = sv->byte_last;
+        state->eframer->framing_errors = sv->framing_errors;
+        state->eframer->frames_ok = sv->frames_ok;
+        state->eframer->trace = trace_open();
+        if ((state->eframer->trace != NULL) && sv->has_trace)
+            memcpy(state->eframer->trace, &sv->trace, sizeof(trace_ring_t));
+        state->epkt->pkt_error = sv->pkt_error;
+        state->epkt->pkt_ok = sv->pkt_ok;
+        if (sv->has_mac) {
+            state->epkt->sk_mac = malloc(sizeof(EKeySkein));
+            if (state->epkt->sk_mac == NULL) {
+                state->key_stream->fd = -1; /* the caller still owns it */
+                econ_close(state);
+                errno = ENOMEM;
+                return NULL;
+            }
+            memcpy(state->epkt->sk_mac, &sv->mac_state, sizeof(EKeySkein));
+        }
+        state->key_stream->bytes_read = sv->bytes_read;
+        state->key_stream->bytes_written = sv->bytes_written;
+        state->current_state = sv->current_state;
+    } else {
+        /* the stream could not be passed on, it is reopened */
+        state->current_state = ESTATE_CLOSE;
+        state->reopen_at_ms = sv->stream_open ? monotonic_ms() : sv->reopen_at_ms;
+    }
+
+    state->op_stream = op_stream;
+    state->keyreq_counter = sv->keyreq_counter;
+    state->key_badness = sv->key_badness;
+    memcpy(&state->session_state, &sv->session_state, sizeof(EKeySkein));
+
+    state->last_pkt_ms = sv->last_pkt_ms;
+    state->stall_reset_ms = sv->stall_reset_ms;
+    if (fd != -1)
+        state->reopen_at_ms = sv->reopen_at_ms;
+    state->reopen_backoff_ms = sv->reopen_backoff_ms;
+
+    state->con_start = sv->con_start;
+    state->con_open_ms = sv->con_open_ms;
+    state->con_first_entropy = sv->con_first_entropy;
+    state->con_pkts = sv->con_pkts;
+    state->con_reset = sv->con_reset;
+    state->con_nonces = sv->con_nonces;
+    state->con_rekeys = sv->con_rekeys;
+    state->con_entropy = sv->con_entropy;
+    state->con_lost_entropy = sv->con_lost_entropy;
+    state->con_reopens = sv->con_reopens;
+    state->con_stalls = sv->con_stalls;
+    state->down_since_ms = sv->down_since_ms;
+    state->con_downtime_ms = sv->con_downtime_ms;
+    state->state_since_ms = sv->state_since_ms;
+    memcpy(state->state_ms, sv->state_ms, sizeof(sv->state_ms));
+    state->rekey_sent_ms = sv->rekey_sent_ms;
+    memcpy(state->rekey_rtt, sv->rekey_rtt, sizeof(sv->rekey_rtt));
+    state->rekey_rtt_last = sv->rekey_rtt_last;
+    state->rekey_rtt_max = sv->rekey_rtt_max;
+    state->rekey_rtt_total = sv->rekey_rtt_total;
+    state->key_temp = sv->key_temp;
+    state->key_voltage = sv->key_voltage;
+    state->fips_frame_rate = sv->fips_frame_rate;
+    state->fips_frame_num = sv->fips_frame_num;
+    state->fips_frame_time = sv->fips_frame_time;
+    state->key_raw_entl = sv->key_raw_entl;
+    state->key_raw_entr = sv->key_raw_entr;
+    state->key_raw_entx = sv->key_raw_entx;
+    state->key_dbsd_entl = sv->key_dbsd_entl;
+    state->key_dbsd_entr = sv->key_dbsd_entr;
+    state->key_health = sv->key_health;
+
+    return state;
+}
+
 /** Shutdown a connection and free its context.
  *
  * @param state The connection context.
@@ -668,10 +1244,13 @@ econ_getsnum(econ_state_t *state)
 int
 econ_close(econ_state_t *state)
 {
+    if (state->eframer != NULL)
+        trace_close(state->eframer->trace);
     if (state->epkt != NULL)
         epkt_close(state->epkt);
     if (state->key_stream != NULL)
         estream_close(state->key_stream);
+    free(state->key_path);
     if (state->snum != NULL)
         free(state->snum);
     if (state->ltkey != NULL)
@@ -12,9 +12,27 @@
 
 #include "frame.h"
 #include "packet.h"
+#include "keydb.h"
 
 typedef struct econ_state_s econ_state_t;
 
+/** Take decrypted entropy from a connection instead of its output stream.
+ *
+ * @param state The connection, whose key_health credits the entropy.
+ * @param buf The entropy.
+ * @param count The length of \a buf.
+ * @param pw The connection's entropy_pw.
+ */
+typedef void (econ_entropy_fn)(econ_state_t *state, const uint8_t *buf,
+                               size_t count, void *pw);
+
+/** Number of buckets in the rekey round trip histogram.
+ *
+ * Bucket n counts round trips shorter than 8 << n milliseconds which did
+ * not fit an earlier bucket, the last bucket counts everything longer.
+ */
+#define ECON_RTT_BUCKETS 11
+
 typedef enum {
     ESTATE_INIT = 0, /** Initial state. */
     ESTATE_CLOSE, /** Connection should be closed. */
@@ -31,8 +49,13 @@ typedef enum {
 struct econ_state_s {
     uint8_t *ltkey; /**< Long term key. */
 
+    char *key_path; /**< Path the input stream was opened with. */
+
     estream_state_t *key_stream; /**< The input stream. */
     estream_state_t *op_stream; /**< The output stream. */
+    keydb_t *keydb; /**< Keyring holding the long term key, NULL for the daemon's. */
+    econ_entropy_fn *entropy_fn; /**< Takes entropy in place of op_stream if not NULL. */
+    void *entropy_pw; /**< Private word passed to entropy_fn. */
     eframe_state_t *eframer; /**< The framer attached to the stream. */
     epkt_state_t *epkt; /**< The packet handler attached to the framer. */
 
@@ -45,14 +68,34 @@ struct econ_state_s {
     uint8_t *nonce; /**< The session key nonce. */
     int nonce_len; /**< The length of the session nonce. */
     uint32_t keyreq_counter; /**< The number of times we've ignored a keyreq packet */
+
+    /* Recovery, maintained by the daemon */
+    uint64_t last_pkt_ms; /**< monotonic time in ms of the last packet, or of the open */
+    uint64_t stall_reset_ms; /**< monotonic time in ms the watchdog reset the key, 0 if it has not */
+    uint64_t reopen_at_ms; /**< monotonic time in ms of the next reopen attempt, 0 for none */
+    uint32_t reopen_backoff_ms; /**< delay before the reopen attempt after next */
   
     /* Statistics */
     time_t con_start; /**< time connection was started */
+    uint64_t con_open_ms; /**< monotonic time in ms the connection was opened */
+    uint32_t con_first_entropy; /**< ms from opening to first entropy, 0 if none yet */
     uint32_t con_pkts; /**< number of processed packets */
     uint32_t con_reset; /**< The number of times the connection has encounterd a reset condition. */
     uint32_t con_nonces; /**< The number of times a nonce has been sent. */
     uint32_t con_rekeys; /**< The number of times the session key has been set. */
     uint64_t con_entropy; /**< The number of bytes of entropy recived. */
+    uint64_t con_lost_entropy; /**< Bytes of entropy discarded while not keyed. */
+    uint32_t con_reopens; /**< The number of times the input stream has been reopened. */
+    uint32_t con_stalls; /**< The number of times the key stopped sending and was reset. */
+    uint64_t down_since_ms; /**< monotonic time in ms the key stopped producing entropy, 0 if it has not */
+    uint64_t con_downtime_ms; /**< ms between the key failing and its entropy resuming, excluding any current outage */
+    uint64_t state_since_ms; /**< monotonic time in ms the current state was entered */
+    uint64_t state_ms[ESTATE_SIZE]; /**< ms spent in each state, excluding the current period */
+    uint64_t rekey_sent_ms; /**< monotonic time in ms of the outstanding keying request, 0 if none */
+    uint32_t rekey_rtt[ECON_RTT_BUCKETS]; /**< Histogram of rekey round trip times. */
+    uint32_t rekey_rtt_last; /**< Last rekey round trip time in ms. */
+    uint32_t rekey_rtt_max; /**< Longest rekey round trip time in ms. */
+    uint64_t rekey_rtt_total; /**< Sum of the rekey round trip times in ms. */
     uint32_t key_temp; /**< Last reported key temerature in deci-kelvin */
     uint32_t key_voltage; /**< Last internal supply voltage reported by key. */
     uint32_t fips_frame_rate; /**< fips frame rate. */
@@ -67,18 +110,88 @@ struct econ_state_s {
     uint32_t key_dbsd_entr; /**< debiased shanons per bit of left input */
   
     char key_badness; /**< badness indicator \see control.lua */
+    uint32_t key_health; /**< health in percent derived from the estimates */
   
 };
 
 
 
 econ_state_t *econ_open(const char *key_path, estream_state_t *op_stream);
+
+/** Create a new connection on a stream which is already open.
+ *
+ * @param key_path Name of the key, used to reopen it.
+ * @param key_stream The input stream, owned by the connection on success.
+ * @param op_stream The output stream.
+ * @return The new connection state or NULL and errno set.
+ */
+econ_state_t *econ_attach(const char *key_path, estream_state_t *key_stream,
+                          estream_state_t *op_stream);
 int econ_run(econ_state_t *con_state);
 ekey_state_t econ_state(econ_state_t *con_state);
 int econ_get_rd_fd(econ_state_t *con_state);
 void econ_setsnum(econ_state_t *state, const char *snum);
 int econ_close(econ_state_t *con_state);
 
+/** Reopen a connection's input stream.
+ *
+ * The stream is opened afresh from the path the connection was opened
+ * with, any stream still open is closed, and the state machine starts
+ * again from the initial state.  Statistics and the event trace are kept.
+ *
+ * @param con_state The connection context.
+ * @return true on success, false with errno set and the connection
+ *         unchanged on failure.
+ */
+bool econ_reopen(econ_state_t *con_state);
+
+/** Close a connection's input stream.
+ *
+ * The connection is left closed until it is reopened or closed itself.
+ *
+ * @param con_state The connection context.
+ */
+void econ_close_stream(econ_state_t *con_state);
+
+/** Reset a key which has stopped sending.
+ *
+ * The reset character is sent to the key and the state machine restarted,
+ * the time since the last packet is counted as downtime.
+ *
+ * @param con_state The connection context.
+ */
+void econ_stall_reset(econ_state_t *con_state);
+
+/** Save a connection's state to hand it to an upgraded daemon.
+ *
+ * The state machine, session key, partial frame, statistics and event
+ * trace are saved.  The stream itself is passed separately as its file
+ * descriptor.
+ *
+ * @param con_state The connection context.
+ * @param len Updated with the length of the saved state.
+ * @return The heap allocated state, which the caller frees, or NULL.
+ */
+void *econ_save(econ_state_t *con_state, size_t *len);
+
+/** Restore a connection saved by ::econ_save in another process.
+ *
+ * The connection carries on where it was left, without rekeying.  If the
+ * stream could not be passed the connection is restored closed and due
+ * to be reopened at once.
+ *
+ * @param key_path Path the input stream was opened with.
+ * @param data The saved state.
+ * @param len The length of \a data.
+ * @param fd The stream's file descriptor, or -1 if it was not passed.
+ * @param op_stream The output stream.
+ * @return The connection, which now owns \a fd, or NULL and errno set if
+ *         the state cannot be restored, for example because it was saved
+ *         by an incompatible version or the long term key is not known.
+ */
+econ_state_t *econ_restore(const char *key_path, const void *data, size_t len,
+                           int fd, estream_state_t *op_stream);
+
 /** Get the a connections pem encoded serial number. 
  *
  * This obtains a PEM64 encoded string representation of the serial number for
@@ -0,0 +1,439 @@
+-- daemon/control-test.lua
+--
+-- Checks of the control code which need neither keys nor a daemon.
+--
+-- control.lua is loaded with stand-ins for the C API and LuaSocket, so
+-- clients, entropy and the clock are all driven from here.  Run from the
+-- host directory by make check.
+--
+-- Copyright 2026 agent
+--
+-- For licence terms refer to the COPYING file.
+
+local failures = 0
+
+local function check(what, cond)
+   if not cond then
+      io.stderr:write("control-test: check failed: " .. what .. "\n")
+      failures = failures + 1
+   end
+   return cond
+end
+
+-- The clock, advanced by the checks
+local now = 1000
+
+-- Sockets.  A socket's input is written by the checks and its output
+-- collected for them, accepted sockets stand for both ends.
+local nextfd = 100
+local bound = {}
+local uids = {}
+
+local function newsock()
+   nextfd = nextfd + 1
+   local sock = { fd = nextfd, input = "", output = "", pending = {} }
+   function sock:getfd() return self.fd end
+   function sock:setfd(fd) self.fd = fd end
+   function sock:settimeout() end
+   function sock:setoption() return 1 end
+   function sock:connect() return nil, "connection refused" end
+   function sock:bind(name) bound[name] = self return 1 end
+   function sock:listen() return 1 end
+   function sock:getpeername() return "peer", nil end
+   function sock:close() self.closed = true end
+   function sock:accept() return table.remove(self.pending, 1) end
+   function sock:send(str)
+      self.output = self.output .. str
+      return #str
+   end
+   function sock:receive(n)
+      if self.input == "" then
+	 return nil, self.hungup and "closed" or "timeout"
+      end
+      local r
+      if type(n) == "number" then
+	 r = string.sub(self.input, 1, n)
+      else
+	 r = string.match(self.input, "^[^\n]*")
+	 n = #r + 1
+      end
+      self.input = string.sub(self.input, n + 1)
+      return r
+   end
+   return sock
+end
+
+local function ready(sock)
+   return sock.input ~= "" or sock.pending[1] or sock.hungup
+end
+
+package.loaded["socket"] = {
+   gettime = function() return now end,
+   tcp = newsock,
+   unix = newsock,
+   select = function(readt, writet)
+      local r = {}
+      for _, sock in ipairs(readt) do
+	 if ready(sock) then r[#r + 1] = sock end
+      end
+      return r, writet
+   end,
+}
+socket = package.loaded["socket"]
+package.loaded["socket.unix"] = newsock
+
+-- The C API.  Keys are recorded rather than opened.
+local keys = {}
+local calls = {}
+
+local function record(name, result)
+   return function(...)
+      calls[#calls + 1] = { name, ... }
+      return result
+   end
+end
+
+for _, name in ipairs { "_addfd", "_delfd", "_writefd", "_nowritefd",
+			"_record_ekey", "_trace_ekey", "_daemonise",
+			"_flow_control", "_key_recovery", "_upgrade",
+			"_close_watch" } do
+   _G[name] = record(name)
+end
+for _, name in ipairs { "_open_output_file", "_open_kernel_output",
+			"_open_sink_output", "_open_foldback_output",
+			"_seed_file", "_unlink", "_chmod", "_chown" } do
+   _G[name] = record(name, true)
+end
+_G._load_keys = record("_load_keys", 1)
+_G._enumerate = function() return {} end
+_G._watch_dir = function() return nil end
+_G._read_watch = function() return {} end
+_G._inherited_socket = function() return nil end
+_G._inherited_keys = function() return {} end
+_G._peercred = function(fd) return uids[fd] end
+_G._user_id = function(name) return nil end
+_G._io_stats = function() return {} end
+_G._sink_stats = function() return {} end
+_G._add_ekey = function(path)
+   calls[#calls + 1] = { "_add_ekey", path }
+   local ekey = { path = path }
+   keys[ekey] = true
+   return ekey
+end
+_G._del_ekey = function(ekey)
+   calls[#calls + 1] = { "_del_ekey", ekey.path }
+   keys[ekey] = nil
+end
+_G._query_ekey = function(ekey) return true, "Running", nil end
+_G._stat_ekey = function(ekey) return {} end
+
+dofile("control.lua")
+
+-- The denial of service hook counts instructions, which these checks
+-- would run out of.
+debug.sethook()
+
+local tmpfiles = {}
+
+local function config(text, fname)
+   -- Write a configuration file, or rewrite one for a reload
+   if not fname then
+      fname = os.tmpname()
+      tmpfiles[#tmpfiles + 1] = fname
+   end
+   local fh = assert(io.open(fname, "w"))
+   fh:write(text)
+   fh:close()
+   return fname
+end
+
+local function pump()
+   -- Let the control code accept, read and write everything it can, as
+   -- the poll loop would without the clock moving on
+   local passes = 0
+   repeat
+      for _ = 1, 4 do
+	 CONTROL()
+      end
+      passes = passes + 1
+   until TIMER() ~= 0 or passes > 1000
+   CONTROL()
+end
+
+local function egd_connect(name, uid)
+   local client = newsock()
+   uids[client.fd] = uid
+   table.insert(bound[name].pending, client)
+   pump()
+   return client
+end
+
+local function egd_send(client, ...)
+   client.input = client.input .. string.char(...)
+   pump()
+end
+
+local function take(client)
+   local out = client.output
+   client.output = ""
+   return out
+end
+
+local function entropy(nbytes)
+   ENTROPY(string.rep("e", nbytes))
+   pump()
+end
+
+local egd = "/test/egd"
+local conffile = config([[
+EGDUnixSocket "/test/egd"
+EGDClass(1, "interactive")
+EGDClass(2, "normal")
+EGDClass(3, "bulk")
+EGDQuota(4, 100, 100)
+]])
+CONFIG(conffile)
+
+-- Blocked reads are shared between classes in proportion to their
+-- weights, however much each asks for.
+do
+   local clients = {}
+   for uid = 1, 3 do
+      clients[uid] = egd_connect(egd, uid)
+      for _ = 1, 20 do
+	 egd_send(clients[uid], 2, 255)
+      end
+   end
+   for _ = 1, 50 do
+      entropy(44)
+   end
+   local got = {}
+   for uid = 1, 3 do
+      got[uid] = #take(clients[uid])
+   end
+   check("all entropy delivered", got[1] + got[2] + got[3] == 50 * 44)
+   check("interactive shares 8:2 with normal",
+	 math.abs((got[1] / got[2]) - 4) < 0.5)
+   check("normal shares 2:1 with bulk",
+	 math.abs((got[2] / got[3]) - 2) < 0.5)
+   for uid = 1, 3 do
+      clients[uid].hungup = true
+   end
+   pump()
+end
+
+-- A client over its quota is served when the quota refills, without
+-- waiting for more entropy or another command.
+do
+   local client = egd_connect(egd, 4)
+   check("no timer while idle", TIMER() == -1)
+   entropy(1000)
+   egd_send(client, 2, 250)
+   check("burst served at once", #take(client) == 100)
+   local wait = TIMER()
+   check("refill scheduled", wait > 0 and wait <= 1000)
+   now = now + (wait / 1000)
+   TIMER()
+   pump()
+   local got = #take(client)
+   check("served on refill", got > 0)
+   local start = now
+   while got < 150 and TIMER() >= 0 do
+      now = now + (TIMER() / 1000)
+      TIMER()
+      pump()
+      got = got + #take(client)
+   end
+   check("read completed by refills", got == 150)
+   check("refills follow the quota rate", now - start >= 1.0)
+   check("no timer once served", TIMER() == -1)
+   -- Non-blocking reads are limited by the quota too
+   egd_send(client, 1, 255)
+   local r = take(client)
+   check("non-blocking read limited", string.byte(r, 1) == #r - 1 and #r - 1 <= 100)
+   client.hungup = true
+   pump()
+end
+
+local function u32(val)
+   local b4 = val % 256
+   val = math.floor(val / 256)
+   local b3 = val % 256
+   val = math.floor(val / 256)
+   return math.floor(val / 256), val % 256, b3, b4
+end
+
+local function unpack32(str, at)
+   local b1, b2, b3, b4 = string.byte(str, at, at + 3)
+   return ((b1 * 256 + b2) * 256 + b3) * 256 + b4
+end
+
+local function drain_pool(client)
+   repeat
+      egd_send(client, 0x11, u32(65536))
+   until unpack32(take(client), 1) == 0
+end
+
+-- Extended commands: version, 32 bit reads and streaming subscriptions.
+do
+   local client = egd_connect(egd, nil)
+   drain_pool(client)
+
+   egd_send(client, 0x10)
+   check("extension version", take(client) == string.char(1))
+
+   -- Entropy arriving in small blocks is kept whole and in order
+   local sent = {}
+   for i = 1, 4000 do
+      sent[i] = string.char(i % 256, math.floor(i / 256), 0x5a)
+   end
+   for i = 1, 4000 do
+      ENTROPY(sent[i])
+   end
+   egd_send(client, 0)
+   check("pool counts every block", unpack32(take(client), 1) == 4000 * 3 * 8)
+   egd_send(client, 0x11, u32(65536))
+   local r = take(client)
+   check("32 bit read returns the pool", unpack32(r, 1) == 4000 * 3 and #r == 4 + 4000 * 3)
+   local want, have = {}, {}
+   for i = 1, 4000 do
+      want[sent[i]] = (want[sent[i]] or 0) + 1
+      local piece = string.sub(r, 5 + (i - 1) * 3, 4 + i * 3)
+      have[piece] = (have[piece] or 0) + 1
+   end
+   local same = true
+   for piece, count in pairs(want) do
+      if have[piece] ~= count then same = false end
+   end
+   check("pool blocks survive gathering", same)
+
+   -- Non-blocking reads are capped, the rest stays in the pool
+   entropy(70000)
+   egd_send(client, 0x11, u32(100000))
+   r = take(client)
+   check("32 bit read capped", unpack32(r, 1) == 65536 and #r == 4 + 65536)
+   egd_send(client, 0)
+   check("remainder left", unpack32(take(client), 1) == (70000 - 65536) * 8)
+   drain_pool(client)
+
+   -- A blocking read larger than 255 bytes completes as entropy arrives
+   egd_send(client, 0x12, u32(10000))
+   entropy(6000)
+   check("blocking read partly served", #take(client) == 6000)
+   entropy(6000)
+   check("blocking read completed", #take(client) == 4000)
+   egd_send(client, 0)
+   check("blocking read took no more", unpack32(take(client), 1) == 2000 * 8)
+   drain_pool(client)
+
+   -- A subscription streams entropy against the credit granted
+   egd_send(client, 0x13, u32(1000))
+   entropy(600)
+   check("subscription streams", #take(client) == 600)
+   egd_send(client, 0x13, u32(1000))
+   entropy(2000)
+   check("subscription credit adds up", #take(client) == 1400)
+   egd_send(client, 0x13, u32(0))
+   egd_send(client, 0)
+   check("commands after subscription ends", #take(client) == 4)
+   drain_pool(client)
+
+   -- Other commands are refused while subscribed
+   egd_send(client, 0x13, u32(100))
+   egd_send(client, 0)
+   check("command during subscription drops client", client.closed)
+end
+
+local function called(from, name)
+   -- The first arguments of the calls to a C function since a mark
+   local args = {}
+   for i = from + 1, #calls do
+      if calls[i][1] == name then
+	 args[#args + 1] = tostring(calls[i][2])
+      end
+   end
+   return table.concat(args, " ")
+end
+
+-- A reload applies only what changed in the configuration file.
+do
+   local base = [[
+EGDUnixSocket "/test/egd"
+Daemonise(true)
+]]
+   local mark = #calls
+   config(base .. [[
+AddEntropyKey "/dev/k1"
+AddEntropyKey "/dev/k2"
+UnixControlSocket "/test/ctl"
+EGDQuota(4, 100, 100)
+]], conffile)
+   local ok, msg = pcall(RELOAD)
+   check("reload runs Daemonise: " .. tostring(msg), ok)
+   check("Daemonise ignored by reload", called(mark, "_daemonise") == "")
+   check("listed keys added", called(mark, "_add_ekey") == "/dev/k1 /dev/k2")
+   local ctl = bound["/test/ctl"]
+   check("control socket opened", ctl ~= nil)
+   local user = newsock()
+   table.insert(ctl.pending, user)
+   user.input = "Daemonise(true)\n"
+   pump()
+   check("Daemonise withdrawn from control",
+	 string.match(take(user), "\nERROR .*'Daemonise' %(a nil value%)"))
+   user.hungup = true
+   pump()
+
+   mark = #calls
+   config(base .. [[
+AddEntropyKey "/dev/k1"
+AddEntropyKey "/dev/k3"
+UnixControlSocket "/test/ctl"
+]], conffile)
+   ok, msg = pcall(RELOAD)
+   check("second reload: " .. tostring(msg), ok)
+   check("removed key closed", called(mark, "_del_ekey") == "/dev/k2")
+   check("only the new key opened", called(mark, "_add_ekey") == "/dev/k3")
+   check("unchanged socket kept", bound["/test/ctl"] == ctl and not ctl.closed)
+
+   -- The quota went with the reload
+   local client = egd_connect(egd, 4)
+   entropy(1000)
+   egd_send(client, 1, 255)
+   check("quota removed", #take(client) == 256)
+   client.hungup = true
+   pump()
+
+   mark = #calls
+   config(base .. [[
+AddEntropyKey "/dev/k1"
+AddEntropyKey "/dev/k3"
+UnixControlSocket "/test/ctl2"
+]], conffile)
+   ok, msg = pcall(RELOAD)
+   check("third reload: " .. tostring(msg), ok)
+   check("changed socket closed", ctl.closed)
+   check("changed socket removed", string.match(called(mark, "_unlink"), "^/test/ctl "))
+   check("changed socket opened", bound["/test/ctl2"] ~= nil)
+   check("keys left alone", called(mark, "_add_ekey") == "" and called(mark, "_del_ekey") == "")
+
+   -- A reload which changes the output is refused and changes nothing
+   mark = #calls
+   config([[
+UnixControlSocket "/test/ctl2"
+SetOutputToKernel(8)
+]], conffile)
+   ok = pcall(RELOAD)
+   check("output change refused", not ok)
+   check("refused reload changes nothing", #calls == mark)
+end
+
+for _, fname in ipairs(tmpfiles) do
+   os.remove(fname)
+end
+
+if failures ~= 0 then
+   io.stderr:write(tostring(failures) .. " checks failed\n")
+   os.exit(1)
+end
+
+print("control: all checks passed")
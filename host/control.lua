@@ -11,17 +11,33 @@ local writefd = _writefd
 local nowritefd = _nowritefd
 local ekey_add = _add_ekey
 local ekey_del = _del_ekey
+local ekey_record = _record_ekey
 local ekey_query = _query_ekey
 local ekey_stat = _stat_ekey
+local ekey_trace = _trace_ekey
+local io_stats = _io_stats
 local read_keys = _load_keys
 local open_output_file = _open_output_file
 local open_kernel_output = _open_kernel_output
+local open_sink_output = _open_sink_output
+local sink_stats = _sink_stats
 local open_foldback_output = _open_foldback_output
 local daemonise = _daemonise
+local flow_control = _flow_control
+local key_recovery = _key_recovery
+local seed_file = _seed_file
 local unlink = _unlink
 local chmod = _chmod
 local chown = _chown
 local enumerate = _enumerate
+local watch_dir = _watch_dir
+local read_watch = _read_watch
+local close_watch = _close_watch
+local peercred = _peercred
+local user_id = _user_id
+local upgrade = _upgrade
+local inherited_socket = _inherited_socket
+local inherited_keys = _inherited_keys
 local gc = collectgarbage
 local debugprint = function() end -- Use print to output debugging
 
@@ -60,6 +76,7 @@ local ctldielater = {}
 local ctltoaccept = {}
 local ctlenv = {}
 local ctlrhandler = {}
+local egd_forget -- Set up with the EGD scheduler below
 
 function addctlsocket(sock, name, isconn, rhandler)
    --print("New " .. (isconn and "control" or "connection") .. " socket: " .. name)
@@ -93,6 +110,7 @@ function delctlsocket(sock)
    ctldielater[sock] = nil
    ctlenv[sock] = nil
    ctlrhandler[sock] = nil
+   egd_forget(sock)
    delfd(sock:getfd())
    sock:close()
 end
@@ -168,6 +186,7 @@ end
 
 -- Output management
 local output_configured = false
+local output_credits = false -- Output credits entropy or feeds EGD clients
 
 -- Entropy Key management
 
@@ -218,6 +237,11 @@ end
 
 function add_ekey(path, serial)
    assert(output_configured, "No output type yet configured")
+   -- Replayed and simulated keys do not produce entropy which may be trusted
+   assert(not (output_credits and (string.find(path, "^replay:") or
+				   string.find(path, "^replay%-fast:") or
+				   string.find(path, "^usb:fake"))),
+	  "Replayed and simulated keys need a file output")
    local ekey = find_ekey(path)
    if ekey then
       -- Already got it
@@ -273,39 +297,198 @@ local strsub = string.sub
 local strbyte = string.byte
 local strchar = string.char
 local tremove = table.remove
+local tinsert = table.insert
+local tconcat = table.concat
+
+local ENTROPY_BLOCK = 4096 -- Small blocks are gathered up to this size
+
+local entropy_used = 0 -- Bytes already taken from the top block
+local entropy_gather = {} -- Small blocks waiting to be joined
+local gather_len = 0
+
+local function gather_entropy()
+   -- Join the gathered blocks with one copy, onto the top block if it
+   -- has room for them
+   if gather_len == 0 then return end
+   local joined = tconcat(entropy_gather)
+   local top = entropy_blocks[#entropy_blocks]
+   if top and (#top - entropy_used + gather_len) <= ENTROPY_BLOCK then
+      entropy_blocks[#entropy_blocks] = strsub(top, entropy_used + 1) .. joined
+      entropy_used = 0
+   else
+      entropy_blocks[#entropy_blocks + 1] = joined
+   end
+   entropy_gather = {}
+   gather_len = 0
+end
 
 local function enqueue_entropy(bytes)
    if ((total_entropy + #bytes) <= MAX_ENTROPY) then
-      entropy_blocks[#entropy_blocks + 1] = bytes
+      -- Gathering up blocks keeps large dequeues to a few iterations
+      entropy_gather[#entropy_gather + 1] = bytes
+      gather_len = gather_len + #bytes
+      if gather_len >= ENTROPY_BLOCK then
+	 gather_entropy()
+      end
       total_entropy = total_entropy + #bytes
       --debugprint("Total entropy now " .. tostring(total_entropy) .. " bytes.")
    end
 end
 
 local function dequeue_entropy(nbytes)
-   local retstr = ""
+   local parts = {}
+   gather_entropy()
    while total_entropy > 0 and nbytes > 0 do
       local eval = entropy_blocks[#entropy_blocks]
-      if #eval <= nbytes then
-	 retstr = retstr .. eval
-	 nbytes = nbytes - #eval
+      local left = #eval - entropy_used
+      if left <= nbytes then
+	 parts[#parts + 1] = strsub(eval, entropy_used + 1)
+	 nbytes = nbytes - left
 	 tremove(entropy_blocks, #entropy_blocks)
-	 total_entropy = total_entropy - #eval
+	 entropy_used = 0
+	 total_entropy = total_entropy - left
       else
-	 retstr = retstr .. strsub(eval, 1, nbytes)
+	 -- Taking from the front by offset avoids copying the rest
+	 parts[#parts + 1] = strsub(eval, entropy_used + 1, entropy_used + nbytes)
+	 entropy_used = entropy_used + nbytes
 	 total_entropy = total_entropy - nbytes
-	 entropy_blocks[#entropy_blocks] = strsub(eval, nbytes + 1)
 	 nbytes = 0
       end
    end
-   return retstr
+   return tconcat(parts)
 end
 
 local weakkeyed = { __mode = "k" }
 local readbuffers = setmetatable({}, weakkeyed)
-local egdwriteblocked = setmetatable({}, weakkeyed)
 local egdreadblocked = setmetatable({}, weakkeyed)
 
+-- EGD blocking read scheduler
+--
+-- Clients blocked reading entropy wait in a ring which is served by
+-- deficit round robin.  Each turn grants the client its class quantum of
+-- bytes and it keeps the turn until they are sent, so classes share the
+-- entropy in proportion to their weights however much each client asks
+-- for, and a bulk consumer cannot starve an interactive one.  Token
+-- buckets per UID (per connection for TCP clients) optionally cap the
+-- rate at which any consumer may take entropy at all.
+
+local EGD_QUANTUM = 16 -- Bytes per visit for a class of weight 1
+local EGD_MAX_VISITS = 32 -- Ring visits per scheduling pass
+
+local gettime = socket.gettime
+local egd_classes = {}
+local egd_classorder = {}
+local egd_classfor = {}
+local egd_quotafor = {}
+local egd_buckets = {}
+local egdclients = setmetatable({}, weakkeyed)
+local egd_ring = {}
+local egd_next = 1
+local egd_spreading = false
+local egd_wake_at -- When blocked clients can next be served without new entropy
+
+local function egd_newclass(name, weight)
+   local class = { name = name, weight = weight,
+		   waiting = 0, pending = 0, served = 0, requests = 0,
+		   completed = 0, totalwait = 0, maxwait = 0 }
+   egd_classes[name] = class
+   egd_classorder[#egd_classorder + 1] = class
+end
+
+egd_newclass("interactive", 8)
+egd_newclass("normal", 2)
+egd_newclass("bulk", 1)
+
+local function egd_bucket(key, quota)
+   -- The bucket for a quota, which a UID keeps between its clients, so
+   -- it is brought up to date with the quota each time it is found
+   local bucket = egd_buckets[key]
+   if quota == nil then
+      egd_buckets[key] = nil
+      return nil
+   end
+   if bucket == nil then
+      bucket = { rate = quota.rate, burst = quota.burst,
+		 tokens = quota.burst, last = gettime() }
+      egd_buckets[key] = bucket
+   else
+      bucket.rate, bucket.burst = quota.rate, quota.burst
+      bucket.tokens = math.min(bucket.tokens, quota.burst)
+   end
+   return bucket
+end
+
+local function egd_allowance(bucket, now)
+   -- Bytes the bucket allows right now
+   if bucket == nil then return MAX_ENTROPY end
+   bucket.tokens = math.min(bucket.burst,
+			    bucket.tokens + ((now - bucket.last) * bucket.rate))
+   bucket.last = now
+   return math.floor(bucket.tokens)
+end
+
+local function egd_newclient(sock, uid)
+   local who = uid or "tcp"
+   local class = egd_classfor[who] or egd_classfor["default"] or egd_classes.normal
+   local quota = egd_quotafor[who] or egd_quotafor["default"]
+   egdclients[sock] = {
+      uid = uid, class = class, want = 0, deficit = 0, since = 0,
+      -- UNIX clients with a UID share its bucket, others get their own
+      bucket = egd_bucket(uid or sock, quota)
+   }
+end
+
+local function egd_unblock(client, now)
+   local class = client.class
+   local waited = (now - client.since) * 1000
+   class.waiting = class.waiting - 1
+   class.completed = class.completed + 1
+   class.totalwait = class.totalwait + waited
+   if waited > class.maxwait then class.maxwait = waited end
+   client.deficit = 0
+end
+
+egd_forget = function(sock)
+   local client = egdclients[sock]
+   if client == nil then return end
+   if client.want > 0 then
+      for i, rsock in ipairs(egd_ring) do
+	 if rsock == sock then
+	    tremove(egd_ring, i)
+	    if egd_next > i then egd_next = egd_next - 1 end
+	    break
+	 end
+      end
+      client.class.pending = client.class.pending - client.want
+      egd_unblock(client, gettime())
+   end
+   if client.bucket and client.uid == nil then
+      egd_buckets[sock] = nil
+   end
+   egdclients[sock] = nil
+end
+
+local function egd_block(sock, nbytes)
+   -- Queue a blocking read behind any clients already waiting
+   local client = egdclients[sock]
+   local class = client.class
+   if client.want > 0 then
+      -- Already queued, as a subscriber granting more credit
+      client.want = client.want + nbytes
+      class.pending = class.pending + nbytes
+      return
+   end
+   client.want = nbytes
+   client.deficit = 0
+   client.since = gettime()
+   class.waiting = class.waiting + 1
+   class.pending = class.pending + nbytes
+   class.requests = class.requests + 1
+   -- Just behind the next client to be visited is the back of the ring
+   tinsert(egd_ring, egd_next, sock)
+   egd_next = egd_next + 1
+end
+
 local function egd_getbytes(sock, nr)
    local r = readbuffers[sock] or ""
    if #r < nr then return end
@@ -326,6 +509,13 @@ local EGD_CMD_READBYTES = 1
 local EGD_CMD_BLOCKREAD = 2
 local EGD_CMD_ADDENTROPY = 3
 local EGD_CMD_GETPID = 4
+local EGD_CMD_EXTVERSION = 0x10
+local EGD_CMD_READBYTES32 = 0x11
+local EGD_CMD_BLOCKREAD32 = 0x12
+local EGD_CMD_SUBSCRIBE = 0x13
+
+local EGD_EXT_VERSION = 1
+local EGD_EXT_MAX_READ = 65536 -- Largest non-blocking extended read
 
 local function egd_pack32(val)
    local r
@@ -339,9 +529,24 @@ local function egd_pack32(val)
    return r
 end
 
+local function egd_unpack32(b1, b2, b3, b4)
+   return ((b1 * 256 + b2) * 256 + b3) * 256 + b4
+end
+
+local function egd_readnow(sock, nbytes)
+   -- Dequeue what entropy there is, up to nbytes and the client's quota
+   local bucket = egdclients[sock].bucket
+   local ent = dequeue_entropy(math.min(nbytes, egd_allowance(bucket, gettime())))
+   if bucket then bucket.tokens = bucket.tokens - #ent end
+   return ent
+end
+
+local egd_spreadwrite -- Defined after the command handler it calls
+
 local function egd_try_cmd(sock)
+   local client = egdclients[sock]
    -- If blocked writing entropy, do not process commands
-   if egdwriteblocked[sock] then
+   if client.want > 0 and not client.subscribed then
       --debugprint("Not servicing, write blocked")
       return
    end
@@ -360,6 +565,11 @@ local function egd_try_cmd(sock)
    local cmd = egd_getbytes(sock, 1)
    -- Just in case there's no command...
    if cmd == nil then return end
+   if client.subscribed and cmd ~= EGD_CMD_SUBSCRIBE then
+      debugprint("EGD command during subscription: " .. tostring(cmd))
+      ctltokill[sock] = true
+      return
+   end
    --debugprint("Command: " .. tostring(cmd))
    if cmd == EGD_CMD_QUERYPOOL then
       -- Query pool size, no arguments
@@ -378,7 +588,7 @@ local function egd_try_cmd(sock)
 	 return
       end
       --debugprint("Dequeuing " .. tostring(nbytes))
-      local ent = dequeue_entropy(nbytes)
+      local ent = egd_readnow(sock, nbytes)
       --debugprint("Acquired " .. tostring(#ent))
       ctlwrite(sock, strchar(#ent) .. ent)
       return
@@ -392,10 +602,9 @@ local function egd_try_cmd(sock)
 	 egd_pushbackread(sock, EGD_CMD_BLOCKREAD)
 	 return
       end
-      local ent = dequeue_entropy(nbytes)
-      ctlwrite(sock, ent)
-      if #ent < nbytes then
-	 egdwriteblocked[sock] = nbytes - #ent
+      if nbytes > 0 then
+	 egd_block(sock, nbytes)
+	 egd_spreadwrite()
       end
       return
    end
@@ -421,47 +630,118 @@ local function egd_try_cmd(sock)
       ctlwrite(sock, strchar(2) .. "-1")
       return
    end
+   if cmd == EGD_CMD_EXTVERSION then
+      -- Query extension version, no arguments
+      -- Return: U8 version
+      ctlwrite(sock, strchar(EGD_EXT_VERSION))
+      return
+   end
+   if cmd == EGD_CMD_READBYTES32 then
+      -- Retrieve N bytes (nonblocking)
+      -- Arguments: U32 nbytes
+      -- Return: U32 rbytes, STR bytes
+      local b1, b2, b3, b4 = egd_getbytes(sock, 4)
+      if b1 == nil then
+	 egd_pushbackread(sock, EGD_CMD_READBYTES32)
+	 return
+      end
+      local nbytes = math.min(egd_unpack32(b1, b2, b3, b4), EGD_EXT_MAX_READ)
+      local ent = egd_readnow(sock, nbytes)
+      ctlwrite(sock, egd_pack32(#ent) .. ent)
+      return
+   end
+   if cmd == EGD_CMD_BLOCKREAD32 or cmd == EGD_CMD_SUBSCRIBE then
+      -- Retrieve N bytes (blocking), or grant N bytes of streaming credit
+      -- Arguments: U32 nbytes
+      -- Return: STR bytes
+      local b1, b2, b3, b4 = egd_getbytes(sock, 4)
+      if b1 == nil then
+	 egd_pushbackread(sock, cmd)
+	 return
+      end
+      local nbytes = egd_unpack32(b1, b2, b3, b4)
+      if cmd == EGD_CMD_SUBSCRIBE then
+	 -- No more credit ends the subscription once the rest is sent
+	 client.subscribed = nbytes > 0
+      end
+      if nbytes > 0 then
+	 egd_block(sock, nbytes)
+	 egd_spreadwrite()
+      end
+      return
+   end
    -- Unknown command
    debugprint("Unknown EGD command: " .. tostring(cmd))
    ctltokill[sock] = true
 end
 
-local function egd_spreadwrite()
-   -- If there are any EGD sockets blocked on entropy, try feeding it around.
-   if next(egdwriteblocked) == nil then return end
-   debugprint("Doing a spreadwrite")
-   local totpending = 0
-   for k, v in pairs(egdwriteblocked) do totpending = totpending + v end
-   if (totpending > MAX_ENTROPY) then
-      debugprint("Somehow, we are blocking for more entropy than we can ever have, skipping the test.")
-   else
-      if (totpending > total_entropy) then 
-	 debugprint("Not enough entropy to satisfy spread-write. Want "..tostring(totpending).." but only have "..tostring(total_entropy))
-	 return 
+egd_spreadwrite = function()
+   -- Feed the available entropy to the blocked clients, in DRR order.
+   -- A client keeps its turn until it has had its quantum, so entropy
+   -- arriving in small blocks is still shared in proportion to weight.
+   if egd_spreading or egd_ring[1] == nil then return end
+   egd_spreading = true
+   local now = gettime()
+   local visits, idle = 0, 0
+   while total_entropy > 0 and egd_ring[1] and
+      visits < EGD_MAX_VISITS and idle < #egd_ring do
+      if egd_next > #egd_ring then egd_next = 1 end
+      local sock = egd_ring[egd_next]
+      local client = egdclients[sock]
+      local class = client.class
+      if client.deficit == 0 then
+	 client.deficit = EGD_QUANTUM * class.weight
       end
-   end
-
-   local to_try = {} -- Filled out with sockets we unblocked, so we can try a command.
-   for sock, amount in pairs(egdwriteblocked) do
-      local towrite = amount
-      debugprint("egd_spreadwrite("..tostring(sock)..") of " .. tostring(towrite))
-      local got = dequeue_entropy(towrite)
+      local allowance = egd_allowance(client.bucket, now)
+      local got = dequeue_entropy(math.min(client.want, client.deficit, allowance))
+      visits = visits + 1
       if #got > 0 then
 	 ctlwrite(sock, got)
-	 if towrite == amount then
-	    debugprint("huzzah, unblocked")
-	    egdwriteblocked[sock] = nil
-	    to_try[sock] = true
-	 else
-	    debugprint("boo hiss, "..tostring(amount-entper).." left")
-	    egdwriteblocked[sock] = amount - entper
+	 idle = 0
+	 client.want = client.want - #got
+	 client.deficit = client.deficit - #got
+	 if client.bucket then
+	    client.bucket.tokens = client.bucket.tokens - #got
 	 end
+	 class.pending = class.pending - #got
+	 class.served = class.served + #got
+      else
+	 idle = idle + 1
+      end
+      if client.want == 0 then
+	 tremove(egd_ring, egd_next)
+	 egd_unblock(client, now)
+	 -- Let it queue its next read, if it has one, at the back
+	 egd_try_cmd(sock)
+      elseif client.deficit == 0 or #got == allowance then
+	 -- Turn over, either the quantum is used up or the quota is
+	 client.deficit = 0
+	 egd_next = egd_next + 1
       end
    end
-
-   for sock in pairs(to_try) do
-      egd_try_cmd(sock)
+   -- Entropy left over must reach clients without waiting for more to
+   -- arrive, once the pass limit or their quotas allow
+   egd_wake_at = nil
+   if total_entropy > 0 and egd_ring[1] then
+      if visits >= EGD_MAX_VISITS then
+	 egd_wake_at = now
+      end
+      for _, sock in ipairs(egd_ring) do
+	 local client = egdclients[sock]
+	 local bucket = client.bucket
+	 if bucket and bucket.rate > 0 then
+	    local need = math.min(client.want, bucket.burst,
+				  EGD_QUANTUM * client.class.weight)
+	    if bucket.tokens < need then
+	       local at = bucket.last + ((need - bucket.tokens) / bucket.rate)
+	       if egd_wake_at == nil or at < egd_wake_at then
+		  egd_wake_at = at
+	       end
+	    end
+	 end
+      end
    end
+   egd_spreading = false
 end
 
 local function egd_ctlread(sock)
@@ -474,9 +754,15 @@ local function egd_ctlread(sock)
       pcall(function() peer, maybeport = client:getpeername() end)
       if maybeport then peer = peer .. ":" .. tostring(maybeport) end
       local name = "EGDC:" .. peer
+      local uid = nil
+      if controlsockets[sock]:sub(1, 2) == "U:" then
+	 uid = peercred(client:getfd())
+      end
+      if uid then name = name .. ":" .. tostring(uid) end
       debugprint("New client: " .. name)
       addctlsocket(client, name, true, egd_ctlread)
       readbuffers[client] = ""
+      egd_newclient(client, uid)
       return
    end
    --debugprint("EGD command RX")
@@ -516,21 +802,36 @@ local function SetFoldedOutput()
    assert(not output_configured, "Output already configured")
    assert(open_foldback_output())
    output_configured = true
+   output_credits = true
    output_is_folded = true
 end
 
+local function adopt_socket(new, name)
+   -- Take over a listening socket handed on by the daemon being upgraded
+   local fd = inherited_socket(name)
+   if not fd then return nil end
+   local sock = new()
+   sock:close()
+   sock:setfd(fd)
+   assert(sock:listen())
+   return sock
+end
+
 if have_unix_domain_sockets then
    function UnixControlSocket(sockname)
       -- Add a UDS control socket to the set of control sockets available
-      -- First, try and connect, so we can abort if it's present.
-      if socket.unix():connect(sockname) then
-	 error("Control socket " .. sockname .. " already present. Is ekeyd already running?")
-      end
-      -- Okay, clean up (ignoring errors) and create a fresh socket
-      unlink(sockname)
-      local u = socket.unix()
-      assert(u:bind(sockname))
-      assert(u:listen())
+      local u = adopt_socket(socket.unix, "U:" .. sockname)
+      if not u then
+	 -- First, try and connect, so we can abort if it's present.
+	 if socket.unix():connect(sockname) then
+	    error("Control socket " .. sockname .. " already present. Is ekeyd already running?")
+	 end
+	 -- Okay, clean up (ignoring errors) and create a fresh socket
+	 unlink(sockname)
+	 u = socket.unix()
+	 assert(u:bind(sockname))
+	 assert(u:listen())
+      end
       addctlsocket(u, "U:" .. sockname)
    end _ "UnixControlSocket"
 else
@@ -541,27 +842,33 @@ end
 
 function TCPControlSocket(port)
    -- Add a TCP control socket to the set of control sockets available
-   if socket.tcp():connect("127.0.0.1", tonumber(port)) then
-      error("TCP Control socket on port " .. tostring(port) .. " already present. Is ekeyd already running?")
+   local t = adopt_socket(socket.tcp, "T:" .. tostring(port))
+   if not t then
+      if socket.tcp():connect("127.0.0.1", tonumber(port)) then
+	 error("TCP Control socket on port " .. tostring(port) .. " already present. Is ekeyd already running?")
+      end
+      t = socket.tcp()
+      t:setoption("reuseaddr", true)
+      assert(t:bind("127.0.0.1", tonumber(port)))
+      assert(t:listen())
    end
-   local t = socket.tcp()
-   t:setoption("reuseaddr", true)
-   assert(t:bind("127.0.0.1", tonumber(port)))
-   assert(t:listen())
    addctlsocket(t, "T:" .. tostring(port))
 end _ "TCPControlSocket"
 
 if have_unix_domain_sockets then
    function EGDUnixSocket(sockname, modestr, user, group)
       SetFoldedOutput()
-      if socket.unix():connect(sockname) then
-	 error("EGD socket " .. sockname .. " already present. Is ekeyd/EGD already running?")
+      local u = adopt_socket(socket.unix, "U:" .. sockname)
+      if not u then
+	 if socket.unix():connect(sockname) then
+	    error("EGD socket " .. sockname .. " already present. Is ekeyd/EGD already running?")
+	 end
+	 -- Add a UDS control socket to the set of control sockets available
+	 unlink(sockname)
+	 u = socket.unix()
+	 assert(u:bind(sockname))
+	 assert(u:listen())
       end
-      -- Add a UDS control socket to the set of control sockets available
-      unlink(sockname)
-      local u = socket.unix()
-      assert(u:bind(sockname))
-      assert(u:listen())
       addctlsocket(u, "U:" .. sockname, false, egd_ctlread)
       if modestr then
 	 assert(chmod(sockname, tonumber(modestr, 8)))
@@ -581,17 +888,39 @@ end
 function EGDTCPSocket(port, ipaddr)
    SetFoldedOutput()
    ipaddr = ipaddr or "127.0.0.1"
-   if socket.tcp():connect(ipaddr, tonumber(port)) then
-      error("EGD TCP socket on " .. ipaddr .. ":" .. tostring(port) .. " already present. Is ekeyd/EGD already running?")
+   local t = adopt_socket(socket.tcp, "T:" .. tostring(port))
+   if not t then
+      if socket.tcp():connect(ipaddr, tonumber(port)) then
+	 error("EGD TCP socket on " .. ipaddr .. ":" .. tostring(port) .. " already present. Is ekeyd/EGD already running?")
+      end
+      -- Add a TCP control socket to the set of control sockets available
+      t = socket.tcp()
+      t:setoption("reuseaddr", true)
+      assert(t:bind(ipaddr, tonumber(port)))
+      assert(t:listen())
    end
-   -- Add a TCP control socket to the set of control sockets available
-   local t = socket.tcp()
-   t:setoption("reuseaddr", true)
-   assert(t:bind(ipaddr, tonumber(port)))
-   assert(t:listen())
    addctlsocket(t, "T:" .. tostring(port), false, egd_ctlread)
 end _ "EGDTCPSocket"
 
+local function egd_who(who)
+   -- Resolve an EGD client identity: a UID, user name, "default" or "tcp"
+   if who == "default" or who == "tcp" then return who end
+   if tonumber(who) then return tonumber(who) end
+   return assert(user_id(who))
+end
+
+function EGDClass(who, classname)
+   local class = assert(egd_classes[classname],
+			"Unknown EGD client class '" .. tostring(classname) .. "'")
+   egd_classfor[egd_who(who)] = class
+end _ "EGDClass"
+
+function EGDQuota(who, rate, burst)
+   rate = assert(tonumber(rate), "EGD quota rate must be a number")
+   burst = tonumber(burst) or rate
+   egd_quotafor[egd_who(who)] = { rate = rate, burst = burst }
+end _ "EGDQuota"
+
 function Bye()
    Print "Good bye"
    ctldielater[currentclient] = true
@@ -628,6 +957,14 @@ function AddEntropyKey(devpath, serial)
    Print("ID "..tostring(mykey.nr))
 end _ "AddEntropyKey"
 
+function RecordEntropyKey(devpath, capfile, serial)
+   assert(not find_ekey(devpath), "Entropy key '" .. tostring(devpath) .. "' already added, recording must start with the connection")
+   local mykey = add_ekey(devpath, serial)
+   assert(ekey_record(mykey.ekey, tostring(capfile)))
+   debugprint("Recording ekey " .. tostring(devpath) .. " to " .. tostring(capfile))
+   Print("ID "..tostring(mykey.nr))
+end _ "RecordEntropyKey"
+
 function RemoveEntropyKey(tag)
    local ekey = assert(find_ekey(tag), "Unable to find ekey '" .. tostring(tag) .. "'")
    debugprint("Killing ekey for " .. tostring(tag))
@@ -645,6 +982,121 @@ function AddEntropyKeys(dirname)
    pcall(do_it)
 end _ "AddEntropyKeys"
 
+-- Hotplug support, directories of keys are watched and keys are added
+-- and removed as their nodes come and go.  A watch looks enough like a
+-- socket to sit in the control socket set.
+local function make_watcher(fd)
+   return {
+      getfd = function() return fd end,
+      dirty = function() return false end,
+      close = function() close_watch(fd) end,
+   }
+end
+
+local function hotplug_add(path)
+   if not find_ekey(path) then
+      -- Each key comes up on its own state machine, so many can be
+      -- added at once without waiting on each other.
+      local ok, msg = pcall(add_ekey, path)
+      debugprint("Hotplug add " .. path .. ": " .. tostring(msg))
+   end
+end
+
+local function hotplug_remove(path)
+   local ekey = find_ekey(path)
+   if ekey then
+      debugprint("Hotplug remove " .. path)
+      kill_ekey(ekey)
+   end
+end
+
+local watch_entropy_keys
+
+local function hotplug_scan(dirname)
+   for _, knode in ipairs(enumerate(dirname) or {}) do
+      if string.sub(knode, 1, 1) ~= "." then
+	 hotplug_add(dirname .. "/" .. knode)
+      end
+   end
+end
+
+watch_entropy_keys = function(dirname)
+   local name = "watch:" .. dirname
+   if controlsockets[name] then
+      return true
+   end
+
+   local fd, err = watch_dir(dirname)
+   if fd then
+      local function handler(watcher)
+	 for _, ev in ipairs(read_watch(fd)) do
+	    local op, node = ev[1], ev[2]
+	    if op == "gone" then
+	       -- The directory went away, wait for it to come back.
+	       delctlsocket(watcher)
+	       for _, ekey in ipairs(ekey_list) do
+		  if string.sub(ekey.devpath, 1, #dirname + 1) == dirname .. "/" then
+		     hotplug_remove(ekey.devpath)
+		  end
+	       end
+	       watch_entropy_keys(dirname)
+	       return
+	    elseif string.sub(node, 1, 1) ~= "." then
+	       if op == "add" then
+		  hotplug_add(dirname .. "/" .. node)
+	       else
+		  hotplug_remove(dirname .. "/" .. node)
+	       end
+	    end
+	 end
+      end
+      addctlsocket(make_watcher(fd), name, true, handler)
+      -- Pick up anything already present.
+      hotplug_scan(dirname)
+      return true
+   end
+
+   -- The directory does not exist yet, watch for it being created.
+   local parent, leaf = string.match(dirname, "^(.*)/([^/]+)$")
+   if not parent then
+      return nil, err
+   end
+   if parent == "" then
+      parent = "/"
+   end
+
+   local pname = "watchfor:" .. dirname
+   if controlsockets[pname] then
+      return true
+   end
+
+   local pfd, perr = watch_dir(parent)
+   if not pfd then
+      return nil, perr
+   end
+   local function phandler(watcher)
+      for _, ev in ipairs(read_watch(pfd)) do
+	 if ev[1] == "add" and ev[2] == leaf then
+	    delctlsocket(watcher)
+	    watch_entropy_keys(dirname)
+	    return
+	 end
+      end
+   end
+   local pwatcher = make_watcher(pfd)
+   addctlsocket(pwatcher, pname, true, phandler)
+   -- It may have been created before the watch was in place.
+   if enumerate(dirname) then
+      delctlsocket(pwatcher)
+      return watch_entropy_keys(dirname)
+   end
+   return true
+end
+
+function WatchEntropyKeys(dirname)
+   assert(watch_entropy_keys(tostring(dirname)))
+end _ "WatchEntropyKeys"
+
 function Keyring(fname)
    Print(tostring(read_keys(tostring(fname))))
 end _ "Keyring"
@@ -655,10 +1107,17 @@ function SetOutputToFile(fname)
    output_configured = true
 end _ "SetOutputToFile"
 
-function SetOutputToKernel(bpb)
+function SetOutputToFileSink(fname, options)
    assert(not output_configured, "Output already configured")
-   assert(open_kernel_output(tonumber(bpb)))
+   assert(open_sink_output(fname, options))
    output_configured = true
+end _ "SetOutputToFileSink"
+
+function SetOutputToKernel(bpb, options)
+   assert(not output_configured, "Output already configured")
+   assert(open_kernel_output(tonumber(bpb), options))
+   output_configured = true
+   output_credits = true
 end _ "SetOutputToKernel"
 
 function ListEntropyKeys()
@@ -681,6 +1140,44 @@ function StatEntropyKey(tag)
 
 end _ "StatEntropyKey"
 
+function TraceEntropyKey(tag)
+   local ekey = assert(find_ekey(tag), "Unable to find ekey '" .. tostring(tag) .. "'")
+   local dump = assert(ekey_trace(ekey.ekey))
+
+   for line in string.gmatch(dump, "[^\n]+") do
+      MLPrint(line)
+   end
+end _ "TraceEntropyKey"
+
+function IOStatistics()
+   local stats = assert(io_stats())
+
+   for i, v in pairs(stats) do
+      KVPrint(i, v)
+   end
+end _ "IOStatistics"
+
+function EGDStatistics()
+   for _, class in ipairs(egd_classorder) do
+      local pfx = class.name .. "."
+      KVPrint(pfx .. "Waiting", class.waiting)
+      KVPrint(pfx .. "PendingBytes", class.pending)
+      KVPrint(pfx .. "ServedBytes", class.served)
+      KVPrint(pfx .. "Requests", class.requests)
+      KVPrint(pfx .. "MeanWaitMs", class.completed > 0 and
+	      math.floor(class.totalwait / class.completed) or 0)
+      KVPrint(pfx .. "MaxWaitMs", math.floor(class.maxwait))
+   end
+end _ "EGDStatistics"
+
+function SinkStatistics()
+   local stats = assert(sink_stats())
+
+   for i, v in pairs(stats) do
+      KVPrint(i, v)
+   end
+end _ "SinkStatistics"
+
 function Shutdown()
    while #ekey_list > 0 do
       kill_ekey(ekey_list[1])
@@ -696,6 +1193,349 @@ function Daemonise(val)
    daemonise(val)
 end _ "Daemonise"
 
+function FlowControl(val)
+   flow_control(val)
+end _ "FlowControl"
+
+function KeyRecovery(reopen, watchdog)
+   key_recovery(reopen, watchdog and tonumber(watchdog))
+end _ "KeyRecovery"
+
+function SeedFile(fname, refresh)
+   -- Credit the seed left by the last run and keep a fresh one for the next
+   assert(output_configured, "No output type yet configured")
+   assert(seed_file(tostring(fname), refresh and tonumber(refresh), true))
+end _ "SeedFile"
+
+-- Configuration plans.  The configuration file is run against recorders
+-- which note what it asks for, so a reload can compare the file with the
+-- plan it was last run to and only touch what has changed.
+
+local config_file
+local running_plan
+
+local function plan_repr(...)
+   -- A comparable string for a command's arguments
+   local t = { n = select("#", ...), ... }
+   for i = 1, t.n do
+      local v = t[i]
+      if type(v) == "table" then
+	 local fields = {}
+	 for k, fv in pairs(v) do
+	    fields[#fields + 1] = tostring(k) .. "=" .. tostring(fv)
+	 end
+	 table.sort(fields)
+	 t[i] = "{" .. tconcat(fields, ",") .. "}"
+      else
+	 t[i] = tostring(v)
+      end
+   end
+   return tconcat(t, "\0", 1, t.n)
+end
+
+local function plan_spec(cmd, ...)
+   return { cmd = cmd, args = { n = select("#", ...), ... },
+	    repr = cmd .. "\0" .. plan_repr(...) }
+end
+
+local function new_plan()
+   return { listeners = {}, listenorder = {}, keys = {}, keyorder = {},
+	    watches = {}, classes = {}, quotas = {},
+	    flow = true, reopen = true }
+end
+
+local function plan_listener(plan, name, spec)
+   if not plan.listeners[name] then
+      plan.listenorder[#plan.listenorder + 1] = name
+   end
+   plan.listeners[name] = spec
+end
+
+local function plan_key(plan, path, serial, capfile, tolerant)
+   path = tostring(path)
+   if not plan.keys[path] then
+      plan.keyorder[#plan.keyorder + 1] = path
+   end
+   plan.keys[path] = { path = path, serial = serial, capfile = capfile,
+		       tolerant = tolerant,
+		       repr = plan_repr(path, serial, capfile) }
+end
+
+local function plan_watched(plan, path)
+   for dir in pairs(plan.watches) do
+      if string.sub(path, 1, #dir + 1) == dir .. "/" then
+	 return true
+      end
+   end
+   return false
+end
+
+local plan_recorders = {
+   UnixControlSocket = function(plan, sockname)
+      plan_listener(plan, "U:" .. tostring(sockname),
+		    plan_spec("UnixControlSocket", sockname))
+   end,
+   TCPControlSocket = function(plan, port)
+      plan_listener(plan, "T:" .. tostring(port),
+		    plan_spec("TCPControlSocket", port))
+   end,
+   EGDUnixSocket = function(plan, sockname, ...)
+      plan.folded = true
+      plan_listener(plan, "U:" .. tostring(sockname),
+		    plan_spec("EGDUnixSocket", sockname, ...))
+   end,
+   EGDTCPSocket = function(plan, port, ...)
+      plan.folded = true
+      plan_listener(plan, "T:" .. tostring(port),
+		    plan_spec("EGDTCPSocket", port, ...))
+   end,
+   EGDClass = function(plan, who, classname)
+      plan.classes[egd_who(who)] =
+	 assert(egd_classes[classname],
+		"Unknown EGD client class '" .. tostring(classname) .. "'")
+   end,
+   EGDQuota = function(plan, who, rate, burst)
+      rate = assert(tonumber(rate), "EGD quota rate must be a number")
+      plan.quotas[egd_who(who)] = { rate = rate, burst = tonumber(burst) or rate }
+   end,
+   AddEntropyKey = function(plan, devpath, serial)
+      plan_key(plan, devpath, serial)
+   end,
+   RecordEntropyKey = function(plan, devpath, capfile, serial)
+      plan_key(plan, devpath, serial, tostring(capfile))
+   end,
+   AddEntropyKeys = function(plan, dirname)
+      for _, knode in ipairs(enumerate(dirname) or {}) do
+	 if string.sub(knode, 1, 1) ~= "." then
+	    plan_key(plan, dirname .. "/" .. knode, nil, nil, true)
+	 end
+      end
+   end,
+   RemoveEntropyKey = function(plan, tag)
+      plan.keys[tostring(tag)] = nil
+   end,
+   WatchEntropyKeys = function(plan, dirname)
+      plan.watches[tostring(dirname)] = true
+   end,
+   Keyring = function(plan, fname)
+      plan.keyring = tostring(fname)
+   end,
+   FlowControl = function(plan, val)
+      plan.flow = val and true or false
+   end,
+   KeyRecovery = function(plan, reopen, watchdog)
+      plan.reopen = reopen and true or false
+      plan.watchdog = watchdog and tonumber(watchdog)
+   end,
+   SeedFile = function(plan, fname, refresh)
+      plan.seed = plan_spec("SeedFile", tostring(fname), refresh and tonumber(refresh))
+   end,
+}
+
+for _, cmd in ipairs { "SetOutputToFile", "SetOutputToFileSink", "SetOutputToKernel" } do
+   plan_recorders[cmd] = function(plan, ...)
+      plan.output = plan_spec(cmd, ...)
+   end
+end
+
+-- Commands which only mean anything at startup.  They are withdrawn from
+-- the control interface once the configuration has run, and do nothing
+-- when the file is run again by a reload.
+local startup_only = { "Daemonise" }
+
+local function plan_env(plan, live)
+   -- The environment the configuration file runs in.  When live the
+   -- commands are carried out as well as recorded.
+   local env = {}
+   for name, func in pairs(protectedenv) do
+      env[name] = live and func or function() end
+   end
+   for _, name in ipairs(startup_only) do
+      env[name] = env[name] or function() end
+   end
+   for name, record in pairs(plan_recorders) do
+      local func = live and protectedenv[name]
+      env[name] = function(...)
+	 record(plan, ...)
+	 if func then
+	    return func(...)
+	 end
+      end
+   end
+   return env
+end
+
+local function ekey_by_path(path)
+   for _, ekey in ipairs(ekey_list) do
+      if ekey.devpath == path then
+	 return ekey
+      end
+   end
+end
+
+local function reload_egd(plan)
+   -- Replace the class and quota maps, moving connected clients over
+   for _, map in ipairs { egd_classfor, egd_quotafor } do
+      for k in pairs(map) do
+	 map[k] = nil
+      end
+   end
+   for who, class in pairs(plan.classes) do
+      egd_classfor[who] = class
+   end
+   for who, quota in pairs(plan.quotas) do
+      egd_quotafor[who] = quota
+   end
+
+   for sock, client in pairs(egdclients) do
+      local who = client.uid or "tcp"
+      -- A client blocked in a read finishes it in its old class
+      if client.want == 0 then
+	 client.class = egd_classfor[who] or egd_classfor["default"] or egd_classes.normal
+      end
+      local quota = egd_quotafor[who] or egd_quotafor["default"]
+      client.bucket = egd_bucket(client.uid or sock, quota)
+   end
+end
+
+local function reload_config()
+   -- Run the configuration file again and apply what has changed.  Keys
+   -- whose entries are unchanged keep their sessions and the pool of
+   -- entropy is kept.
+   local plan = new_plan()
+   local func = assert(loadfile(config_file))
+   setfenv(func, plan_env(plan, false))
+   assert(pcall(func))
+
+   local old = running_plan
+   assert(((plan.output and plan.output.repr) == (old.output and old.output.repr)) and
+	  (plan.folded == old.folded),
+	  "Output changed, restart ekeyd to apply it")
+   assert(next(plan.listeners), "No control interface specified")
+
+   local errors, changes = {}, 0
+   local function apply(what, func, ...)
+      dos_callcount = 0 -- Each step is bounded, the whole reload need not be
+      local ok, msg = pcall(func, ...)
+      if ok then
+	 changes = changes + 1
+      else
+	 errors[#errors + 1] = what .. ": " .. tostring(msg)
+      end
+      return ok
+   end
+
+   -- Listeners which went or changed are closed before any are opened
+   for _, name in ipairs(old.listenorder) do
+      local spec = old.listeners[name]
+      if spec and (plan.listeners[name] or {}).repr ~= spec.repr then
+	 apply(name, function()
+		  if controlsockets[name] then
+		     delctlsocket(name)
+		  end
+		  if string.sub(name, 1, 2) == "U:" then
+		     unlink(string.sub(name, 3))
+		  end
+	       end)
+      end
+   end
+   for _, name in ipairs(plan.listenorder) do
+      local spec = plan.listeners[name]
+      if spec and (old.listeners[name] or {}).repr ~= spec.repr then
+	 if not apply(name, protectedenv[spec.cmd], unpack(spec.args, 1, spec.args.n)) then
+	    plan.listeners[name] = nil
+	 end
+      end
+   end
+
+   for dir in pairs(old.watches) do
+      if not plan.watches[dir] then
+	 apply("watch " .. dir, function()
+		  for _, name in ipairs { "watch:" .. dir, "watchfor:" .. dir } do
+		     if controlsockets[name] then
+			delctlsocket(name)
+		     end
+		  end
+	       end)
+      end
+   end
+
+   -- Keys which were removed, or whose entries changed and must be
+   -- reconnected.  Keys added from the control socket or by a watch
+   -- which is still configured are left alone.
+   local gone = {}
+   for _, ekey in ipairs(ekey_list) do
+      local path = ekey.devpath
+      local spec, new = old.keys[path], plan.keys[path]
+      if (spec and new and spec.repr ~= new.repr) or
+	 (spec and not new and not plan_watched(plan, path)) or
+	 (not spec and not new and plan_watched(old, path) and
+	  not plan_watched(plan, path)) then
+	 gone[#gone + 1] = ekey
+      end
+   end
+   for _, ekey in ipairs(gone) do
+      apply("remove " .. ekey.devpath, kill_ekey, ekey)
+   end
+
+   for _, path in ipairs(plan.keyorder) do
+      local spec = plan.keys[path]
+      if spec and not ekey_by_path(path) then
+	 local ok = apply(path, function()
+			     local ekey = add_ekey(spec.path, spec.serial)
+			     if spec.capfile then
+				assert(ekey_record(ekey.ekey, spec.capfile))
+			     end
+			  end)
+	 if not ok then
+	    plan.keys[path] = nil
+	    if spec.tolerant then
+	       errors[#errors] = nil
+	    end
+	 end
+      end
+   end
+
+   for dir in pairs(plan.watches) do
+      if not old.watches[dir] then
+	 if not apply("watch " .. dir, function() assert(watch_entropy_keys(dir)) end) then
+	    plan.watches[dir] = nil
+	 end
+      end
+   end
+
+   dos_callcount = 0
+   reload_egd(plan)
+   if plan.keyring then
+      apply("keyring " .. plan.keyring, function()
+	       assert(read_keys(plan.keyring) >= 0, "Unable to read keyring")
+	    end)
+   end
+   flow_control(plan.flow)
+   key_recovery(plan.reopen, plan.watchdog)
+   -- The seed was credited at startup, a reload only changes its refreshing
+   if (plan.seed and plan.seed.repr) ~= (old.seed and old.seed.repr) then
+      local args = plan.seed and plan.seed.args or {}
+      apply("seed file", function() assert(seed_file(args[1], args[2], false)) end)
+   end
+
+   running_plan = plan
+   if errors[1] then
+      error("Reloaded with errors: " .. tconcat(errors, "; "), 0)
+   end
+   return "Reloaded " .. config_file .. ", " .. tostring(changes) .. " changes"
+end
+
+function Reload()
+   Print(reload_config())
+end _ "Reload"
+
+function Upgrade()
+   -- Hand everything over to a fresh copy of the daemon binary
+   assert(upgrade(), "Upgrade already in progress")
+   Print("Upgrading")
+end _ "Upgrade"
+
 -- Routines to run stuff in the controlled environment
 
 local function protected_closure(client, func)
@@ -750,15 +1590,42 @@ end
 function CONFIG(cfile)
    -- Prepare a controlled state and run the contents of cfile in it.
    dos_callcount = 0
+   config_file = cfile
+   running_plan = new_plan()
    local func = assert(loadfile(cfile))
-   setfenv(func, protectedenv)
+   setfenv(func, plan_env(running_plan, true))
    assert(pcall(func))
    assert(next(controlsockets), "No control interface specified")
-   protectedenv.Daemonise = nil
+   for _, name in ipairs(startup_only) do
+      protectedenv[name] = nil
+   end
+   -- Keep any keys handed over which the configuration did not add itself
+   for _, path in ipairs(inherited_keys()) do
+      pcall(add_ekey, path)
+   end
+end
+
+function LISTENERS()
+   -- The listening sockets to hand over to an upgraded daemon, by name.
+   dos_callcount = 0
+   local fds = {}
+   for sock, name in pairs(controlsockets) do
+      if type(sock) ~= "string" and ctltoaccept[sock] then
+	 fds[name] = sock:getfd()
+      end
+   end
+   return fds
+end
+
+function RELOAD()
+   -- Reload the configuration when asked by a signal.
+   dos_callcount = 0
+   return reload_config()
 end
 
 function CONTROL()
    dos_callcount = 0
+   egd_spreading = false -- In case the DOS hook cut a pass short
    -- Process anything pending on any of the control sockets.
    local readt, writet = {}, {}
 
@@ -811,6 +1678,7 @@ local lastused = 0
 local lastent = 0
 function ENTROPY(bytes)
    dos_callcount = 0
+   egd_spreading = false -- In case the DOS hook cut a pass short
    enqueue_entropy(bytes)
    egd_spreadwrite()
    if (debugprint == print) then
@@ -824,6 +1692,35 @@ function ENTROPY(bytes)
    end
 end
 
+function TIMER()
+   -- Called from the poll loop to run scheduled work, returns the
+   -- milliseconds until it is next needed or -1.
+   dos_callcount = 0
+   if egd_wake_at and egd_wake_at <= gettime() then
+      egd_spreading = false -- In case the DOS hook cut a pass short
+      egd_wake_at = nil
+      egd_spreadwrite()
+   end
+   if egd_wake_at == nil then
+      return -1
+   end
+   return math.max(0, math.ceil((egd_wake_at - gettime()) * 1000))
+end
+
+function DEMAND(resuming)
+   -- Called for foldback output to learn whether entropy is wanted.  Once
+   -- (nearly) full, keys are paused until the pool has half drained or a
+   -- client is blocked waiting.
+   dos_callcount = 0
+   if egd_ring[1] then
+      return true
+   end
+   if resuming then
+      return total_entropy < (MAX_ENTROPY / 2)
+   end
+   return (total_entropy + ENTROPY_BLOCK) <= MAX_ENTROPY
+end
+
 -- Set everything up...
 
 local function hookfunc()
@@ -24,35 +24,126 @@
 #include <fcntl.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 
 #include <linux/types.h>
 #include <linux/random.h>
 #include <sys/ioctl.h>
 
 #include "daemonise.h"
+#include "util.h"
 
 #define DEFAULT_HOST "127.0.0.1"
 #define DEFAULT_PORT "8888"
 #define DEFAULT_BLOCKS 4
 #define DEFAULT_READTIMEOUT 10
+#define DEFAULT_OUTSTANDING 8
+
+/** Largest request a single EGD blocking read command may make. */
+#define EGD_MAX_REQUEST 255
+
+/** Largest request made with the extended blocking read command. */
+#define EGD_EXT_MAX_REQUEST 4096
+
+/** EGD blocking read commands, the extended one taking a U32 length. */
+#define EGD_CMD_BLOCKREAD 0x02
+#define EGD_CMD_BLOCKREAD32 0x12
+
+/** EGD command returning the server's extension version. */
+#define EGD_CMD_EXTVERSION 0x10
+
+/** Upper limit on the number of requests which may be outstanding. */
+#define EGD_MAX_OUTSTANDING 64
+
+/** Size of the buffer entropy is read into and passed to the kernel from. */
+#define EGD_BUFFER_SIZE (EGD_MAX_OUTSTANDING * EGD_MAX_REQUEST)
+
+/** Maximum number of EGD servers. */
+#define EGD_MAX_SERVERS 8
+
+/** Longest time between reconnection attempts in seconds. */
+#define EGD_MAX_BACKOFF 300
+
+/** Interval at which pending name lookups are checked, in milliseconds. */
+#define EGD_RESOLVE_POLL 100
+
+#define PROC_RANDOM "/proc/sys/kernel/random/"
+
+/** Connection state of an EGD server. */
+typedef enum {
+    SRV_IDLE, /**< Waiting until the next connection attempt is due. */
+    SRV_RESOLVING, /**< Looking up the server address. */
+    SRV_CONNECTING, /**< Non-blocking connect in progress. */
+    SRV_PROBING, /**< Connected, asking whether the extension is supported. */
+    SRV_CONNECTED, /**< Connected and able to take requests. */
+    SRV_DEAD, /**< Failed and no retry is configured. */
+} srv_state_t;
+
+/** An EGD server and its request pipeline. */
+typedef struct {
+    char *host;
+    char *port;
+    srv_state_t state;
+    int fd;
+    int pollidx; /**< Index of the server in the poll set or -1. */
+
+    struct addrinfo hints;
+    struct gaicb gai;
+    struct addrinfo *addrs; /**< Resolved addresses. */
+    struct addrinfo *addr; /**< Address being connected to. */
+
+    int64_t deadline; /**< Connect timeout or time of the next attempt. */
+    unsigned int backoff; /**< Seconds to wait after the next failure. */
+    int extended; /**< Extension version, 0 if unsupported, -1 if unknown. */
+
+    /* requests in flight, oldest first */
+    int req_size[EGD_MAX_OUTSTANDING];
+    int64_t req_sent[EGD_MAX_OUTSTANDING];
+    int req_head;
+    int req_count;
+    int bytes_waiting; /**< Bytes requested and not yet received. */
+    int64_t last_rx; /**< Time data last arrived or the pipeline started. */
+
+    /* commands which have not yet been accepted by the socket */
+    unsigned char cmd_buf[EGD_MAX_OUTSTANDING * 5];
+    int cmd_len;
+
+    /* observed performance */
+    double latency; /**< Request completion time in milliseconds. */
+    double rate; /**< Bytes per millisecond while busy. */
+    uint64_t bytes;
+    unsigned long connects;
+    unsigned long failures;
+} egd_server_t;
 
 static const char *pidfilename = NULL;
 static int random_fd = 0;
-static int egd_fd = -1;
 static int shannons = 7;
 static unsigned int retry_time = 0;
-static char *host;
-static char *port;
+static int read_timeout = DEFAULT_READTIMEOUT;
 
-struct pollfd poll_fds[2] = {
-    { .events = POLLOUT },
-    { .events = POLLIN }
-};
+static egd_server_t servers[EGD_MAX_SERVERS];
+static int nservers = 0;
+
+static struct pollfd poll_fds[1 + EGD_MAX_SERVERS];
 
 #define RND_POLLFD 0
-#define EGD_POLLFD 1
 
-static int bytes_waiting = 0; /* Number of bytes waiting on read*/
+static int bytes_wanted = 0; /* Number of bytes still to be requested */
+static int max_outstanding = DEFAULT_OUTSTANDING;
+static int max_request = EGD_MAX_REQUEST;
+static bool extended = false; /* Use the extended EGD read command where supported */
+
+/* entropy read from a server, passed to the kernel in one ioctl */
+static union {
+    struct rand_pool_info info;
+    unsigned char space[sizeof(struct rand_pool_info) + EGD_BUFFER_SIZE];
+} rndpool;
+
+/* benchmark state */
+static bool benchmark = false;
+static unsigned long long bench_bytes = 0;
+static unsigned long bench_ioctls = 0;
 
 static void
 usage(FILE *stream, char **argv)
@@ -65,16 +156,36 @@ usage(FILE *stream, char **argv)
             "Valid options are:\n"                                      \
             "\t-h\t\tDisplay this help.\n"                                \
             "\t-v\t\tDisplay the version of this program.\n"              \
-            "\t-H <host>\tSet the host IP address to connect to.\n"     \
-            "\t-p <postnr>\tSet the port number to connect to.\n"       \
+            "\t-H <host>\tAdd a server to connect to as host or host:port,\n" \
+            "\t\t\t may be given up to %d times.\n"                 \
+            "\t-p <postnr>\tSet the default port number to connect to.\n" \
             "\t-b <blocks>\tThe number of 1024 bit blocks to request in\n" \
-            "\t\t\t each transaction. (Default %d)\n"           \
+            "\t\t\t each transaction if the kernel pool state\n"  \
+            "\t\t\t cannot be read. (Default %d)\n"                \
+            "\t-o <reqs>\tThe number of requests to keep outstanding\n" \
+            "\t\t\t with each server. (Default %d)\n"               \
+            "\t-x\t\tUse the extended EGD read command where the\n" \
+            "\t\t\t server supports it, requesting up to %d\n"  \
+            "\t\t\t bytes at a time.\n"                          \
+            "\t-T <time>\tMeasure the kernel fill rate for time seconds.\n" \
             "\t-s <S>\t\tSet the number of shannons per byte to S.\n"     \
             "\t-D <pidf>\tDaemonise, writing PID to pidf.\n"            \
-            "\t-r <time>\tRetry connection every time seconds.\n"       \
-            "\t-t <time>\tTimeout on read operations from server before\n"\
-            "\t\t\t connection retry. (Default %d)\n",
-            argv[0], argv[0], DEFAULT_BLOCKS, DEFAULT_READTIMEOUT);
+            "\t-r <time>\tRetry connection after time seconds, doubling\n" \
+            "\t\t\t on each failure.\n"                             \
+            "\t-t <time>\tTimeout on connect and read operations from\n"\
+            "\t\t\t server before connection retry. (Default %d)\n",
+            argv[0], argv[0], EGD_MAX_SERVERS, DEFAULT_BLOCKS,
+            DEFAULT_OUTSTANDING, EGD_EXT_MAX_REQUEST, DEFAULT_READTIMEOUT);
+}
+
+/** Obtain the current monotonic time in milliseconds. */
+static int64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 }
 
 static bool
@@ -85,218 +196,738 @@ try_open_random(void)
     return (random_fd != -1);
 }
 
-static void
-set_egd_blocking(bool block)
+/** Read an integer from a file in the kernel random sysctl directory.
+ *
+ * @param name The name of the file.
+ * @return The value or -1 if it could not be read.
+ */
+static int
+read_random_sysctl(const char *name)
 {
-    int flags;
-    if ((flags = fcntl(egd_fd, F_GETFL)) == -1)
-        perror("fcntl");
-    flags &= ~(O_NONBLOCK);
-    if (block == false)
-        flags |= O_NONBLOCK;
-    if (fcntl(egd_fd, F_SETFL, flags) == -1)
-        perror("fcntl");
+    char path[64];
+    char buf[32];
+    int fd;
+    ssize_t len;
+
+    snprintf(path, sizeof(path), PROC_RANDOM "%s", name);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+    buf[len] = 0;
+
+    return atoi(buf);
 }
 
-/** attempt to connect to an EGD server.
+/** Compute how many bytes are needed to fill the kernel pool.
  *
- * Create a socket and connect it to an EGD server.
+ * The pool is filled to its size rather than just past the wakeup
+ * threshold so the next wakeup is as far away as possible.
  *
- * @param rtime The time between retry attempts, 0 for no retrys.
- * @return true if the connection was sucessful, false if it was not.
+ * @param nblocks The number of 128 byte blocks to use if the pool state
+ *                cannot be read.
+ * @return The number of bytes to fetch.
  */
-static bool
-egd_connect(unsigned int rtime)
+static int
+kernel_demand(int nblocks)
 {
-    int con_res = -1;
-    int keepalive = 1;
-    socklen_t keepalive_len = sizeof(keepalive);
-    struct addrinfo *addrs, *addrs_head;
-    struct addrinfo hints;
-    int r;
+    int avail;
+    int poolsize;
+    int threshold;
+    int deficit;
+
+    avail = read_random_sysctl("entropy_avail");
+    poolsize = read_random_sysctl("poolsize");
+    threshold = read_random_sysctl("write_wakeup_threshold");
+
+    if ((avail < 0) || (poolsize <= 0))
+        return nblocks * 128;
+
+    /* never ask for less than it takes to clear the wakeup threshold */
+    deficit = poolsize - avail;
+    if ((threshold > 0) && (deficit < threshold - avail))
+        deficit = threshold - avail;
+    if (deficit <= 0)
+        return 0;
+
+    /* round up to whole bytes at the credited rate */
+    return (deficit + shannons - 1) / shannons;
+}
 
-    /* Look up port and address */
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
+/** Add a server from a host, host:port or [address]:port specification.
+ *
+ * @param spec The server specification.
+ * @param defport The port to use if the specification has none.
+ * @return true on success, false if the specification is invalid.
+ */
+static bool
+add_server(const char *spec, const char *defport)
+{
+    egd_server_t *srv;
+    char *host;
+    char *port;
 
-    if ((r = getaddrinfo(host, port, &hints, &addrs)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
+    if (!split_hostport(spec, defport, &host, &port)) {
+        fprintf(stderr, "Invalid server address %s\n", spec);
         return false;
     }
 
-    addrs_head = addrs;
-    do {
-        while (addrs) {
-            /* close fd if we already have one open */
-            if (egd_fd >= 0) {
-                close(egd_fd);
-            }
-            
-            /* create socket */
-            egd_fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
-            if (egd_fd == -1) {
-                perror("socket");
-            return false;
-            }
+    srv = &servers[nservers++];
+    srv->host = host;
+    srv->port = port;
+    srv->state = SRV_IDLE;
+    srv->fd = -1;
+    srv->pollidx = -1;
+    srv->deadline = 0;
+    srv->backoff = retry_time;
+    srv->extended = extended ? -1 : 0;
 
-            /* Set the keepalive option active */
-            if (setsockopt(egd_fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, keepalive_len) < 0) {
-                perror("setsockopt");
-            }
+    /* optimistic estimates so every server is tried */
+    srv->latency = 10;
+    srv->rate = 100;
 
-            con_res = connect(egd_fd, addrs->ai_addr, addrs->ai_addrlen);
-            if (con_res == 0) {
-                rtime = 0; /* get out of outer loop */
-                break;
-            }
-            addrs = addrs->ai_next;
+    return true;
+}
+
+/** Free a server's resolved addresses. */
+static void
+srv_free_addrs(egd_server_t *srv)
+{
+    if (srv->addrs != NULL)
+        freeaddrinfo(srv->addrs);
+    srv->addrs = NULL;
+    srv->addr = NULL;
+}
+
+/** Record a failed connection and schedule the next attempt.
+ *
+ * Successive failures double the delay up to EGD_MAX_BACKOFF. Without a
+ * retry time the server is abandoned.
+ */
+static void
+srv_failed(egd_server_t *srv)
+{
+    srv_free_addrs(srv);
+    srv->failures++;
+
+    if (retry_time == 0) {
+        syslog(LOG_ERR, "EGD server %s:%s failed", srv->host, srv->port);
+        srv->state = SRV_DEAD;
+        return;
+    }
+
+    srv->state = SRV_IDLE;
+    srv->deadline = now_ms() + (srv->backoff * 1000);
+    srv->backoff *= 2;
+    if (srv->backoff > EGD_MAX_BACKOFF)
+        srv->backoff = EGD_MAX_BACKOFF;
+}
+
+/** Close a server connection and hand its outstanding requests back. */
+static void
+srv_drop(egd_server_t *srv, const char *reason)
+{
+    syslog(LOG_INFO, "EGD server %s:%s %s, reconnecting",
+           srv->host, srv->port, reason);
+
+    close(srv->fd);
+    srv->fd = -1;
+
+    /* let another server satisfy what this one did not */
+    if (!benchmark)
+        bytes_wanted += srv->bytes_waiting;
+
+    srv->bytes_waiting = 0;
+    srv->req_head = 0;
+    srv->req_count = 0;
+    srv->cmd_len = 0;
+
+    srv_failed(srv);
+}
+
+static void
+srv_connected(egd_server_t *srv)
+{
+    srv_free_addrs(srv);
+    srv->state = SRV_CONNECTED;
+    srv->backoff = retry_time;
+    srv->last_rx = now_ms();
+    srv->connects++;
+
+    syslog(LOG_INFO, "Connected to EGD server %s:%s", srv->host, srv->port);
+
+    if (srv->extended < 0) {
+        /* find out whether the server has the extension before using it */
+        srv->cmd_buf[srv->cmd_len++] = EGD_CMD_EXTVERSION;
+        srv->state = SRV_PROBING;
+    }
+}
+
+/** Start a non-blocking connect to the next untried address. */
+static void
+srv_try_connect(egd_server_t *srv)
+{
+    int keepalive = 1;
+
+    while (srv->addr != NULL) {
+        srv->fd = socket(srv->addr->ai_family, srv->addr->ai_socktype,
+                         srv->addr->ai_protocol);
+        if (srv->fd == -1) {
+            perror("socket");
+            break;
+        }
+
+        /* Set the keepalive option active */
+        if (setsockopt(srv->fd, SOL_SOCKET, SO_KEEPALIVE,
+                       &keepalive, sizeof(keepalive)) < 0) {
+            perror("setsockopt");
+        }
+
+        /* the socket stays non-blocking for the life of the connection */
+        if (fcntl(srv->fd, F_SETFL, fcntl(srv->fd, F_GETFL) | O_NONBLOCK) == -1)
+            perror("fcntl");
+
+        if (connect(srv->fd, srv->addr->ai_addr, srv->addr->ai_addrlen) == 0) {
+            srv_connected(srv);
+            return;
         }
-        if (rtime != 0) {
-            sleep(rtime);
-            fprintf(stderr, "Retrying connection.\n");
+
+        if (errno == EINPROGRESS) {
+            srv->state = SRV_CONNECTING;
+            srv->deadline = now_ms() + (read_timeout * 1000);
+            return;
         }
-        addrs = addrs_head;
-    } while (rtime != 0);
-    freeaddrinfo(addrs_head);
 
-    /* Set the keepalive option active */
-    if (setsockopt(egd_fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, keepalive_len) < 0) {
-        perror("setsockopt");
+        close(srv->fd);
+        srv->fd = -1;
+        srv->addr = srv->addr->ai_next;
     }
 
-    if (con_res != 0) {
-        perror("connect");
-        close(egd_fd);
-        egd_fd = -1;
-        return false;
+    srv_failed(srv);
+}
+
+/** Begin an asynchronous lookup of a server's address. */
+static void
+srv_start(egd_server_t *srv)
+{
+    struct gaicb *list[1] = { &srv->gai };
+    int r;
+
+    memset(&srv->hints, 0, sizeof(srv->hints));
+    srv->hints.ai_family = AF_UNSPEC;
+    srv->hints.ai_socktype = SOCK_STREAM;
+    srv->hints.ai_protocol = IPPROTO_TCP;
+    srv->hints.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
+
+    memset(&srv->gai, 0, sizeof(srv->gai));
+    srv->gai.ar_name = srv->host;
+    srv->gai.ar_service = srv->port;
+    srv->gai.ar_request = &srv->hints;
+
+    r = getaddrinfo_a(GAI_NOWAIT, list, 1, NULL);
+    if (r != 0) {
+        syslog(LOG_ERR, "getaddrinfo: %s", gai_strerror(r));
+        srv_failed(srv);
+        return;
     }
 
-    poll_fds[EGD_POLLFD].fd = egd_fd;
+    srv->state = SRV_RESOLVING;
+}
 
-    /* ensure the random pool state is reset */
-    bytes_waiting = 0;
-    poll_fds[RND_POLLFD].events = POLLOUT;
+/** Check whether an asynchronous lookup has finished. */
+static void
+srv_check_resolve(egd_server_t *srv)
+{
+    int r;
 
-    return true;
+    r = gai_error(&srv->gai);
+    if (r == EAI_INPROGRESS)
+        return;
+
+    if (r != 0) {
+        syslog(LOG_ERR, "getaddrinfo %s: %s", srv->host, gai_strerror(r));
+        srv_failed(srv);
+        return;
+    }
+
+    srv->addrs = srv->gai.ar_result;
+    srv->addr = srv->addrs;
+    srv_try_connect(srv);
 }
 
+/** Complete a non-blocking connect once the socket becomes writable. */
+static void
+srv_check_connect(egd_server_t *srv)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(srv->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
+
+    if (error == 0) {
+        srv_connected(srv);
+        return;
+    }
 
+    /* try the next address */
+    close(srv->fd);
+    srv->fd = -1;
+    srv->addr = srv->addr->ai_next;
+    srv_try_connect(srv);
+}
+
+/** Handle the reply to the extension version command.
+ *
+ * A server without the extension closes the connection on receipt of the
+ * command, so it is reconnected to at once and sent only standard commands.
+ */
 static void
-issue_read_for_random(int nblocks)
+srv_probed(egd_server_t *srv)
 {
-    set_egd_blocking(true);
-    bytes_waiting += nblocks * 128;
-    while (nblocks--)
-        if (write(egd_fd, (const void *)"\x02\x80", 2) != 2) {
-            perror("write");
-            bytes_waiting = 0;
+    unsigned char version;
+    ssize_t bread;
+
+    bread = read(srv->fd, &version, 1);
+    if (bread < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            return;
+    }
+
+    if (bread == 1) {
+        srv->extended = version;
+        srv->state = SRV_CONNECTED;
+        if (version > 0)
             return;
+    } else {
+        srv->extended = 0;
+        close(srv->fd);
+        srv->fd = -1;
+        srv->cmd_len = 0;
+        srv_start(srv);
+    }
+
+    syslog(LOG_INFO, "EGD server %s:%s lacks the extended commands, "
+           "using standard reads", srv->host, srv->port);
+}
+
+/** Send as many queued commands as the socket will accept.
+ *
+ * @return true on success, false if the connection failed.
+ */
+static bool
+srv_flush(egd_server_t *srv)
+{
+    ssize_t wrote;
+
+    while (srv->cmd_len > 0) {
+        wrote = write(srv->fd, srv->cmd_buf, srv->cmd_len);
+        if (wrote < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            return false;
+        }
+        srv->cmd_len -= wrote;
+        memmove(srv->cmd_buf, srv->cmd_buf + wrote, srv->cmd_len);
+    }
+
+    return true;
+}
+
+/** Queue a blocking read command on a server. */
+static void
+srv_queue(egd_server_t *srv, int len, int64_t now)
+{
+    int idx = (srv->req_head + srv->req_count) % EGD_MAX_OUTSTANDING;
+
+    /* an idle server starts its read timeout from now */
+    if (srv->req_count == 0)
+        srv->last_rx = now;
+
+    srv->req_size[idx] = len;
+    srv->req_sent[idx] = now;
+    srv->req_count++;
+
+    if (srv->extended > 0) {
+        srv->cmd_buf[srv->cmd_len++] = EGD_CMD_BLOCKREAD32;
+        srv->cmd_buf[srv->cmd_len++] = len >> 24;
+        srv->cmd_buf[srv->cmd_len++] = len >> 16;
+        srv->cmd_buf[srv->cmd_len++] = len >> 8;
+    } else {
+        srv->cmd_buf[srv->cmd_len++] = EGD_CMD_BLOCKREAD;
+    }
+    srv->cmd_buf[srv->cmd_len++] = len;
+
+    srv->bytes_waiting += len;
+}
+
+/** Largest part of a request a server can be sent in one command. */
+static int
+srv_request(egd_server_t *srv, int len)
+{
+    if ((srv->extended <= 0) && (len > EGD_MAX_REQUEST))
+        return EGD_MAX_REQUEST;
+    return len;
+}
+
+/** Expected time in milliseconds for a server to deliver a new request. */
+static double
+srv_cost(egd_server_t *srv, int len)
+{
+    return srv->latency + ((srv->bytes_waiting + len) / srv->rate);
+}
+
+/** Spread the outstanding demand across the connected servers.
+ *
+ * Each request of up to max_request bytes goes to the server
+ * expected to deliver it soonest given its observed latency, throughput
+ * and queue, so a slow server receives only as much as it can keep up
+ * with. Commands are then sent to each server in a single write.
+ */
+static void
+dispatch_requests(void)
+{
+    egd_server_t *srv;
+    egd_server_t *best;
+    double cost;
+    double best_cost = 0;
+    int64_t now = now_ms();
+    int len;
+    int idx;
+
+    while (benchmark || (bytes_wanted > 0)) {
+        len = max_request;
+        if (!benchmark && (bytes_wanted < len))
+            len = bytes_wanted;
+
+        best = NULL;
+        for (idx = 0; idx < nservers; idx++) {
+            srv = &servers[idx];
+            if ((srv->state != SRV_CONNECTED) ||
+                (srv->req_count >= max_outstanding))
+                continue;
+
+            cost = srv_cost(srv, srv_request(srv, len));
+            if ((best == NULL) || (cost < best_cost)) {
+                best = srv;
+                best_cost = cost;
+            }
         }
-    set_egd_blocking(false);
+
+        if (best == NULL)
+            break;
+
+        len = srv_request(best, len);
+        srv_queue(best, len, now);
+        if (!benchmark)
+            bytes_wanted -= len;
+    }
+
+    for (idx = 0; idx < nservers; idx++) {
+        srv = &servers[idx];
+        if (((srv->state == SRV_CONNECTED) || (srv->state == SRV_PROBING)) &&
+            (srv->cmd_len > 0) && (srv_flush(srv) == false))
+            srv_drop(srv, "write error");
+    }
 }
 
+/** Account for bytes received against a server's outstanding requests. */
 static void
-punt_entropy(void)
+srv_complete(egd_server_t *srv, int bread, int64_t now)
 {
-    static unsigned char buffer[128];
-    struct rand_pool_info *rndpool;
-    int bread;
+    int64_t start;
+    double interval;
+
+    /* throughput while busy, measured from whichever is later of the
+     * previous data or the oldest request being sent
+     */
+    start = srv->last_rx;
+    if ((srv->req_count > 0) && (srv->req_sent[srv->req_head] > start))
+        start = srv->req_sent[srv->req_head];
+    interval = now - start;
+    if (interval < 1)
+        interval = 1;
+    srv->rate += ((bread / interval) - srv->rate) / 4;
+    srv->last_rx = now;
+
+    srv->bytes += bread;
+    srv->bytes_waiting -= bread;
+
+    while ((bread > 0) && (srv->req_count > 0)) {
+        if (bread < srv->req_size[srv->req_head]) {
+            srv->req_size[srv->req_head] -= bread;
+            break;
+        }
+        bread -= srv->req_size[srv->req_head];
+        srv->latency += ((now - srv->req_sent[srv->req_head]) -
+                         srv->latency) / 8;
+        srv->req_head = (srv->req_head + 1) % EGD_MAX_OUTSTANDING;
+        srv->req_count--;
+    }
+}
 
-    bread = read(egd_fd, buffer, 128);
+static void
+punt_entropy(egd_server_t *srv)
+{
+    ssize_t bread;
+
+    bread = read(srv->fd, rndpool.info.buf, EGD_BUFFER_SIZE);
     if (bread < 0) {
-        perror("read");
-        exit(1);
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            return;
+        srv_drop(srv, "read error");
+        return;
     }
 
     if (bread == 0) {
         /* EOF on the EGD socket is never good, reset the world */
-        fprintf(stderr, "EGD Client Daemon reconnecting to server\n");
-        syslog(LOG_ERR, "Reconnecting to EGD server");
-        if (egd_connect(retry_time) == false) {
-            exit(1);
-        }
+        srv_drop(srv, "closed connection");
         return;
     }
 
-    rndpool = alloca(sizeof(struct rand_pool_info) + bread);
-
-    rndpool->entropy_count = bread * shannons;
-    rndpool->buf_size = bread;
-    memcpy(rndpool->buf, buffer, bread);
+    rndpool.info.entropy_count = bread * shannons;
+    rndpool.info.buf_size = bread;
 
-    if (ioctl(random_fd, RNDADDENTROPY, rndpool) == -1) {
+    if (ioctl(random_fd, RNDADDENTROPY, &rndpool.info) == -1) {
         perror("ioctl");
         exit(1);
     }
 
-    bytes_waiting -= bread;
+    bench_bytes += bread;
+    bench_ioctls++;
+
+    srv_complete(srv, bread, now_ms());
 }
 
-/** core poll loop.
+/** Advance server state machines whose deadlines have passed.
+ *
+ * @return The time in milliseconds until the next deadline or -1 if there
+ *         is none.
  */
-int 
-main_poll(int nblocks, int read_timeout)
+static int
+service_timers(void)
 {
-    int poll_ret = 0;
-    static int poll_timeout; /* time poll waits for input */
-
-    /* Main poll for activity */
-    while (poll_ret != -1) {
-        if (bytes_waiting == 0) {
-            /* not waiting on data from server*/
-            poll_timeout = -1;
- 
-            /* re-enable polling for kernel input */
-            poll_fds[RND_POLLFD].events = POLLOUT;
-        } else {
-            /* poll timeouts in miliseconds */
-            poll_timeout = read_timeout * 1000; 
+    egd_server_t *srv;
+    int64_t now = now_ms();
+    int64_t due;
+    int64_t timeout = -1;
+    int idx;
+
+    for (idx = 0; idx < nservers; idx++) {
+        srv = &servers[idx];
+
+        switch (srv->state) {
+        case SRV_IDLE:
+            if (srv->deadline <= now)
+                srv_start(srv);
+            break;
+
+        case SRV_RESOLVING:
+            srv_check_resolve(srv);
+            break;
+
+        case SRV_CONNECTING:
+            if (srv->deadline <= now) {
+                close(srv->fd);
+                srv->fd = -1;
+                syslog(LOG_INFO, "EGD server %s:%s connect timeout",
+                       srv->host, srv->port);
+                srv_failed(srv);
+            }
+            break;
+
+        case SRV_PROBING:
+            if ((now - srv->last_rx) >= (read_timeout * 1000))
+                srv_drop(srv, "probe timeout");
+            break;
+
+        case SRV_CONNECTED:
+            if ((srv->bytes_waiting > 0) &&
+                ((now - srv->last_rx) >= (read_timeout * 1000)))
+                srv_drop(srv, "poll timeout");
+            break;
+
+        case SRV_DEAD:
+            break;
         }
 
-        poll_ret = poll(poll_fds, 2, poll_timeout);
+        /* work out when this server next needs attention */
+        switch (srv->state) {
+        case SRV_IDLE:
+        case SRV_CONNECTING:
+            due = srv->deadline - now;
+            break;
 
-        if ((poll_ret == -1) && (errno != EINTR)) {
+        case SRV_RESOLVING:
+            due = EGD_RESOLVE_POLL;
+            break;
+
+        case SRV_PROBING:
+            due = srv->last_rx + (read_timeout * 1000) - now;
+            break;
+
+        case SRV_CONNECTED:
+            if (srv->bytes_waiting == 0)
+                continue;
+            due = srv->last_rx + (read_timeout * 1000) - now;
             break;
+
+        default:
+            continue;
         }
 
-        if (poll_ret == 0) {
-            /* poll timed out. Indicates no server reply to request */
-            syslog(LOG_INFO, "EGD server poll timeout, reconnecting");
-            egd_connect(retry_time);
+        if (due < 0)
+            due = 0;
+        if ((timeout < 0) || (due < timeout))
+            timeout = due;
+    }
+
+    return timeout;
+}
+
+/** Count the servers in a given state. */
+static int
+count_servers(srv_state_t state)
+{
+    int count = 0;
+    int idx;
+
+    for (idx = 0; idx < nservers; idx++) {
+        if (servers[idx].state == state)
+            count++;
+    }
+    return count;
+}
+
+/** Perform one iteration of the poll loop.
+ *
+ * @param nblocks Blocks to request when the kernel pool cannot be read.
+ * @param limit Longest time to wait in milliseconds or -1 for no limit.
+ * @return true to continue, false on a fatal error.
+ */
+static bool
+poll_once(int nblocks, int limit)
+{
+    egd_server_t *srv;
+    int bytes_waiting = 0;
+    int poll_timeout; /* time poll waits for input */
+    int nfds = 1;
+    int poll_ret;
+    int idx;
+
+    poll_timeout = service_timers();
+
+    if (count_servers(SRV_DEAD) == nservers) {
+        syslog(LOG_ERR, "No EGD servers remain");
+        return false;
+    }
+
+    dispatch_requests();
+
+    /* build the poll set */
+    for (idx = 0; idx < nservers; idx++) {
+        srv = &servers[idx];
+        srv->pollidx = -1;
+
+        if (srv->state == SRV_CONNECTING) {
+            poll_fds[nfds].events = POLLOUT;
+        } else if ((srv->state == SRV_CONNECTED) ||
+                   (srv->state == SRV_PROBING)) {
+            poll_fds[nfds].events = POLLIN;
+            if (srv->cmd_len > 0)
+                poll_fds[nfds].events |= POLLOUT;
+            bytes_waiting += srv->bytes_waiting;
+        } else {
             continue;
         }
 
-        if (poll_fds[RND_POLLFD].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-            syslog(LOG_INFO, "Linux random device poll error");
-            break;
+        poll_fds[nfds].fd = srv->fd;
+        srv->pollidx = nfds++;
+    }
+
+    if ((bytes_waiting == 0) && (bytes_wanted == 0) && !benchmark) {
+        /* not waiting on data from servers, wait for the kernel */
+        poll_fds[RND_POLLFD].events = POLLOUT;
+    } else {
+        poll_fds[RND_POLLFD].events = 0;
+    }
+
+    if ((limit >= 0) && ((poll_timeout < 0) || (limit < poll_timeout)))
+        poll_timeout = limit;
+
+    poll_ret = poll(poll_fds, nfds, poll_timeout);
+
+    if (poll_ret == -1) {
+        return (errno == EINTR);
+    }
+
+    if (poll_fds[RND_POLLFD].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        syslog(LOG_INFO, "Linux random device poll error");
+        return false;
+    }
+
+    if (poll_fds[RND_POLLFD].revents & POLLOUT) {
+        bytes_wanted = kernel_demand(nblocks) - bytes_waiting;
+        if (bytes_wanted < 0)
+            bytes_wanted = 0;
+    }
+
+    for (idx = 0; idx < nservers; idx++) {
+        srv = &servers[idx];
+        if ((srv->pollidx < 0) || (poll_fds[srv->pollidx].revents == 0))
+            continue;
+
+        if (srv->state == SRV_CONNECTING) {
+            srv_check_connect(srv);
+            continue;
         }
 
-        if (poll_fds[EGD_POLLFD].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-            if (retry_time != 0) {
-                syslog(LOG_INFO, "EGD server poll error, reconnecting");
-                sleep(retry_time);
-                egd_connect(retry_time);
-                continue;
-            } else {
-                syslog(LOG_ERR, "EGD server poll error");
-                break;
-            }
+        if ((srv->state == SRV_PROBING) &&
+            (poll_fds[srv->pollidx].revents & (POLLIN | POLLHUP))) {
+            srv_probed(srv);
+            continue;
         }
 
-        if (poll_fds[RND_POLLFD].revents & POLLOUT) {
-            poll_fds[RND_POLLFD].events = 0;
-            issue_read_for_random(nblocks);
+        if (poll_fds[srv->pollidx].revents & POLLIN) {
+            punt_entropy(srv);
+        } else if (poll_fds[srv->pollidx].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            srv_drop(srv, "poll error");
         }
+    }
 
-        if (poll_fds[EGD_POLLFD].revents & POLLIN) {
-            punt_entropy();
+    return true;
+}
+
+/** core poll loop.
+ *
+ * @param nblocks Blocks to request when the kernel pool cannot be read.
+ * @param duration Seconds to run for, 0 to run until an error occurs.
+ * @return true if the loop ran to completion, false on a fatal error.
+ */
+static bool
+main_poll(int nblocks, int duration)
+{
+    int64_t end = now_ms() + (duration * 1000);
+    int64_t left;
+
+    for (;;) {
+        left = -1;
+        if (duration != 0) {
+            left = end - now_ms();
+            if (left <= 0)
+                break;
         }
 
+        if (poll_once(nblocks, left) == false)
+            return false;
     }
 
-    return 0;
+    return true;
 }
 
 int
@@ -305,14 +936,18 @@ main(int argc, char **argv)
     int opt;
     bool daemonise = false;
     int blocks = DEFAULT_BLOCKS;
-    int read_timeout = DEFAULT_READTIMEOUT;
-
-    /* setup default host address */
-    host = DEFAULT_HOST;
-    port = DEFAULT_PORT;
+    int duration = 0;
+    const char *hosts[EGD_MAX_SERVERS];
+    int nhosts = 0;
+    const char *port = DEFAULT_PORT;
+    int64_t start;
+    double elapsed;
+    egd_server_t *srv;
+    bool ok;
+    int idx;
 
     /* command line option parsing */
-    while ((opt = getopt(argc, argv, "vhH:p:D:b:S:r:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "vhH:p:D:b:o:xS:r:t:T:")) != -1) {
         switch (opt) {
         case 'v':
             printf("%s: Version %s\n", argv[0], EKEYD_VERSION_S);
@@ -325,11 +960,15 @@ main(int argc, char **argv)
             break;
 
         case 'H':
-            host = strdup(optarg);
+            if (nhosts == EGD_MAX_SERVERS) {
+                fprintf(stderr, "Too many servers, at most %d may be given\n", EGD_MAX_SERVERS);
+                return 1;
+            }
+            hosts[nhosts++] = optarg;
             break;
 
         case 'p':
-            port = strdup(optarg);
+            port = optarg;
             break;
 
         case 'D':
@@ -339,16 +978,38 @@ main(int argc, char **argv)
 
         case 'b':
             blocks = atoi(optarg);
-            if (blocks < 1 || blocks > 4) {
-                fprintf(stderr, "Number of blocks (%d) is out of range, must be between 1 and 4\n", blocks);
+            if (blocks < 1 || blocks > EGD_BUFFER_SIZE / 128) {
+                fprintf(stderr, "Number of blocks (%d) is out of range, must be between 1 and %d\n", blocks, EGD_BUFFER_SIZE / 128);
+                return 1;
+            }
+            break;
+
+        case 'o':
+            max_outstanding = atoi(optarg);
+            if (max_outstanding < 1 || max_outstanding > EGD_MAX_OUTSTANDING) {
+                fprintf(stderr, "Outstanding requests (%d) is out of range, must be between 1 and %d\n", max_outstanding, EGD_MAX_OUTSTANDING);
                 return 1;
             }
             break;
 
+        case 'x':
+            extended = true;
+            max_request = EGD_EXT_MAX_REQUEST;
+            break;
+
+        case 'T':
+            duration = atoi(optarg);
+            if (duration < 1) {
+                fprintf(stderr, "Benchmark time (%d) must be at least 1 second\n", duration);
+                return 1;
+            }
+            benchmark = true;
+            break;
+
         case 't':
             read_timeout = atoi(optarg);
             if (read_timeout < 1 || read_timeout > 600) {
-                fprintf(stderr, "Read Timeout (%d) is out of range, must be between 1 and 600\n", blocks);
+                fprintf(stderr, "Read Timeout (%d) is out of range, must be between 1 and 600\n", read_timeout);
                 return 1;
             }
             break;
@@ -372,19 +1033,40 @@ main(int argc, char **argv)
         }
     }
 
+    /* setup default host address */
+    if (nhosts == 0)
+        hosts[nhosts++] = DEFAULT_HOST;
+
+    for (idx = 0; idx < nhosts; idx++) {
+        if (add_server(hosts[idx], port) == false)
+            return 1;
+    }
+
     if (try_open_random() == false) {
         fprintf(stderr, "Unable to open /dev/random for writing\n");
         return 1;
     }
 
-    /* try initial connect to EGD server */
-    egd_connect(0);
-    if ((retry_time == 0) && (egd_fd == -1)) {
+    /* ignore pipe signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* try initial connect to the EGD servers, waiting for the first
+     * attempt on each to finish or for one to succeed
+     */
+    do {
+        if (poll_once(blocks, -1) == false)
+            break;
+    } while ((count_servers(SRV_CONNECTED) == 0) &&
+             ((count_servers(SRV_RESOLVING) +
+               count_servers(SRV_CONNECTING) +
+               count_servers(SRV_PROBING)) > 0));
+
+    if ((retry_time == 0) && (count_servers(SRV_CONNECTED) == 0)) {
         fprintf(stderr, "Unable to connect to EGD server.\n");
         return 1;
     }
 
-    if (daemonise)
+    if (daemonise && !benchmark)
         do_daemonise(pidfilename, false);
 
     /* now we are a daemon, start system logging */
@@ -392,21 +1074,38 @@ main(int argc, char **argv)
 
     syslog(LOG_INFO, "Starting EGD Client Daemon");
 
-    /* retry EGD server connection if necessary */
-    if (egd_fd == -1)
-        egd_connect(retry_time);
-
-    /* ignore pipe signal */
-    signal(SIGPIPE, SIG_IGN);
-
-    main_poll(blocks, read_timeout);
+    start = now_ms();
+    bench_bytes = 0;
+    bench_ioctls = 0;
+
+    ok = main_poll(blocks, duration);
+
+    if (benchmark) {
+        elapsed = (now_ms() - start) / 1000.0;
+        printf("%llu bytes in %lu ioctls over %.2f seconds\n",
+               bench_bytes, bench_ioctls, elapsed);
+        printf("Kernel fill rate %.0f bytes/s (%.0f bits/s credited), "
+               "%.1f bytes per ioctl\n",
+               bench_bytes / elapsed, (bench_bytes * shannons) / elapsed,
+               bench_ioctls ? (double)bench_bytes / bench_ioctls : 0.0);
+        for (idx = 0; idx < nservers; idx++) {
+            srv = &servers[idx];
+            printf("  %s:%s %llu bytes, latency %.1f ms, "
+                   "%.0f bytes/s, %lu connects, %lu failures\n",
+                   srv->host, srv->port, (unsigned long long)srv->bytes,
+                   srv->latency, srv->rate * 1000,
+                   srv->connects, srv->failures);
+        }
+    }
 
-    if (egd_fd != -1)
-        close(egd_fd);
+    for (idx = 0; idx < nservers; idx++) {
+        if (servers[idx].fd != -1)
+            close(servers[idx].fd);
+    }
 
     close(random_fd);
 
     syslog(LOG_INFO, "EGD Client Daemon Stopping");
 
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,865 @@
+/* daemon/ekey-bench.c
+ *
+ * Entropy key daemon pipeline microbenchmarks.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "pem.h"
+#include "skeinwrap.h"
+#include "util.h"
+#include "stream.h"
+#include "frame.h"
+#include "ekeyd.h"
+#include "lstate.h"
+
+/* The packet and connection handlers under test are private to their
+ * modules, so those modules are built into the benchmark directly.  The
+ * kernel sink is built the same way with its ioctl stubbed out so it can
+ * be measured without privileges or feeding the real pool.
+ */
+#include "packet.c"
+#include "connection.c"
+
+/* skein.c declares its block function privately */
+extern void Skein_256_Process_Block(Skein_256_Ctxt_t *ctx, const u08b_t *blkPtr,
+                                    size_t blkCnt, size_t byteCntAdd);
+
+#define ioctl bench_ioctl
+int bench_ioctl(int fd, unsigned long request, ...);
+#include "krnlop.c"
+#undef ioctl
+
+/** Default minimum time each benchmark runs for, in milliseconds. */
+#define BENCH_MIN_MS 200
+
+/** Number of timed runs of each benchmark, the fastest is reported. */
+#define BENCH_RUNS 5
+
+/** Number of frames in the synthetic key streams. */
+#define BENCH_FRAMES 256
+
+/** Entropy blocks folded back to Lua before its pool is reset. */
+#define BENCH_FOLDBACK_BATCH 16384
+
+/** A benchmark. */
+typedef struct {
+    const char *name; /**< Name reported in the results. */
+    size_t bytes; /**< Bytes processed by each operation. */
+    bool (*setup)(void); /**< Prepare, false if the benchmark cannot run. */
+    void (*run)(unsigned long ops); /**< Perform a number of operations. */
+    void (*teardown)(void); /**< Release anything setup acquired. */
+} bench_t;
+
+/** Result of a benchmark. */
+typedef struct {
+    unsigned long ops; /**< Operations in the fastest run. */
+    double ns_per_op; /**< Nanoseconds per operation. */
+    double cycles_per_op; /**< Cycles per operation, negative if unknown. */
+} bench_result_t;
+
+static const uint8_t bench_snum[12] = {
+    0x00, 0x01, 0x02, 0x03, 0x10, 0x11, 0x12, 0x13, 0xab, 0xac, 0xad, 0xae
+};
+static uint8_t bench_key[32];
+
+/** Bytes per operation of the current benchmark, which setup may change. */
+static size_t bench_bytes;
+
+/** Time excluded from the current run by benchmarks which must reset. */
+static uint64_t excluded_ns;
+static uint64_t excluded_cycles;
+
+/** Somewhere for results to go so they are not optimised away. */
+static volatile uint32_t bench_sink;
+
+static uint8_t clean_stream[BENCH_FRAMES * EFRAME_LEN];
+static uint8_t noisy_stream[BENCH_FRAMES * EFRAME_LEN * 2];
+static size_t noisy_len;
+static unsigned long noisy_frames;
+
+/** Source for the memory stream. */
+static const uint8_t *mem_src;
+static size_t mem_len;
+static size_t mem_off;
+
+static eframe_state_t *bench_framer;
+static epkt_state_t *bench_epkt;
+static estream_state_t *bench_stream;
+static estream_state_t *bench_out;
+static econ_state_t bench_econ;
+static char bench_outname[64];
+
+static uint64_t
+bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/** Read the processor cycle counter, zero where there is none. */
+static uint64_t
+bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+int
+bench_ioctl(int fd, unsigned long request, ...)
+{
+    return 0;
+}
+
+/** Build a valid frame as a key keyed with ::bench_key would send it. */
+static void
+make_frame(uint8_t *frame, char type, char class, short subcode, const uint8_t *payload)
+{
+    EKeySkein mac_sk;
+    uint8_t macbuf[32];
+
+    frame[0] = SOF0;
+    frame[1] = SOF1;
+    frame[2] = type;
+    frame[3] = class;
+    pem64_encode_12bits(subcode, (char *)frame + 4);
+    pem64_encode_bytes(payload, 36, (char *)frame + 6);
+
+    PrepareSkein(&mac_sk, bench_snum, bench_key, EKEY_SKEIN_PERSONALISATION_PMS);
+    Skein_256_Update(&mac_sk, frame + 2, 52);
+    Skein_256_Final_Pad(&mac_sk, macbuf);
+    pem64_encode_bytes(macbuf, 3, (char *)frame + 54);
+    pem64_encode_bytes(macbuf + 29, 3, (char *)frame + 58);
+
+    frame[62] = EOF0;
+    frame[63] = EOF1;
+}
+
+static void
+make_streams(void)
+{
+    uint32_t seed = 1;
+    uint8_t payload[36];
+    uint8_t *frame;
+    int idx;
+    int junk;
+
+#define NEXT_RAND() (seed = (seed * 1103515245) + 12345, (seed >> 16) & 0x7fff)
+
+    noisy_len = 0;
+    noisy_frames = 0;
+
+    for (idx = 0; idx < BENCH_FRAMES; idx++) {
+        for (junk = 0; junk < 36; junk++)
+            payload[junk] = NEXT_RAND();
+
+        frame = clean_stream + (idx * EFRAME_LEN);
+        make_frame(frame, 'E', PKT_CLASS_BINARY, idx & 0xfff, payload);
+
+        /* line noise between frames, with every eighth frame damaged */
+        for (junk = NEXT_RAND() % 16; junk > 0; junk--)
+            noisy_stream[noisy_len++] = NEXT_RAND();
+
+        memcpy(noisy_stream + noisy_len, frame, EFRAME_LEN);
+        if ((idx % 8) == 7)
+            noisy_stream[noisy_len + 62] = NEXT_RAND() & 0x7f;
+        else
+            noisy_frames++;
+        noisy_len += EFRAME_LEN;
+    }
+
+#undef NEXT_RAND
+}
+
+static ssize_t
+mem_read(int fd, void *buf, size_t count)
+{
+    size_t chunk;
+    size_t done = 0;
+
+    while (done < count) {
+        chunk = mem_len - mem_off;
+        if (chunk > (count - done))
+            chunk = count - done;
+        memcpy((uint8_t *)buf + done, mem_src + mem_off, chunk);
+        done += chunk;
+        mem_off += chunk;
+        if (mem_off == mem_len)
+            mem_off = 0;
+    }
+    return count;
+}
+
+static ssize_t
+null_write(int fd, const void *buf, size_t count)
+{
+    bench_sink += ((const uint8_t *)buf)[0];
+    return count;
+}
+
+static int
+null_close(int fd)
+{
+    return 0;
+}
+
+static estream_state_t *
+bench_stream_open(const char *uri)
+{
+    estream_state_t *stream;
+
+    stream = calloc(1, sizeof(estream_state_t));
+    if (stream == NULL)
+        return NULL;
+
+    stream->uri = strdup(uri);
+    stream->fd = -1;
+    stream->estream_read = mem_read;
+    stream->estream_write = null_write;
+    stream->estream_close = null_close;
+
+    return stream;
+}
+
+/* pem64_decode_bytes */
+
+static void
+run_pem64_decode(unsigned long ops)
+{
+    uint8_t out[36];
+
+    while (ops-- > 0) {
+        pem64_decode_bytes((const char *)clean_stream + 6 + ((ops & 7) * EFRAME_LEN), 48, out);
+        bench_sink += out[0];
+    }
+}
+
+/* eframe_read */
+
+static bool
+setup_framer(const uint8_t *src, size_t len)
+{
+    mem_src = src;
+    mem_len = len;
+    mem_off = 0;
+
+    bench_stream = bench_stream_open("bench");
+    if (bench_stream == NULL)
+        return false;
+
+    bench_framer = eframe_open(bench_stream);
+    bench_epkt = epkt_open(bench_framer);
+    if (bench_epkt == NULL)
+        return false;
+
+    /* trace as the daemon does */
+    bench_framer->trace = trace_open();
+
+    epkt_setsessionkey(bench_epkt, (uint8_t *)bench_snum, bench_key);
+
+    return true;
+}
+
+static bool
+setup_framer_clean(void)
+{
+    return setup_framer(clean_stream, sizeof(clean_stream));
+}
+
+static bool
+setup_framer_noisy(void)
+{
+    /* report the line bytes consumed for each good frame */
+    bench_bytes = noisy_len / noisy_frames;
+    return setup_framer(noisy_stream, noisy_len);
+}
+
+static void
+teardown_framer(void)
+{
+    if (bench_framer != NULL)
+        trace_close(bench_framer->trace);
+    epkt_close(bench_epkt);
+    estream_close(bench_stream);
+    bench_epkt = NULL;
+    bench_framer = NULL;
+    bench_stream = NULL;
+}
+
+static void
+run_eframe_read(unsigned long ops)
+{
+    while (ops-- > 0) {
+        while (eframe_read(bench_framer) <= 0);
+        bench_framer->used = 0;
+    }
+}
+
+/* verify_mac and epkt_read */
+
+static bool
+setup_verify_mac(void)
+{
+    if (!setup_framer_clean())
+        return false;
+
+    while (eframe_read(bench_framer) <= 0);
+
+    /* the synthetic frames must pass, or this measures the failure path */
+    return verify_mac(bench_epkt);
+}
+
+static void
+run_verify_mac(unsigned long ops)
+{
+    while (ops-- > 0)
+        bench_sink += verify_mac(bench_epkt);
+}
+
+static void
+run_epkt_read(unsigned long ops)
+{
+    uint8_t buf[128];
+
+    while (ops-- > 0)
+        bench_sink += epkt_read(bench_epkt, buf, sizeof(buf));
+}
+
+/* entropy_pkt_handler */
+
+static bool
+setup_entropy_handler(void)
+{
+    uint8_t buf[128];
+
+    if (!setup_framer_clean())
+        return false;
+
+    bench_out = bench_stream_open("null");
+    if (bench_out == NULL)
+        return false;
+
+    memset(&bench_econ, 0, sizeof(bench_econ));
+    bench_econ.key_stream = bench_stream;
+    bench_econ.op_stream = bench_out;
+    bench_econ.epkt = bench_epkt;
+    bench_econ.eframer = bench_framer;
+    bench_econ.con_entropy = 1; /* skip the first entropy log message */
+    PrepareSkein(&bench_econ.session_state, bench_snum, bench_key,
+                 EKEY_SKEIN_PERSONALISATION_EES);
+
+    return (epkt_read(bench_epkt, buf, sizeof(buf)) > 0);
+}
+
+static void
+teardown_entropy_handler(void)
+{
+    estream_close(bench_out);
+    bench_out = NULL;
+    teardown_framer();
+}
+
+static void
+run_entropy_handler(unsigned long ops)
+{
+    uint8_t buf[36];
+
+    while (ops-- > 0) {
+        memcpy(buf, clean_stream + 6, 32);
+        entropy_pkt_handler(&bench_econ, buf, 32);
+    }
+}
+
+/* trace_event */
+
+static trace_ring_t *bench_trace;
+
+static bool
+setup_trace(void)
+{
+    bench_trace = trace_open();
+    return (bench_trace != NULL);
+}
+
+static void
+teardown_trace(void)
+{
+    trace_close(bench_trace);
+    bench_trace = NULL;
+}
+
+static void
+run_trace(unsigned long ops)
+{
+    while (ops-- > 0)
+        trace_event(bench_trace, TRACE_FRAME_OK, 'E', ops);
+}
+
+static void
+run_trace_stamped(unsigned long ops)
+{
+    trace_stamp(bench_trace);
+    while (ops-- > 0)
+        trace_event_stamped(bench_trace, TRACE_FRAME_OK, 'E', ops);
+}
+
+/* skein */
+
+static void
+run_prepare_skein(unsigned long ops)
+{
+    EKeySkein skein;
+
+    while (ops-- > 0) {
+        PrepareSkein(&skein, bench_snum, bench_key, EKEY_SKEIN_PERSONALISATION_EES);
+        bench_sink += skein.X[0];
+    }
+}
+
+static void
+run_skein_block(unsigned long ops)
+{
+    EKeySkein skein;
+
+    PrepareSkein(&skein, bench_snum, bench_key, EKEY_SKEIN_PERSONALISATION_EES);
+
+    while (ops-- > 0)
+        Skein_256_Process_Block(&skein, clean_stream, 1, SKEIN_256_BLOCK_BYTES);
+
+    bench_sink += skein.X[0];
+}
+
+/* output sinks */
+
+static void
+run_sink(unsigned long ops)
+{
+    while (ops-- > 0)
+        estream_write(bench_out, clean_stream + (ops & 31), 32);
+}
+
+static bool
+setup_sink_null(void)
+{
+    bench_out = bench_stream_open("null");
+    return (bench_out != NULL);
+}
+
+static bool
+setup_sink_file(void)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    int fd;
+
+    snprintf(bench_outname, sizeof(bench_outname), "%s/ekey-bench.XXXXXX",
+             (tmpdir != NULL) ? tmpdir : "/tmp");
+    fd = mkstemp(bench_outname);
+    if (fd == -1)
+        return false;
+    close(fd);
+
+    bench_out = estream_open(bench_outname);
+    return (bench_out != NULL);
+}
+
+static bool
+setup_sink_filesink(void)
+{
+    filesink_config_t config;
+
+    if (!setup_sink_file())
+        return false;
+    estream_close(bench_out);
+
+    memset(&config, 0, sizeof(config));
+    config.path = bench_outname;
+    bench_out = estream_filesink_open(&config);
+    return (bench_out != NULL);
+}
+
+static void
+teardown_sink_file(void)
+{
+    estream_close(bench_out);
+    bench_out = NULL;
+    unlink(bench_outname);
+}
+
+static bool
+setup_sink_kernel(void)
+{
+    bench_out = estream_krnl_open("/dev/null", 8, -1);
+    return (bench_out != NULL);
+}
+
+static void
+teardown_sink(void)
+{
+    estream_close(bench_out);
+    bench_out = NULL;
+}
+
+/* Lua foldback */
+
+static bool
+setup_foldback(void)
+{
+    return lstate_init();
+}
+
+static void
+teardown_foldback(void)
+{
+    lstate_finalise();
+}
+
+static void
+run_foldback(unsigned long ops)
+{
+    unsigned long batch;
+    uint64_t ns;
+    uint64_t cycles;
+
+    while (ops > 0) {
+        batch = (ops > BENCH_FOLDBACK_BATCH) ? BENCH_FOLDBACK_BATCH : ops;
+        ops -= batch;
+
+        while (batch-- > 0)
+            lstate_foldback_entropy(clean_stream + (batch & 31), 32);
+
+        /* empty the Lua pool before it fills and starts dropping blocks */
+        ns = bench_ns();
+        cycles = bench_cycles();
+        lstate_finalise();
+        lstate_init();
+        excluded_cycles += bench_cycles() - cycles;
+        excluded_ns += bench_ns() - ns;
+    }
+}
+
+static const bench_t benches[] = {
+    { "pem64_decode_bytes", 48, NULL, run_pem64_decode, NULL },
+    { "eframe_read_clean", EFRAME_LEN, setup_framer_clean, run_eframe_read, teardown_framer },
+    { "eframe_read_noisy", EFRAME_LEN, setup_framer_noisy, run_eframe_read, teardown_framer },
+    { "verify_mac", 52, setup_verify_mac, run_verify_mac, teardown_framer },
+    { "epkt_read", EFRAME_LEN, setup_framer_clean, run_epkt_read, teardown_framer },
+    { "entropy_pkt_handler", 32, setup_entropy_handler, run_entropy_handler, teardown_entropy_handler },
+    { "trace_event", 0, setup_trace, run_trace, teardown_trace },
+    { "trace_event_stamped", 0, setup_trace, run_trace_stamped, teardown_trace },
+    { "PrepareSkein", 0, NULL, run_prepare_skein, NULL },
+    { "Skein_256_Process_Block", SKEIN_256_BLOCK_BYTES, NULL, run_skein_block, NULL },
+    { "sink_null", 32, setup_sink_null, run_sink, teardown_sink },
+    { "sink_file", 32, setup_sink_file, run_sink, teardown_sink_file },
+    { "sink_filesink", 32, setup_sink_filesink, run_sink, teardown_sink_file },
+    { "sink_kernel", 32, setup_sink_kernel, run_sink, teardown_sink },
+    { "lua_foldback", 32, setup_foldback, run_foldback, teardown_foldback },
+};
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/** Time a benchmark, reporting the fastest of several runs. */
+static void
+bench_measure(const bench_t *bench, unsigned int min_ms, bench_result_t *result)
+{
+    unsigned long ops = 1;
+    uint64_t elapsed;
+    uint64_t cycles;
+    uint64_t start;
+    uint64_t cstart;
+    int run;
+
+    /* find an operation count which takes long enough to time */
+    for (;;) {
+        excluded_ns = 0;
+        start = bench_ns();
+        bench->run(ops);
+        elapsed = bench_ns() - start - excluded_ns;
+        if (elapsed >= ((uint64_t)min_ms * 1000000) / BENCH_RUNS)
+            break;
+        if (elapsed < 1000000)
+            ops *= 10;
+        else
+            ops = (ops * ((uint64_t)min_ms * 1000000 / BENCH_RUNS)) / elapsed + 1;
+    }
+
+    result->ops = ops;
+    result->ns_per_op = -1;
+    result->cycles_per_op = -1;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        excluded_ns = 0;
+        excluded_cycles = 0;
+        start = bench_ns();
+        cstart = bench_cycles();
+        bench->run(ops);
+        cycles = bench_cycles() - cstart - excluded_cycles;
+        elapsed = bench_ns() - start - excluded_ns;
+
+        if ((result->ns_per_op < 0) || (((double)elapsed / ops) < result->ns_per_op)) {
+            result->ns_per_op = (double)elapsed / ops;
+            if (cstart != 0)
+                result->cycles_per_op = (double)cycles / ops;
+        }
+    }
+}
+
+/** Find a benchmark's ns/op in a previous results file.
+ *
+ * Results are written one per line, so they are found without a JSON parser.
+ */
+static double
+baseline_ns(FILE *baseline, const char *name)
+{
+    char line[256];
+    char key[64];
+    double ns;
+
+    if (baseline == NULL)
+        return -1;
+
+    rewind(baseline);
+    snprintf(key, sizeof(key), "{\"name\": \"%s\",", name);
+
+    while (fgets(line, sizeof(line), baseline) != NULL) {
+        char *pos = strstr(line, key);
+        if (pos == NULL)
+            continue;
+        pos = strstr(pos, "\"ns_per_op\": ");
+        if ((pos != NULL) && (sscanf(pos, "\"ns_per_op\": %lf", &ns) == 1))
+            return ns;
+    }
+
+    return -1;
+}
+
+static const char *usage =
+    "Usage: %s [-t <ms>] [-c <baseline.json>] [-h] [name...]\n"
+    "Entropy key daemon pipeline microbenchmarks\n\n"
+    "\t-t Minimum time to run each benchmark for (default %d)\n"
+    "\t-c Compare against results from a previous run\n"
+    "\t-h Display this help and exit\n\n"
+    "Results are written to stdout as JSON, comparisons to stderr.\n";
+
+int
+main(int argc, char **argv)
+{
+    unsigned int min_ms = BENCH_MIN_MS;
+    FILE *baseline = NULL;
+    bench_result_t result;
+    const bench_t *bench;
+    unsigned int idx;
+    bool first = true;
+    double base;
+    int opt;
+    int arg;
+
+    while ((opt = getopt(argc, argv, "ht:c:")) != -1) {
+        switch (opt) {
+        case 't':
+            min_ms = atoi(optarg);
+            if (min_ms == 0)
+                min_ms = 1;
+            break;
+
+        case 'c':
+            baseline = fopen(optarg, "r");
+            if (baseline == NULL) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+
+        case 'h':
+        default:
+            fprintf(stderr, usage, argv[0], BENCH_MIN_MS);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    make_streams();
+
+    printf("{\n  \"version\": \"%s\",\n  \"runs\": %d,\n  \"results\": [\n",
+           EKEYD_VERSION_S, BENCH_RUNS);
+
+    for (idx = 0; idx < NBENCHES; idx++) {
+        bench = &benches[idx];
+
+        if (optind < argc) {
+            for (arg = optind; arg < argc; arg++) {
+                if (strcmp(argv[arg], bench->name) == 0)
+                    break;
+            }
+            if (arg == argc)
+                continue;
+        }
+
+        bench_bytes = bench->bytes;
+        if ((bench->setup != NULL) && !bench->setup()) {
+            fprintf(stderr, "%s: unavailable, skipped\n", bench->name);
+            continue;
+        }
+
+        bench_measure(bench, min_ms, &result);
+
+        if (bench->teardown != NULL)
+            bench->teardown();
+
+        printf("%s    {\"name\": \"%s\", \"bytes_per_op\": %u, \"ops\": %lu, "
+               "\"ns_per_op\": %.2f, \"cycles_per_op\": ",
+               first ? "" : ",\n", bench->name, (unsigned)bench_bytes,
+               result.ops, result.ns_per_op);
+        if (result.cycles_per_op < 0)
+            printf("null, \"cycles_per_byte\": null}");
+        else if (bench_bytes == 0)
+            printf("%.1f, \"cycles_per_byte\": null}", result.cycles_per_op);
+        else
+            printf("%.1f, \"cycles_per_byte\": %.2f}", result.cycles_per_op,
+                   result.cycles_per_op / bench_bytes);
+        fflush(stdout);
+        first = false;
+
+        base = baseline_ns(baseline, bench->name);
+        if (base > 0)
+            fprintf(stderr, "%-24s %10.2f ns/op  %+7.1f%%\n", bench->name,
+                    result.ns_per_op, ((result.ns_per_op - base) * 100) / base);
+    }
+
+    printf("\n  ]\n}\n");
+
+    if (baseline != NULL)
+        fclose(baseline);
+
+    return 0;
+}
+
+/* The benchmark has no keys, outputs or poll loop of its own; these satisfy
+ * the control state when the Lua foldback path is measured.
+ */
+
+bool
+lstate_cb_newfd(int fd)
+{
+    return true;
+}
+
+void
+lstate_cb_delfd(int fd)
+{
+}
+
+void
+lstate_cb_writefd(int fd)
+{
+}
+
+void
+lstate_cb_nowritefd(int fd)
+{
+}
+
+OpaqueEkey *
+add_ekey(const char *devpath, const char *serial)
+{
+    errno = ENODEV;
+    return NULL;
+}
+
+void
+kill_ekey(OpaqueEkey *ekey)
+{
+}
+
+bool
+record_ekey(OpaqueEkey *ekey, const char *fname)
+{
+    errno = ENODEV;
+    return false;
+}
+
+int
+query_ekey_status(OpaqueEkey *ekey)
+{
+    return EKEY_STATUS_UNKNOWN;
+}
+
+char *
+retrieve_ekey_serial(OpaqueEkey *ekey)
+{
+    return NULL;
+}
+
+bool
+open_file_output(const char *fname)
+{
+    errno = ENODEV;
+    return false;
+}
+
+bool
+open_sink_output(const filesink_config_t *config)
+{
+    errno = ENODEV;
+    return false;
+}
+
+bool
+open_kernel_output(int bits_per_byte, int min_bits_per_byte)
+{
+    errno = ENODEV;
+    return false;
+}
+
+bool
+open_foldback_output(void)
+{
+    return true;
+}
+
+bool
+watch_keyring(const char *fname)
+{
+    errno = ENODEV;
+    return false;
+}
+
+void
+set_flow_control(bool enable)
+{
+}
+
+void
+set_key_recovery(bool reopen, int stall_secs)
+{
+}
+
+int
+use_seed_file(const char *fname, int refresh_secs, bool consume)
+{
+    errno = ENODEV;
+    return -1;
+}
+
+bool
+request_upgrade(void)
+{
+    return false;
+}
@@ -0,0 +1,653 @@
+/* daemon/ekey-netd.c
+ *
+ * Entropy Key network server.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <poll.h>
+#include <syslog.h>
+
+#include "daemonise.h"
+#include "stream.h"
+#include "netstream.h"
+#include "util.h"
+
+/** Maximum number of keys served by one process. */
+#define NETD_MAX_KEYS 16
+
+/** Data buffered for a client which is not reading fast enough. */
+#define NETD_CLIENT_BUFFER (64 * 1024)
+
+/** Address listened on when none is given. */
+#define NETD_DEFAULT_ADDRESS "127.0.0.1"
+
+/** Maximum number of allowed client networks. */
+#define NETD_MAX_ALLOW 16
+
+/** A network clients may connect from. */
+typedef struct {
+    int family; /**< AF_INET or AF_INET6. */
+    uint8_t addr[16]; /**< Network address, 4 bytes for AF_INET. */
+    unsigned int prefix; /**< Significant bits of addr. */
+} netd_allow_t;
+
+/** State of one Entropy Key served by the daemon. */
+typedef struct {
+    char *devpath; /**< Key device node or ekey-ulusbd socket. */
+    char *address; /**< Address to listen on. */
+    char *port; /**< Port to listen on. */
+    estream_state_t *stream; /**< The key, open while a client is connected. */
+    int accept_fd; /**< Listening socket. */
+    int client_fd; /**< Connected client or -1. */
+    uint8_t outbuf[NETD_CLIENT_BUFFER]; /**< Data waiting for the client. */
+    size_t outhead; /**< Offset of the first waiting byte in outbuf. */
+    size_t outlen; /**< Number of bytes waiting in outbuf. */
+    uint64_t client_bytes; /**< Bytes written to clients. */
+    unsigned long clients; /**< Clients accepted. */
+} netd_key_t;
+
+static netd_key_t *keys[NETD_MAX_KEYS];
+static int nkeys = 0;
+static netd_allow_t allow[NETD_MAX_ALLOW];
+static int nallow = 0;
+static bool daemonise = false;
+static char *pidfilename = NULL;
+static volatile sig_atomic_t report_stats = 0;
+static volatile sig_atomic_t finish = 0;
+
+static void
+usage(FILE *stream, char *argv0)
+{
+    fprintf(stream,
+            "Usage: %s -k[address:]port=device [-k...] [-aaddress[/prefix]...]\n" \
+            "\t[-Ppidfilename] [-D]\n"                          \
+            "\n"                                                  \
+            "Serve Entropy Keys to ekeyd over TCP, for example\n" \
+            "  %s -k 0.0.0.0:8890=/dev/entropykey/AAAAAAAAAAAAAAAAAAAAAA\n" \
+            "is added to ekeyd as tcp://keyhost:8890\n"          \
+            "\n"                                                  \
+            "Options:\n"                                          \
+            "\t-k\tServe a key, may be given several times; the address\n" \
+            "\t\tdefaults to " NETD_DEFAULT_ADDRESS "\n"          \
+            "\t-a\tOnly accept clients from an address or network, may\n" \
+            "\t\tbe given several times\n"                      \
+            "\t-D\tDaemonise (fork into background)\n"            \
+            "\t-P\tWrite the process ID to a file\n"              \
+            "\t-v\tDisplay version and exit\n"                    \
+            "\t-h\tDisplay this information and exit\n"           \
+            , argv0, argv0);
+}
+
+/** Report a message to syslog or the terminal as appropriate. */
+static void
+report(int priority, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (daemonise) {
+        vsyslog(priority, fmt, ap);
+    } else {
+        vfprintf((priority <= LOG_WARNING) ? stderr : stdout, fmt, ap);
+        fputc('\n', (priority <= LOG_WARNING) ? stderr : stdout);
+    }
+    va_end(ap);
+}
+
+/** End a client session, closing the key so ekeyd starts afresh. */
+static void
+close_client(netd_key_t *key)
+{
+    if (key->client_fd == -1)
+        return;
+
+    close(key->client_fd);
+    key->client_fd = -1;
+    key->outhead = 0;
+    key->outlen = 0;
+
+    estream_close(key->stream);
+    key->stream = NULL;
+}
+
+/** Write as much buffered data to the client as it will take. */
+static void
+flush_client(netd_key_t *key)
+{
+    size_t chunk;
+    ssize_t r;
+
+    while ((key->client_fd != -1) && (key->outlen > 0)) {
+        chunk = NETD_CLIENT_BUFFER - key->outhead;
+        if (chunk > key->outlen)
+            chunk = key->outlen;
+
+        r = write(key->client_fd, key->outbuf + key->outhead, chunk);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return; /* client is full, wait for POLLOUT */
+            close_client(key);
+            return;
+        }
+
+        key->client_bytes += r;
+        key->outhead = (key->outhead + r) % NETD_CLIENT_BUFFER;
+        key->outlen -= r;
+    }
+
+    if (key->outlen == 0)
+        key->outhead = 0;
+}
+
+/* Data read from the Entropy Key is queued for the client, the key is only
+ * polled while there is room for it
+ */
+static void
+handle_key(netd_key_t *key, short revents)
+{
+    uint8_t buf[4096];
+    uint8_t *src = buf;
+    ssize_t len;
+    size_t room;
+    size_t tail;
+    size_t chunk;
+
+    room = NETD_CLIENT_BUFFER - key->outlen;
+    if (room == 0) {
+        /* not polled for input while full, so the key has failed */
+        report(LOG_ERR, "Entropy Key %s has gone away", key->devpath);
+        close_client(key);
+        return;
+    }
+
+    len = estream_read(key->stream, buf, (room < sizeof(buf)) ? room : sizeof(buf));
+    if (len <= 0) {
+        if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            return;
+        report(LOG_ERR, "Entropy Key %s has gone away", key->devpath);
+        close_client(key);
+        return;
+    }
+
+    while (len > 0) {
+        tail = (key->outhead + key->outlen) % NETD_CLIENT_BUFFER;
+        chunk = NETD_CLIENT_BUFFER - tail;
+        if (chunk > (size_t)len)
+            chunk = len;
+        memcpy(key->outbuf + tail, src, chunk);
+        key->outlen += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+
+    flush_client(key);
+}
+
+static bool
+prepare_listener(netd_key_t *key)
+{
+    struct addrinfo hints;
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    int one = 1;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    err = getaddrinfo(key->address, key->port, &hints, &addrs);
+    if (err != 0) {
+        report(LOG_ERR, "Unable to resolve %s: %s", key->address,
+               gai_strerror(err));
+        return false;
+    }
+
+    for (addr = addrs; addr != NULL; addr = addr->ai_next) {
+        key->accept_fd = socket(addr->ai_family, addr->ai_socktype,
+                                addr->ai_protocol);
+        if (key->accept_fd == -1)
+            continue;
+
+        setsockopt(key->accept_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if ((bind(key->accept_fd, addr->ai_addr, addr->ai_addrlen) == 0) &&
+            (listen(key->accept_fd, 5) == 0))
+            break;
+
+        err = errno;
+        close(key->accept_fd);
+        key->accept_fd = -1;
+        errno = err;
+    }
+    freeaddrinfo(addrs);
+
+    if (key->accept_fd == -1) {
+        report(LOG_ERR, "Unable to listen on %s port %s: %s", key->address,
+               key->port, strerror(errno));
+        return false;
+    }
+
+    fcntl(key->accept_fd, F_SETFL, fcntl(key->accept_fd, F_GETFL) | O_NONBLOCK);
+
+    return true;
+}
+
+/* Parse a key specification of the form [address:]port=device */
+static bool
+add_key_spec(const char *spec)
+{
+    netd_key_t *key;
+    const char *equals;
+    char *where;
+
+    if (nkeys == NETD_MAX_KEYS) {
+        fprintf(stderr, "Too many keys, maximum is %d\n", NETD_MAX_KEYS);
+        return false;
+    }
+
+    equals = strchr(spec, '=');
+    if ((equals == NULL) || (equals == spec) || (equals[1] == 0))
+        return false;
+
+    key = calloc(1, sizeof(*key));
+    if (key == NULL) {
+        perror("calloc");
+        return false;
+    }
+
+    where = strndup(spec, equals - spec);
+    key->devpath = strdup(equals + 1);
+    if ((where == NULL) || (key->devpath == NULL))
+        goto error;
+
+    if (strchr(where, ':') == NULL) {
+        /* only the port is given */
+        key->address = strdup(NETD_DEFAULT_ADDRESS);
+        key->port = where;
+        where = NULL;
+        if (key->address == NULL)
+            goto error;
+    } else if (!split_hostport(where, NULL, &key->address, &key->port)) {
+        goto error;
+    }
+    free(where);
+
+    key->accept_fd = -1;
+    key->client_fd = -1;
+    keys[nkeys++] = key;
+
+    return true;
+
+error:
+    free(where);
+    free(key->devpath);
+    free(key->address);
+    free(key->port);
+    free(key);
+    return false;
+}
+
+/* Parse an allowed client specification of the form address[/prefix] */
+static bool
+add_allow_spec(const char *spec)
+{
+    netd_allow_t *net;
+    char addr[INET6_ADDRSTRLEN];
+    const char *slash;
+    unsigned int bits;
+    char *end;
+
+    if (nallow == NETD_MAX_ALLOW) {
+        fprintf(stderr, "Too many allowed clients, maximum is %d\n",
+                NETD_MAX_ALLOW);
+        return false;
+    }
+    net = &allow[nallow];
+
+    slash = strchr(spec, '/');
+    if (slash == NULL)
+        slash = spec + strlen(spec);
+    if ((size_t)(slash - spec) >= sizeof(addr))
+        return false;
+    memcpy(addr, spec, slash - spec);
+    addr[slash - spec] = 0;
+
+    if (inet_pton(AF_INET, addr, net->addr) == 1) {
+        net->family = AF_INET;
+        bits = 32;
+    } else if (inet_pton(AF_INET6, addr, net->addr) == 1) {
+        net->family = AF_INET6;
+        bits = 128;
+    } else {
+        return false;
+    }
+
+    net->prefix = bits;
+    if (*slash == '/') {
+        net->prefix = strtoul(slash + 1, &end, 10);
+        if ((slash[1] == 0) || (*end != 0) || (net->prefix > bits))
+            return false;
+    }
+
+    nallow++;
+    return true;
+}
+
+/** Check a client's address against the allowed networks. */
+static bool
+allowed_client(const struct sockaddr_storage *sa)
+{
+    const uint8_t *addr;
+    const netd_allow_t *net;
+    unsigned int whole;
+    unsigned int rest;
+    int family = sa->ss_family;
+    int idx;
+
+    if (nallow == 0)
+        return true; /* anyone who can reach the listening address */
+
+    if (family == AF_INET) {
+        addr = (const uint8_t *)&((const struct sockaddr_in *)sa)->sin_addr;
+    } else if (family == AF_INET6) {
+        addr = (const uint8_t *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)addr)) {
+            /* IPv4 client of a dual stack listener */
+            family = AF_INET;
+            addr += 12;
+        }
+    } else {
+        return false;
+    }
+
+    for (idx = 0; idx < nallow; idx++) {
+        net = &allow[idx];
+        if (net->family != family)
+            continue;
+
+        whole = net->prefix / 8;
+        rest = net->prefix % 8;
+        if ((memcmp(addr, net->addr, whole) == 0) &&
+            ((rest == 0) ||
+             (((addr[whole] ^ net->addr[whole]) & (0xff00 >> rest)) == 0)))
+            return true;
+    }
+
+    return false;
+}
+
+static void
+report_key_stats(void)
+{
+    int idx;
+
+    for (idx = 0; idx < nkeys; idx++) {
+        report(LOG_INFO, "%s: %s clients=%lu bytes=%llu",
+               keys[idx]->devpath,
+               (keys[idx]->client_fd != -1) ? "connected" : "idle",
+               keys[idx]->clients,
+               (unsigned long long)keys[idx]->client_bytes);
+    }
+}
+
+static void
+request_stats(int sig)
+{
+    report_stats = 1;
+}
+
+static void
+request_finish(int sig)
+{
+    finish = 1;
+}
+
+static void
+unlinkpid(void)
+{
+    if (pidfilename != NULL)
+        unlink(pidfilename);
+}
+
+static void
+handle_accept(netd_key_t *key)
+{
+    char host[NI_MAXHOST];
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    int tempclient;
+
+    tempclient = accept(key->accept_fd, (struct sockaddr *)&sa, &salen);
+    if (tempclient == -1)
+        return;
+
+    if (key->client_fd != -1) {
+        /* one client at a time */
+        close(tempclient);
+        return;
+    }
+
+    if (getnameinfo((struct sockaddr *)&sa, salen, host, sizeof(host),
+                    NULL, 0, NI_NUMERICHOST) != 0)
+        strcpy(host, "unknown");
+
+    if (!allowed_client(&sa)) {
+        report(LOG_WARNING, "Refused client %s for %s", host, key->devpath);
+        close(tempclient);
+        return;
+    }
+
+    /* the key is opened for each session so the client sees it from the
+     * start, as it would a locally attached key
+     */
+    key->stream = estream_open(key->devpath);
+    if (key->stream == NULL) {
+        report(LOG_ERR, "Unable to open Entropy Key %s for %s",
+               key->devpath, host);
+        close(tempclient);
+        return;
+    }
+
+    netstream_tune(tempclient);
+    fcntl(tempclient, F_SETFL, fcntl(tempclient, F_GETFL) | O_NONBLOCK);
+    key->client_fd = tempclient;
+    key->clients++;
+
+    report(LOG_INFO, "Client %s connected to %s", host, key->devpath);
+}
+
+/** Pass data written by the client on to the key. */
+static void
+handle_client(netd_key_t *key, short revents)
+{
+    uint8_t buf[1024];
+    ssize_t r;
+
+    if (revents & POLLOUT)
+        flush_client(key);
+
+    if ((key->client_fd != -1) && (revents & POLLIN)) {
+        r = read(key->client_fd, buf, sizeof(buf));
+        if (r < 1) {
+            if ((r < 0) &&
+                ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+                return;
+            /* Client vanished? */
+            report(LOG_INFO, "Client of %s gone away", key->devpath);
+            close_client(key);
+            return;
+        }
+        if (estream_write(key->stream, buf, r) != r) {
+            report(LOG_ERR, "Entropy Key %s has gone away during write",
+                   key->devpath);
+            close_client(key);
+        }
+    } else if ((key->client_fd != -1) && (revents & (POLLERR | POLLHUP))) {
+        close_client(key);
+    }
+}
+
+static void
+poll_loop(void)
+{
+    struct pollfd pfd[NETD_MAX_KEYS * 3];
+    netd_key_t *owner[NETD_MAX_KEYS * 3];
+    netd_key_t *key;
+    int nfds;
+    int idx;
+
+    while (!finish) {
+        nfds = 0;
+        for (idx = 0; idx < nkeys; idx++) {
+            key = keys[idx];
+
+            pfd[nfds].fd = key->accept_fd;
+            pfd[nfds].events = POLLIN;
+            owner[nfds++] = key;
+
+            if (key->client_fd != -1) {
+                /* a client which is not reading holds the key back */
+                pfd[nfds].fd = key->stream->fd;
+                pfd[nfds].events = (key->outlen < NETD_CLIENT_BUFFER) ? POLLIN : 0;
+                owner[nfds++] = key;
+
+                pfd[nfds].fd = key->client_fd;
+                pfd[nfds].events = POLLIN;
+                if (key->outlen > 0)
+                    pfd[nfds].events |= POLLOUT;
+                owner[nfds++] = key;
+            }
+        }
+
+        if (poll(pfd, nfds, -1) < 0) {
+            if (errno != EINTR)
+                break;
+            continue;
+        }
+
+        for (idx = 0; idx < nfds; idx++) {
+            if (pfd[idx].revents == 0)
+                continue;
+            key = owner[idx];
+            if (pfd[idx].fd == key->accept_fd) {
+                handle_accept(key);
+            } else if ((key->client_fd != -1) && (pfd[idx].fd == key->stream->fd)) {
+                handle_key(key, pfd[idx].revents);
+            } else if ((key->client_fd != -1) && (pfd[idx].fd == key->client_fd)) {
+                handle_client(key, pfd[idx].revents);
+            }
+        }
+
+        if (report_stats) {
+            report_stats = 0;
+            report_key_stats();
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+    int idx;
+
+    while ((opt = getopt(argc, argv, "vhk:a:DP:")) != -1) {
+        switch(opt) {
+        case 'v':
+            printf("Simtec Entropy Key, Network Key Server. Version 1.0\n");
+            return 0;
+        case 'h':
+            printf("Simtec Entropy Key, Network Key Server. Version 1.0\n");
+            usage(stdout, argv[0]);
+            return 0;
+        case 'k':
+            if (add_key_spec(optarg) == false) {
+                fprintf(stderr, "Bad key specification: %s\n", optarg);
+                usage(stderr, argv[0]);
+                return 1;
+            }
+            break;
+        case 'a':
+            if (add_allow_spec(optarg) == false) {
+                fprintf(stderr, "Bad allowed client: %s\n", optarg);
+                usage(stderr, argv[0]);
+                return 1;
+            }
+            break;
+        case 'D':
+            daemonise = true;
+            break;
+        case 'P':
+            pidfilename = optarg;
+            break;
+        default:
+            fprintf(stderr, "Unknown option: %c\n", opt);
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+
+    if (nkeys == 0) {
+        fprintf(stderr, "At least one key must be given.\n");
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    for (idx = 0; idx < nkeys; idx++) {
+        if (prepare_listener(keys[idx]) == false)
+            return 3;
+    }
+
+    if (daemonise) {
+        do_daemonise(pidfilename, false);
+        openlog("ekey-netd", LOG_ODELAY | LOG_PID, LOG_DAEMON);
+    }
+
+    atexit(unlinkpid);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, request_stats);
+    signal(SIGTERM, request_finish);
+    signal(SIGINT, request_finish);
+
+    report(LOG_INFO, "Polling");
+
+    poll_loop();
+
+    report(LOG_INFO, "Closing down");
+
+    report_key_stats();
+
+    for (idx = 0; idx < nkeys; idx++)
+        close_client(keys[idx]);
+
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * c-basic-offset:4
+ * End:
+ */
@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "pem.h"
 #include "skeinwrap.h"
@@ -27,6 +28,9 @@
 #include "frame.h"
 #include "packet.h"
 #include "keydb.h"
+#ifdef EKEY_USB_STREAM
+#include "usbstream.h"
+#endif
 
 #define STDIN   0
 
@@ -43,6 +47,15 @@
 
 #define DEVEKEY "/dev/entropykey/"
 
+/** Maximum number of devices in a batch. */
+#define BATCH_MAX 256
+
+/** Default time allowed for each device in a batch, in seconds. */
+#define BATCH_TIMEOUT 30
+
+/** Number of unexpected packets tolerated while waiting for a reply. */
+#define REKEY_RETRIES 20
+
 /** Conenction state. */
 struct econ_state_s {
     uint8_t *mkey; /**< Master key. */
@@ -79,16 +92,60 @@ calc_mac(uint8_t *snum, uint8_t *mkey, uint8_t *nonce, int nonce_len)
     return mac;
 }
 
+/** Send the nonce MAC which starts a long term rekey. */
+static void
+send_nonce_mac(estream_state_t *key_stream, uint8_t *snum, uint8_t *mkey,
+               uint8_t *nonce)
+{
+    uint8_t data[9];
+    uint8_t *mac;
+
+    mac = calc_mac(snum, mkey, nonce, 12);
+    data[0] = 'M';
+    pem64_encode_bytes(mac, 6, (char *)data + 1);
+    estream_write(key_stream, data, 9);
+    free(mac);
+}
+
+/** Send the nonce which completes a long term rekey. */
+static void
+send_rekey_nonce(estream_state_t *key_stream, uint8_t *nonce)
+{
+    uint8_t data[18];
+
+    data[0] = 'L';
+    pem64_encode_bytes(nonce, 12, (char *)data + 1);
+    data[17] = '.';
+    estream_write(key_stream, data, 18);
+}
+
+/** Calculate the new long term key from the device's rekey reply. */
+static void
+derive_ltkey(uint8_t *snum, uint8_t *mkey, uint8_t *reply, uint8_t *nonce,
+             uint8_t *session_key)
+{
+    EKeySkein rekeying_state;
+
+    PrepareSkein(&rekeying_state, snum, &(mkey[0]), EKEY_SKEIN_PERSONALISATION_LRS);
+    Skein_256_Update(&rekeying_state, &(reply[0]), 32);
+    Skein_256_Update(&rekeying_state, nonce, 12);
+
+    Skein_256_Final(&rekeying_state, session_key);
+}
+
 static const char *usage =
     "Usage: %s [-d] [-h] [-n] [-f <keyring>] [-m <master>]\n"
     "       [-s <serial>] <path>\n"
+    "       %s [-n] [-f <keyring>] [-t <timeout>] -b <batchfile>\n"
     "Entropy key device long term session key tool\n\n"
     "\t-v Print version and exit.\n"
     "\t-h Print this help text and exit.\n"
     "\t-n Do not update the keyring with the result.\n"
     "\t-f The path to the keyring to update.\n"
     "\t-m The master key of the device being updated.\n"
-    "\t-s The serial number of the device being updated.\n\n";
+    "\t-s The serial number of the device being updated.\n"
+    "\t-b Rekey every device listed in batchfile concurrently.\n"
+    "\t-t Seconds allowed for each device in a batch.\n\n";
 
 int
 get_keyring(const char *keyring_filename)
@@ -183,6 +240,444 @@ extract_master_key(const char *s, int len)
     return mkey;
 }
 
+/** State of a device in a batch rekey. */
+typedef enum {
+    BATCH_SNUM, /**< Reset sent, waiting for the serial number. */
+    BATCH_MACACK, /**< Nonce MAC sent, waiting for acknowledgement. */
+    BATCH_REKEY, /**< Nonce sent, waiting for the rekey reply. */
+    BATCH_DONE, /**< New long term key derived. */
+    BATCH_FAILED, /**< Rekey failed, see the error. */
+} batch_state_t;
+
+/** A device being rekeyed as part of a batch. */
+typedef struct {
+    char *path; /**< Stream the device is reached through. */
+    uint8_t *mkey; /**< Master key. */
+    uint8_t *snum; /**< Serial number, expected or as reported. */
+    bool snum_given; /**< The serial number was given in the batch file. */
+
+    estream_state_t *key_stream;
+    epkt_state_t *epkt;
+
+    batch_state_t state;
+    int retries;
+    const char *error;
+    uint8_t nonce[12];
+    uint8_t session_key[32];
+
+    uint64_t t_start; /**< Time the device was reset. */
+    uint64_t t_snum; /**< Time the serial number arrived. */
+    uint64_t t_mac; /**< Time the MAC was acknowledged. */
+    uint64_t t_done; /**< Time the rekey finished or failed. */
+} batch_dev_t;
+
+static batch_dev_t batch[BATCH_MAX];
+static int batch_count;
+
+#ifdef EKEY_USB_STREAM
+/* file descriptors the USB transports need polled */
+static struct pollfd batch_usbfds[BATCH_MAX];
+static int batch_nusbfds;
+
+static void
+batch_usb_fd_add(int fd, short events, void *pw)
+{
+    batch_usbfds[batch_nusbfds].fd = fd;
+    batch_usbfds[batch_nusbfds].events = events;
+    batch_nusbfds++;
+}
+
+static void
+batch_usb_fd_rm(int fd, void *pw)
+{
+    int idx;
+
+    for (idx = 0; idx < batch_nusbfds; idx++) {
+        if (batch_usbfds[idx].fd == fd) {
+            batch_usbfds[idx] = batch_usbfds[--batch_nusbfds];
+            break;
+        }
+    }
+}
+#endif
+
+static void
+batch_fail(batch_dev_t *dev, const char *error)
+{
+    dev->state = BATCH_FAILED;
+    dev->error = error;
+    dev->t_done = monotonic_ms();
+}
+
+/** Read a batch file.
+ *
+ * Each line gives a device path, its master key and optionally its serial
+ * number, separated by whitespace. Blank lines and lines starting with #
+ * are ignored.
+ *
+ * @return The number of devices read or -1 on error.
+ */
+static int
+read_batch(const char *fname)
+{
+    FILE *fh;
+    char line[512];
+    char path[256];
+    char mkeypem[64];
+    char snumpem[32];
+    int lineno = 0;
+    int res;
+    int idx;
+    batch_dev_t *dev;
+
+    fh = fopen(fname, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "Unable to open batch file %s (%s).\n",
+                fname, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fh) != NULL) {
+        lineno++;
+
+        res = sscanf(line, " %255s %63s %31s", path, mkeypem, snumpem);
+        if ((res < 1) || (path[0] == '#'))
+            continue;
+
+        if (res < 2) {
+            fprintf(stderr, "%s:%d: A master key must be given.\n",
+                    fname, lineno);
+            goto error;
+        }
+
+        if (batch_count == BATCH_MAX) {
+            fprintf(stderr, "%s:%d: Too many devices, at most %d.\n",
+                    fname, lineno, BATCH_MAX);
+            goto error;
+        }
+
+        /* two rekeys of one device would race each other */
+        for (idx = 0; idx < batch_count; idx++) {
+            if (strcmp(batch[idx].path, path) == 0) {
+                fprintf(stderr, "%s:%d: Device %s is already listed.\n",
+                        fname, lineno, path);
+                goto error;
+            }
+        }
+
+        dev = &batch[batch_count];
+        memset(dev, 0, sizeof(*dev));
+
+        dev->mkey = extract_master_key(mkeypem, strlen(mkeypem));
+        if (dev->mkey == NULL) {
+            fprintf(stderr, "%s:%d: Unusable master key.\n", fname, lineno);
+            goto error;
+        }
+
+        dev->snum = malloc(12);
+        if (dev->snum == NULL) {
+            perror("malloc");
+            goto error;
+        }
+        if (res == 3) {
+            if (pem64_decode_bytes(snumpem, 16, dev->snum) != 12) {
+                fprintf(stderr, "%s:%d: The serial number given is not the correct length.\n",
+                        fname, lineno);
+                goto error;
+            }
+            dev->snum_given = true;
+        }
+
+        dev->path = strdup(path);
+        if (dev->path == NULL) {
+            perror("strdup");
+            goto error;
+        }
+        batch_count++;
+    }
+
+    fclose(fh);
+    return batch_count;
+
+error:
+    /* the device being read when the error was found is not counted */
+    if (batch_count < BATCH_MAX)
+        batch_count++;
+    for (idx = 0; idx < batch_count; idx++) {
+        free(batch[idx].path);
+        free(batch[idx].mkey);
+        free(batch[idx].snum);
+    }
+    memset(batch, 0, sizeof(batch));
+    batch_count = 0;
+    fclose(fh);
+    return -1;
+}
+
+/** Reset a device and start waiting for its serial number. */
+static void
+batch_reset(batch_dev_t *dev)
+{
+    estream_write(dev->key_stream, reset, 1);
+    epkt_setsessionkey(dev->epkt, NULL, default_session_key);
+}
+
+/** Open a device and start its rekey. */
+static void
+batch_start(batch_dev_t *dev)
+{
+    int flags;
+
+    dev->t_start = monotonic_ms();
+    dev->retries = REKEY_RETRIES;
+
+    dev->key_stream = estream_open(dev->path);
+    if (dev->key_stream == NULL) {
+        batch_fail(dev, strerror(errno));
+        return;
+    }
+
+    /* every device shares one poll loop so none may block */
+    flags = fcntl(dev->key_stream->fd, F_GETFL);
+    if (flags != -1)
+        fcntl(dev->key_stream->fd, F_SETFL, flags | O_NONBLOCK);
+
+    dev->epkt = epkt_open(eframe_open(dev->key_stream));
+
+    dev->state = BATCH_SNUM;
+    batch_reset(dev);
+}
+
+/** Advance a device's rekey with a packet it sent. */
+static void
+batch_packet(batch_dev_t *dev, uint8_t *data, int len)
+{
+    switch (dev->state) {
+    case BATCH_SNUM:
+        if (dev->epkt->pkt_type != PKTTYPE_SNUM) {
+            if (--dev->retries == 0) {
+                batch_fail(dev, "Timeout obtaining serial number from key");
+                return;
+            }
+            batch_reset(dev);
+            return;
+        }
+
+        if (len != 12) {
+            batch_fail(dev, "Bad serial number from key");
+            return;
+        }
+
+        if (dev->snum_given) {
+            if (memcmp(dev->snum, data, 12) != 0) {
+                batch_fail(dev, "Serial number did not match the one specified");
+                return;
+            }
+        } else {
+            memcpy(dev->snum, data, 12);
+        }
+
+        dev->t_snum = monotonic_ms();
+
+        epkt_setsessionkey(dev->epkt, dev->snum, default_session_key);
+        if (fill_nonce(dev->nonce, 12) != true) {
+            batch_fail(dev, "Unable to generate nonce");
+            return;
+        }
+        send_nonce_mac(dev->key_stream, dev->snum, dev->mkey, dev->nonce);
+
+        dev->state = BATCH_MACACK;
+        dev->retries = REKEY_RETRIES;
+        break;
+
+    case BATCH_MACACK:
+        if (dev->epkt->pkt_type != PKTTYPE_LTREKEYMAC) {
+            if (--dev->retries == 0)
+                batch_fail(dev, "Timeout obtaining MAC acknowledgement packet");
+            return;
+        }
+
+        dev->t_mac = monotonic_ms();
+        send_rekey_nonce(dev->key_stream, dev->nonce);
+        dev->state = BATCH_REKEY;
+        break;
+
+    case BATCH_REKEY:
+        if (dev->epkt->pkt_type != PKTTYPE_LTREKEY)
+            return;
+
+        derive_ltkey(dev->snum, dev->mkey, data, dev->nonce, dev->session_key);
+        dev->state = BATCH_DONE;
+        dev->t_done = monotonic_ms();
+        break;
+
+    default:
+        break;
+    }
+}
+
+/** Process everything a device has sent. */
+static void
+batch_read(batch_dev_t *dev)
+{
+    uint8_t data[128];
+    int res;
+
+    while ((dev->state != BATCH_DONE) && (dev->state != BATCH_FAILED)) {
+        res = epkt_read(dev->epkt, data, 128);
+        if (res > 0) {
+            batch_packet(dev, data, res);
+            continue;
+        }
+
+        if (res == 0) {
+            batch_fail(dev, "Device closed");
+        } else if (errno == EPROTO) {
+            if (dev->state == BATCH_REKEY)
+                batch_fail(dev, "Provided master key does not match the device's");
+            /* otherwise a corrupt packet, wait for the next one */
+            continue;
+        } else if ((errno != EWOULDBLOCK) && (errno != EAGAIN)) {
+            batch_fail(dev, strerror(errno));
+        }
+        break;
+    }
+}
+
+/** Rekey every device in the batch concurrently.
+ *
+ * @param timeout Seconds allowed for each device.
+ */
+static void
+batch_run(int timeout)
+{
+    struct pollfd fds[BATCH_MAX + BATCH_MAX];
+    batch_dev_t *owner[BATCH_MAX];
+    uint64_t deadline;
+    uint64_t now;
+    int poll_timeout;
+    int nfds;
+    int active;
+    int idx;
+
+#ifdef EKEY_USB_STREAM
+    estream_usb_set_poll(batch_usb_fd_add, batch_usb_fd_rm, NULL);
+#endif
+
+    for (idx = 0; idx < batch_count; idx++)
+        batch_start(&batch[idx]);
+
+    deadline = monotonic_ms() + (timeout * 1000);
+
+    for (;;) {
+        nfds = 0;
+        active = 0;
+        for (idx = 0; idx < batch_count; idx++) {
+            if ((batch[idx].state == BATCH_DONE) ||
+                (batch[idx].state == BATCH_FAILED))
+                continue;
+            active++;
+            fds[nfds].fd = batch[idx].key_stream->fd;
+            fds[nfds].events = POLLIN;
+            owner[nfds++] = &batch[idx];
+        }
+
+        if (active == 0)
+            break;
+
+        now = monotonic_ms();
+        if (now >= deadline) {
+            for (idx = 0; idx < nfds; idx++)
+                batch_fail(owner[idx], "Timeout");
+            break;
+        }
+        poll_timeout = deadline - now;
+
+#ifdef EKEY_USB_STREAM
+        memcpy(fds + nfds, batch_usbfds, batch_nusbfds * sizeof(*fds));
+        if ((estream_usb_timeout() >= 0) &&
+            (estream_usb_timeout() < poll_timeout))
+            poll_timeout = estream_usb_timeout();
+
+        if (poll(fds, nfds + batch_nusbfds, poll_timeout) < 0) {
+#else
+        if (poll(fds, nfds, poll_timeout) < 0) {
+#endif
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+#ifdef EKEY_USB_STREAM
+        estream_usb_handle_events();
+#endif
+
+        for (idx = 0; idx < nfds; idx++) {
+            if (fds[idx].revents != 0)
+                batch_read(owner[idx]);
+        }
+    }
+
+    close_nonce();
+}
+
+/** Report the outcome of each device and commit the new keys.
+ *
+ * @return The exit code.
+ */
+static int
+batch_finish(bool nokeyring, const char *keyring_filename)
+{
+    batch_dev_t *dev;
+    char snumpem[17];
+    int done = 0;
+    int idx;
+
+    for (idx = 0; idx < batch_count; idx++) {
+        dev = &batch[idx];
+
+        if (dev->state == BATCH_DONE) {
+            pem64_encode_bytes(dev->snum, 12, snumpem);
+            snumpem[16] = 0;
+            printf("%s %s OK serial %dms, mac %dms, rekey %dms, total %dms\n",
+                   dev->path, snumpem,
+                   (int)(dev->t_snum - dev->t_start),
+                   (int)(dev->t_mac - dev->t_snum),
+                   (int)(dev->t_done - dev->t_mac),
+                   (int)(dev->t_done - dev->t_start));
+            done++;
+
+            if (nokeyring == false) {
+                add_ltkey(dev->snum, dev->session_key);
+            } else {
+                /* just display new key */
+                output_key(stdout, dev->snum, dev->session_key);
+            }
+        } else {
+            printf("%s FAILED after %dms: %s\n", dev->path,
+                   (int)(dev->t_done - dev->t_start), dev->error);
+        }
+
+        epkt_close(dev->epkt); /* closes the framer too */
+        if (dev->key_stream != NULL)
+            estream_close(dev->key_stream);
+        free(dev->path);
+        free(dev->mkey);
+        free(dev->snum);
+    }
+
+    printf("%d of %d devices rekeyed\n", done, batch_count);
+
+    /* all the new keys are committed in one keyring write */
+    if ((nokeyring == false) && (done > 0)) {
+        if (put_keyring(keyring_filename) < 0)
+            return EXIT_CODE_WRITEKEYRING;
+    }
+
+    return (done == batch_count) ? 0 : EXIT_CODE_EKEYERR;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -197,16 +692,16 @@ main(int argc, char **argv)
     int res;
     uint8_t data[128];
     uint8_t nonce[12];
-    uint8_t *mac;
-    EKeySkein rekeying_state;
     uint8_t session_key[32];
     int retries;
     char *keyring_filename;
     bool nokeyring = false;
+    char *batch_filename = NULL;
+    int batch_timeout = BATCH_TIMEOUT;
 
     keyring_filename = strdup(KEYRINGFILE);
 
-    while ((opt = getopt(argc, argv, "vhnf:s:m:")) != -1) {
+    while ((opt = getopt(argc, argv, "vhnf:s:m:b:t:")) != -1) {
         switch (opt) {
         case 's': /* set serial number */
             snum = malloc(12);
@@ -232,21 +727,45 @@ main(int argc, char **argv)
             nokeyring = true;
             break;
 
+        case 'b': /* batch of devices */
+            batch_filename = optarg;
+            break;
+
+        case 't': /* batch timeout */
+            batch_timeout = atoi(optarg);
+            if (batch_timeout < 1) {
+                fprintf(stderr, "The timeout must be at least one second.\n");
+                return EXIT_CODE_CMDLINE;
+            }
+            break;
+
         case 'v': /* print version number */
             printf("%s: Version 1.1\n", argv[0]);
             return 0;
 
         case 'h':
         default:
-            fprintf(stderr, usage, argv[0]);
+            fprintf(stderr, usage, argv[0], argv[0]);
             return EXIT_CODE_CMDLINE;
         }
     }
 
+    if (batch_filename != NULL) {
+        if (read_batch(batch_filename) < 0)
+            return EXIT_CODE_CMDLINE;
+
+        if ((nokeyring == false) && (get_keyring(keyring_filename) < 0))
+            return EXIT_CODE_LOADKEYRING;
+
+        batch_run(batch_timeout);
+
+        return batch_finish(nokeyring, keyring_filename);
+    }
+
     if (optind >= argc) {
         if (snum == NULL) {
             fprintf(stderr, "A device path must be given.\n");
-            fprintf(stderr, usage, argv[0]);
+            fprintf(stderr, usage, argv[0], argv[0]);
             return EXIT_CODE_CMDLINE;
         } else {
             key_path = calloc(1, 17 + strlen(DEVEKEY));
@@ -319,7 +838,7 @@ main(int argc, char **argv)
     epkt_setsessionkey(epkt, NULL, default_session_key);
 
     /* wait for serial packet */
-    retries = 20;
+    retries = REKEY_RETRIES;
     do {
         res = epkt_read(epkt, data, 128);
         if (res <= 0) {
@@ -375,13 +894,10 @@ main(int argc, char **argv)
     close_nonce();
 
     /* send nonce MAC */
-    mac = calc_mac(snum, mkey, nonce, 12);
-    data[0] = 'M';
-    pem64_encode_bytes(mac, 6, (char *)data + 1);
-    estream_write(key_stream, data, 9);
+    send_nonce_mac(key_stream, snum, mkey, nonce);
 
     /* wait for MAC ack packet */
-    retries = 20;
+    retries = REKEY_RETRIES;
     do {
         res = epkt_read(epkt, data, 128);
         if (res <= 0) {
@@ -403,10 +919,7 @@ main(int argc, char **argv)
         return 3;
     }
 
-    data[0] = 'L';
-    data[17] = '.';
-    pem64_encode_bytes(nonce, 12, (char *)data + 1);
-    estream_write(key_stream, data, 18);
+    send_rekey_nonce(key_stream, nonce);
 
     /* wait for rekey ack packet */
     do {
@@ -426,11 +939,7 @@ main(int argc, char **argv)
     } while (epkt->pkt_type != PKTTYPE_LTREKEY);
 
     /* calculate new longterm key */
-    PrepareSkein(&rekeying_state, snum, &(mkey[0]), EKEY_SKEIN_PERSONALISATION_LRS);
-    Skein_256_Update(&rekeying_state, &(data[0]), 32);
-    Skein_256_Update(&rekeying_state, nonce, 12);
-
-    Skein_256_Final(&rekeying_state, session_key);
+    derive_ltkey(snum, mkey, data, nonce, session_key);
 
     if (nokeyring == false) {
         add_ltkey(snum, session_key);
@@ -2,17 +2,19 @@
  *
  * Entropy key userspace USB peuso CDC serial server.
  *
- * Copyright 2009 Simtec Electronics
+ * Copyright 2009-2011 Simtec Electronics
  *
  * For licence terms refer to the COPYING file.
  */
 
 #include <stdio.h>
 #include <stdbool.h>
-#include <usb.h>
-#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <signal.h>
@@ -21,6 +23,7 @@
 #include <syslog.h>
 
 #include "daemonise.h"
+#include "usbtrans.h"
 
 /*  POSIX.1g requires <sys/un.h> to define a SUN_LEN macro for determining the
  *  length of sockaddr_un. Of course its not available everywhere. This is the
@@ -30,297 +33,524 @@
 #define SUN_LEN(su) (sizeof(*(su)) - sizeof((su)->sun_path) + strlen((su)->sun_path))
 #endif
 
+/** Maximum number of keys served by one process. */
+#define ULUSBD_MAX_KEYS 16
+
+/** Maximum number of file descriptors the USB transport may need polled. */
+#define ULUSBD_MAX_TRANSFD 32
+
+/** Data buffered for a client which is not reading fast enough. */
+#define ULUSBD_CLIENT_BUFFER (64 * 1024)
+
+/** State of one Entropy Key served by the daemon. */
+typedef struct {
+    char *busmatch; /**< Bus the key is on. */
+    char *devmatch; /**< Device number of the key. */
+    char *devpath; /**< Path of the UNIX domain socket. */
+    usbtrans_dev_t *usb; /**< USB transport handle. */
+    int accept_fd; /**< Listening socket. */
+    int client_fd; /**< Connected client or -1. */
+    bool gone; /**< The USB device has failed. */
+    bool paused; /**< Reading is paused until the client catches up. */
+    uint8_t outbuf[ULUSBD_CLIENT_BUFFER]; /**< Data waiting for the client. */
+    size_t outhead; /**< Offset of the first waiting byte in outbuf. */
+    size_t outlen; /**< Number of bytes waiting in outbuf. */
+    uint8_t tousb[USBTRANS_TX_SIZE]; /**< Data waiting for the device. */
+    size_t tousb_len; /**< Number of bytes waiting in tousb. */
+    uint64_t client_bytes; /**< Bytes written to clients. */
+} ulusbd_key_t;
+
 static char namebuffer[1024];
-static struct usb_dev_handle *devh;
-static int uds_accept_fd = -1;
-static int uds_client_fd = -1;
-static char *devpath = NULL;
+static ulusbd_key_t *keys[ULUSBD_MAX_KEYS];
+static int nkeys = 0;
+static int live_keys = 0;
+static const usbtrans_ops_t *trans = &usbtrans_libusb;
+static struct pollfd trans_fds[ULUSBD_MAX_TRANSFD];
+static int ntrans_fds = 0;
 static bool daemonise = false;
 static char *pidfilename = NULL;
-
-#define EKEY_IFACE 1
-#define EKEY_EP_TOHOST 1
-#define EKEY_EP_TODEVICE 3
+static volatile sig_atomic_t report_stats = 0;
 
 static void
 usage(FILE *stream, char *argv0)
 {
     fprintf(stream,
             "Usage: %s -b<bus> -d<device> -p<socketpath>, [-Ppidfilename] [-D]\n" \
+            "       %s -k<bus>/<device>:<socketpath> [-k...] [-Ppidfilename] [-D] [-F]\n" \
             "\n"                                                  \
             "Options:\n"                                          \
+            "\t-k\tServe a key, may be given several times\n"     \
+            "\t-F\tUse simulated keys instead of USB hardware\n"  \
             "\t-D\tDaemonise (fork into background)\n"            \
             "\t-v\tDisplay version and exit\n"                    \
             "\t-h\tDisplay this information and exit\n"           \
-            , argv0);
+            , argv0, argv0);
 }
 
-static bool
-find_usb_device(char *busmatch, char *devmatch)
+/** Report a message to syslog or the terminal as appropriate. */
+static void
+report(int priority, const char *fmt, ...)
 {
-    struct usb_bus *bus;
-    struct usb_device *dev, *devfound = NULL;
-    int r;
-
-    usb_init();
-    usb_find_busses();
-    usb_find_devices();
+    va_list ap;
 
-    for (bus = usb_get_busses(); bus != NULL; bus = bus->next) {
-        if (strcmp(bus->dirname, busmatch) != 0)
-            continue;
+    va_start(ap, fmt);
+    if (daemonise) {
+        vsyslog(priority, fmt, ap);
+    } else {
+        vfprintf((priority <= LOG_WARNING) ? stderr : stdout, fmt, ap);
+        fputc('\n', (priority <= LOG_WARNING) ? stderr : stdout);
+    }
+    va_end(ap);
+}
 
-        for (dev = bus->devices; dev != NULL; dev = dev->next) {
-            if (strcmp(dev->filename, devmatch) != 0)
-                continue;
+static void
+trans_fdadd(int fd, short events, void *pw)
+{
+    if (ntrans_fds == ULUSBD_MAX_TRANSFD) {
+        report(LOG_ERR, "Too many USB transport file descriptors");
+        return;
+    }
+    trans_fds[ntrans_fds].fd = fd;
+    trans_fds[ntrans_fds].events = events;
+    ntrans_fds++;
+}
 
-            if (dev->descriptor.idVendor != 0x20df ||
-                dev->descriptor.idProduct != 0x0001) {
+static void
+trans_fdrm(int fd, void *pw)
+{
+    int idx;
 
-                /* Found the device, but it's not an Entropy Key */
-                fprintf(stderr, 
-                        "Device at %s/%s is not an Entropy Key\n", 
-                        busmatch, devmatch);
-                return false;
-            }
-            devfound = dev;
+    for (idx = 0; idx < ntrans_fds; idx++) {
+        if (trans_fds[idx].fd == fd) {
+            trans_fds[idx] = trans_fds[--ntrans_fds];
+            break;
         }
     }
-    if (devfound == NULL) {
-        fprintf(stderr, "Unable to find device at %s/%s\n", busmatch, devmatch);
-        return false;
+}
+
+/** Stop reading the device while the client buffer could not hold what is
+ * still in flight, and start again once the client has caught up.
+ */
+static void
+key_flow(ulusbd_key_t *key)
+{
+    bool full = (ULUSBD_CLIENT_BUFFER - key->outlen) < USBTRANS_RX_INFLIGHT;
+
+    if ((key->usb != NULL) && !key->gone && (full != key->paused)) {
+        trans->pause(key->usb, full);
+        key->paused = full;
     }
+}
 
-    devh = usb_open(devfound);
-    if (devh == NULL) {
-        fprintf(stderr, 
-                "Unable to open Entropy Key at %s/%s\n", busmatch, devmatch);
-        return false;
+static void
+close_client(ulusbd_key_t *key)
+{
+    if (key->client_fd == -1)
+        return;
+
+    if (!daemonise)
+        printf("Client gone away from %d\n", key->client_fd);
+
+    close(key->client_fd);
+    key->client_fd = -1;
+    key->outhead = 0;
+    key->outlen = 0;
+    key->tousb_len = 0;
+
+    key_flow(key);
+}
+
+/** Write as much buffered data to the client as it will take. */
+static void
+flush_client(ulusbd_key_t *key)
+{
+    size_t chunk;
+    ssize_t r;
+
+    while ((key->client_fd != -1) && (key->outlen > 0)) {
+        chunk = ULUSBD_CLIENT_BUFFER - key->outhead;
+        if (chunk > key->outlen)
+            chunk = key->outlen;
+
+        r = write(key->client_fd, key->outbuf + key->outhead, chunk);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break; /* client is full, wait for POLLOUT */
+            close_client(key);
+            return;
+        }
+
+        key->client_bytes += r;
+        key->outhead = (key->outhead + r) % ULUSBD_CLIENT_BUFFER;
+        key->outlen -= r;
     }
 
-#if LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
-    if ((r = usb_detach_kernel_driver_np(devh, EKEY_IFACE)) != 0) {
-        if (r != -ENODATA) {
-            fprintf(stderr, 
-                    "Unable to detach Entropy Key at %s/%s from kernel\n", 
-                    busmatch, devmatch);
-            usb_close(devh);
-            return false;
+    if (key->outlen == 0)
+        key->outhead = 0;
+
+    key_flow(key);
+}
+
+/** Pass data written by the client on to the device. */
+static void
+flush_usb(ulusbd_key_t *key)
+{
+    ssize_t r;
+
+    if ((key->tousb_len == 0) || key->gone)
+        return;
+
+    r = trans->write(key->usb, key->tousb, key->tousb_len);
+    if (r < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            report(LOG_ERR, "USB device at %s/%s has vanished during write",
+                   key->busmatch, key->devmatch);
+            key->gone = true;
         }
+        return;
     }
-#endif
 
-    if ((r = usb_claim_interface(devh, EKEY_IFACE)) != 0) {
-        fprintf(stderr, 
-                "Unable to claim Entropy Key interface at %s/%s\n", 
-                busmatch, devmatch);
-        usb_close(devh);
-        return false;
+    key->tousb_len -= r;
+    if (key->tousb_len > 0)
+        memmove(key->tousb, key->tousb + r, key->tousb_len);
+}
+
+/* Data read from the Entropy Key is queued for the client */
+static void
+key_rx(usbtrans_dev_t *dev, const uint8_t *buf, size_t len, void *pw)
+{
+    ulusbd_key_t *key = pw;
+    size_t tail;
+    size_t chunk;
+
+    if (key->client_fd == -1)
+        return; /* nobody listening, discard */
+
+    while (len > 0) {
+        tail = (key->outhead + key->outlen) % ULUSBD_CLIENT_BUFFER;
+        chunk = ULUSBD_CLIENT_BUFFER - tail;
+        if (chunk > len)
+            chunk = len;
+        memcpy(key->outbuf + tail, buf, chunk);
+        key->outlen += chunk;
+        buf += chunk;
+        len -= chunk;
     }
 
-    /* Opened, and interface claimed, we found it, return true */
-    return true;
+    flush_client(key);
+}
+
+static void
+key_gone(usbtrans_dev_t *dev, int error, void *pw)
+{
+    ulusbd_key_t *key = pw;
+
+    report(LOG_ERR, "USB device at %s/%s vanished during read? Errno=%d (%s)",
+           key->busmatch, key->devmatch, error, strerror(error));
+    key->gone = true;
 }
 
 static bool
-prepare_uds(void)
+prepare_uds(ulusbd_key_t *key)
 {
     struct sockaddr_un sa;
-    size_t namelen = strlen(devpath) + 1;
-    unlink(devpath);
+    size_t namelen = strlen(key->devpath) + 1;
+    unlink(key->devpath);
 
-    uds_accept_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (uds_accept_fd == -1) {
+    key->accept_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (key->accept_fd == -1) {
         perror("socket");
         return false;
     }
 
     sa.sun_family = AF_UNIX;
     if (namelen > sizeof(sa.sun_path)) {
-        fprintf(stderr, "Device name (%s) too long (%u, max. %u)\n", devpath,
+        fprintf(stderr, "Device name (%s) too long (%u, max. %u)\n", key->devpath,
                 (unsigned int)namelen, (unsigned int)sizeof(sa.sun_path));
         /* same return code as config/cmdline syntax error */
         exit(1);
     }
     /* this is effectively a strcpy, but strcpy produces warnings on BSD */
-    memcpy(sa.sun_path, devpath, namelen);
+    memcpy(sa.sun_path, key->devpath, namelen);
 
 #ifdef BSD44SOCKETS
-    sa.sun_len = strlen(devpath)
+    sa.sun_len = strlen(key->devpath)
 #if defined(EKEY_OS_OPENBSD) || defined(EKEY_OS_MIRBSD)
                  + 1
 #endif
                  ;
 #endif
 
-    if (bind(uds_accept_fd, (struct sockaddr *)&sa, SUN_LEN(&sa)) == -1) {
+    if (bind(key->accept_fd, (struct sockaddr *)&sa, SUN_LEN(&sa)) == -1) {
         perror("bind");
-        close(uds_accept_fd);
+        close(key->accept_fd);
+        key->accept_fd = -1;
         return false;
     }
 
-    if (listen(uds_accept_fd, 5) == -1) {
+    if (listen(key->accept_fd, 5) == -1) {
         perror("listen");
-        close(uds_accept_fd);
+        close(key->accept_fd);
+        key->accept_fd = -1;
         return false;
     }
 
     return true;
 }
 
-/* Reader thread reads from Entropy Key and writes to uds */
-static void *
-reader_thread_func(void *arg)
+static void
+close_key(ulusbd_key_t *key)
 {
-    static char buffer[1024];
-    char *bptr;
-    int r, r2;
-    int fd = (int)((intptr_t)arg);
-    int saved_errno;
-
-    /* Drain input buffer */
-    while (usb_bulk_read(devh, EKEY_EP_TOHOST, buffer, 1024, 500) > 0);
-
-    do {
-        if ((r = usb_bulk_read(devh, EKEY_EP_TOHOST, buffer, 1024, 0)) < 1) {
-	    saved_errno = errno;
-            switch (saved_errno) {
-            case EAGAIN:
-                /* Apparently we can get EAGAIN from a still-connected device
-                 * which we chose to read from without a timeout.
-                 */
-                continue;
+    close_client(key);
+    if (key->accept_fd != -1) {
+        close(key->accept_fd);
+        key->accept_fd = -1;
+        unlink(key->devpath);
+    }
+    if (key->usb != NULL) {
+        trans->close(key->usb);
+        key->usb = NULL;
+        live_keys--;
+    }
+}
 
-            default:
-                /* Anything else, log and exit. */
-                if (daemonise) {
-                    syslog(LOG_ERR, "USB device vanished during read?");
-                    syslog(LOG_ERR, "ret=%d Errno=%d (%s)", r, saved_errno, strerror(saved_errno));
-                } else {
-                    fprintf(stderr, "USB device has vanished?\n");
-                    fprintf(stderr, "ret=%d Errno=%d (%s)\n", r, saved_errno, strerror(saved_errno));
-                }
-                close(fd);
-                return NULL;
-            }
-        }
-        bptr = buffer;
-        if (!daemonise) {
-            printf("<<< %.*s", r, buffer);
-        }
+static bool
+add_key(char *busmatch, char *devmatch, char *devpath)
+{
+    ulusbd_key_t *key;
 
-        while ((uds_client_fd != -1) && (r > 0)) {
-            r2 = write(uds_client_fd, bptr, r);
-            if (r2 < 1) {
-                if (!daemonise) {
-                    fprintf(stderr, 
-                            "No longer able to write to client on %d\n", 
-                            uds_client_fd);
-                    break;
-                }
-            } else {
-                /* Client ate some bytes */
-                bptr += r2;
-                r -= r2;
-            }
-        }
-    } while(1);
+    if (nkeys == ULUSBD_MAX_KEYS) {
+        fprintf(stderr, "Too many keys, maximum is %d\n", ULUSBD_MAX_KEYS);
+        return false;
+    }
 
-    return NULL;
+    key = calloc(1, sizeof(*key));
+    if (key == NULL) {
+        perror("calloc");
+        return false;
+    }
+
+    key->busmatch = busmatch;
+    key->devmatch = devmatch;
+    key->devpath = devpath;
+    key->accept_fd = -1;
+    key->client_fd = -1;
+    keys[nkeys++] = key;
+
+    return true;
 }
 
-static pthread_t
-start_reader(int fd)
+/* Parse a key specification of the form bus/device:socketpath */
+static bool
+add_key_spec(char *spec)
 {
-    pthread_t blah;
-    pthread_create(&blah, NULL, reader_thread_func, (void *)(intptr_t)fd);
-    return blah;
+    char *slash;
+    char *colon;
+
+    spec = strdup(spec);
+    if (spec == NULL)
+        return false;
+
+    slash = strchr(spec, '/');
+    if (slash == NULL) {
+        free(spec);
+        return false;
+    }
+
+    colon = strchr(slash + 1, ':');
+    if (colon == NULL) {
+        free(spec);
+        return false;
+    }
+
+    *slash = 0;
+    *colon = 0;
+
+    if (add_key(spec, slash + 1, colon + 1) == false) {
+        free(spec);
+        return false;
+    }
+
+    return true;
+}
+
+static void
+report_key_stats(void)
+{
+    const usbtrans_stats_t *stats;
+    int idx;
+
+    for (idx = 0; idx < nkeys; idx++) {
+        if (keys[idx]->usb == NULL)
+            continue;
+        stats = trans->stats(keys[idx]->usb);
+        report(LOG_INFO, "%s: usb_rx=%llu/%llu usb_tx=%llu/%llu tx_busy=%llu "
+               "client=%llu%s",
+               keys[idx]->devpath,
+               (unsigned long long)stats->rx_bytes,
+               (unsigned long long)stats->rx_transfers,
+               (unsigned long long)stats->tx_bytes,
+               (unsigned long long)stats->tx_transfers,
+               (unsigned long long)stats->tx_busy,
+               (unsigned long long)keys[idx]->client_bytes,
+               keys[idx]->paused ? " paused" : "");
+    }
+}
+
+static void
+request_stats(int sig)
+{
+    report_stats = 1;
 }
 
 static void
 unlinksock(void)
 {
-    unlink(devpath);
-    unlink(pidfilename);
+    int idx;
+
+    for (idx = 0; idx < nkeys; idx++)
+        unlink(keys[idx]->devpath);
+    if (pidfilename != NULL)
+        unlink(pidfilename);
 }
 
 static void
-poll_loop(int readerpipe)
+handle_accept(ulusbd_key_t *key, short revents)
 {
-    static char buffer[1024];
-    int r;
-    struct pollfd pfd[3];
     int tempclient;
 
-    pfd[0].fd = uds_accept_fd;
-    pfd[1].fd = readerpipe;
-    pfd[0].events = POLLIN | POLLERR;
-    pfd[1].events = POLLIN | POLLERR;
-    /* pfd[2]'s FD will be whatever we accept as uds_client_fd later */
-    pfd[2].events = POLLIN | POLLERR;
-    pfd[2].revents = 0;
-
-    while (poll(pfd, uds_client_fd == -1 ? 2 : 3, -1) >= 0) {
-        if (pfd[0].revents & POLLERR) {
-            if (daemonise) {
-                syslog(LOG_ERR, "Error on UNIX domain socket");
-            } else {
-                fprintf(stderr, "Error on UNIX domain socket\n");
-            }
-            break;
+    if (revents & POLLERR) {
+        report(LOG_ERR, "Error on UNIX domain socket %s", key->devpath);
+        key->gone = true;
+        return;
+    }
+
+    tempclient = accept(key->accept_fd, NULL, 0);
+    if (tempclient == -1)
+        return;
+
+    if (key->client_fd != -1) {
+        close(tempclient);
+        return;
+    }
+
+    fcntl(tempclient, F_SETFL, fcntl(tempclient, F_GETFL) | O_NONBLOCK);
+    key->client_fd = tempclient;
+    if (!daemonise)
+        printf("New client on %d\n", key->client_fd);
+}
+
+static void
+handle_client(ulusbd_key_t *key, short revents)
+{
+    ssize_t r;
+
+    if (revents & POLLOUT)
+        flush_client(key);
+
+    if ((key->client_fd != -1) && (revents & POLLIN)) {
+        r = read(key->client_fd, key->tousb, sizeof(key->tousb));
+        if (r < 1) {
+            if ((r < 0) &&
+                ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+                return;
+            /* Client vanished? */
+            close_client(key);
+            return;
         }
-        if (pfd[1].revents) {
-            if (daemonise) {
-                syslog(LOG_ERR, "Events on pipe to reader thread");
-            } else {
-                fprintf(stderr, "Events on pipe to reader thread\n");
+        key->tousb_len = r;
+        flush_usb(key);
+    } else if ((key->client_fd != -1) && (revents & (POLLERR | POLLHUP))) {
+        close_client(key);
+    }
+}
+
+static void
+poll_loop(void)
+{
+    struct pollfd pfd[(ULUSBD_MAX_KEYS * 2) + ULUSBD_MAX_TRANSFD];
+    ulusbd_key_t *owner[ULUSBD_MAX_KEYS * 2];
+    bool is_client[ULUSBD_MAX_KEYS * 2];
+    ulusbd_key_t *key;
+    int nfds;
+    int nkeyfds;
+    int timeout;
+    int rdy;
+    int idx;
+    bool trans_ready;
+
+    while (live_keys > 0) {
+        nfds = 0;
+        for (idx = 0; idx < nkeys; idx++) {
+            key = keys[idx];
+            if (key->usb == NULL)
+                continue;
+
+            pfd[nfds].fd = key->accept_fd;
+            pfd[nfds].events = POLLIN | POLLERR;
+            owner[nfds] = key;
+            is_client[nfds++] = false;
+
+            if (key->client_fd != -1) {
+                pfd[nfds].fd = key->client_fd;
+                /* stop reading the client while the device is busy */
+                pfd[nfds].events = (key->tousb_len == 0) ? POLLIN : 0;
+                if (key->outlen > 0)
+                    pfd[nfds].events |= POLLOUT;
+                owner[nfds] = key;
+                is_client[nfds++] = true;
             }
-            break;
         }
+        nkeyfds = nfds;
 
-        if (pfd[0].revents & POLLIN) {
-            tempclient = accept(uds_accept_fd, NULL, 0);
-            if (uds_client_fd == -1) {
-                uds_client_fd = tempclient;
-                if (!daemonise) {
-                    printf("New client on %d\n", uds_client_fd);
-                }
-                pfd[2].fd = uds_client_fd;
-                pfd[2].revents = 0;
-            } else {
-                close(tempclient);
-            }
+        memcpy(pfd + nfds, trans_fds, ntrans_fds * sizeof(struct pollfd));
+        nfds += ntrans_fds;
+
+        timeout = trans->timeout();
+
+        rdy = poll(pfd, nfds, timeout);
+        if (rdy < 0) {
+            if (errno != EINTR)
+                break;
+            rdy = 0;
         }
 
-        if (uds_client_fd != -1 && pfd[2].revents & POLLERR) {
-            if (!daemonise) {
-                printf("Client gone away from %d\n", uds_client_fd);
-            }
-            close(uds_client_fd);
-            uds_client_fd = -1;
+        trans_ready = (timeout >= 0);
+        for (idx = nkeyfds; (idx < nfds) && !trans_ready; idx++) {
+            if (pfd[idx].revents != 0)
+                trans_ready = true;
         }
 
-        if (uds_client_fd != -1 && pfd[2].revents & POLLIN) {
-            r = read(uds_client_fd, buffer, 1024);
-            if (r < 1) {
-                /* Client vanished? */
-                if (!daemonise) {
-                    printf("Client on %d vanished?\n", uds_client_fd);
-                }
-                close(uds_client_fd);
-                uds_client_fd = -1;
+        if (trans_ready)
+            trans->handle_events();
+
+        for (idx = 0; idx < nkeyfds; idx++) {
+            if (pfd[idx].revents == 0)
+                continue;
+            key = owner[idx];
+            if (is_client[idx]) {
+                if (pfd[idx].fd == key->client_fd)
+                    handle_client(key, pfd[idx].revents);
             } else {
-                if (usb_bulk_write(devh, EKEY_EP_TODEVICE, buffer, r, 0) <= 0) {
-                    /* USB device went away while we were writing */
-                    if (daemonise) {
-                        syslog(LOG_ERR, "USB device has vanised during write. Exiting");
-                    } else {
-                        fprintf(stderr, "USB device has vanished?\n");
-                    }
-                    exit(6);
-                }
+                handle_accept(key, pfd[idx].revents);
             }
         }
+
+        for (idx = 0; idx < nkeys; idx++) {
+            key = keys[idx];
+            if (key->usb == NULL)
+                continue;
+            flush_usb(key);
+            if (key->gone)
+                close_key(key);
+        }
+
+        if (report_stats) {
+            report_stats = 0;
+            report_key_stats();
+        }
     }
 }
 
@@ -328,17 +558,16 @@ int
 main(int argc, char **argv)
 {
     int opt;
-    char *busmatch = NULL, *devmatch = NULL;
-    int readerpipe[2];
-    pthread_t readerthread;
+    int idx;
+    char *busmatch = NULL, *devmatch = NULL, *devpath = NULL;
 
-    while ((opt = getopt(argc, argv, "vhb:d:p:DP:")) != -1) {
+    while ((opt = getopt(argc, argv, "vhb:d:p:k:DFP:")) != -1) {
         switch(opt) {
         case 'v':
-            printf("Simtec Entropy Key, Userland USB Daemon. Version 1.1\n");
+            printf("Simtec Entropy Key, Userland USB Daemon. Version 1.2\n");
             return 0;
         case 'h':
-            printf("Simtec Entropy Key, Userland USB Daemon. Version 1.1\n");
+            printf("Simtec Entropy Key, Userland USB Daemon. Version 1.2\n");
             usage(stdout, argv[0]);
             return 0;
         case 'b':
@@ -350,9 +579,19 @@ main(int argc, char **argv)
         case 'p':
             devpath = optarg;
             break;
+        case 'k':
+            if (add_key_spec(optarg) == false) {
+                fprintf(stderr, "Bad key specification: %s\n", optarg);
+                usage(stderr, argv[0]);
+                return 1;
+            }
+            break;
         case 'D':
             daemonise = true;
             break;
+        case 'F':
+            trans = &usbtrans_fake;
+            break;
         case 'P':
             pidfilename = optarg;
             break;
@@ -363,7 +602,16 @@ main(int argc, char **argv)
         }
     }
 
-    if (busmatch == NULL || devmatch == NULL || devpath == NULL) {
+    if (busmatch != NULL || devmatch != NULL || devpath != NULL) {
+        if (busmatch == NULL || devmatch == NULL || devpath == NULL) {
+            fprintf(stderr, "Bus, device and socket path must all be provided.\n");
+            return 1;
+        }
+        if (add_key(busmatch, devmatch, devpath) == false)
+            return 1;
+    }
+
+    if (nkeys == 0) {
         fprintf(stderr, "Bus, device and socket path must all be provided.\n");
         return 1;
     }
@@ -372,63 +620,63 @@ main(int argc, char **argv)
         do_daemonise(pidfilename, true);
 
     if (daemonise) {
-        snprintf(namebuffer, 1024, "ekey-ulusbd(%s)", strrchr(devpath, '/') + 1);
+        if (nkeys == 1 && strrchr(keys[0]->devpath, '/') != NULL) {
+            snprintf(namebuffer, 1024, "ekey-ulusbd(%s)",
+                     strrchr(keys[0]->devpath, '/') + 1);
+        } else {
+            snprintf(namebuffer, 1024, "ekey-ulusbd");
+        }
         openlog(namebuffer, LOG_ODELAY | LOG_PID, LOG_DAEMON);
-    } else {
-        printf("Scanning for USB device %s/%s\n", busmatch, devmatch);
     }
 
-    if (find_usb_device(busmatch, devmatch) == false) {
-        if (daemonise) {
-            syslog(LOG_ERR, 
-                   "Unable to locate Simtec Entropy Key at %s/%s", 
-                   busmatch, devmatch);
-        } else {
-            fprintf(stderr, 
-                    "Error locating Simtec Entropy Key at %s/%s\n", 
-                    busmatch, devmatch);
-        }
+    if (trans->init(trans_fdadd, trans_fdrm, NULL) == false) {
+        report(LOG_ERR, "Unable to initialise %s USB transport: %s",
+               trans->name, strerror(errno));
         return 2;
     }
 
-    if (!daemonise) {
-        printf("Entropy Key at %s/%s opened and claimed\n", busmatch, devmatch);
-    }
+    atexit(unlinksock);
 
-    if (prepare_uds() == false) {
-        if (daemonise) {
-            syslog(LOG_ERR, 
-                   "Unable to prepare UNIX domain socket at %s", devpath);
-        } else {
-            fprintf(stderr, 
-                    "Unable to prepare UNIX domain socket at %s\n", devpath);
+    for (idx = 0; idx < nkeys; idx++) {
+        ulusbd_key_t *key = keys[idx];
+
+        if (!daemonise)
+            printf("Scanning for USB device %s/%s\n", key->busmatch, key->devmatch);
+
+        key->usb = trans->open(key->busmatch, key->devmatch, key_rx, key_gone, key);
+        if (key->usb == NULL) {
+            report(LOG_ERR, "Unable to locate Simtec Entropy Key at %s/%s: %s",
+                   key->busmatch, key->devmatch, strerror(errno));
+            return 2;
+        }
+        live_keys++;
+
+        if (!daemonise)
+            printf("Entropy Key at %s/%s opened and claimed\n",
+                   key->busmatch, key->devmatch);
+
+        if (prepare_uds(key) == false) {
+            report(LOG_ERR, "Unable to prepare UNIX domain socket at %s",
+                   key->devpath);
+            return 3;
         }
-        return 3;
     }
 
     signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, request_stats);
 
-    atexit(unlinksock);
+    report(LOG_INFO, "Polling");
 
-    if (pipe(readerpipe) < 0) {
-        perror("pipe");
-        return 8;
-    }
+    poll_loop();
 
-    readerthread = start_reader(readerpipe[1]);
-    if (daemonise) {
-        syslog(LOG_INFO, "Polling");
-    } else {
-        fprintf(stdout, "Polling\n");
-    }
-    poll_loop(readerpipe[0]);
-    if (daemonise) {
-        syslog(LOG_INFO, "Closing down");
-    } else {
-        fprintf(stdout, "Closing down\n");
-    }
-    pthread_kill(readerthread, 9);
-    pthread_join(readerthread, NULL);
+    report(LOG_INFO, "Closing down");
+
+    report_key_stats();
+
+    for (idx = 0; idx < nkeys; idx++)
+        close_key(keys[idx]);
+
+    trans->finalise();
 
     return 0;
 }
@@ -18,17 +18,31 @@
 #include <fcntl.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/wait.h>
 
 #include "nonce.h"
 #include "stream.h"
+#include "netstream.h"
 #include "krnlop.h"
+#include "filesink.h"
 #include "foldback.h"
 #include "connection.h"
 #include "fds.h"
+#include "keydb.h"
+#include "capture.h"
 #include "ekeyd.h"
+#include "handoff.h"
+#include "seed.h"
+#ifdef EKEY_IO_URING
+#include "uring.h"
+#endif
+#ifdef EKEY_USB_STREAM
+#include "usbstream.h"
+#endif
 
 #include "lstate.h"
 #include "daemonise.h"
+#include "util.h"
 
 #ifndef EKEYD_VERSION_S
 #error "tool verison not set"
@@ -41,9 +55,70 @@
 #define EKEYD_DEV_RANDOM "/dev/random"
 #endif
 
+/** Interval between checks of the output demand while the keys run, in ms. */
+#define FLOW_CHECK_MS 100
+
+/** Interval between checks of the output demand while the keys are paused. */
+#define FLOW_PAUSED_MS 1000
+
+/** Longest time the keys stay paused.  They are then run for one check
+ * interval so an output which never reports demand is not starved.
+ */
+#define FLOW_MAX_PAUSE_MS 60000
+
+/** Shortest and longest delay before reopening a key whose stream ended,
+ * the delay doubles while reopening fails or the key keeps closing.
+ */
+#define KEY_REOPEN_MIN_MS 1000
+#define KEY_REOPEN_MAX_MS 60000
+
+/** Default time a key may send nothing before the watchdog resets it. */
+#define KEY_STALL_MS 10000
+
 static bool lua_fd_ready = false;
+static volatile sig_atomic_t reload_requested = false;
 static estream_state_t *output_stream;
 
+/** Flow control of the keys by output demand. */
+static struct {
+    bool enabled; /**< Pause the keys while the output has no demand. */
+    bool paused; /**< The keys are paused. */
+    bool refreshing; /**< Running only because the pause was too long. */
+    bool kick; /**< Check the demand without waiting for the interval. */
+    bool watching; /**< The output fd is polled for renewed demand. */
+    uint64_t checked; /**< Time of the last demand check. */
+    uint64_t paused_at; /**< Time the keys were paused. */
+    econ_state_t **keys; /**< The attached keys. */
+    unsigned int nkeys; /**< Number of entries in keys. */
+} flow = { .enabled = true };
+
+/** Recovery of keys which close or stop sending. */
+static struct {
+    bool reopen; /**< Reopen keys whose stream ends. */
+    uint64_t stall_ms; /**< Time without a packet before a key is reset, 0 never. */
+} recovery = { .reopen = true, .stall_ms = KEY_STALL_MS };
+
+/** Upgrade of the running daemon to a newly installed binary. */
+static struct {
+    volatile sig_atomic_t requested; /**< Hand over at the next opportunity. */
+    char **argv; /**< The daemon's arguments, the new binary gets the same. */
+    int sock; /**< Handoff socket while taking over, else -1. */
+    bool took_over; /**< This daemon took over from another. */
+    unsigned int adopted; /**< Keys taken over with their sessions. */
+    uint64_t stopped_ms; /**< When the previous daemon stopped reading the keys, 0 once entropy flows again. */
+} upgrade = { .sock = -1 };
+
+/** Startup benchmark timings, in monotonic milliseconds. */
+static struct {
+    bool enabled; /**< Report the timings and exit on first entropy. */
+    bool done; /**< The first entropy has been credited. */
+    uint64_t start; /**< Daemon started. */
+    uint64_t lua; /**< Control state initialised. */
+    uint64_t config; /**< Configuration run, keys opened. */
+    uint64_t seeded; /**< Seed file credited, 0 if it was not. */
+    unsigned int seed_len; /**< Bytes credited from the seed file. */
+} startup;
+
 void
 lua_fd_activity(int fd, short events, void *pw)
 {
@@ -75,48 +150,488 @@ lstate_cb_nowritefd(int fd)
     ekeyfd_clear_events(fd, POLLOUT);
 }
 
+#ifdef EKEY_USB_STREAM
+static void
+usb_fd_activity(int fd, short events, void *pw)
+{
+    estream_usb_handle_events();
+}
+
+static void
+usb_fd_add(int fd, short events, void *pw)
+{
+    ekeyfd_add(fd, events, usb_fd_activity, NULL);
+}
+
+static void
+usb_fd_rm(int fd, void *pw)
+{
+    ekeyfd_rm(fd);
+}
+#endif
+
+/** Pause or resume reading from the keys to match the flow state.
+ *
+ * Only keys which are keyed and producing entropy are paused, a key still
+ * establishing its session carries on so it is ready when demand returns.
+ * A paused key stops sending once the buffers on its path fill, deferring
+ * its rekeys too.
+ */
+static void
+flow_apply(void)
+{
+    unsigned int idx;
+    int state;
+    int fd;
+
+    for (idx = 0; idx < flow.nkeys; idx++) {
+        if ((flow.keys[idx]->key_stream == NULL) ||
+            flow.keys[idx]->key_stream->connecting)
+            continue;
+        fd = econ_get_rd_fd(flow.keys[idx]);
+        state = econ_state(flow.keys[idx]);
+        if (flow.paused &&
+            ((state == ESTATE_KEYED) || (state == ESTATE_KEYED_FIRST)))
+            ekeyfd_clear_events(fd, POLLIN);
+        else
+            ekeyfd_set_events(fd, POLLIN);
+    }
+}
+
+static void
+flow_fd_activity(int fd, short events, void *pw)
+{
+    /* one shot, re-armed at the next timed check if demand has not
+     * actually returned so a persistently writable fd cannot spin
+     */
+    ekeyfd_rm(fd);
+    flow.watching = false;
+    flow.kick = true;
+}
+
+static void
+flow_pause(uint64_t now)
+{
+    if (!flow.refreshing)
+        syslog(LOG_INFO, "Output has no demand, pausing entropy keys");
+
+    flow.paused = true;
+    flow.paused_at = now;
+    flow_apply();
+
+    if ((output_stream->demand_events != 0) && !flow.watching) {
+        ekeyfd_add(output_stream->fd, output_stream->demand_events,
+                   flow_fd_activity, NULL);
+        flow.watching = true;
+    }
+}
+
+static void
+flow_resume(uint64_t now, bool demand)
+{
+    if (flow.watching) {
+        ekeyfd_rm(output_stream->fd);
+        flow.watching = false;
+    }
+
+    if (demand)
+        syslog(LOG_INFO, "Output demand returned, resuming entropy keys "
+               "after %us", (unsigned int)((now - flow.paused_at) / 1000));
+
+    flow.paused = false;
+    flow.refreshing = !demand;
+    flow_apply();
+}
+
+/** Check the output demand, pausing or resuming the keys as required.
+ *
+ * @return The poll timeout before the next check is due, -1 for none.
+ */
+static int
+flow_check(void)
+{
+    uint64_t now = monotonic_ms();
+    uint64_t interval;
+    unsigned int idx;
+    unsigned int active = 0;
+
+    for (idx = 0; idx < flow.nkeys; idx++) {
+        if (flow.keys[idx]->key_stream != NULL)
+            active++;
+    }
+
+    if (!flow.enabled || (active == 0) || (output_stream == NULL) ||
+        (output_stream->estream_demand == NULL)) {
+        if (flow.paused)
+            flow_resume(now, false);
+        flow.refreshing = false;
+        return -1;
+    }
+
+    interval = flow.paused ? FLOW_PAUSED_MS : FLOW_CHECK_MS;
+    if (!flow.kick && ((now - flow.checked) < interval))
+        return interval - (now - flow.checked);
+    flow.kick = false;
+    flow.checked = now;
+
+    if (flow.paused) {
+        if (estream_demand(output_stream, true)) {
+            flow_resume(now, true);
+        } else if ((now - flow.paused_at) >= FLOW_MAX_PAUSE_MS) {
+            flow_resume(now, false);
+        } else {
+            /* pause any key which has finished keying since */
+            flow_apply();
+            if ((output_stream->demand_events != 0) && !flow.watching) {
+                ekeyfd_add(output_stream->fd, output_stream->demand_events,
+                           flow_fd_activity, NULL);
+                flow.watching = true;
+            }
+        }
+    } else if (!estream_demand(output_stream, false)) {
+        flow_pause(now);
+    } else if (flow.refreshing) {
+        syslog(LOG_INFO, "Output demand returned, resuming entropy keys");
+        flow.refreshing = false;
+    }
+
+    return flow.paused ? FLOW_PAUSED_MS : FLOW_CHECK_MS;
+}
+
+/* exported interface documented in ekeyd.h */
+void
+set_flow_control(bool enable)
+{
+    flow.enabled = enable;
+    flow.kick = true;
+}
+
+/* exported interface documented in ekeyd.h */
+void
+set_key_recovery(bool reopen, int stall_secs)
+{
+    recovery.reopen = reopen;
+    if (stall_secs >= 0)
+        recovery.stall_ms = (uint64_t)stall_secs * 1000;
+    else
+        recovery.stall_ms = KEY_STALL_MS;
+}
+
+/** Is a key paused by flow control, and so not expected to send. */
+static bool
+flow_key_paused(econ_state_t *econ)
+{
+    int state = econ_state(econ);
+
+    return flow.paused &&
+        ((state == ESTATE_KEYED) || (state == ESTATE_KEYED_FIRST));
+}
+
+/** Schedule the next attempt to reopen a closed key. */
+static void
+key_schedule_reopen(econ_state_t *econ, uint64_t now)
+{
+    if (econ->reopen_backoff_ms == 0)
+        econ->reopen_backoff_ms = KEY_REOPEN_MIN_MS;
+    else if (econ->reopen_backoff_ms < KEY_REOPEN_MAX_MS)
+        econ->reopen_backoff_ms *= 2;
+    if (econ->reopen_backoff_ms > KEY_REOPEN_MAX_MS)
+        econ->reopen_backoff_ms = KEY_REOPEN_MAX_MS;
+
+    econ->reopen_at_ms = now + econ->reopen_backoff_ms;
+}
+
+void ekey_fd_activity(int fd, short events, void *pw);
+
+/** Start watching a key's stream, for the end of its connect if one is
+ * still in progress.
+ */
+static void
+key_attach(econ_state_t *econ)
+{
+    if (econ->key_stream->connecting) {
+        ekeyfd_add(econ_get_rd_fd(econ), POLLOUT, ekey_fd_activity, econ);
+        return;
+    }
+
+#ifdef EKEY_IO_URING
+    ekey_uring_attach_reader(econ->key_stream);
+#endif
+
+    ekeyfd_add(econ_get_rd_fd(econ), POLLIN, ekey_fd_activity, econ);
+}
+
+/** Close a key's failed stream, scheduling a reopen if recovery allows. */
+static void
+key_closed(econ_state_t *econ)
+{
+    const char *uri = econ->key_stream->uri;
+
+    ekeyfd_rm(econ_get_rd_fd(econ));
+
+    /* a replay has ended rather than failed */
+    if (recovery.reopen &&
+        (strncmp(uri, REPLAY_PREFIX, strlen(REPLAY_PREFIX)) != 0) &&
+        (strncmp(uri, REPLAY_FAST_PREFIX, strlen(REPLAY_FAST_PREFIX)) != 0)) {
+        key_schedule_reopen(econ, monotonic_ms());
+        syslog(LOG_INFO, "Entropy key %s closed, reopening in %us",
+               econ->key_path, econ->reopen_backoff_ms / 1000);
+    }
+
+    econ_close_stream(econ);
+    lstate_inform_about_key(econ);
+}
+
+/** Reopen a key's stream, closing it and scheduling another attempt if
+ * that fails.
+ */
+static bool
+key_reopen(econ_state_t *econ, uint64_t now)
+{
+    if (econ->key_stream != NULL)
+        ekeyfd_rm(econ_get_rd_fd(econ));
+
+    econ->reopen_at_ms = 0;
+
+    if (!econ_reopen(econ)) {
+        econ_close_stream(econ);
+        key_schedule_reopen(econ, now);
+        syslog(LOG_INFO, "Unable to reopen entropy key %s, retrying in %us",
+               econ->key_path, econ->reopen_backoff_ms / 1000);
+        lstate_inform_about_key(econ);
+        return false;
+    }
+
+    key_attach(econ);
+
+    if (econ->key_stream->connecting)
+        syslog(LOG_INFO, "Reconnecting to entropy key %s", econ->key_path);
+    else
+        syslog(LOG_INFO, "Reopened entropy key %s", econ->key_path);
+
+    lstate_inform_about_key(econ);
+
+    return true;
+}
+
+/** Note the next time a key check is due in a poll timeout. */
+static void
+key_check_due(int *timeout, uint64_t now, uint64_t due)
+{
+    int wait = (due > now) ? (int)(due - now) : 0;
+
+    if ((*timeout < 0) || (wait < *timeout))
+        *timeout = wait;
+}
+
+/** Reopen closed keys when they are due and watch for stalled ones.
+ *
+ * A key which sends nothing for the stall time is reset and, if it then
+ * sends nothing for as long again, its stream is reopened.  Keys paused by
+ * flow control are not expected to send and are not watched.
+ *
+ * @return The poll timeout before the next check is due, -1 for none.
+ */
+static int
+keys_check(void)
+{
+    uint64_t now = monotonic_ms();
+    econ_state_t *econ;
+    unsigned int idx;
+    int timeout = -1;
+
+    for (idx = 0; idx < flow.nkeys; idx++) {
+        econ = flow.keys[idx];
+
+        if (econ->key_stream == NULL) {
+            if (econ->reopen_at_ms == 0)
+                continue; /* closed for good */
+            if ((now < econ->reopen_at_ms) || !key_reopen(econ, now)) {
+                key_check_due(&timeout, now, econ->reopen_at_ms);
+                continue;
+            }
+        }
+
+        if (econ->key_stream->connecting) {
+            if (now < (econ->last_pkt_ms + NETSTREAM_CONNECT_MS)) {
+                key_check_due(&timeout, now,
+                              econ->last_pkt_ms + NETSTREAM_CONNECT_MS);
+                continue;
+            }
+            syslog(LOG_INFO, "Unable to connect to entropy key %s (%s)",
+                   econ->key_path, strerror(ETIMEDOUT));
+            netstream_connected(econ->key_stream, false);
+            key_closed(econ);
+            if (econ->reopen_at_ms != 0)
+                key_check_due(&timeout, now, econ->reopen_at_ms);
+            continue;
+        }
+
+        /* a key producing entropy again starts its backoff afresh */
+        if (econ->down_since_ms == 0)
+            econ->reopen_backoff_ms = 0;
+
+        if ((recovery.stall_ms == 0) || flow_key_paused(econ)) {
+            econ->last_pkt_ms = now;
+            continue;
+        }
+
+        if ((econ->stall_reset_ms != 0) &&
+            (econ->last_pkt_ms >= econ->stall_reset_ms))
+            econ->stall_reset_ms = 0; /* the reset brought it back */
+
+        if (econ->stall_reset_ms == 0) {
+            if (now >= (econ->last_pkt_ms + recovery.stall_ms)) {
+                syslog(LOG_WARNING, "No data from entropy key %s for %us, "
+                       "resetting it", econ->key_path,
+                       (unsigned int)((now - econ->last_pkt_ms) / 1000));
+                econ_stall_reset(econ);
+            }
+        } else if (now >= (econ->stall_reset_ms + recovery.stall_ms)) {
+            if (recovery.reopen) {
+                syslog(LOG_WARNING, "Entropy key %s did not respond to a "
+                       "reset, reopening it", econ->key_path);
+                if (!key_reopen(econ, now)) {
+                    key_check_due(&timeout, now, econ->reopen_at_ms);
+                    continue;
+                }
+            } else {
+                econ_stall_reset(econ);
+            }
+        }
+
+        key_check_due(&timeout, now, ((econ->stall_reset_ms != 0) ?
+                                      econ->stall_reset_ms :
+                                      econ->last_pkt_ms) + recovery.stall_ms);
+    }
+
+    return timeout;
+}
+
 void ekey_fd_activity(int fd, short events, void *pw)
 {
     econ_state_t *econ = pw;
+    uint64_t entropy = econ->con_entropy;
+
+    if (econ->key_stream->connecting) {
+        if (!netstream_connected(econ->key_stream, true)) {
+            syslog(LOG_INFO, "Unable to connect to entropy key %s (%s)",
+                   econ->key_path, strerror(errno));
+            key_closed(econ);
+            return;
+        }
+        ekeyfd_clear_events(fd, POLLOUT);
+#ifdef EKEY_IO_URING
+        ekey_uring_attach_reader(econ->key_stream);
+#endif
+        ekeyfd_set_events(fd, POLLIN);
+        return;
+    }
+
     econ_run(econ);
-    if (econ_state(econ) == ESTATE_CLOSE) {
-        ekeyfd_rm(econ_get_rd_fd(econ));
-        estream_close(econ->key_stream);
-        econ->key_stream = NULL;
-        lstate_inform_about_key(econ);
+    if ((upgrade.stopped_ms != 0) && (econ->con_entropy != entropy)) {
+        syslog(LOG_INFO, "Entropy resumed %ums after the upgrade handoff began",
+               (unsigned)(monotonic_ms() - upgrade.stopped_ms));
+        upgrade.stopped_ms = 0;
     }
+    if (startup.enabled && !startup.done && (econ->con_entropy > 0)) {
+        uint64_t now = monotonic_ms();
+
+        printf("Control state ready:    %6ums\n"
+               "Configuration run:      %6ums\n",
+               (unsigned)(startup.lua - startup.start),
+               (unsigned)(startup.config - startup.start));
+        if (startup.seeded != 0)
+            printf("Seed file credited:     %6ums (%u bytes)\n",
+                   (unsigned)(startup.seeded - startup.start),
+                   startup.seed_len);
+        printf("First entropy credited: %6ums (%s, %ums after open)\n",
+               (unsigned)(now - startup.start),
+               econ->key_stream->uri, econ->con_first_entropy);
+        startup.done = true;
+    }
+    if (econ_state(econ) == ESTATE_CLOSE)
+        key_closed(econ);
 }
 
 /** lua interface called to add an ekey */
 OpaqueEkey *
 add_ekey(const char *devpath, const char *serial)
 {
-    econ_state_t *econ;
+    econ_state_t *econ = NULL;
+    econ_state_t **keys;
+    void *saved;
+    size_t len;
+    int fd;
 
     if (output_stream == NULL) {
         errno = EWOULDBLOCK;
         return NULL;
     }
 
-    econ = econ_open(devpath, output_stream);
+    keys = realloc(flow.keys, (flow.nkeys + 1) * sizeof(econ_state_t *));
+    if (keys == NULL)
+        return NULL;
+    flow.keys = keys;
+
+    /* a key handed over by an upgrade carries on with its session */
+    if (handoff_take(HANDOFF_KEY, devpath, &saved, &len, &fd)) {
+        econ = econ_restore(devpath, saved, len, fd, output_stream);
+        if (econ == NULL) {
+            syslog(LOG_WARNING, "Unable to take over entropy key %s (%s), "
+                   "opening it afresh", devpath, strerror(errno));
+            if (fd != -1)
+                close(fd);
+        } else {
+            upgrade.adopted++;
+        }
+        free(saved);
+    }
+
+    if (econ == NULL)
+        econ = econ_open(devpath, output_stream);
 
     if (econ == NULL)
         return NULL;
 
-    if (serial != NULL)
+    flow.keys[flow.nkeys++] = econ;
+
+    if ((serial != NULL) && (econ->snum == NULL))
         econ_setsnum(econ, serial);
 
-    ekeyfd_add(econ_get_rd_fd(econ), POLLIN, ekey_fd_activity, econ);
+    /* a restored key whose stream could not be passed is reopened */
+    if (econ->key_stream != NULL)
+        key_attach(econ);
 
     syslog(LOG_INFO, "Attached new entropy key %s", devpath);
 
     return econ;
 }
 
+/* exported interface documented in ekeyd.h */
+bool
+record_ekey(OpaqueEkey *ekey, const char *fname)
+{
+    if (ekey->key_stream == NULL) {
+        errno = EBADF;
+        return false;
+    }
+
+    return estream_record(ekey->key_stream, fname);
+}
+
 void
 kill_ekey(OpaqueEkey *ekey)
 {
     char *serialnumber = econ_getsnum(ekey);
+    unsigned int idx;
+
+    for (idx = 0; idx < flow.nkeys; idx++) {
+        if (flow.keys[idx] == ekey) {
+            flow.keys[idx] = flow.keys[--flow.nkeys];
+            break;
+        }
+    }
 
     if (serialnumber == NULL) {
         if (ekey->key_stream != NULL) {
@@ -135,6 +650,9 @@ kill_ekey(OpaqueEkey *ekey)
         }
         free(serialnumber);
     }
+    if (strncmp(ekey->key_path, NETSTREAM_PREFIX,
+                strlen(NETSTREAM_PREFIX)) == 0)
+        netstream_forget(ekey->key_path + strlen(NETSTREAM_PREFIX));
     econ_close(ekey);
 }
 
@@ -178,11 +696,29 @@ open_file_output(const char *fname)
 
     output_stream = estream_open(fname);
 
+#ifdef EKEY_IO_URING
+    if (output_stream != NULL)
+        ekey_uring_attach_writer(output_stream);
+#endif
+
     return (output_stream != NULL);
 }
 
 bool
-open_kernel_output(int bits_per_byte)
+open_sink_output(const filesink_config_t *config)
+{
+    if (output_stream != NULL) {
+        errno = EADDRINUSE;
+        return false;
+    }
+
+    output_stream = estream_filesink_open(config);
+
+    return (output_stream != NULL);
+}
+
+bool
+open_kernel_output(int bits_per_byte, int min_bits_per_byte)
 {
     static char fname[] = EKEYD_DEV_RANDOM;
         
@@ -191,7 +727,7 @@ open_kernel_output(int bits_per_byte)
         return false;
     }
 
-    output_stream = estream_krnl_open(fname, bits_per_byte);
+    output_stream = estream_krnl_open(fname, bits_per_byte, min_bits_per_byte);
 
     return (output_stream != NULL);
 }
@@ -209,11 +745,248 @@ open_foldback_output(void)
     return (output_stream != NULL);
 }
 
+/* exported interface documented in ekeyd.h */
+int
+use_seed_file(const char *fname, int refresh_secs, bool consume)
+{
+    uint8_t seed[SEED_LEN];
+    ssize_t len = 0;
+
+    if (output_stream == NULL) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    /* a bad seed file must not stop the daemon starting at boot */
+    if (consume && (fname != NULL)) {
+        len = seed_consume(fname, seed, sizeof(seed));
+        if (len < 0) {
+            syslog(LOG_WARNING, "Unable to use seed file %s: %s",
+                   fname, strerror(errno));
+            len = 0;
+        } else if (len == 0) {
+            syslog(LOG_INFO, "No seed in seed file %s", fname);
+        } else {
+            estream_health(output_stream, 100);
+            if (estream_write(output_stream, seed, len) != len) {
+                syslog(LOG_WARNING, "Unable to credit seed file %s", fname);
+                len = 0;
+            } else {
+                startup.seeded = monotonic_ms();
+                startup.seed_len = len;
+                syslog(LOG_INFO, "Credited %u bytes from seed file %s, "
+                       "%ums after start", (unsigned)len, fname,
+                       (unsigned)(startup.seeded - startup.start));
+            }
+            memset(seed, 0, sizeof(seed));
+        }
+    }
+
+    if (!seed_refresh(fname, (refresh_secs > 0) ? refresh_secs : SEED_REFRESH_S))
+        return -1;
+
+    return len;
+}
+
+static void
+keyring_fd_activity(int fd, short events, void *pw)
+{
+    int keys = keydb_watch_event(fd);
+
+    if (keys >= 0)
+        syslog(LOG_INFO, "Keyring changed, reloaded %d keys", keys);
+}
+
+bool
+watch_keyring(const char *fname)
+{
+    static int keyring_fd = -1;
+
+    if (keyring_fd != -1) {
+        ekeyfd_rm(keyring_fd);
+        keydb_unwatch();
+    }
+
+    keyring_fd = keydb_watch(fname);
+    if (keyring_fd == -1)
+        return false;
+
+    ekeyfd_add(keyring_fd, POLLIN, keyring_fd_activity, NULL);
+
+    return true;
+}
+
+/* exported interface documented in ekeyd.h */
+bool
+request_upgrade(void)
+{
+    if (upgrade.sock != -1)
+        return false; /* still taking over */
+
+    upgrade.requested = true;
+    return true;
+}
+
+/** SIGUSR2 handler, the upgrade is made from the main loop. */
+static void
+request_upgrade_signal(int sig)
+{
+    upgrade.requested = true;
+}
+
+/** Hand the listening sockets and the keys to a newly started binary.
+ *
+ * The keys are not read from the time the handoff starts.  The new
+ * daemon adopts them as its configuration adds them and does not read
+ * them until this one has exited, so no data is read twice or lost
+ * between the two.
+ *
+ * @return true if the new daemon has taken over and this one must exit.
+ */
+static bool
+upgrade_handoff(void)
+{
+    handoff_hello_t hello;
+    uint64_t start = monotonic_ms();
+    econ_state_t *econ;
+    unsigned int passed = 0;
+    unsigned int idx;
+    void *saved;
+    size_t len;
+    pid_t pid;
+    int sock;
+    int fd;
+    bool ok;
+
+    sock = handoff_spawn(upgrade.argv, &pid);
+    if (sock == -1) {
+        syslog(LOG_ERR, "Unable to start the upgraded daemon: %s",
+               strerror(errno));
+        return false;
+    }
+
+    hello.version = HANDOFF_VERSION;
+    hello.pid = getpid();
+    hello.stopped_ms = start;
+    ok = handoff_send(sock, HANDOFF_HELLO, NULL, &hello, sizeof(hello), -1) &&
+        lstate_handoff_sockets(sock);
+
+    for (idx = 0; ok && (idx < flow.nkeys); idx++) {
+        econ = flow.keys[idx];
+        saved = econ_save(econ, &len);
+        if (saved == NULL) {
+            ok = false;
+            break;
+        }
+        fd = ((econ->key_stream != NULL) && econ->key_stream->passable) ?
+            econ->key_stream->fd : -1;
+        ok = handoff_send(sock, HANDOFF_KEY, econ->key_path, saved, len, fd);
+        free(saved);
+        if (fd != -1)
+            passed++;
+    }
+
+    ok = ok && handoff_send(sock, HANDOFF_END, NULL, NULL, 0, -1) &&
+        handoff_wait(sock, HANDOFF_READY, HANDOFF_READY_MS);
+
+    if (!ok) {
+        close(sock);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        syslog(LOG_ERR, "The upgraded daemon did not take over, carrying on");
+        return false;
+    }
+
+    /* the handoff socket closing as this daemon exits lets the new one
+     * start reading the keys
+     */
+    syslog(LOG_INFO, "Handed over to upgraded daemon %d after %ums, "
+           "%u of %u entropy keys with their sessions", (int)pid,
+           (unsigned)(monotonic_ms() - start), passed, flow.nkeys);
+
+    return true;
+}
+
+/** Take over from a daemon being upgraded, once the configuration has run.
+ *
+ * @param pidfile The file to record this daemon's process ID in.
+ * @return true on success, false if the old daemon must carry on.
+ */
+static bool
+upgrade_takeover(const char *pidfile)
+{
+    FILE *pf;
+
+    handoff_discard();
+
+    if (!handoff_send(upgrade.sock, HANDOFF_READY, NULL, NULL, 0, -1))
+        return false;
+
+    /* wait for the old daemon to exit, closing the socket */
+    handoff_wait(upgrade.sock, HANDOFF_END, HANDOFF_EXIT_MS);
+    close(upgrade.sock);
+    upgrade.sock = -1;
+
+    pf = fopen(pidfile, "w");
+    if (pf != NULL) {
+        fprintf(pf, "%d\n", (int)getpid());
+        fclose(pf);
+    }
+
+    return true;
+}
+
+/** Keep the daemon's arguments for starting an upgraded binary.
+ *
+ * Any handoff socket is dropped, and a relative path to the binary made
+ * absolute as the daemon changes directory.
+ *
+ * @return The arguments or NULL.
+ */
+static char **
+upgrade_args(int argc, char **argv)
+{
+    char **args;
+    int in;
+    int out = 0;
+
+    args = calloc(argc + 1, sizeof(char *));
+    if (args == NULL)
+        return NULL;
+
+    for (in = 0; in < argc; in++) {
+        if (strcmp(argv[in], "-H") == 0) {
+            in++;
+            continue;
+        }
+        if (strncmp(argv[in], "-H", 2) == 0)
+            continue;
+        args[out++] = argv[in];
+    }
+
+    if ((args[0] != NULL) && (args[0][0] != '/') && (strchr(args[0], '/') != NULL))
+        args[0] = realpath(args[0], NULL);
+
+    return args;
+}
+
+/** SIGHUP handler, the configuration is reloaded from the main loop. */
+static void
+request_reload(int sig)
+{
+    reload_requested = true;
+}
+
 static const char *usage=
-    "Usage: %s [-f <configfile>] [-p <pidfile>] [-v] [-h]\n"
+    "Usage: %s [-f <configfile>] [-p <pidfile>] [-n] [-s] [-H <fd>] [-v] [-h]\n"
     "Entropy Key Daemon\n\n"
     "\t-f Read configuration from configfile\n"
     "\t-p Write pid to pidfile\n"
+    "\t-n Do not use the io_uring I/O backend\n"
+    "\t-s Stay in the foreground, report the time to the first\n"
+    "\t   credited entropy and exit\n"
+    "\t-H Take over from a running daemon through a handoff socket,\n"
+    "\t   only used when ekeyd upgrades itself\n"
     "\t-v Display version and exit\n"
     "\t-h Display this help and exit\n\n";
 
@@ -223,11 +996,22 @@ int main(int argc, char **argv)
     int opt;
     char *configfile;
     char *pidfile;
+    int timeout = -1;
+    int key_timeout;
+#ifdef EKEY_USB_STREAM
+    int usb_timeout;
+#endif
+    bool use_uring = true;
+    bool handed_over = false;
+    handoff_hello_t hello;
+
+    startup.start = monotonic_ms();
 
     configfile = strdup(CONFIGFILE);
     pidfile = strdup(PIDFILE);
+    upgrade.argv = upgrade_args(argc, argv);
 
-    while ((opt = getopt(argc, argv, "vhf:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "vhnsf:p:H:")) != -1) {
         switch (opt) {
         case 'f':
             free(configfile);
@@ -239,6 +1023,19 @@ int main(int argc, char **argv)
             pidfile = strdup(optarg);
             break;
 
+        case 'n':
+            use_uring = false;
+            break;
+
+        case 's':
+            startup.enabled = true;
+            break;
+
+        case 'H':
+            upgrade.sock = atoi(optarg);
+            fcntl(upgrade.sock, F_SETFD, FD_CLOEXEC);
+            break;
+
         case 'v':
             printf("%s: Version %s\n", argv[0], EKEYD_VERSION_S);
             return 0;
@@ -257,17 +1054,49 @@ int main(int argc, char **argv)
     }
 
 
+#ifdef EKEY_IO_URING
+    /* must be ready before the configuration attaches any streams */
+    if (use_uring)
+        ekey_uring_init();
+#else
+    (void)use_uring;
+#endif
+
+#ifdef EKEY_USB_STREAM
+    /* USB keys are serviced by the main poll loop */
+    estream_usb_set_poll(usb_fd_add, usb_fd_rm, NULL);
+#endif
+
+    /* as are connects to key servers */
+    netstream_set_async(true);
+
     if (lstate_init() == false) {
         return 1;
     }
+    startup.lua = monotonic_ms();
+
+    /* the keys and sockets handed over are adopted by the configuration */
+    if (upgrade.sock != -1) {
+        if (!handoff_receive(upgrade.sock, &hello)) {
+            fprintf(stderr, "Unable to take over from the running daemon: %s\n",
+                    strerror(errno));
+            return 1;
+        }
+        upgrade.took_over = true;
+        upgrade.stopped_ms = hello.stopped_ms;
+    }
 
     if (!lstate_runconfig(configfile)) {
         /* Failed to run the configuration */
         return 1;
     }
+    startup.config = monotonic_ms();
+
+    if (upgrade.took_over && !upgrade_takeover(pidfile))
+        return 1;
 
     /* Everything is good, daemonise */
-    if (lstate_request_daemonise())
+    if (lstate_request_daemonise() && !startup.enabled && !upgrade.took_over)
         do_daemonise(pidfile, false);
 
     /* now we are a daemon, start system logging */
@@ -275,11 +1104,61 @@ int main(int argc, char **argv)
 
     syslog(LOG_INFO, "Starting Entropy Key Daemon");
 
+    if (upgrade.took_over)
+        syslog(LOG_INFO, "Took over from daemon %u, %u entropy keys with "
+               "their sessions", hello.pid, upgrade.adopted);
+
+    signal(SIGHUP, request_reload);
+    signal(SIGUSR2, request_upgrade_signal);
+
+#ifdef EKEY_IO_URING
+    if (ekey_uring_active())
+        syslog(LOG_INFO, "Using io_uring I/O backend");
+#endif
+
     while (true) {
-        res = ekeyfd_poll(-1);
-        if (res == 0)
+        if (upgrade.requested) {
+            upgrade.requested = false;
+            /* send the reply to an Upgrade command before going */
+            lstate_controlbytes();
+            if (upgrade_handoff()) {
+                handed_over = true;
+                break;
+            }
+        }
+
+        if (reload_requested) {
+            reload_requested = false;
+            lstate_reload();
+            /* keys may have been added or flow control changed */
+            if (flow.paused)
+                flow.kick = true;
+        }
+
+        timeout = flow_check();
+        key_timeout = keys_check();
+        if ((key_timeout >= 0) && ((timeout < 0) || (key_timeout < timeout)))
+            timeout = key_timeout;
+        key_timeout = seed_check();
+        if ((key_timeout >= 0) && ((timeout < 0) || (key_timeout < timeout)))
+            timeout = key_timeout;
+        key_timeout = lstate_timer();
+        if ((key_timeout >= 0) && ((timeout < 0) || (key_timeout < timeout)))
+            timeout = key_timeout;
+#ifdef EKEY_USB_STREAM
+        usb_timeout = estream_usb_timeout();
+        if ((usb_timeout >= 0) && ((timeout < 0) || (usb_timeout < timeout)))
+            timeout = usb_timeout;
+#endif
+        res = ekeyfd_poll(timeout);
+        if ((res == 0) && (timeout < 0))
             break; /* no more fd open, finish */
 
+#ifdef EKEY_USB_STREAM
+        if (usb_timeout >= 0)
+            estream_usb_handle_events();
+#endif
+
         if (res < 0) {
             if ((errno == EINTR) || (errno == EWOULDBLOCK))
                 continue; /* these errors are ok and the poll is retried */
@@ -292,16 +1171,29 @@ int main(int argc, char **argv)
         if (lua_fd_ready) {
             lstate_controlbytes();
             lua_fd_ready = false;
+            /* a control or EGD client may have created demand */
+            if (flow.paused)
+                flow.kick = true;
         }
+
+        if (startup.done)
+            break;
     }
 
     lstate_finalise();
 
     estream_close(output_stream);
+    free(flow.keys);
+
+#ifdef EKEY_IO_URING
+    ekey_uring_finalise();
+#endif
 
     close_nonce();
 
-    unlink(pidfile);
+    /* the upgraded daemon has recorded itself */
+    if (!handed_over)
+        unlink(pidfile);
 
     free(configfile);
     free(pidfile);
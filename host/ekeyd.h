@@ -12,6 +12,8 @@
 
 #include <stdbool.h>
 
+#include "filesink.h"
+
 /** An opaque handle to an entropy key. */
 typedef struct econ_state_s OpaqueEkey;
 
@@ -45,6 +47,16 @@ extern OpaqueEkey *add_ekey(const char *devpath, const char *serial);
  */
 extern void kill_ekey(OpaqueEkey *ekey);
 
+/**
+ * Record all traffic with an ekey to a capture file for later replay.
+ *
+ * @param ekey The ekey structure to record, which should not yet have been
+ *             read from.
+ * @param fname The capture file to create.
+ * @return true on success, false on failure, with errno set.
+ */
+extern bool record_ekey(OpaqueEkey *ekey, const char *fname);
+
 /**
  * Retrieve the status of an ekey structure.
  *
@@ -74,13 +86,24 @@ extern char *retrieve_ekey_serial(OpaqueEkey *ekey);
  */
 extern bool open_file_output(const char *fname);
 
+/**
+ * Open a buffered output stream for writing entropy to rotating files.
+ *
+ * @param config The file sink configuration.
+ * @return true on success, false on failure, with errno set.
+ */
+extern bool open_sink_output(const filesink_config_t *config);
+
 /**
  * Open an output stream for writing entropy to the kernel.
  *
  * @param bits_per_byte The number of bits per byte to claim entropy on.
+ * @param min_bits_per_byte The least bits per byte to claim from an
+ *                          unhealthy key, negative to always claim
+ *                          \a bits_per_byte.
  * @return true on success, false on failure, with errno set.
  */
-extern bool open_kernel_output(int bits_per_byte);
+extern bool open_kernel_output(int bits_per_byte, int min_bits_per_byte);
 
 /**
  * Open the "foldback" output stream which writes the entropy back into
@@ -90,4 +113,53 @@ extern bool open_kernel_output(int bits_per_byte);
  */
 extern bool open_foldback_output(void);
 
+/**
+ * Reload the keyring automatically whenever the file changes.
+ *
+ * @param fname The keyring file, replacing any previously watched file.
+ * @return true on success, false on failure, with errno set.
+ */
+extern bool watch_keyring(const char *fname);
+
+/**
+ * Credit the seed file left by the last run and keep it refreshed.
+ *
+ * The seed is consumed and written to the output, credited as from a
+ * healthy key, and a fresh one is gathered from the keys to replace it.
+ *
+ * @param fname The seed file, or NULL to stop refreshing it.
+ * @param refresh_secs Seconds between refreshes, 0 for the default.
+ * @param consume true to credit the seed in the file, false to only
+ *                refresh it.
+ * @return The number of bytes credited, or -1 with errno set.
+ */
+extern int use_seed_file(const char *fname, int refresh_secs, bool consume);
+
+/**
+ * Enable or disable pausing the keys while the output has no demand.
+ *
+ * @param enable true to pause keys while the output is full.
+ */
+extern void set_flow_control(bool enable);
+
+/**
+ * Configure the recovery of keys which close or stop sending.
+ *
+ * @param reopen true to reopen keys whose stream ends.
+ * @param stall_secs Seconds a key may send nothing before it is reset, and
+ *                   reopened if it still sends nothing, 0 to never or
+ *                   negative for the default.
+ */
+extern void set_key_recovery(bool reopen, int stall_secs);
+
+/**
+ * Upgrade the daemon to the binary now installed.
+ *
+ * The binary is started and handed the listening sockets and the keys,
+ * with their sessions, once the current control command has completed.
+ *
+ * @return true if the upgrade will be attempted.
+ */
+extern bool request_upgrade(void);
+
 #endif /* DAEMON_EKEYD_H */
@@ -10,6 +10,9 @@
 #include <poll.h>
 
 #include "fds.h"
+#ifdef EKEY_IO_URING
+#include "uring.h"
+#endif
 
 #define MAX_EKEY_POLLFD 256
 
@@ -39,6 +42,9 @@ int
 ekeyfd_rm(int fd)
 {
     int fdloop;
+#ifdef EKEY_IO_URING
+    ekey_uring_forget(fd);
+#endif
     for (fdloop = 0 ; fdloop < ekeyd_lastfd ; fdloop++) {
         if (ekeyfd_pollfd[fdloop].fd == fd) {
             ekeyd_lastfd--;
@@ -90,7 +96,12 @@ ekeyfd_poll(int timeout)
         return 0;
     }
 
-    rdy = poll(ekeyfd_pollfd, ekeyd_lastfd, timeout);
+#ifdef EKEY_IO_URING
+    if (ekey_uring_active())
+        rdy = ekey_uring_wait(ekeyfd_pollfd, ekeyd_lastfd, timeout);
+    else
+#endif
+        rdy = poll(ekeyfd_pollfd, ekeyd_lastfd, timeout);
 
     if (rdy > 0) {
         for (fdloop = 0 ; ((fdcnt < rdy) && (fdloop < ekeyd_lastfd)) ; fdloop++) {
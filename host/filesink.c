@@ -0,0 +1,365 @@
+/* daemon/filesink.c
+ *
+ * Buffered, rotating file output
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "stream.h"
+#include "filesink.h"
+#include "util.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+static filesink_config_t sink_config;
+static filesink_stats_t sink_stats;
+static uint8_t *sink_buf;
+static int sink_fd = -1;
+static bool sink_direct; /* O_DIRECT is set on the current file */
+static bool sink_failing; /* writes are failing, already logged */
+static uint64_t sink_file_bytes; /* bytes written and buffered for the file */
+static uint64_t sink_file_ms; /* time the current file was opened */
+static uint64_t sink_sync_ms; /* time of the last sync */
+
+static uint64_t
+sink_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/** Stop using O_DIRECT on the current file. */
+static void
+sink_undirect(void)
+{
+    fcntl(sink_fd, F_SETFL, fcntl(sink_fd, F_GETFL) & ~O_DIRECT);
+    sink_direct = false;
+}
+
+/** Open the sink file, appending to it if it already exists. */
+static bool
+sink_open_file(void)
+{
+    struct stat sbuf;
+
+    sink_direct = sink_config.direct && (O_DIRECT != 0);
+    sink_fd = open(sink_config.path,
+                   O_WRONLY | O_CREAT | O_NOCTTY | (sink_direct ? O_DIRECT : 0),
+                   0600);
+    if ((sink_fd == -1) && sink_direct && (errno == EINVAL)) {
+        /* the filesystem does not support direct I/O */
+        syslog(LOG_INFO, "Direct I/O not supported for %s", sink_config.path);
+        sink_direct = sink_config.direct = false;
+        sink_fd = open(sink_config.path, O_WRONLY | O_CREAT | O_NOCTTY, 0600);
+    }
+    if (sink_fd == -1)
+        return false;
+
+    if (fstat(sink_fd, &sbuf) == -1) {
+        close(sink_fd);
+        sink_fd = -1;
+        return false;
+    }
+    lseek(sink_fd, 0, SEEK_END);
+
+    /* direct writes need an aligned file offset */
+    if (sink_direct && ((sbuf.st_size % FILESINK_ALIGN) != 0))
+        sink_undirect();
+
+    sink_file_bytes = sbuf.st_size;
+    sink_file_ms = monotonic_ms();
+
+#ifdef EKEY_OS_LINUX
+    if (sink_config.preallocate && (sink_config.rotate_bytes > sink_file_bytes)) {
+        /* reserve the space without changing the file size, failure only
+         * costs the chance of a less fragmented file
+         */
+        fallocate(sink_fd, FALLOC_FL_KEEP_SIZE, sink_file_bytes,
+                  sink_config.rotate_bytes - sink_file_bytes);
+    }
+#endif
+
+    return true;
+}
+
+/** Close the sink file, releasing any preallocated space it did not use. */
+static void
+sink_close_file(void)
+{
+    if (sink_fd == -1)
+        return;
+
+#ifdef EKEY_OS_LINUX
+    if (sink_config.preallocate &&
+        (ftruncate(sink_fd, lseek(sink_fd, 0, SEEK_CUR)) == -1))
+        syslog(LOG_INFO, "Unable to trim %s: %s", sink_config.path,
+               strerror(errno));
+#endif
+
+    close(sink_fd);
+    sink_fd = -1;
+}
+
+/** Write out the buffer.
+ *
+ * Unless the whole buffer is to be written, only whole aligned blocks
+ * are written out so direct I/O can continue.  If the write fails the
+ * data is discarded.
+ *
+ * @param all true to write out everything buffered.
+ */
+static void
+sink_flush(bool all)
+{
+    size_t len = all ? sink_stats.buffered :
+        (sink_stats.buffered & ~(size_t)(FILESINK_ALIGN - 1));
+    size_t done = 0;
+    uint64_t start;
+    ssize_t wr;
+
+    if (len == 0)
+        return;
+
+    /* retry a file which could not be opened on rotation */
+    if ((sink_fd == -1) && sink_open_file() && sink_failing) {
+        syslog(LOG_INFO, "Reopened %s", sink_config.path);
+    }
+
+    if (sink_direct && ((len % FILESINK_ALIGN) != 0))
+        sink_undirect();
+
+    while ((done < len) && (sink_fd != -1)) {
+        start = sink_now_us();
+        wr = write(sink_fd, sink_buf + done, len - done);
+        sink_stats.write_us += sink_now_us() - start;
+
+        if (wr < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EINVAL) && sink_direct) {
+                /* refused the direct write, carry on through the cache */
+                sink_undirect();
+                continue;
+            }
+            break;
+        }
+
+        sink_stats.writes++;
+        sink_stats.bytes += wr;
+        done += wr;
+    }
+
+    if (done < len) {
+        sink_stats.errors++;
+        sink_stats.dropped += len - done;
+        if (!sink_failing) {
+            syslog(LOG_ERR, "Write error on %s (%s), discarding output",
+                   sink_config.path,
+                   (sink_fd == -1) ? "not open" : strerror(errno));
+            sink_failing = true;
+        }
+    } else if (sink_failing) {
+        syslog(LOG_INFO, "Writes to %s recovered", sink_config.path);
+        sink_failing = false;
+    }
+
+    memmove(sink_buf, sink_buf + len, sink_stats.buffered - len);
+    sink_stats.buffered -= len;
+}
+
+/** Rename the current file out of the way and start a new one. */
+static void
+sink_rotate(void)
+{
+    char name[PATH_MAX];
+    char stamp[32];
+    struct stat sbuf;
+    struct tm tm;
+    time_t now;
+    size_t len;
+    bool rotated;
+    int seq;
+
+    sink_flush(true);
+    sink_close_file();
+
+    now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+    len = snprintf(name, sizeof(name), "%s.%s", sink_config.path, stamp);
+    for (seq = 1; (len < sizeof(name)) && (stat(name, &sbuf) == 0); seq++) {
+        len = snprintf(name, sizeof(name), "%s.%s.%d",
+                       sink_config.path, stamp, seq);
+    }
+
+    rotated = (len < sizeof(name)) && (rename(sink_config.path, name) == 0);
+    if (rotated) {
+        sink_stats.rotations++;
+    } else {
+        syslog(LOG_ERR, "Unable to rotate %s: %s", sink_config.path,
+               strerror((len >= sizeof(name)) ? ENAMETOOLONG : errno));
+    }
+
+    if (!sink_open_file() && !sink_failing) {
+        syslog(LOG_ERR, "Unable to open %s: %s", sink_config.path,
+               strerror(errno));
+        sink_failing = true;
+    }
+
+    if (!rotated || (sink_fd == -1)) {
+        /* count afresh so a failed rotation is not retried on every write */
+        sink_file_bytes = 0;
+        sink_file_ms = monotonic_ms();
+    }
+}
+
+static ssize_t
+sink_write(int fd, const void *buf, size_t count)
+{
+    const uint8_t *src = buf;
+    size_t left = count;
+    uint64_t now = monotonic_ms();
+    size_t len;
+
+    /* the sink file changes on rotation so the stream's fd is not used */
+    (void)fd;
+
+    if ((sink_config.rotate_secs != 0) &&
+        ((now - sink_file_ms) >= (sink_config.rotate_secs * 1000ULL)))
+        sink_rotate();
+
+    while (left > 0) {
+        if ((sink_config.rotate_bytes != 0) &&
+            (sink_file_bytes >= sink_config.rotate_bytes))
+            sink_rotate();
+
+        len = sink_stats.buffer_size - sink_stats.buffered;
+        if (len > left)
+            len = left;
+
+        /* files are rotated at exactly the configured size */
+        if ((sink_config.rotate_bytes != 0) &&
+            ((sink_file_bytes + len) > sink_config.rotate_bytes))
+            len = sink_config.rotate_bytes - sink_file_bytes;
+
+        memcpy(sink_buf + sink_stats.buffered, src, len);
+        sink_stats.buffered += len;
+        sink_file_bytes += len;
+        src += len;
+        left -= len;
+
+        if ((sink_config.rotate_bytes != 0) &&
+            (sink_file_bytes >= sink_config.rotate_bytes))
+            sink_rotate();
+        else if (sink_stats.buffered == sink_stats.buffer_size)
+            sink_flush(false);
+    }
+
+    if ((sink_config.fsync_secs != 0) &&
+        ((now - sink_sync_ms) >= (sink_config.fsync_secs * 1000ULL))) {
+        /* direct I/O can only write out whole blocks */
+        sink_flush(!sink_direct);
+        if (sink_fd != -1)
+            fsync(sink_fd);
+        sink_stats.fsyncs++;
+        sink_sync_ms = now;
+    }
+
+    return count;
+}
+
+static int
+sink_close(int fd)
+{
+    (void)fd;
+
+    sink_flush(true);
+    sink_close_file();
+
+    free(sink_buf);
+    sink_buf = NULL;
+    free((char *)sink_config.path);
+    sink_config.path = NULL;
+
+    return 0;
+}
+
+/* exported interface, documented in filesink.h */
+estream_state_t *
+estream_filesink_open(const filesink_config_t *config)
+{
+    estream_state_t *stream_state;
+    size_t size;
+    int err;
+
+    if (sink_buf != NULL) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    size = (config->buffer_size != 0) ? config->buffer_size : FILESINK_DEFAULT_BUFFER;
+    size = (size + FILESINK_ALIGN - 1) & ~(size_t)(FILESINK_ALIGN - 1);
+
+    sink_config = *config;
+    sink_config.path = strdup(config->path);
+    if (sink_config.path == NULL)
+        return NULL;
+
+    memset(&sink_stats, 0, sizeof(sink_stats));
+    sink_stats.buffer_size = size;
+    sink_stats.opened_ms = sink_sync_ms = monotonic_ms();
+    sink_failing = false;
+
+    err = posix_memalign((void **)&sink_buf, FILESINK_ALIGN, size);
+    if (err != 0) {
+        sink_buf = NULL;
+        free((char *)sink_config.path);
+        errno = err;
+        return NULL;
+    }
+
+    stream_state = calloc(1, sizeof(estream_state_t));
+    if ((stream_state == NULL) || !sink_open_file()) {
+        err = errno;
+        free(stream_state);
+        free(sink_buf);
+        sink_buf = NULL;
+        free((char *)sink_config.path);
+        errno = err;
+        return NULL;
+    }
+
+    stream_state->uri = strdup(config->path);
+    stream_state->fd = sink_fd;
+    stream_state->estream_read = NULL;
+    stream_state->estream_write = sink_write;
+    stream_state->estream_close = sink_close;
+
+    return stream_state;
+}
+
+/* exported interface, documented in filesink.h */
+const filesink_stats_t *
+filesink_stats(void)
+{
+    return (sink_buf != NULL) ? &sink_stats : NULL;
+}
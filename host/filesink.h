@@ -0,0 +1,69 @@
+/* daemon/filesink.h
+ *
+ * Buffered, rotating file output
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_FILESINK_H
+#define DAEMON_FILESINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stream.h"
+
+/** Default size of the file sink write buffer. */
+#define FILESINK_DEFAULT_BUFFER (1024 * 1024)
+
+/** Alignment of the write buffer and of the writes made from it. */
+#define FILESINK_ALIGN 4096
+
+/** File sink configuration. */
+typedef struct {
+    const char *path; /**< File written to, created if necessary. */
+    size_t buffer_size; /**< Write buffer size, 0 for the default. */
+    bool direct; /**< Bypass the page cache with O_DIRECT if possible. */
+    uint64_t rotate_bytes; /**< Rotate after this many bytes, 0 for never. */
+    unsigned int rotate_secs; /**< Rotate after this many seconds, 0 for never. */
+    bool preallocate; /**< Reserve rotate_bytes of space for each file. */
+    unsigned int fsync_secs; /**< Write out and sync at this interval, 0 for never. */
+} filesink_config_t;
+
+/** File sink statistics. */
+typedef struct {
+    uint64_t bytes; /**< Bytes written to files. */
+    uint64_t writes; /**< Number of write calls made. */
+    uint64_t write_us; /**< Microseconds spent in write calls. */
+    uint64_t fsyncs; /**< Number of periodic syncs. */
+    uint64_t rotations; /**< Number of files rotated away. */
+    uint64_t errors; /**< Number of failed writes. */
+    uint64_t dropped; /**< Bytes discarded because writes failed. */
+    uint64_t opened_ms; /**< Monotonic time the sink was opened. */
+    size_t buffered; /**< Bytes currently held in the buffer. */
+    size_t buffer_size; /**< Size of the buffer. */
+} filesink_stats_t;
+
+/** Open a buffered file sink.
+ *
+ * Entropy is gathered in a large aligned buffer and written out a whole
+ * buffer at a time.  With rotation configured the file is renamed, with
+ * a timestamp suffix, once it reaches the configured size or age and a
+ * fresh file started in its place.  Rotation and syncing happen as
+ * entropy is written.  Only one file sink may be open at a time.
+ *
+ * @param config The sink configuration, which is copied.
+ * @return The stream handle or NULL and errno set.
+ */
+extern estream_state_t *estream_filesink_open(const filesink_config_t *config);
+
+/** Obtain the file sink statistics.
+ *
+ * @return The current statistics or NULL if no file sink is open.
+ */
+extern const filesink_stats_t *filesink_stats(void);
+
+#endif /* DAEMON_FILESINK_H */
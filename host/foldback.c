@@ -21,6 +21,12 @@ foldback_write(int fd, const void *buf, size_t count)
     return lstate_foldback_entropy(buf, count);
 }
 
+static bool
+foldback_demand(int fd, bool resuming)
+{
+    return lstate_foldback_demand(resuming);
+}
+
 /* exported interface, documented in foldback.h */
 estream_state_t *
 estream_foldback_open(void)
@@ -33,6 +39,7 @@ estream_foldback_open(void)
 
     stream_state->estream_read = NULL;
     stream_state->estream_write = foldback_write;
+    stream_state->estream_demand = foldback_demand;
 
     return stream_state;
 }
@@ -74,6 +74,7 @@ eframe_read(eframe_state_t *state)
     int rd;
     int avail;
     uint8_t *sof;
+    int bad;
 
     if (state->used == EFRAME_LEN) {
         errno = EINVAL; /* invalid argument buffer is full */
@@ -88,6 +89,7 @@ eframe_read(eframe_state_t *state)
             return rd; /* propogate the error */
         }
         state->used += rd;
+        trace_stamp(state->trace);
     }
 
     if (state->used != EFRAME_LEN)
@@ -98,6 +100,7 @@ eframe_read(eframe_state_t *state)
     if (sof == NULL) {
         /* no asterisk so no SOF in frame, clear frame, return error */
         state->used = 0;
+        trace_event_stamped(state->trace, TRACE_FRAME_SKIP, 0, EFRAME_LEN);
         goto ewouldblock;
     }
 
@@ -105,12 +108,14 @@ eframe_read(eframe_state_t *state)
         /* possible SOF is not at beginning of frame */
         state->used = EFRAME_LEN - (sof - state->frame);
         memmove(state->frame, sof, state->used);
+        trace_event_stamped(state->trace, TRACE_FRAME_SKIP, 0, sof - state->frame);
         goto ewouldblock;
     }
 
     /* first char of SOF is at buffer start, check for second */
     if (sof[1] != SOF1) {
         /* was not SOF1, find next SOF0 if available */
+        bad = 1;
         goto skipsof0;
     }
 
@@ -118,6 +123,7 @@ eframe_read(eframe_state_t *state)
     if ((state->frame[EFRAME_LEN - 2] != EOF0) ||
         (state->frame[EFRAME_LEN - 1] != EOF1)) {
         /* invalid EOF */
+        bad = 2;
         goto skipsof0;
     }
 
@@ -125,7 +131,8 @@ eframe_read(eframe_state_t *state)
     state->frames_ok++;
     state->byte_last = state->stream->bytes_read - EFRAME_LEN;
 
-    //printf("Frame: %.60s\n", state->frame + 2);
+    trace_event_stamped(state->trace, TRACE_FRAME_OK, state->frame[2],
+                        (uint32_t)state->byte_last);
 
     return EFRAME_LEN; /* valid frame */
 
@@ -141,6 +148,7 @@ skipsof0:
         memmove(state->frame, sof, state->used);
     }
     state->framing_errors++;
+    trace_event_stamped(state->trace, TRACE_FRAME_BAD, bad, EFRAME_LEN - state->used);
 
 ewouldblock:
     errno = EWOULDBLOCK;
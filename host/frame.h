@@ -10,6 +10,8 @@
 #ifndef DAEMON_FRAME_H
 #define DAEMON_FRAME_H
 
+#include "trace.h"
+
 #define EFRAME_LEN 64
 
 #define SOF0 '*'
@@ -29,6 +31,8 @@ typedef struct {
     uint64_t byte_last; /**< Index of begining of last correct frame */
     uint32_t framing_errors; /**< Number of framing errors */
     uint32_t frames_ok; /**< Number of valid frames. */
+
+    trace_ring_t *trace; /**< Event trace, NULL if not tracing. */
 } eframe_state_t;
 
 /** Create a new framing context.
@@ -0,0 +1,221 @@
+/* daemon/handoff-test.c
+ *
+ * Hand sockets and a connection over a socket pair and check the
+ * successor's side gets them intact.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "handoff.h"
+#include "stream.h"
+#include "frame.h"
+#include "connection.h"
+#include "check.h"
+
+/** Send a hello of a given version. */
+static bool
+test_hello(int sock, uint32_t version)
+{
+    handoff_hello_t hello = { .version = version, .pid = getpid(), .stopped_ms = 1234 };
+
+    return handoff_send(sock, HANDOFF_HELLO, NULL, &hello, sizeof(hello), -1);
+}
+
+/** Whether a received descriptor is the other end of a pipe. */
+static bool
+test_pipe_end(int rfd, int wfd)
+{
+    char c = 0;
+
+    return (write(wfd, "h", 1) == 1) && (read(rfd, &c, 1) == 1) && (c == 'h');
+}
+
+/* Items arrive in order, named, with their data and descriptors */
+static void
+test_items(void)
+{
+    handoff_hello_t hello;
+    int sv[2];
+    int pipefd[2];
+    void *data;
+    size_t len;
+    int fd;
+
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+    CHECK(pipe(pipefd) == 0);
+
+    CHECK(test_hello(sv[0], HANDOFF_VERSION));
+    CHECK(handoff_send(sv[0], HANDOFF_SOCKET, "U:/run/ekeyd.sock", NULL, 0, pipefd[0]));
+    CHECK(handoff_send(sv[0], HANDOFF_SOCKET, "T:8888", NULL, 0, -1));
+    CHECK(handoff_send(sv[0], HANDOFF_KEY, "/dev/key", "state", 5, -1));
+    CHECK(handoff_send(sv[0], HANDOFF_END, NULL, NULL, 0, -1));
+    close(pipefd[0]);
+
+    CHECK(handoff_receive(sv[1], &hello));
+    CHECK((hello.pid == (uint32_t)getpid()) && (hello.stopped_ms == 1234));
+
+    CHECK(strcmp(handoff_remaining(HANDOFF_SOCKET, 0), "U:/run/ekeyd.sock") == 0);
+    CHECK(strcmp(handoff_remaining(HANDOFF_SOCKET, 1), "T:8888") == 0);
+    CHECK(handoff_remaining(HANDOFF_SOCKET, 2) == NULL);
+    CHECK(!handoff_take(HANDOFF_KEY, "T:8888", NULL, NULL, &fd));
+
+    CHECK(handoff_take(HANDOFF_SOCKET, "U:/run/ekeyd.sock", NULL, NULL, &fd));
+    CHECK((fd != -1) && test_pipe_end(fd, pipefd[1]));
+    close(fd);
+    CHECK(!handoff_take(HANDOFF_SOCKET, "U:/run/ekeyd.sock", NULL, NULL, &fd));
+
+    CHECK(handoff_take(HANDOFF_KEY, "/dev/key", &data, &len, &fd));
+    CHECK((len == 5) && (memcmp(data, "state", 5) == 0) && (fd == -1));
+    free(data);
+
+    /* what is left is discarded, its descriptors closed */
+    CHECK(strcmp(handoff_remaining(HANDOFF_SOCKET, 0), "T:8888") == 0);
+    handoff_discard();
+    CHECK(handoff_remaining(HANDOFF_SOCKET, 0) == NULL);
+
+    /* the successor reports ready, anything else is not */
+    CHECK(handoff_send(sv[1], HANDOFF_READY, NULL, NULL, 0, -1));
+    CHECK(handoff_wait(sv[0], HANDOFF_READY, 1000));
+    CHECK(handoff_send(sv[1], HANDOFF_END, NULL, NULL, 0, -1));
+    CHECK(!handoff_wait(sv[0], HANDOFF_READY, 1000));
+    CHECK(!handoff_wait(sv[0], HANDOFF_READY, 10));
+
+    close(sv[0]);
+    close(sv[1]);
+    close(pipefd[1]);
+}
+
+/* A handoff from another version or cut short is refused whole */
+static void
+test_refused(void)
+{
+    handoff_hello_t hello;
+    int pipefd[2];
+    int sv[2];
+
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+    CHECK(test_hello(sv[0], HANDOFF_VERSION + 1));
+    CHECK(!handoff_receive(sv[1], &hello) && (errno == EPROTONOSUPPORT));
+    close(sv[0]);
+    close(sv[1]);
+
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+    CHECK(pipe(pipefd) == 0);
+    CHECK(test_hello(sv[0], HANDOFF_VERSION));
+    CHECK(handoff_send(sv[0], HANDOFF_SOCKET, "U:/run/ekeyd.sock", NULL, 0, pipefd[0]));
+    close(pipefd[0]);
+    close(sv[0]);
+    CHECK(!handoff_receive(sv[1], &hello) && (errno == ECONNRESET));
+    CHECK(handoff_remaining(HANDOFF_SOCKET, 0) == NULL);
+    /* the passed descriptor was closed with the items */
+    CHECK((write(pipefd[1], "h", 1) == -1) && (errno == EPIPE));
+    close(sv[1]);
+    close(pipefd[1]);
+}
+
+/* A connection handed over part way through a frame carries on with it */
+static void
+test_connection(void)
+{
+    /* a serial number frame, whose MAC is not checked until the serial
+     * number is known
+     */
+    static const char head[] = "* S!AAAAAAAAA";
+    uint8_t tail[EFRAME_LEN];
+    handoff_hello_t hello;
+    econ_state_t *econ;
+    econ_state_t *restored;
+    void *saved;
+    size_t len;
+    int keysv[2];
+    int sv[2];
+    int fd;
+
+    memset(tail, 'A', sizeof(tail));
+    tail[EFRAME_LEN - (sizeof(head) - 1) - 2] = '\r';
+    tail[EFRAME_LEN - (sizeof(head) - 1) - 1] = '\n';
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, keysv) == 0);
+    fcntl(keysv[0], F_SETFL, O_NONBLOCK);
+    econ = econ_attach("sock:test", estream_adopt("sock:test", keysv[0]), NULL);
+    CHECK(econ != NULL);
+
+    CHECK(write(keysv[1], head, sizeof(head) - 1) == (ssize_t)(sizeof(head) - 1));
+    econ_run(econ);
+    econ->con_reset = 3;
+    trace_event(econ->eframer->trace, TRACE_RESET, 0, 0);
+    CHECK(econ->eframer->used == (int)(sizeof(head) - 1));
+
+    saved = econ_save(econ, &len);
+    CHECK(saved != NULL);
+
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+    CHECK(test_hello(sv[0], HANDOFF_VERSION));
+    CHECK(handoff_send(sv[0], HANDOFF_KEY, "sock:test", saved, len, keysv[0]));
+    CHECK(handoff_send(sv[0], HANDOFF_END, NULL, NULL, 0, -1));
+    free(saved);
+    econ_close(econ);
+
+    CHECK(handoff_receive(sv[1], &hello));
+    CHECK(handoff_take(HANDOFF_KEY, "sock:test", &saved, &len, &fd));
+
+    /* a record from another layout is refused */
+    ((uint32_t *)saved)[1]++;
+    CHECK((econ_restore("sock:test", saved, len, fd, NULL) == NULL) && (errno == EPROTO));
+    ((uint32_t *)saved)[1]--;
+
+    restored = econ_restore("sock:test", saved, len, fd, NULL);
+    CHECK(restored != NULL);
+    if (restored != NULL) {
+        CHECK(restored->con_reset == 3);
+        CHECK(restored->key_stream->bytes_read == sizeof(head) - 1);
+        CHECK(restored->eframer->trace->head == 1);
+
+        CHECK(write(keysv[1], tail, EFRAME_LEN - (sizeof(head) - 1)) ==
+              (ssize_t)(EFRAME_LEN - (sizeof(head) - 1)));
+        econ_run(restored);
+        CHECK(restored->eframer->frames_ok == 1);
+        CHECK(restored->eframer->framing_errors == 0);
+        CHECK(restored->epkt->pkt_ok == 1);
+        CHECK(restored->snum != NULL);
+        CHECK(econ_state(restored) != ESTATE_CLOSE);
+        econ_close(restored);
+    }
+
+    /* without its stream the connection is restored closed, to reopen */
+    restored = econ_restore("sock:test", saved, len, -1, NULL);
+    CHECK((restored != NULL) && (econ_state(restored) == ESTATE_CLOSE));
+    if (restored != NULL)
+        econ_close(restored);
+
+    free(saved);
+    close(sv[0]);
+    close(sv[1]);
+    close(keysv[1]);
+}
+
+int
+main(int argc, char **argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    test_items();
+    test_refused();
+    test_connection();
+
+    return check_result("handoff");
+}
@@ -0,0 +1,380 @@
+/* daemon/handoff.c
+ *
+ * Handing a running daemon's sockets and keys to its upgraded binary
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "handoff.h"
+
+/** Header of each message, the name and data follow. */
+typedef struct {
+    uint32_t type; /**< The handoff_type_t. */
+    uint32_t name_len; /**< Length of the name including its terminator, 0 for none. */
+} handoff_hdr_t;
+
+/** A received item waiting to be taken. */
+typedef struct handoff_item_s {
+    struct handoff_item_s *next;
+    handoff_type_t type;
+    char *name;
+    void *data;
+    size_t len;
+    int fd;
+} handoff_item_t;
+
+static handoff_item_t *items;
+
+/** Keep a received item, in the order sent. */
+static void
+handoff_keep(handoff_item_t *item)
+{
+    handoff_item_t **tail = &items;
+
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = item;
+}
+
+/* exported interface documented in handoff.h */
+int
+handoff_spawn(char *const argv[], pid_t *pid)
+{
+    int sv[2];
+    int argc;
+    char **nargv;
+    char fdarg[16];
+    int fdlimit;
+    int cfd;
+
+    for (argc = 0; argv[argc] != NULL; argc++)
+        ;
+
+    nargv = calloc(argc + 3, sizeof(char *));
+    if (nargv == NULL)
+        return -1;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        free(nargv);
+        return -1;
+    }
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    memcpy(nargv, argv, argc * sizeof(char *));
+    snprintf(fdarg, sizeof(fdarg), "%d", sv[1]);
+    nargv[argc] = "-H";
+    nargv[argc + 1] = fdarg;
+
+    switch ((*pid = fork())) {
+    case -1:
+        close(sv[0]);
+        close(sv[1]);
+        free(nargv);
+        return -1;
+
+    case 0:
+        /* the successor is handed exactly what it needs, anything else
+         * left open would hold keys and sockets open behind its back
+         */
+        fdlimit = sysconf(_SC_OPEN_MAX);
+        for (cfd = 3; cfd < fdlimit; cfd++) {
+            if (cfd != sv[1])
+                close(cfd);
+        }
+        execvp(nargv[0], nargv);
+        _exit(127);
+
+    default:
+        break;
+    }
+
+    close(sv[1]);
+    free(nargv);
+
+    return sv[0];
+}
+
+/* exported interface documented in handoff.h */
+bool
+handoff_send(int sock, handoff_type_t type, const char *name,
+             const void *data, size_t len, int fd)
+{
+    handoff_hdr_t hdr;
+    struct iovec iov[3];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t sent;
+
+    hdr.type = type;
+    hdr.name_len = (name != NULL) ? strlen(name) + 1 : 0;
+
+    if ((sizeof(hdr) + hdr.name_len + len) > HANDOFF_MAX_MSG) {
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)name;
+    iov[1].iov_len = hdr.name_len;
+    iov[2].iov_base = (void *)data;
+    iov[2].iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    if (fd != -1) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do {
+        sent = sendmsg(sock, &msg, 0);
+    } while ((sent == -1) && (errno == EINTR));
+
+    return (sent == (ssize_t)(sizeof(hdr) + hdr.name_len + len));
+}
+
+/** Receive one message.
+ *
+ * @param sock The handoff socket.
+ * @param buf Buffer of HANDOFF_MAX_MSG bytes to receive into.
+ * @param fd Updated with the passed file descriptor or -1.
+ * @return The message length or -1 and errno set, 0 if the socket closed.
+ */
+static ssize_t
+handoff_recv(int sock, uint8_t *buf, int *fd)
+{
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t rd;
+
+    iov.iov_base = buf;
+    iov.iov_len = HANDOFF_MAX_MSG;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *fd = -1;
+
+    do {
+        rd = recvmsg(sock, &msg, 0);
+    } while ((rd == -1) && (errno == EINTR));
+
+    if (rd <= 0)
+        return rd;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) &&
+            (cmsg->cmsg_type == SCM_RIGHTS))
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+        (rd < (ssize_t)sizeof(handoff_hdr_t)) ||
+        (((handoff_hdr_t *)buf)->name_len > (rd - sizeof(handoff_hdr_t)))) {
+        if (*fd != -1)
+            close(*fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    return rd;
+}
+
+/* exported interface documented in handoff.h */
+bool
+handoff_wait(int sock, handoff_type_t type, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    uint8_t *buf;
+    ssize_t rd;
+    int fd;
+    int res;
+
+    do {
+        res = poll(&pfd, 1, timeout_ms);
+    } while ((res == -1) && (errno == EINTR));
+
+    if (res != 1)
+        return false;
+
+    buf = malloc(HANDOFF_MAX_MSG);
+    if (buf == NULL)
+        return false;
+
+    rd = handoff_recv(sock, buf, &fd);
+    if (fd != -1)
+        close(fd);
+    res = (rd > 0) && (((handoff_hdr_t *)buf)->type == type);
+    free(buf);
+
+    return res;
+}
+
+/* exported interface documented in handoff.h */
+bool
+handoff_receive(int sock, handoff_hello_t *hello)
+{
+    uint8_t *buf;
+    handoff_hdr_t *hdr;
+    handoff_item_t *item;
+    ssize_t rd;
+    size_t len;
+    int fd;
+    bool first = true;
+
+    buf = malloc(HANDOFF_MAX_MSG);
+    if (buf == NULL)
+        return false;
+    hdr = (handoff_hdr_t *)buf;
+
+    while (true) {
+        rd = handoff_recv(sock, buf, &fd);
+        if (rd <= 0) {
+            if (rd == 0)
+                errno = ECONNRESET;
+            break;
+        }
+        len = rd - sizeof(*hdr) - hdr->name_len;
+
+        if (first) {
+            first = false;
+            if ((hdr->type != HANDOFF_HELLO) || (len != sizeof(*hello))) {
+                errno = EPROTO;
+                break;
+            }
+            memcpy(hello, buf + sizeof(*hdr) + hdr->name_len, sizeof(*hello));
+            if (hello->version != HANDOFF_VERSION) {
+                errno = EPROTONOSUPPORT;
+                break;
+            }
+            continue;
+        }
+
+        if (hdr->type == HANDOFF_END) {
+            free(buf);
+            return true;
+        }
+
+        if ((hdr->name_len == 0) ||
+            (buf[sizeof(*hdr) + hdr->name_len - 1] != 0) ||
+            ((item = calloc(1, sizeof(*item))) == NULL)) {
+            if (fd != -1)
+                close(fd);
+            errno = EPROTO;
+            break;
+        }
+
+        item->type = hdr->type;
+        item->name = strdup((char *)buf + sizeof(*hdr));
+        item->len = len;
+        item->data = malloc(len + 1);
+        item->fd = fd;
+        handoff_keep(item);
+        if ((item->name == NULL) || (item->data == NULL)) {
+            errno = ENOMEM;
+            break;
+        }
+        memcpy(item->data, buf + sizeof(*hdr) + hdr->name_len, len);
+    }
+
+    free(buf);
+    handoff_discard();
+    return false;
+}
+
+/* exported interface documented in handoff.h */
+bool
+handoff_take(handoff_type_t type, const char *name,
+             void **data, size_t *len, int *fd)
+{
+    handoff_item_t **prev;
+    handoff_item_t *item;
+
+    for (prev = &items; (item = *prev) != NULL; prev = &item->next) {
+        if ((item->type == type) && (strcmp(item->name, name) == 0))
+            break;
+    }
+
+    if (item == NULL)
+        return false;
+
+    *prev = item->next;
+
+    if (data != NULL)
+        *data = item->data;
+    else
+        free(item->data);
+    if (len != NULL)
+        *len = item->len;
+    *fd = item->fd;
+
+    free(item->name);
+    free(item);
+
+    return true;
+}
+
+/* exported interface documented in handoff.h */
+const char *
+handoff_remaining(handoff_type_t type, unsigned int idx)
+{
+    handoff_item_t *item;
+
+    for (item = items; item != NULL; item = item->next) {
+        if ((item->type == type) && (idx-- == 0))
+            return item->name;
+    }
+
+    return NULL;
+}
+
+/* exported interface documented in handoff.h */
+void
+handoff_discard(void)
+{
+    handoff_item_t *item;
+
+    while ((item = items) != NULL) {
+        items = item->next;
+        if (item->fd != -1)
+            close(item->fd);
+        free(item->name);
+        free(item->data);
+        free(item);
+    }
+}
@@ -0,0 +1,120 @@
+/* daemon/handoff.h
+ *
+ * Handing a running daemon's sockets and keys to its upgraded binary
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_HANDOFF_H
+#define DAEMON_HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Version of the handoff protocol, both daemons must agree on it. */
+#define HANDOFF_VERSION 1
+
+/** Largest handoff message, including its header. */
+#define HANDOFF_MAX_MSG (64 * 1024)
+
+/** Longest time the running daemon waits for its successor to take over. */
+#define HANDOFF_READY_MS 30000
+
+/** Longest time the successor waits for the old daemon to exit. */
+#define HANDOFF_EXIT_MS 5000
+
+/** Handoff message types. */
+typedef enum {
+    HANDOFF_HELLO = 1, /**< First message, a handoff_hello_t. */
+    HANDOFF_SOCKET, /**< A listening socket, named as the control state names it. */
+    HANDOFF_KEY, /**< An entropy key, named by its path, with its saved connection state. */
+    HANDOFF_END, /**< Everything has been sent. */
+    HANDOFF_READY, /**< Sent back once the successor has taken everything over. */
+} handoff_type_t;
+
+/** The first message of a handoff. */
+typedef struct {
+    uint32_t version; /**< HANDOFF_VERSION. */
+    uint32_t pid; /**< Process ID of the daemon handing over. */
+    uint64_t stopped_ms; /**< Monotonic time in ms the keys stopped being read. */
+} handoff_hello_t;
+
+/** Start the upgraded daemon.
+ *
+ * The daemon is executed afresh, with the original arguments and the
+ * handoff socket added, from a child process in which every other file
+ * descriptor has been closed.
+ *
+ * @param argv The daemon's original arguments.
+ * @param pid Updated with the process ID of the new daemon.
+ * @return The handoff socket or -1 and errno set.
+ */
+extern int handoff_spawn(char *const argv[], pid_t *pid);
+
+/** Send a handoff message.
+ *
+ * @param sock The handoff socket.
+ * @param type The message type.
+ * @param name The name of the item, or NULL.
+ * @param data The message data, or NULL.
+ * @param len The length of \a data.
+ * @param fd A file descriptor to pass with the message, or -1.
+ * @return true on success, false and errno set on failure.
+ */
+extern bool handoff_send(int sock, handoff_type_t type, const char *name,
+                         const void *data, size_t len, int fd);
+
+/** Wait for a handoff message of one type.
+ *
+ * Used by the daemon handing over to wait for ::HANDOFF_READY and by its
+ * successor to wait for the old daemon to exit, which closes the socket.
+ *
+ * @param sock The handoff socket.
+ * @param type The message type wanted.
+ * @param timeout_ms How long to wait.
+ * @return true if the message arrived, false if the socket closed, the
+ *         wait timed out or anything else arrived.
+ */
+extern bool handoff_wait(int sock, handoff_type_t type, int timeout_ms);
+
+/** Receive everything a handoff sends.
+ *
+ * Messages are read until ::HANDOFF_END and the items kept for
+ * ::handoff_take.
+ *
+ * @param sock The handoff socket.
+ * @param hello Updated with the first message.
+ * @return true on success, false and errno set on failure.
+ */
+extern bool handoff_receive(int sock, handoff_hello_t *hello);
+
+/** Take a received item.
+ *
+ * @param type The type of the item.
+ * @param name The name of the item.
+ * @param data Updated with the item's data, which the caller frees, or NULL.
+ * @param len Updated with the length of \a data, or NULL.
+ * @param fd Updated with the item's file descriptor, which the caller owns.
+ * @return true if the item was received and has now been taken.
+ */
+extern bool handoff_take(handoff_type_t type, const char *name,
+                         void **data, size_t *len, int *fd);
+
+/** Get the name of a received item which has not been taken.
+ *
+ * @param type The type of the item.
+ * @param idx The index of the item amongst those of its type.
+ * @return The name or NULL once there are no more.
+ */
+extern const char *handoff_remaining(handoff_type_t type, unsigned int idx);
+
+/** Discard every received item which has not been taken, closing its file
+ * descriptor.
+ */
+extern void handoff_discard(void);
+
+#endif /* DAEMON_HANDOFF_H */
@@ -0,0 +1,158 @@
+/* daemon/keydb-test.c
+ *
+ * Check the keyring index and reloading a watched keyring.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "keydb.h"
+#include "check.h"
+
+/** Lengths of a serial number and a long term key. */
+#define SNUM_LEN 12
+#define LTKEY_LEN 32
+
+/** Number of keys in the test keyrings. */
+#define TEST_KEYS 1000
+
+static void
+test_key(int idx, int generation, uint8_t *snum, uint8_t *ltkey)
+{
+    memset(snum, 0, SNUM_LEN);
+    snum[0] = idx;
+    snum[1] = idx >> 8;
+    memset(ltkey, generation, LTKEY_LEN);
+    ltkey[0] = idx;
+    ltkey[1] = idx >> 8;
+}
+
+/** Whether the daemon's keyring holds a generation of the test keys. */
+static bool
+test_keyring_is(int count, int generation)
+{
+    uint8_t snum[SNUM_LEN];
+    uint8_t ltkey[LTKEY_LEN];
+    uint8_t *found;
+    bool ok = true;
+    int idx;
+
+    for (idx = 0; idx < count; idx++) {
+        test_key(idx, generation, snum, ltkey);
+        found = snum_to_ltkey(snum);
+        if ((found == NULL) || (memcmp(found, ltkey, LTKEY_LEN) != 0))
+            ok = false;
+        free(found);
+    }
+
+    /* one past the end must not be found */
+    test_key(count, generation, snum, ltkey);
+    found = snum_to_ltkey(snum);
+    if (found != NULL)
+        ok = false;
+    free(found);
+
+    return ok;
+}
+
+/** Write a generation of the test keys as a keyring, replacing it whole
+ * as ekey-setkey does.
+ */
+static int
+test_write(const char *fname, int count, int generation)
+{
+    uint8_t snum[SNUM_LEN];
+    uint8_t ltkey[LTKEY_LEN];
+    char tmp[256];
+    FILE *fh;
+    int idx;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+    fh = fopen(tmp, "w");
+    if (fh == NULL)
+        return -1;
+    for (idx = 0; idx < count; idx++) {
+        test_key(idx, generation, snum, ltkey);
+        output_key(fh, snum, ltkey);
+    }
+    if ((fclose(fh) != 0) || (rename(tmp, fname) == -1))
+        return -1;
+    return 0;
+}
+
+int
+main(void)
+{
+    char dir[] = "/tmp/keydbtestXXXXXX";
+    char fname[sizeof(dir) + 16];
+    char other[sizeof(dir) + 16];
+    FILE *fh;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(fname, sizeof(fname), "%s/keyring", dir);
+    snprintf(other, sizeof(other), "%s/other", dir);
+
+    /* a written keyring reads back with every key found */
+    CHECK(test_write(fname, TEST_KEYS, 1) == 0);
+    CHECK(read_keyring(fname) == TEST_KEYS);
+    CHECK(test_keyring_is(TEST_KEYS, 1));
+
+    /* lines which are not keys are skipped */
+    fh = fopen(fname, "a");
+    CHECK(fh != NULL);
+    if (fh != NULL) {
+        fprintf(fh, "# comment\n\nnot a key\nAAAAAAAAAAAAAAAA short\n");
+        fclose(fh);
+    }
+    CHECK(read_keyring(fname) == TEST_KEYS);
+
+    /* a keyring which cannot be read leaves the current one in use */
+    CHECK(read_keyring(other) == -1);
+    CHECK(test_keyring_is(TEST_KEYS, 1));
+
+#ifdef EKEY_OS_LINUX
+    struct pollfd pfd;
+    int fd;
+
+    fd = keydb_watch(fname);
+    CHECK(fd != -1);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    /* other files in the directory do not cause a reload */
+    fh = fopen(other, "w");
+    if (fh != NULL)
+        fclose(fh);
+    CHECK(poll(&pfd, 1, 1000) == 1);
+    CHECK(keydb_watch_event(fd) == -1);
+
+    /* replacing the keyring reloads it, as ekey-setkey does */
+    CHECK(test_write(fname, TEST_KEYS + 1, 2) == 0);
+    CHECK(poll(&pfd, 1, 1000) == 1);
+    CHECK(keydb_watch_event(fd) == TEST_KEYS + 1);
+    CHECK(test_keyring_is(TEST_KEYS + 1, 2));
+
+    /* nothing further happened */
+    CHECK(poll(&pfd, 1, 0) == 0);
+
+    keydb_unwatch();
+#endif
+
+    unlink(other);
+    unlink(fname);
+    rmdir(dir);
+
+    return check_result("keydb");
+}
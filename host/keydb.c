@@ -8,92 +8,268 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef EKEY_OS_LINUX
+#include <sys/inotify.h>
+#endif
+
 #include "keydb.h"
 #include "pem.h"
 
+/** Length of a serial number. */
+#define SNUM_LEN 12
+
+/** Length of a long term session key. */
+#define LTKEY_LEN 32
+
+/** Length of a PEM encoded serial number. */
+#define SNUM_PEM_LEN 16
+
+/** Length of a PEM encoded long term session key. */
+#define LTKEY_PEM_LEN 44
+
+/** Smallest index size, must be a power of two. */
+#define KEYDB_MIN_INDEX 64
+
 /** Keyring entry. */
 struct snum_to_key_s {
-    struct snum_to_key_s *next; /**< Next entry. */
-    uint8_t snum[12]; /**< Serial number. */
-    uint8_t ltkey[32]; /**< Long term session key. */
+    uint8_t snum[SNUM_LEN]; /**< Serial number. */
+    uint8_t ltkey[LTKEY_LEN]; /**< Long term session key. */
 };
 
-static struct snum_to_key_s *ents = NULL;
+/** Keyring.
+ *
+ * Entries are held in insertion order so the keyring is written back in
+ * the order it was read. The index is an open-addressed, linearly probed
+ * table of entry numbers plus one, zero marking an empty slot, kept no
+ * more than half full.
+ */
+struct keydb_s {
+    struct snum_to_key_s *ents; /**< Entries in insertion order. */
+    size_t nents; /**< Number of entries in use. */
+    size_t ents_alloc; /**< Number of entries allocated. */
+    uint32_t *index; /**< Hash index into ents. */
+    size_t index_size; /**< Number of index slots, a power of two. */
+};
+
+#ifndef EKEY_ENGINE
+/** The keyring in use. */
+static keydb_t *keydb = NULL;
+#endif
+
+#if defined(EKEY_OS_LINUX) && !defined(EKEY_ENGINE)
+static int watch_fd = -1; /**< inotify instance watching the keyring. */
+static char *watch_fname = NULL; /**< Keyring being watched. */
+static const char *watch_leaf; /**< Leaf name of the keyring. */
+#endif
+
+/** Hash a serial number, FNV-1a. */
+static uint32_t
+hash_snum(const uint8_t *snum)
+{
+    uint32_t hash = 2166136261U;
+    int idx;
+
+    for (idx = 0; idx < SNUM_LEN; idx++) {
+        hash ^= snum[idx];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* exported interface documented in keydb.h */
+void
+keydb_free(keydb_t *db)
+{
+    if (db == NULL)
+        return;
+    free(db->ents);
+    free(db->index);
+    free(db);
+}
+
+/** Find the index slot for a serial number.
+ *
+ * @return The slot holding the serial number or the empty slot it would
+ *         be placed in.
+ */
+static uint32_t *
+find_slot(const keydb_t *db, const uint8_t *snum)
+{
+    size_t mask = db->index_size - 1;
+    size_t pos = hash_snum(snum) & mask;
+
+    while (db->index[pos] != 0) {
+        if (memcmp(db->ents[db->index[pos] - 1].snum, snum, SNUM_LEN) == 0)
+            break;
+        pos = (pos + 1) & mask;
+    }
+    return &db->index[pos];
+}
+
+/** Rebuild the index with a new size. */
+static int
+resize_index(keydb_t *db, size_t size)
+{
+    uint32_t *index;
+    size_t ent;
+
+    index = calloc(size, sizeof(*index));
+    if (index == NULL)
+        return -1;
+
+    free(db->index);
+    db->index = index;
+    db->index_size = size;
+
+    for (ent = 0; ent < db->nents; ent++)
+        *find_slot(db, db->ents[ent].snum) = ent + 1;
+
+    return 0;
+}
+
+/* exported interface documented in keydb.h */
+keydb_t *
+keydb_new(size_t hint)
+{
+    keydb_t *db;
+    size_t size = KEYDB_MIN_INDEX;
+
+    while (size < (hint * 2))
+        size *= 2;
+
+    db = calloc(1, sizeof(*db));
+    if (db == NULL)
+        return NULL;
+
+    db->ents_alloc = size / 2;
+    db->ents = malloc(db->ents_alloc * sizeof(*db->ents));
+    db->index = calloc(size, sizeof(*db->index));
+    db->index_size = size;
+    if ((db->ents == NULL) || (db->index == NULL)) {
+        keydb_free(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+/* exported interface documented in keydb.h */
+int
+keydb_insert(keydb_t *db, const uint8_t *snum, const uint8_t *ltkey)
+{
+    uint32_t *slot;
+    struct snum_to_key_s *ents;
+
+    slot = find_slot(db, snum);
+    if (*slot == 0) {
+        /* no current entry for that serial number */
+        if (db->nents == db->ents_alloc) {
+            ents = realloc(db->ents, db->ents_alloc * 2 * sizeof(*ents));
+            if (ents == NULL)
+                return -1;
+            db->ents = ents;
+            db->ents_alloc *= 2;
+        }
+
+        if (((db->nents + 1) * 2) > db->index_size) {
+            if (resize_index(db, db->index_size * 2) == -1)
+                return -1;
+            slot = find_slot(db, snum);
+        }
+
+        memcpy(db->ents[db->nents].snum, snum, SNUM_LEN);
+        *slot = ++db->nents;
+    }
+
+    memcpy(db->ents[*slot - 1].ltkey, ltkey, LTKEY_LEN);
+
+    return 0;
+}
 
 /** Find a long term saession key from a serial number.
  *
+ * @param db The keyring to search, may be NULL.
  * @param snum The serial number to find the key for.
  * @return The keyring entry or NULL if no matching serial number is found.
  */
 static struct snum_to_key_s *
-find_ltkey(const uint8_t *snum)
+find_ltkey(const keydb_t *db, const uint8_t *snum)
 {
-    struct snum_to_key_s *ent = ents;
+    uint32_t slot;
 
-    while (ent != NULL) {
-        if (memcmp(ent->snum, snum, 12) == 0)
-            break;
-        ent = ent->next;
-    }
-    return ent;
+    if (db == NULL)
+        return NULL;
+
+    slot = *find_slot(db, snum);
+    if (slot == 0)
+        return NULL;
+
+    return &db->ents[slot - 1];
 }
 
 /* exported interface documented in keydb.h */
 uint8_t *
-snum_to_ltkey(const uint8_t *snum)
+keydb_ltkey(const keydb_t *db, const uint8_t *snum)
 {
     struct snum_to_key_s *ent;
     uint8_t *key = NULL;
 
-    ent = find_ltkey(snum);
+    ent = find_ltkey(db, snum);
     if (ent != NULL) {
-        key = malloc(32);
+        key = malloc(LTKEY_LEN);
         if (key != NULL) {
-            memcpy(key, ent->ltkey, 32);
+            memcpy(key, ent->ltkey, LTKEY_LEN);
         }
     }
     return key;
 }
 
+#ifndef EKEY_ENGINE
+/* exported interface documented in keydb.h */
+uint8_t *
+snum_to_ltkey(const uint8_t *snum)
+{
+    return keydb_ltkey(keydb, snum);
+}
+#endif
+
 /* exported interface documented in keydb.h */
 int
 output_key(FILE *fh, const uint8_t *snum, const uint8_t *ltkey)
 {
     uint8_t data[128];
 
-    pem64_encode_bytes(snum, 12, (char *)data);
+    pem64_encode_bytes(snum, SNUM_LEN, (char *)data);
     data[16] = ' ';
-    pem64_encode_bytes(ltkey, 32, (char *)data + 17);
+    pem64_encode_bytes(ltkey, LTKEY_LEN, (char *)data + 17);
     data[61] = 0;
     return fprintf(fh, "%s\n", data);
 }
 
+#ifndef EKEY_ENGINE
 /* exported interface documented in keydb.h */
 int
 add_ltkey(const uint8_t *snum, const uint8_t *ltkey)
 {
-    struct snum_to_key_s *ent;
-
-    ent = find_ltkey(snum);
-    if (ent == NULL) {
-        /* no current entry for that serial number */
-        ent = calloc(1, sizeof(struct snum_to_key_s));
-        memcpy(ent->snum, snum, 12);
-        ent->next = ents;
-        ents = ent;
+    if (keydb == NULL) {
+        keydb = keydb_new(0);
+        if (keydb == NULL)
+            return -1;
     }
 
-    memcpy(ent->ltkey, ltkey, 32);
-
-    return 0;
+    return keydb_insert(keydb, snum, ltkey);
 }
 
 /* exported interface documented in keydb.h */
@@ -102,12 +278,15 @@ write_keyring(const char *fname)
 {
     int fd;
     FILE *fh;
-    struct snum_to_key_s *base = ents;
+    size_t ent;
     char *fname2 = malloc(strlen(fname) + 5);
-    
+
+    if (fname2 == NULL)
+        return -1;
+
     strcpy(fname2, fname);
     strcat(fname2, ".tmp");
-    
+
     fd = open(fname2, O_CREAT | O_EXCL | O_WRONLY, 0600);
     if (fd == -1) {
         /* Unable to open keyring */
@@ -115,80 +294,269 @@ write_keyring(const char *fname)
         free(fname2);
         return -1;
     }
-    
+
     fh = fdopen(fd, "w");
     if (fh == NULL) {
         free(fname2);
         close(fd);
         return -1;
     }
-    
+
     fprintf(fh, "# Do not edit this directly, this file is managed by ekey-setkey\n");
 
-    while (base) {
-        output_key(fh, base->snum, base->ltkey);
-        base = base->next;
+    if (keydb != NULL) {
+        for (ent = 0; ent < keydb->nents; ent++)
+            output_key(fh, keydb->ents[ent].snum, keydb->ents[ent].ltkey);
     }
 
     fflush(fh);
     fclose(fh);
-    
+
     if (rename(fname2, fname) == -1) {
         perror("rename");
-        free(fname2);
         unlink(fname2);
+        free(fname2);
         return -1;
     }
-    
+
     free(fname2);
-    
+
     return 0;
 }
+#endif
 
+static inline bool
+is_pem_char(char c)
+{
+    return (isalnum((unsigned char)c) || (c == '+') || (c == '/') || (c == '='));
+}
+
+/** Length of the run of PEM characters at the start of a buffer. */
+static size_t
+pem_span(const char *data, const char *end)
+{
+    const char *pos = data;
+
+    while ((pos < end) && is_pem_char(*pos))
+        pos++;
+    return pos - data;
+}
+
+/** Parse a keyring image into a keyring.
+ *
+ * Each line holds a PEM serial number and a PEM long term key separated
+ * by whitespace, anything else (such as comments) is ignored.
+ *
+ * @return The number of keys read or -1 on memory exhaustion.
+ */
+static int
+parse_keyring(keydb_t *db, const char *data, size_t len)
+{
+    const char *end = data + len;
+    const char *eol;
+    const char *pos;
+    uint8_t snum[SNUM_LEN];
+    uint8_t ltkey[LTKEY_LEN + 1];
+    int keys = 0;
+
+    while (data < end) {
+        eol = memchr(data, '\n', end - data);
+        if (eol == NULL)
+            eol = end;
+
+        pos = data;
+        data = eol + 1;
+
+        while ((pos < eol) && isspace((unsigned char)*pos))
+            pos++;
+        if (pem_span(pos, eol) != SNUM_PEM_LEN)
+            continue;
+        pem64_decode_bytes(pos, SNUM_PEM_LEN, snum);
+        pos += SNUM_PEM_LEN;
+
+        while ((pos < eol) && isspace((unsigned char)*pos))
+            pos++;
+        if (pem_span(pos, eol) < LTKEY_PEM_LEN)
+            continue;
+        pem64_decode_bytes(pos, LTKEY_PEM_LEN, ltkey);
+
+        if (keydb_insert(db, snum, ltkey) == -1)
+            return -1;
+        keys++;
+    }
+
+    return keys;
+}
+
+/* exported interface documented in keydb.h */
+keydb_t *
+keydb_read(const char *fname, int *keys_read)
+{
+    int fd;
+    struct stat st;
+    void *map = NULL;
+    keydb_t *db;
+    int keys;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        /* Unable to open keyring */
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+
+    /* each line is at least 62 bytes, size the index to avoid rehashing */
+    db = keydb_new(st.st_size / 62);
+    if (db == NULL) {
+        keys = -1;
+    } else {
+        keys = parse_keyring(db, map, st.st_size);
+    }
+
+    if (map != NULL)
+        munmap(map, st.st_size);
+
+    if (keys == -1) {
+        keydb_free(db);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (keys_read != NULL)
+        *keys_read = keys;
+
+    return db;
+}
+
+#ifndef EKEY_ENGINE
 /* exported interface documented in keydb.h */
 int
 read_keyring(const char *fname)
 {
-    FILE *fh;
-    char line[512];
-    char snumpem[17];
-    char ltkeypem[45];
-    int res;
-    int keys = 0;
-    uint8_t snum[12];
-    uint8_t ltkey[33];
-    struct snum_to_key_s *base = ents;
+    keydb_t *db;
+    int keys;
 
-    fh = fopen(fname, "r");
-    if (fh == NULL) {
-        /* Unable to open keyring */
+    db = keydb_read(fname, &keys);
+    if (db == NULL)
+        return -1;
+
+    /* swap the new keyring in, the old one stays in use until now */
+    keydb_free(keydb);
+    keydb = db;
+
+    return keys;
+}
+#endif
+
+#if defined(EKEY_OS_LINUX) && !defined(EKEY_ENGINE)
+/* exported interface documented in keydb.h */
+int
+keydb_watch(const char *fname)
+{
+    char *dir;
+    char *slash;
+
+    keydb_unwatch();
+
+    watch_fname = strdup(fname);
+    dir = strdup(fname);
+    if ((watch_fname == NULL) || (dir == NULL)) {
+        free(dir);
+        keydb_unwatch();
+        errno = ENOMEM;
         return -1;
     }
 
-    /* Blow the old keyring out of the water */
-    while (base) {
-        struct snum_to_key_s *next = base->next;
-        free(base);
-        base = next;
+    /* watch the directory as the keyring is replaced by rename */
+    slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        watch_leaf = watch_fname;
+    } else {
+        *(slash == dir ? slash + 1 : slash) = 0;
+        watch_leaf = watch_fname + (slash - dir) + 1;
     }
 
-    ents = NULL;
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ((watch_fd == -1) ||
+        (inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)) {
+        free(dir);
+        keydb_unwatch();
+        return -1;
+    }
 
-    while (fgets(line, 512, fh) != NULL) {
-        res = sscanf(line,
-                     " %16[A-Za-z0-9+/=] %44[A-Za-z0-9+/=]",
-                     snumpem,
-                     ltkeypem);
+    free(dir);
 
-        if (res == 2) {
-            pem64_decode_bytes(snumpem, 16, snum);
-            pem64_decode_bytes(ltkeypem, 44, ltkey);
-            add_ltkey(snum, ltkey);
-            keys++;
+    return watch_fd;
+}
+
+/* exported interface documented in keydb.h */
+int
+keydb_watch_event(int fd)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *pos;
+    bool changed = false;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (pos = buf; pos < buf + len;
+             pos += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)pos;
+            if ((event->len > 0) && (strcmp(event->name, watch_leaf) == 0))
+                changed = true;
         }
     }
 
-    fclose(fh);
+    if (!changed || (watch_fname == NULL))
+        return -1;
 
-    return keys;
+    return read_keyring(watch_fname);
+}
+
+/* exported interface documented in keydb.h */
+void
+keydb_unwatch(void)
+{
+    if (watch_fd != -1)
+        close(watch_fd);
+    watch_fd = -1;
+    free(watch_fname);
+    watch_fname = NULL;
+}
+#elif !defined(EKEY_ENGINE)
+/* exported interface documented in keydb.h */
+int
+keydb_watch(const char *fname)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+/* exported interface documented in keydb.h */
+int
+keydb_watch_event(int fd)
+{
+    return -1;
+}
+
+/* exported interface documented in keydb.h */
+void
+keydb_unwatch(void)
+{
 }
+#endif
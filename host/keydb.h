@@ -10,7 +10,62 @@
 #ifndef DAEMON_KEYDB_H
 #define DAEMON_KEYDB_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+/** A keyring of long term session keys indexed by serial number. */
+typedef struct keydb_s keydb_t;
+
+/**
+ * Create an empty keyring.
+ *
+ * @param hint The number of keys expected, the keyring grows as needed.
+ * @return The keyring or NULL on memory exhaustion.
+ */
+extern keydb_t *keydb_new(size_t hint);
+
+/**
+ * Read a keyring file into a new keyring.
+ *
+ * @param fname The file to read the keyring from.
+ * @param keys_read Updated with the number of keys read, or NULL.
+ * @return The keyring or NULL and errno set.
+ * @note Format is as for read_keyring().
+ */
+extern keydb_t *keydb_read(const char *fname, int *keys_read);
+
+/**
+ * Add or replace a long term session key in a keyring.
+ *
+ * @param db The keyring.
+ * @param snum Serial number of the key.
+ * @param ltkey The long term session key.
+ * @return 0 on success or -1 on memory exhaustion.
+ */
+extern int keydb_insert(keydb_t *db, const uint8_t *snum, const uint8_t *ltkey);
+
+/**
+ * Retrieve a long term session key from a keyring by serial number.
+ *
+ * @param db The keyring, may be NULL.
+ * @param snum The serial number of the LTK to retrieve.
+ * @return A copy of the LTK, which the caller frees, or NULL if not found.
+ */
+extern uint8_t *keydb_ltkey(const keydb_t *db, const uint8_t *snum);
+
+/**
+ * Free a keyring.
+ *
+ * @param db The keyring, may be NULL.
+ */
+extern void keydb_free(keydb_t *db);
+
+/*
+ * The daemon's keyring.  Apart from output_key(), the functions below act
+ * on a single keyring shared by the whole process and are not built into
+ * the engine library.
+ */
 
 /**
  * (re-)Initialise the key database and read a keyring into it.
@@ -18,6 +73,8 @@
  * @param fname The file to read the keyring from.
  * @return -1 with errno set on failure, otherwise returns the number of keys read.
  * @note Format is "PEMSerial PEMLTK\n" * nkeys.
+ * @note The new keyring is built before replacing the current one, which
+ *       remains in use if reading fails.
  */
 extern int read_keyring(const char *fname);
 
@@ -56,4 +113,28 @@ int add_ltkey(const uint8_t *snum, const uint8_t *ltkey);
  */
 int output_key(FILE *fh, const uint8_t *snum, const uint8_t *ltkey);
 
+/**
+ * Watch a keyring file and reload it when it changes.
+ *
+ * Any previous watch is removed.
+ *
+ * @param fname The keyring file to watch.
+ * @return A file descriptor which becomes readable when the keyring may have
+ *         changed, or -1 and errno set.
+ */
+extern int keydb_watch(const char *fname);
+
+/**
+ * Process change notifications on a keyring watch.
+ *
+ * @param fd The file descriptor returned by keydb_watch().
+ * @return The number of keys read if the keyring was reloaded, otherwise -1.
+ */
+extern int keydb_watch_event(int fd);
+
+/**
+ * Stop watching the keyring file.
+ */
+extern void keydb_unwatch(void);
+
 #endif /* DAEMON_KEYDB_H */
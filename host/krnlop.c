@@ -22,6 +22,44 @@
 
 static int krnlop_bpb;
 
+#if defined(EKEY_OS_LINUX) || defined(EKEY_OS_OPENBSD) || defined(EKEY_OS_MIRBSD)
+
+/* adaptive crediting bounds the credit between krnlop_min_bpb, negative if
+ * it is not adaptive, and krnlop_bpb by the health of the source key
+ */
+static int krnlop_min_bpb = -1;
+static unsigned int krnlop_health;
+
+/** Shannons to credit for a write of count bytes. */
+static unsigned int
+krnl_credit(size_t count)
+{
+    if (krnlop_min_bpb < 0)
+        return count * krnlop_bpb;
+
+    return (count * ((krnlop_min_bpb * 100) +
+                     ((krnlop_bpb - krnlop_min_bpb) * krnlop_health))) / 100;
+}
+
+static void
+krnl_health(int fd, unsigned int health)
+{
+    krnlop_health = (health > 100) ? 100 : health;
+}
+
+/** Set up the credit claimed for each byte. */
+static void
+krnl_set_credit(estream_state_t *stream_state, int bpb, int min_bpb)
+{
+    krnlop_bpb = bpb;
+    if ((min_bpb >= 0) && (min_bpb < bpb)) {
+        krnlop_min_bpb = min_bpb;
+        stream_state->estream_health = krnl_health;
+    }
+}
+
+#endif
+
 #if defined(EKEY_OS_LINUX)
 
 /* Linux kernel entropy injection */
@@ -30,6 +68,9 @@ static int krnlop_bpb;
 #include <linux/types.h>
 #include <linux/random.h>
 #include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <poll.h>
+#include <syslog.h>
 
 static ssize_t
 krnl_write(int fd, const void *buf, size_t count)
@@ -37,7 +78,7 @@ krnl_write(int fd, const void *buf, size_t count)
     struct rand_pool_info *rndpool;
     rndpool = alloca(sizeof(struct rand_pool_info) + count);
 
-    rndpool->entropy_count = count * krnlop_bpb;
+    rndpool->entropy_count = krnl_credit(count);
     rndpool->buf_size = count;
     memcpy(rndpool->buf, buf, count);
 
@@ -48,8 +89,63 @@ krnl_write(int fd, const void *buf, size_t count)
     return count;
 }
 
+/* pool size and write wakeup threshold, in bits */
+static int krnlop_poolsize;
+static int krnlop_wakeup;
+
+/** Read an integer from the kernel random sysctl directory. */
+static int
+krnl_sysctl(const char *name)
+{
+    char path[64];
+    FILE *fh;
+    int val = -1;
+
+    snprintf(path, sizeof(path), "/proc/sys/kernel/random/%s", name);
+    fh = fopen(path, "r");
+    if (fh != NULL) {
+        if (fscanf(fh, "%d", &val) != 1)
+            val = -1;
+        fclose(fh);
+    }
+    return val;
+}
+
+/** The pool wants entropy until it is full and, once input has been paused,
+ * again when it drops below the threshold at which the kernel would wake
+ * writers.  That is also when /dev/random polls writable.
+ */
+static bool
+krnl_demand(int fd, bool resuming)
+{
+    int count = 0;
+
+    if (ioctl(fd, RNDGETENTCNT, &count) == -1)
+        return true;
+
+    return count < (resuming ? krnlop_wakeup : krnlop_poolsize);
+}
+
+/** Whether the kernel reports its pool as full whatever it holds.
+ *
+ * From Linux 5.18 the entropy count is pinned at the pool size once the
+ * CRNG is initialised and /dev/random never polls writable again, so the
+ * count says nothing about demand.  Older kernels may read full at any
+ * moment, which is when the keys should pause, so only the version says.
+ */
+static bool
+krnl_pinned(void)
+{
+    struct utsname uts;
+    int major = 0, minor = 0;
+
+    return (uname(&uts) == 0) &&
+        (sscanf(uts.release, "%d.%d", &major, &minor) == 2) &&
+        ((major > 5) || ((major == 5) && (minor >= 18)));
+}
+
 estream_state_t *
-estream_krnl_open(const char *path, int bpb)
+estream_krnl_open(const char *path, int bpb, int min_bpb)
 {
     estream_state_t *stream_state = NULL;
     int fd;
@@ -68,8 +164,23 @@ estream_krnl_open(const char *path, int bpb)
 
     stream_state->estream_read = read;
     stream_state->estream_write = krnl_write;
+    stream_state->estream_close = close;
+
+    /* a pool which is always full never has demand, so the keys are left
+     * running rather than paused for all but a moment each minute
+     */
+    krnlop_poolsize = krnl_sysctl("poolsize");
+    krnlop_wakeup = krnl_sysctl("write_wakeup_threshold");
+    if ((krnlop_poolsize > 0) && (krnlop_wakeup > 0) && krnl_pinned()) {
+        syslog(LOG_INFO, "Kernel pool is always full, output has constant demand");
+    } else if ((krnlop_poolsize > 0) && (krnlop_wakeup > 0)) {
+        if (krnlop_wakeup > krnlop_poolsize)
+            krnlop_wakeup = krnlop_poolsize;
+        stream_state->estream_demand = krnl_demand;
+        stream_state->demand_events = POLLOUT;
+    }
 
-    krnlop_bpb = bpb;
+    krnl_set_credit(stream_state, bpb, min_bpb);
 
     return stream_state;
 }
@@ -102,7 +213,7 @@ krnl_write(int fd, const void *buf, size_t count)
     }
 
     /* from MirOS: src/libexec/cprng/cprng.c,v 1.14 */
-    u = count * krnlop_bpb;
+    u = krnl_credit(count);
     if (ioctl(fd, RNDADDTOENTCNT, &u) == -1) {
         perror("ioctl");
         return -1;
@@ -111,7 +222,7 @@ krnl_write(int fd, const void *buf, size_t count)
 }
 
 estream_state_t *
-estream_krnl_open(const char *path, int bpb)
+estream_krnl_open(const char *path, int bpb, int min_bpb)
 {
     estream_state_t *stream_state = NULL;
     int fd;
@@ -130,8 +241,9 @@ estream_krnl_open(const char *path, int bpb)
 
     stream_state->estream_read = read;
     stream_state->estream_write = krnl_write;
+    stream_state->estream_close = close;
 
-    krnlop_bpb = bpb;
+    krnl_set_credit(stream_state, bpb, min_bpb);
 
     return stream_state;
 }
@@ -141,7 +253,7 @@ estream_krnl_open(const char *path, int bpb)
 /* Default implementation */
 
 estream_state_t *
-estream_krnl_open(const char *path, int bpb)
+estream_krnl_open(const char *path, int bpb, int min_bpb)
 {
     estream_state_t *stream_state = NULL;
 
@@ -14,8 +14,10 @@
  *
  * @param path The path to the device node to open.
  * @param bpb The number of shannons per byte to claim during insertion.
+ * @param min_bpb The least shannons per byte to claim for an unhealthy key,
+ *                or negative to always claim \a bpb.
  * @return The stream handle or NULL and errno set.
  */
-estream_state_t *estream_krnl_open(const char *path, int bpb);
+estream_state_t *estream_krnl_open(const char *path, int bpb, int min_bpb);
 
 #endif
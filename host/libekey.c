@@ -0,0 +1,784 @@
+/* daemon/libekey.c
+ *
+ * Client library for reading entropy from ekeyd
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "libekey.h"
+#include "util.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef EGDSOCKET
+#define EGDSOCKET "/etc/entropy"
+#endif
+
+/** Port used for servers given without one. */
+#define EKEY_DEFAULT_PORT "8888"
+
+/** Maximum number of EGD servers. */
+#define EKEY_MAX_SERVERS 8
+
+/** Smallest buffer which may be configured. */
+#define EKEY_MIN_BUFFER 1024
+
+/** Largest request made with the extended blocking read command. */
+#define EKEY_EXT_MAX_REQUEST 65536
+
+/** Largest request a single EGD blocking read command may make. */
+#define EKEY_MAX_REQUEST 255
+
+/** Most EGD blocking read commands sent at once. */
+#define EKEY_MAX_PIPELINE 16
+
+/** EGD commands. */
+#define EGD_CMD_BLOCKREAD 0x02
+#define EGD_CMD_EXTVERSION 0x10
+#define EGD_CMD_BLOCKREAD32 0x12
+
+/** Seconds a server may take to send anything before it is failed. */
+#define EKEY_READ_TIMEOUT 10
+
+/** Seconds a server may take to accept a connection before it is failed. */
+#define EKEY_CONNECT_TIMEOUT 5
+
+/** Interval at which a connect in progress checks for ekey_fini. */
+#define EKEY_CONNECT_POLL_MS 100
+
+/** Delay after every server has failed, doubling to EKEY_MAX_BACKOFF_MS. */
+#define EKEY_MIN_BACKOFF_MS 100
+#define EKEY_MAX_BACKOFF_MS 5000
+
+/** Library state, all protected by the lock apart from the file
+ * descriptor which only the fill thread reads from.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t filled; /**< Signalled as entropy arrives. */
+    pthread_cond_t drained; /**< Signalled when a refill is due or on stop. */
+
+    pthread_t thread;
+    bool running; /**< The fill thread has been started. */
+    bool stop; /**< The fill thread should exit. */
+
+    uint8_t *buf; /**< The buffer, NULL until the library is started. */
+    size_t size;
+    size_t head; /**< Offset of the oldest buffered byte. */
+    size_t fill; /**< Bytes buffered. */
+    size_t low; /**< Refill when fewer bytes are buffered. */
+    bool locked; /**< The buffer is locked into memory. */
+    unsigned int timeout_ms;
+
+    char *servers[EKEY_MAX_SERVERS];
+    signed char extended[EKEY_MAX_SERVERS]; /**< Extension support, -1 not yet known. */
+    int nservers;
+    int current; /**< Index of the server in use or to try next. */
+    int fd; /**< Connection to the current server or -1. */
+
+    ekey_stats_t stats;
+} lib = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+static pthread_once_t lib_once = PTHREAD_ONCE_INIT;
+static pthread_condattr_t lib_condattr;
+
+static void
+ekey_deadline(struct timespec *ts, unsigned int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void
+ekey_init_sync(void)
+{
+    pthread_cond_init(&lib.filled, &lib_condattr);
+    pthread_cond_init(&lib.drained, &lib_condattr);
+}
+
+static void
+ekey_atfork_prepare(void)
+{
+    pthread_mutex_lock(&lib.lock);
+}
+
+static void
+ekey_atfork_parent(void)
+{
+    pthread_mutex_unlock(&lib.lock);
+}
+
+/** Give a forked child a fresh start.
+ *
+ * The fill thread does not exist in the child and the buffered entropy
+ * must not be returned by both processes, so the buffer is emptied and
+ * the thread restarted on the next read.
+ */
+static void
+ekey_atfork_child(void)
+{
+    pthread_mutex_init(&lib.lock, NULL);
+    ekey_init_sync();
+
+    if (lib.buf != NULL)
+        memset(lib.buf, 0, lib.size);
+    lib.head = lib.fill = 0;
+    lib.running = false;
+    lib.stop = false;
+    memset(&lib.stats, 0, sizeof(lib.stats));
+
+    if (lib.fd != -1) {
+        /* the parent's connection, which may be mid request */
+        close(lib.fd);
+        lib.fd = -1;
+    }
+}
+
+static void
+ekey_once(void)
+{
+    pthread_condattr_init(&lib_condattr);
+    pthread_condattr_setclock(&lib_condattr, CLOCK_MONOTONIC);
+    ekey_init_sync();
+
+    pthread_atfork(ekey_atfork_prepare, ekey_atfork_parent, ekey_atfork_child);
+}
+
+/** Wait on a condition until the deadline, or forever if it is NULL. */
+static int
+ekey_wait(pthread_cond_t *cond, const struct timespec *deadline)
+{
+    if (deadline == NULL)
+        return pthread_cond_wait(cond, &lib.lock);
+    return pthread_cond_timedwait(cond, &lib.lock, deadline);
+}
+
+/** Connect a socket without blocking beyond EKEY_CONNECT_TIMEOUT.
+ *
+ * The connect is abandoned as soon as the library is stopped, so ekey_fini
+ * never waits on an unresponsive server.
+ *
+ * @return 0 on success or -1 and errno set.
+ */
+static int
+ekey_connect_fd(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    socklen_t len = sizeof(int);
+    int waited = 0;
+    int error = 0;
+    int flags;
+    bool stop;
+
+    flags = fcntl(fd, F_GETFL);
+    if ((flags == -1) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1))
+        return -1;
+
+    if (connect(fd, addr, addrlen) == -1) {
+        if (errno != EINPROGRESS)
+            return -1;
+
+        for (;;) {
+            pthread_mutex_lock(&lib.lock);
+            stop = lib.stop;
+            pthread_mutex_unlock(&lib.lock);
+            if (stop) {
+                errno = ECANCELED;
+                return -1;
+            }
+            if (waited >= (EKEY_CONNECT_TIMEOUT * 1000)) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+
+            error = poll(&pfd, 1, EKEY_CONNECT_POLL_MS);
+            if (error > 0)
+                break;
+            if ((error == -1) && (errno != EINTR))
+                return -1;
+            waited += EKEY_CONNECT_POLL_MS;
+        }
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+            return -1;
+        if (error != 0) {
+            errno = error;
+            return -1;
+        }
+    }
+
+    /* reads block, bounded by the receive timeout */
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/** Open a connection to a server.
+ *
+ * @param spec The server, a UNIX socket path or host with optional port.
+ * @return The connected socket or -1 and errno set.
+ */
+static int
+ekey_open_server(const char *spec)
+{
+    struct sockaddr_un addr_un;
+    struct addrinfo hints;
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    struct timeval tv = { EKEY_READ_TIMEOUT, 0 };
+    char *host;
+    char *port;
+    int fd = -1;
+    int err;
+
+    if (*spec == '/') {
+        if (strlen(spec) >= sizeof(addr_un.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&addr_un, 0, sizeof(addr_un));
+        addr_un.sun_family = AF_UNIX;
+        strcpy(addr_un.sun_path, spec);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1)
+            return -1;
+        if (ekey_connect_fd(fd, (struct sockaddr *)&addr_un,
+                            sizeof(addr_un)) == -1) {
+            err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    } else {
+        if (!split_hostport(spec, EKEY_DEFAULT_PORT, &host, &port))
+            return -1;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        err = getaddrinfo(host, port, &hints, &addrs);
+        free(host);
+        free(port);
+        if (err != 0) {
+            errno = EHOSTUNREACH;
+            return -1;
+        }
+
+        for (addr = addrs; addr != NULL; addr = addr->ai_next) {
+            fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd == -1)
+                continue;
+            if (ekey_connect_fd(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+                break;
+            err = errno;
+            close(fd);
+            fd = -1;
+            errno = err;
+        }
+        freeaddrinfo(addrs);
+        if (fd == -1)
+            return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
+
+/** Check whether the server on a fresh connection supports the extended
+ * commands.
+ *
+ * A server without them closes the connection, so the caller reconnects.
+ *
+ * @return true if the extension is supported.
+ */
+static bool
+ekey_probe_extended(int fd)
+{
+    uint8_t cmd = EGD_CMD_EXTVERSION;
+    uint8_t version;
+
+    if (send(fd, &cmd, 1, MSG_NOSIGNAL) != 1)
+        return false;
+
+    return (read(fd, &version, 1) == 1) && (version >= 1);
+}
+
+/** Close the current connection, if any. */
+static void
+ekey_disconnect(bool failed)
+{
+    int fd;
+
+    pthread_mutex_lock(&lib.lock);
+    fd = lib.fd;
+    lib.fd = -1;
+    if (failed) {
+        lib.stats.failovers++;
+        lib.current = (lib.current + 1) % lib.nservers;
+    }
+    pthread_mutex_unlock(&lib.lock);
+
+    if (fd != -1)
+        close(fd);
+}
+
+/** Connect to the first server, from the current one, which accepts.
+ *
+ * @return true if connected.
+ */
+static bool
+ekey_connect(void)
+{
+    int tries;
+    int idx;
+    int fd;
+
+    for (tries = 0; tries < lib.nservers; tries++) {
+        idx = lib.current;
+        fd = ekey_open_server(lib.servers[idx]);
+
+        if ((fd != -1) && (lib.extended[idx] == -1)) {
+            /* published while probing so ekey_fini can wake the read */
+            pthread_mutex_lock(&lib.lock);
+            lib.fd = fd;
+            pthread_mutex_unlock(&lib.lock);
+            lib.extended[idx] = ekey_probe_extended(fd);
+            pthread_mutex_lock(&lib.lock);
+            lib.fd = -1;
+            pthread_mutex_unlock(&lib.lock);
+            if (!lib.extended[idx]) {
+                close(fd);
+                fd = ekey_open_server(lib.servers[idx]);
+            }
+        }
+
+        pthread_mutex_lock(&lib.lock);
+        if (lib.stop) {
+            pthread_mutex_unlock(&lib.lock);
+            if (fd != -1)
+                close(fd);
+            return false;
+        }
+        if (fd != -1) {
+            lib.fd = fd;
+            lib.stats.connects++;
+            pthread_mutex_unlock(&lib.lock);
+            return true;
+        }
+        lib.stats.failovers++;
+        lib.current = (idx + 1) % lib.nservers;
+        pthread_mutex_unlock(&lib.lock);
+    }
+
+    return false;
+}
+
+/** Read entropy from the current server into the buffer.
+ *
+ * @param want The number of bytes to read, no more than the free space.
+ * @return true if all were read.
+ */
+static bool
+ekey_fetch(size_t want)
+{
+    uint8_t cmd[EKEY_MAX_PIPELINE * 5] = { 0 };
+    uint8_t chunk[4096];
+    size_t cmdlen = 0;
+    size_t req = 0;
+    size_t got = 0;
+    size_t part;
+    size_t tail;
+    ssize_t rd;
+
+    if (lib.extended[lib.current] > 0) {
+        req = (want < EKEY_EXT_MAX_REQUEST) ? want : EKEY_EXT_MAX_REQUEST;
+        cmd[cmdlen++] = EGD_CMD_BLOCKREAD32;
+        cmd[cmdlen++] = req >> 24;
+        cmd[cmdlen++] = req >> 16;
+        cmd[cmdlen++] = req >> 8;
+        cmd[cmdlen++] = req;
+    } else {
+        while ((req < want) && (cmdlen < sizeof(cmd))) {
+            part = ((want - req) < EKEY_MAX_REQUEST) ? (want - req) : EKEY_MAX_REQUEST;
+            cmd[cmdlen++] = EGD_CMD_BLOCKREAD;
+            cmd[cmdlen++] = part;
+            req += part;
+        }
+    }
+
+    if (send(lib.fd, cmd, cmdlen, MSG_NOSIGNAL) != (ssize_t)cmdlen)
+        return false;
+
+    while (got < req) {
+        part = ((req - got) < sizeof(chunk)) ? (req - got) : sizeof(chunk);
+        rd = read(lib.fd, chunk, part);
+        if (rd < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (rd == 0)
+            return false;
+
+        pthread_mutex_lock(&lib.lock);
+        tail = (lib.head + lib.fill) % lib.size;
+        part = lib.size - tail;
+        if (part > (size_t)rd)
+            part = rd;
+        memcpy(lib.buf + tail, chunk, part);
+        memcpy(lib.buf, chunk + part, rd - part);
+        lib.fill += rd;
+        lib.stats.bytes_read += rd;
+        pthread_cond_broadcast(&lib.filled);
+        pthread_mutex_unlock(&lib.lock);
+
+        got += rd;
+    }
+    memset(chunk, 0, sizeof(chunk));
+
+    return true;
+}
+
+/** Buffer fill thread. */
+static void *
+ekey_fill_thread(void *arg)
+{
+    unsigned int backoff = EKEY_MIN_BACKOFF_MS;
+    struct timespec deadline;
+    size_t want;
+    bool ok;
+
+    (void)arg;
+
+    pthread_mutex_lock(&lib.lock);
+    while (!lib.stop) {
+        if (lib.fill >= lib.low) {
+            pthread_cond_wait(&lib.drained, &lib.lock);
+            continue;
+        }
+
+        /* refill completely, as entropy is taken the space grows */
+        want = lib.size - lib.fill;
+        pthread_mutex_unlock(&lib.lock);
+
+        ok = ((lib.fd != -1) || ekey_connect());
+        while (ok && (want > 0)) {
+            ok = ekey_fetch(want);
+            if (ok) {
+                /* top up while there is room for a worthwhile request */
+                pthread_mutex_lock(&lib.lock);
+                want = lib.size - lib.fill;
+                if (lib.stop || (want < EKEY_MAX_REQUEST))
+                    want = 0;
+                pthread_mutex_unlock(&lib.lock);
+            }
+        }
+
+        pthread_mutex_lock(&lib.lock);
+        if (ok) {
+            backoff = EKEY_MIN_BACKOFF_MS;
+            continue;
+        }
+        if (lib.stop)
+            break;
+
+        /* move on to the next server, pausing so a server which accepts
+         * connections and then fails is not retried in a tight loop
+         */
+        pthread_mutex_unlock(&lib.lock);
+        ekey_disconnect(lib.fd != -1);
+        pthread_mutex_lock(&lib.lock);
+
+        ekey_deadline(&deadline, backoff);
+        while (!lib.stop &&
+               (pthread_cond_timedwait(&lib.drained, &lib.lock, &deadline) != ETIMEDOUT));
+        backoff *= 2;
+        if (backoff > EKEY_MAX_BACKOFF_MS)
+            backoff = EKEY_MAX_BACKOFF_MS;
+    }
+    pthread_mutex_unlock(&lib.lock);
+
+    ekey_disconnect(false);
+
+    return NULL;
+}
+
+/** Start the fill thread, with all signals blocked so the application's
+ * handlers do not run on it.  Called with the lock held.
+ */
+static int
+ekey_start_thread(void)
+{
+    sigset_t all;
+    sigset_t old;
+    int err;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&lib.thread, NULL, ekey_fill_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    lib.running = true;
+    return 0;
+}
+
+/** Free the server list. */
+static void
+ekey_free_servers(void)
+{
+    while (lib.nservers > 0)
+        free(lib.servers[--lib.nservers]);
+}
+
+/** Start the library, called with the lock held. */
+static int
+ekey_setup(const ekey_config_t *config)
+{
+    static const ekey_config_t defaults;
+    const char *spec;
+    const char *end;
+    size_t len;
+    void *buf;
+    int err;
+
+    if (config == NULL)
+        config = &defaults;
+
+    spec = config->servers;
+    if (spec == NULL)
+        spec = getenv(EKEY_SERVERS_ENV);
+    if ((spec == NULL) || (*spec == 0))
+        spec = EGDSOCKET;
+
+    while (*spec != 0) {
+        end = strchr(spec, ',');
+        len = (end != NULL) ? (size_t)(end - spec) : strlen(spec);
+        if (len > 0) {
+            if (lib.nservers == EKEY_MAX_SERVERS) {
+                ekey_free_servers();
+                errno = E2BIG;
+                return -1;
+            }
+            lib.servers[lib.nservers] = strndup(spec, len);
+            if (lib.servers[lib.nservers] == NULL) {
+                ekey_free_servers();
+                return -1;
+            }
+            lib.extended[lib.nservers++] = -1;
+        }
+        spec += len;
+        if (*spec == ',')
+            spec++;
+    }
+    if (lib.nservers == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    lib.size = (config->buffer_size != 0) ? config->buffer_size : EKEY_DEFAULT_BUFFER;
+    if (lib.size < EKEY_MIN_BUFFER)
+        lib.size = EKEY_MIN_BUFFER;
+    lib.low = (config->low_water != 0) ? config->low_water : (lib.size / 4);
+    if (lib.low > lib.size)
+        lib.low = lib.size;
+    lib.timeout_ms = config->timeout_ms;
+
+    buf = mmap(NULL, lib.size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        ekey_free_servers();
+        return -1;
+    }
+
+    /* keep the entropy out of swap and core files where the system
+     * allows, failure leaves it no worse than any other memory
+     */
+    lib.locked = (mlock(buf, lib.size) == 0);
+#ifdef MADV_DONTDUMP
+    madvise(buf, lib.size, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+    madvise(buf, lib.size, MADV_WIPEONFORK);
+#endif
+
+    lib.buf = buf;
+    lib.head = lib.fill = 0;
+    lib.current = 0;
+    lib.stop = false;
+    memset(&lib.stats, 0, sizeof(lib.stats));
+
+    if (ekey_start_thread() == -1) {
+        err = errno;
+        munmap(lib.buf, lib.size);
+        lib.buf = NULL;
+        ekey_free_servers();
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* exported interface, documented in libekey.h */
+int
+ekey_init(const ekey_config_t *config)
+{
+    int ret;
+
+    pthread_once(&lib_once, ekey_once);
+
+    pthread_mutex_lock(&lib.lock);
+    if (lib.buf != NULL) {
+        pthread_mutex_unlock(&lib.lock);
+        errno = EBUSY;
+        return -1;
+    }
+    ret = ekey_setup(config);
+    pthread_mutex_unlock(&lib.lock);
+
+    return ret;
+}
+
+/* exported interface, documented in libekey.h */
+ssize_t
+ekey_getrandom(void *buf, size_t len)
+{
+    uint8_t *dst = buf;
+    struct timespec deadline;
+    bool waited = false;
+    size_t done = 0;
+    size_t take;
+    size_t part;
+
+    pthread_once(&lib_once, ekey_once);
+
+    pthread_mutex_lock(&lib.lock);
+    if (((lib.buf == NULL) && (ekey_setup(NULL) == -1)) ||
+        (!lib.running && (ekey_start_thread() == -1))) {
+        pthread_mutex_unlock(&lib.lock);
+        return -1;
+    }
+
+    while (done < len) {
+        take = len - done;
+        if (take > lib.fill)
+            take = lib.fill;
+
+        if (take > 0) {
+            part = lib.size - lib.head;
+            if (part > take)
+                part = take;
+            memcpy(dst + done, lib.buf + lib.head, part);
+            memset(lib.buf + lib.head, 0, part);
+            memcpy(dst + done + part, lib.buf, take - part);
+            memset(lib.buf, 0, take - part);
+
+            lib.head = (lib.head + take) % lib.size;
+            lib.fill -= take;
+            done += take;
+
+            if (lib.fill < lib.low)
+                pthread_cond_signal(&lib.drained);
+            continue;
+        }
+
+        if (!waited) {
+            lib.stats.waits++;
+            if (lib.timeout_ms != 0)
+                ekey_deadline(&deadline, lib.timeout_ms);
+            waited = true;
+        }
+        if (ekey_wait(&lib.filled, (lib.timeout_ms != 0) ? &deadline : NULL) == ETIMEDOUT)
+            break;
+    }
+
+    lib.stats.bytes_served += done;
+    pthread_mutex_unlock(&lib.lock);
+
+    if ((done == 0) && (len > 0)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return done;
+}
+
+/* exported interface, documented in libekey.h */
+void
+ekey_getstats(ekey_stats_t *stats)
+{
+    pthread_mutex_lock(&lib.lock);
+    *stats = lib.stats;
+    stats->buffered = lib.fill;
+    pthread_mutex_unlock(&lib.lock);
+}
+
+/* exported interface, documented in libekey.h */
+void
+ekey_fini(void)
+{
+    bool running;
+
+    pthread_mutex_lock(&lib.lock);
+    if (lib.buf == NULL) {
+        pthread_mutex_unlock(&lib.lock);
+        return;
+    }
+
+    lib.stop = true;
+    pthread_cond_broadcast(&lib.drained);
+    if (lib.fd != -1)
+        shutdown(lib.fd, SHUT_RDWR); /* wake a blocked read */
+    running = lib.running;
+    pthread_mutex_unlock(&lib.lock);
+
+    if (running)
+        pthread_join(lib.thread, NULL);
+
+    pthread_mutex_lock(&lib.lock);
+    memset(lib.buf, 0, lib.size);
+    if (lib.locked)
+        munlock(lib.buf, lib.size);
+    munmap(lib.buf, lib.size);
+    lib.buf = NULL;
+    lib.running = false;
+    lib.head = lib.fill = 0;
+    ekey_free_servers();
+    pthread_mutex_unlock(&lib.lock);
+}
@@ -0,0 +1,88 @@
+/* daemon/libekey.h
+ *
+ * Client library for reading entropy from ekeyd
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef LIBEKEY_H
+#define LIBEKEY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Environment variable naming the EGD servers to use. */
+#define EKEY_SERVERS_ENV "EKEY_EGD_SERVERS"
+
+/** Default buffer size in bytes. */
+#define EKEY_DEFAULT_BUFFER 65536
+
+/** Library configuration, zero fields take their defaults. */
+typedef struct {
+    /** Comma separated EGD servers, tried in order.  Each is the path of
+     * a UNIX domain socket or a host with an optional port (default
+     * 8888).  If NULL the EKEY_EGD_SERVERS environment variable is used,
+     * or failing that the default ekeyd EGD socket.
+     */
+    const char *servers;
+    size_t buffer_size; /**< Size of the prefetch buffer in bytes. */
+    size_t low_water; /**< Refill once fewer bytes are buffered, default a quarter of the buffer. */
+    unsigned int timeout_ms; /**< Longest ekey_getrandom() waits for entropy, 0 forever. */
+} ekey_config_t;
+
+/** Library statistics. */
+typedef struct {
+    unsigned long long bytes_read; /**< Bytes read from servers. */
+    unsigned long long bytes_served; /**< Bytes returned to the application. */
+    unsigned long waits; /**< Calls which had to wait for the buffer to refill. */
+    unsigned long connects; /**< Connections made to servers. */
+    unsigned long failovers; /**< Connections lost or refused. */
+    size_t buffered; /**< Bytes currently buffered. */
+} ekey_stats_t;
+
+/** Start the library.
+ *
+ * Allocates the buffer, locked into memory where permitted, and starts
+ * the thread which fills it.  Calling this is optional, the first
+ * ekey_getrandom() starts the library with the default configuration.
+ *
+ * @param config The configuration, or NULL for the defaults.
+ * @return 0 on success or -1 and errno set.
+ */
+extern int ekey_init(const ekey_config_t *config);
+
+/** Read entropy.
+ *
+ * Bytes are copied from the buffer, which is refilled in the background
+ * once it runs low, so a call normally returns without waiting.  Each
+ * byte is only ever returned once and is wiped from the buffer as it is
+ * taken.  A process forked from one using the library starts with an
+ * empty buffer.
+ *
+ * @param buf Where to put the entropy.
+ * @param len The number of bytes wanted.
+ * @return \a len, fewer bytes if the timeout expired after some were
+ *         read, or -1 and errno set to ETIMEDOUT if none were.
+ */
+extern ssize_t ekey_getrandom(void *buf, size_t len);
+
+/** Get the library statistics.
+ *
+ * @param stats Updated with the statistics.
+ */
+extern void ekey_getstats(ekey_stats_t *stats);
+
+/** Stop the library, wiping and freeing the buffer. */
+extern void ekey_fini(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBEKEY_H */
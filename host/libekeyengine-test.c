@@ -0,0 +1,214 @@
+/* daemon/libekeyengine-test.c
+ *
+ * Drive simulated keys through the engine library.
+ *
+ * Each engine keys its keys from its own keyring and hands their entropy
+ * to its own entropy function.  The test is linked against the library,
+ * so it checks the modules as they are built for it.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "usbtrans.h"
+#include "pem.h"
+#include "util.h"
+#include "libekeyengine.h"
+#include "check.h"
+
+/** Length of a PEM encoded serial number. */
+#define SERIAL_PEM_LEN 16
+
+/** Length of a PEM encoded long term key. */
+#define LTKEY_PEM_LEN 44
+
+/** Least entropy the keyed engine must deliver. */
+#define TEST_ENTROPY (64 * 1024)
+
+/** Milliseconds allowed for the keys to deliver it. */
+#define TEST_TIMEOUT 30000
+
+/** A simulated key and the engine driving it. */
+typedef struct {
+    ekey_engine_t *engine;
+    ekey_engine_key_t *key;
+    usbtrans_dev_t *dev; /**< The simulated key. */
+    int fd; /**< The key's end of the socket the engine reads. */
+    uint8_t cmd[USBTRANS_TX_SIZE]; /**< Data from the engine not yet taken by the key. */
+    size_t cmd_len;
+    unsigned long long entropy; /**< Bytes passed to the entropy function. */
+    unsigned long calls; /**< Calls to the entropy function. */
+    unsigned long misdirected; /**< Calls for a key of another engine. */
+    unsigned int health; /**< Health given by the latest call. */
+} test_key_t;
+
+static void
+test_entropy(ekey_engine_key_t *key, const void *buf, size_t len,
+             unsigned int health, void *pw)
+{
+    test_key_t *tk = pw;
+
+    if (key != tk->key)
+        tk->misdirected++;
+    tk->entropy += len;
+    tk->calls++;
+    tk->health = health;
+}
+
+/* the simulated key's output goes to the engine over the socket */
+static void
+test_rx(usbtrans_dev_t *dev, const uint8_t *buf, size_t len, void *pw)
+{
+    test_key_t *tk = pw;
+    ssize_t wr;
+
+    while (len > 0) {
+        wr = write(tk->fd, buf, len);
+        if (wr <= 0)
+            return;
+        buf += wr;
+        len -= wr;
+    }
+}
+
+static void
+test_gone(usbtrans_dev_t *dev, int error, void *pw)
+{
+}
+
+static bool
+readable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/** Open a simulated key on an engine.
+ *
+ * @param bus The simulated bus, which sets the key's serial number.
+ */
+static bool
+test_open(test_key_t *tk, const char *bus)
+{
+    int sv[2];
+
+    memset(tk, 0, sizeof(*tk));
+
+    tk->engine = ekey_engine_create(test_entropy, tk);
+    if (tk->engine == NULL)
+        return false;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        return false;
+    tk->fd = sv[0];
+
+    tk->key = ekey_engine_attach(tk->engine, bus, sv[1]);
+    if (tk->key == NULL)
+        return false;
+
+    tk->dev = usbtrans_fake.open(bus, "0", test_rx, test_gone, tk);
+    return tk->dev != NULL;
+}
+
+/** Pass everything waiting in each direction between a key and its engine. */
+static void
+test_pump(test_key_t *tk)
+{
+    ssize_t rd;
+
+    while (readable(ekey_engine_fd(tk->key)))
+        ekey_engine_run(tk->key);
+
+    if ((tk->cmd_len == 0) && readable(tk->fd)) {
+        rd = read(tk->fd, tk->cmd, sizeof(tk->cmd));
+        if (rd > 0)
+            tk->cmd_len = rd;
+    }
+
+    if (tk->cmd_len > 0) {
+        rd = usbtrans_fake.write(tk->dev, tk->cmd, tk->cmd_len);
+        if (rd > 0) {
+            tk->cmd_len -= rd;
+            memmove(tk->cmd, tk->cmd + rd, tk->cmd_len);
+        }
+    }
+}
+
+static void
+test_close(test_key_t *tk)
+{
+    usbtrans_fake.close(tk->dev);
+    ekey_engine_destroy(tk->engine);
+    close(tk->fd);
+}
+
+int
+main(void)
+{
+    static const uint8_t ltkey[32] = USBTRANS_FAKE_LTKEY;
+    uint8_t snum[12];
+    char serial[SERIAL_PEM_LEN + 1] = "";
+    char ltkeypem[LTKEY_PEM_LEN + 1] = "";
+    test_key_t good;
+    test_key_t bad;
+    ekey_engine_stats_t stats;
+    uint64_t deadline;
+
+    memcpy(snum, USBTRANS_FAKE_SERIAL, sizeof(snum));
+    snum[11] = 1;
+    pem64_encode_bytes(snum, sizeof(snum), serial);
+    pem64_encode_bytes(ltkey, sizeof(ltkey), ltkeypem);
+
+    if (!test_open(&good, "fake1") || !test_open(&bad, "fake2")) {
+        perror("open");
+        return 1;
+    }
+
+    /* only the first engine's keyring holds the key */
+    CHECK(ekey_engine_addkey(good.engine, serial, "short") == -1);
+    CHECK(errno == EINVAL);
+    CHECK(ekey_engine_addkey(good.engine, serial, ltkeypem) == 0);
+    CHECK(ekey_engine_keyring(bad.engine, "/nonexistent/keyring") == -1);
+
+    deadline = monotonic_ms() + TEST_TIMEOUT;
+    while ((good.entropy < TEST_ENTROPY) && (monotonic_ms() < deadline)) {
+        usbtrans_fake.handle_events();
+        test_pump(&good);
+        test_pump(&bad);
+    }
+
+    /* the keyed engine's entropy went to its own function */
+    ekey_engine_getstats(good.key, &stats);
+    CHECK(stats.status == EKEY_ENGINE_KEYED);
+    CHECK(strcmp(stats.serial, serial) == 0);
+    CHECK(good.entropy >= TEST_ENTROPY);
+    CHECK(stats.entropy == good.entropy);
+    CHECK(good.misdirected == 0);
+    CHECK(good.health == 100);
+    CHECK(stats.health == 100);
+    CHECK(stats.rekeys >= 1);
+
+    /* the other could not find the key in its keyring */
+    ekey_engine_getstats(bad.key, &stats);
+    CHECK(stats.status == EKEY_ENGINE_BADKEY);
+    CHECK(stats.entropy == 0);
+    CHECK(bad.calls == 0);
+
+    test_close(&good);
+    test_close(&bad);
+
+    return check_result("libekeyengine");
+}
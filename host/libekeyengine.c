@@ -0,0 +1,297 @@
+/* daemon/libekeyengine.c
+ *
+ * Embeddable engine driving entropy keys within an application
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pem.h"
+#include "stream.h"
+#include "keydb.h"
+#include "connection.h"
+#include "libekeyengine.h"
+
+/** Length of a PEM encoded serial number. */
+#define SERIAL_PEM_LEN 16
+
+/** Length of a PEM encoded long term key. */
+#define LTKEY_PEM_LEN 44
+
+struct ekey_engine_s {
+    keydb_t *keydb; /**< Keyring the engine's keys are keyed from. */
+    ekey_engine_entropy_fn *entropy_fn; /**< Takes the keys' entropy. */
+    void *pw; /**< Private word passed to entropy_fn. */
+    ekey_engine_key_t *keys; /**< Keys open on the engine. */
+};
+
+struct ekey_engine_key_s {
+    ekey_engine_key_t *next; /**< Next key open on the engine. */
+    ekey_engine_t *engine; /**< The engine the key was opened on. */
+    econ_state_t *econ; /**< The key's connection. */
+};
+
+/* exported interface documented in libekeyengine.h */
+ekey_engine_t *
+ekey_engine_create(ekey_engine_entropy_fn *entropy_fn, void *pw)
+{
+    ekey_engine_t *engine;
+
+    if (entropy_fn == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    engine = calloc(1, sizeof(*engine));
+    if (engine == NULL)
+        return NULL;
+
+    engine->keydb = keydb_new(0);
+    if (engine->keydb == NULL) {
+        free(engine);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    engine->entropy_fn = entropy_fn;
+    engine->pw = pw;
+
+    return engine;
+}
+
+/* exported interface documented in libekeyengine.h */
+int
+ekey_engine_keyring(ekey_engine_t *engine, const char *fname)
+{
+    ekey_engine_key_t *key;
+    keydb_t *db;
+    int keys;
+
+    db = keydb_read(fname, &keys);
+    if (db == NULL)
+        return -1;
+
+    /* keys look their long term key up when they identify themselves */
+    for (key = engine->keys; key != NULL; key = key->next)
+        key->econ->keydb = db;
+
+    keydb_free(engine->keydb);
+    engine->keydb = db;
+
+    return keys;
+}
+
+/* exported interface documented in libekeyengine.h */
+int
+ekey_engine_addkey(ekey_engine_t *engine, const char *serial,
+                   const char *ltkey)
+{
+    uint8_t snum[12];
+    uint8_t key[32 + 1];
+    int res;
+
+    if ((strlen(serial) != SERIAL_PEM_LEN) ||
+        (strlen(ltkey) != LTKEY_PEM_LEN)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pem64_decode_bytes(serial, SERIAL_PEM_LEN, snum);
+    pem64_decode_bytes(ltkey, LTKEY_PEM_LEN, key);
+
+    res = keydb_insert(engine->keydb, snum, key);
+    memset(key, 0, sizeof(key));
+    if (res == -1)
+        errno = ENOMEM;
+
+    return res;
+}
+
+/** Pass entropy from a key's connection to the application. */
+static void
+engine_entropy(econ_state_t *econ, const uint8_t *buf, size_t count, void *pw)
+{
+    ekey_engine_key_t *key = pw;
+
+    key->engine->entropy_fn(key, buf, count, econ->key_health,
+                            key->engine->pw);
+}
+
+/** Drive a key's stream from an engine.
+ *
+ * @param engine The engine.
+ * @param name The name of the key.
+ * @param stream The key's stream, owned by the key on success.
+ * @return The key or NULL and errno set.
+ */
+static ekey_engine_key_t *
+engine_add(ekey_engine_t *engine, const char *name, estream_state_t *stream)
+{
+    ekey_engine_key_t *key;
+
+    key = calloc(1, sizeof(*key));
+    if (key == NULL)
+        return NULL;
+
+    key->econ = econ_attach(name, stream, NULL);
+    if ((key->econ == NULL) || (key->econ->epkt == NULL)) {
+        if (key->econ != NULL) {
+            key->econ->key_stream = NULL; /* the caller still owns it */
+            econ_close(key->econ);
+        }
+        free(key);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    key->econ->keydb = engine->keydb;
+    key->econ->entropy_fn = engine_entropy;
+    key->econ->entropy_pw = key;
+
+    key->engine = engine;
+    key->next = engine->keys;
+    engine->keys = key;
+
+    return key;
+}
+
+/* exported interface documented in libekeyengine.h */
+ekey_engine_key_t *
+ekey_engine_open(ekey_engine_t *engine, const char *path)
+{
+    estream_state_t *stream;
+    ekey_engine_key_t *key;
+
+    stream = estream_open(path);
+    if (stream == NULL)
+        return NULL;
+
+    key = engine_add(engine, path, stream);
+    if (key == NULL) {
+        int err = errno;
+
+        estream_close(stream);
+        errno = err;
+    }
+
+    return key;
+}
+
+/* exported interface documented in libekeyengine.h */
+ekey_engine_key_t *
+ekey_engine_attach(ekey_engine_t *engine, const char *name, int fd)
+{
+    estream_state_t *stream;
+    ekey_engine_key_t *key;
+
+    stream = estream_adopt(name, fd);
+    if (stream == NULL)
+        return NULL;
+
+    key = engine_add(engine, name, stream);
+    if (key == NULL) {
+        /* the descriptor stays with the application */
+        stream->estream_close = NULL;
+        estream_close(stream);
+    }
+
+    return key;
+}
+
+/* exported interface documented in libekeyengine.h */
+int
+ekey_engine_fd(ekey_engine_key_t *key)
+{
+    return econ_get_rd_fd(key->econ);
+}
+
+/* exported interface documented in libekeyengine.h */
+int
+ekey_engine_run(ekey_engine_key_t *key)
+{
+    econ_run(key->econ);
+
+    return (econ_state(key->econ) == ESTATE_CLOSE) ? 0 : 1;
+}
+
+/* exported interface documented in libekeyengine.h */
+void
+ekey_engine_getstats(ekey_engine_key_t *key, ekey_engine_stats_t *stats)
+{
+    econ_state_t *econ = key->econ;
+    char *serial;
+
+    memset(stats, 0, sizeof(*stats));
+
+    switch (econ_state(econ)) {
+    case ESTATE_CLOSE:
+        stats->status = EKEY_ENGINE_CLOSED;
+        break;
+
+    case ESTATE_UNTRUSTED:
+        stats->status = EKEY_ENGINE_BADKEY;
+        break;
+
+    case ESTATE_SESSION:
+    case ESTATE_SESSION_SENT:
+        stats->status = EKEY_ENGINE_GOODSERIAL;
+        break;
+
+    case ESTATE_KEYED_FIRST:
+    case ESTATE_KEYED:
+        stats->status = EKEY_ENGINE_KEYED;
+        break;
+
+    default:
+        stats->status = EKEY_ENGINE_UNKNOWN;
+        break;
+    }
+
+    serial = econ_getsnum(econ);
+    if (serial != NULL) {
+        strncpy(stats->serial, serial, sizeof(stats->serial) - 1);
+        free(serial);
+    }
+
+    stats->health = econ->key_health;
+    stats->entropy = econ->con_entropy;
+    stats->lost_entropy = econ->con_lost_entropy;
+    stats->packets = econ->con_pkts;
+    stats->resets = econ->con_reset;
+    stats->rekeys = econ->con_rekeys;
+}
+
+/* exported interface documented in libekeyengine.h */
+void
+ekey_engine_close(ekey_engine_key_t *key)
+{
+    ekey_engine_key_t **prev;
+
+    for (prev = &key->engine->keys; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == key) {
+            *prev = key->next;
+            break;
+        }
+    }
+
+    econ_close(key->econ);
+    free(key);
+}
+
+/* exported interface documented in libekeyengine.h */
+void
+ekey_engine_destroy(ekey_engine_t *engine)
+{
+    while (engine->keys != NULL)
+        ekey_engine_close(engine->keys);
+
+    keydb_free(engine->keydb);
+    free(engine);
+}
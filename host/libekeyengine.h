@@ -0,0 +1,156 @@
+/* daemon/libekeyengine.h
+ *
+ * Embeddable engine driving entropy keys within an application
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef LIBEKEYENGINE_H
+#define LIBEKEYENGINE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** An engine, holding a keyring and the keys opened with it. */
+typedef struct ekey_engine_s ekey_engine_t;
+
+/** An entropy key driven by an engine. */
+typedef struct ekey_engine_key_s ekey_engine_key_t;
+
+/** Key status, as reported by ekey_engine_getstats(). */
+typedef enum {
+    EKEY_ENGINE_UNKNOWN = 0, /**< The key has not yet identified itself. */
+    EKEY_ENGINE_GOODSERIAL, /**< The serial number is known, the session is being keyed. */
+    EKEY_ENGINE_KEYED, /**< The key is keyed and sending entropy. */
+    EKEY_ENGINE_BADKEY, /**< The key is not in the keyring or failed to key. */
+    EKEY_ENGINE_CLOSED, /**< The key's stream has closed. */
+} ekey_engine_status_t;
+
+/** Receive entropy from a key.
+ *
+ * @param key The key the entropy came from.
+ * @param buf The decrypted entropy, only valid during the call.
+ * @param len The length of \a buf.
+ * @param health The key's health in percent, which the entropy should be
+ *               credited by.
+ * @param pw The private word given to ekey_engine_create().
+ */
+typedef void (ekey_engine_entropy_fn)(ekey_engine_key_t *key, const void *buf,
+                                      size_t len, unsigned int health,
+                                      void *pw);
+
+/** Key statistics. */
+typedef struct {
+    ekey_engine_status_t status; /**< The key's status. */
+    char serial[17]; /**< PEM encoded serial number, empty until the key sends it. */
+    unsigned int health; /**< Health in percent derived from the key's estimates. */
+    unsigned long long entropy; /**< Bytes of entropy delivered. */
+    unsigned long long lost_entropy; /**< Bytes of entropy lost to resets and rekeying. */
+    unsigned long packets; /**< Packets processed. */
+    unsigned long resets; /**< Times the key was reset. */
+    unsigned long rekeys; /**< Times the session key was set. */
+} ekey_engine_stats_t;
+
+/** Create an engine.
+ *
+ * The engine starts with an empty keyring.  Engines share nothing, each
+ * may be used from a different thread, but an engine and its keys must
+ * only be used from one thread at a time.
+ *
+ * @param entropy_fn Called with the entropy each key produces.
+ * @param pw Private word passed to \a entropy_fn.
+ * @return The engine or NULL and errno set.
+ */
+extern ekey_engine_t *ekey_engine_create(ekey_engine_entropy_fn *entropy_fn,
+                                         void *pw);
+
+/** Replace an engine's keyring with one read from a file.
+ *
+ * The file is in the format ekey-setkey(8) maintains.  The keyring in use
+ * is kept if the file cannot be read.  Keys already keyed carry on with
+ * the long term key they were keyed with.
+ *
+ * @param engine The engine.
+ * @param fname The keyring file.
+ * @return The number of keys read or -1 and errno set.
+ */
+extern int ekey_engine_keyring(ekey_engine_t *engine, const char *fname);
+
+/** Add a key to an engine's keyring.
+ *
+ * @param engine The engine.
+ * @param serial The PEM encoded serial number, 16 characters.
+ * @param ltkey The PEM encoded long term key, 44 characters.
+ * @return 0 on success or -1 and errno set.
+ */
+extern int ekey_engine_addkey(ekey_engine_t *engine, const char *serial,
+                              const char *ltkey);
+
+/** Open an entropy key.
+ *
+ * @param engine The engine.
+ * @param path The key's device node, a UNIX domain socket or a tcp:host:port
+ *             stream served by ekey-netd(8).
+ * @return The key or NULL and errno set.
+ */
+extern ekey_engine_key_t *ekey_engine_open(ekey_engine_t *engine,
+                                           const char *path);
+
+/** Drive an entropy key the application has already opened.
+ *
+ * @param engine The engine.
+ * @param name Name of the key, used in log messages.
+ * @param fd The key's file descriptor, owned by the key on success.
+ * @return The key or NULL and errno set.
+ */
+extern ekey_engine_key_t *ekey_engine_attach(ekey_engine_t *engine,
+                                             const char *name, int fd);
+
+/** Get the file descriptor to wait on for a key.
+ *
+ * @param key The key.
+ * @return The file descriptor, which becomes readable when
+ *         ekey_engine_run() should be called.
+ */
+extern int ekey_engine_fd(ekey_engine_key_t *key);
+
+/** Process input from a key.
+ *
+ * One packet is read and handled, which may deliver entropy to the
+ * engine's entropy function before this returns.
+ *
+ * @param key The key.
+ * @return 1 while the key is open, 0 once its stream has closed.
+ */
+extern int ekey_engine_run(ekey_engine_key_t *key);
+
+/** Get a key's statistics.
+ *
+ * @param key The key.
+ * @param stats Updated with the statistics.
+ */
+extern void ekey_engine_getstats(ekey_engine_key_t *key,
+                                 ekey_engine_stats_t *stats);
+
+/** Close a key.
+ *
+ * @param key The key.
+ */
+extern void ekey_engine_close(ekey_engine_key_t *key);
+
+/** Destroy an engine, closing any keys still open and freeing its keyring.
+ *
+ * @param engine The engine.
+ */
+extern void ekey_engine_destroy(ekey_engine_t *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBEKEYENGINE_H */
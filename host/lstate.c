@@ -17,11 +17,22 @@
 #include <pwd.h>
 #include <grp.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <dirent.h>
+#include <syslog.h>
+#ifdef EKEY_OS_LINUX
+#include <sys/inotify.h>
+#endif
 
 #include "lstate.h"
+#include "handoff.h"
 #include "keydb.h"
 #include "stats.h"
+#include "filesink.h"
+#include "util.h"
+#ifdef EKEY_IO_URING
+#include "uring.h"
+#endif
 
 #include <lua.h>
 #include <lualib.h>
@@ -80,6 +91,29 @@ l_add_ekey(lua_State *L)
     return 1;
 }
 
+static int
+l_record_ekey(lua_State *L)
+{
+    OpaqueEkey *ekey = (OpaqueEkey *)lua_touserdata(L, 1);
+    const char *fname = luaL_checkstring(L, 2);
+
+    if (ekey == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Unable to record a NULL ekey.");
+        return 2;
+    }
+
+    if (!record_ekey(ekey, fname)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not record to '%s'. Errno was %d (%s)",
+                        fname, errno, strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int
 l_del_ekey(lua_State *L)
 {
@@ -100,6 +134,7 @@ l_stat_ekey(lua_State *L)
 {
     OpaqueEkey *ekey = (OpaqueEkey *)lua_touserdata(L, 1);
     connection_stats_t *key_stats;
+    int bucket;
 
     if (ekey == NULL) {
         lua_pushnil(L);
@@ -133,6 +168,32 @@ l_stat_ekey(lua_State *L)
     L_KEY_STAT(ConnectionResets, con_reset);
     L_KEY_STAT(ConnectionNonces, con_nonces);
     L_KEY_STAT(ConnectionRekeys, con_rekeys);
+    L_KEY_STAT(ConnectionFirstEntropyMs, con_first_entropy);
+    L_KEY_STAT(ConnectionLostEntropy, con_lost_entropy);
+    L_KEY_STAT(ConnectionReopens, con_reopens);
+    L_KEY_STAT(ConnectionStalls, con_stalls);
+    L_KEY_STAT(ConnectionDowntimeMs, con_downtime_ms);
+
+    L_KEY_STAT(StateInitMs, state_ms[ESTATE_INIT]);
+    L_KEY_STAT(StateClosedMs, state_ms[ESTATE_CLOSE]);
+    L_KEY_STAT(StateUntrustedMs, state_ms[ESTATE_UNTRUSTED]);
+    L_KEY_STAT(StateSessionMs, state_ms[ESTATE_SESSION]);
+    L_KEY_STAT(StateSessionSentMs, state_ms[ESTATE_SESSION_SENT]);
+    L_KEY_STAT(StateKeyedFirstMs, state_ms[ESTATE_KEYED_FIRST]);
+    L_KEY_STAT(StateKeyedBadMs, state_ms[ESTATE_KEYED_BAD]);
+    L_KEY_STAT(StateKeyedMs, state_ms[ESTATE_KEYED]);
+
+    L_KEY_STAT(RekeyRttLastMs, rekey_rtt_last);
+    L_KEY_STAT(RekeyRttMaxMs, rekey_rtt_max);
+    L_KEY_STAT(RekeyRttMeanMs, rekey_rtt_mean);
+    for (bucket = 0; bucket < ECON_RTT_BUCKETS; bucket++) {
+        if (bucket < (ECON_RTT_BUCKETS - 1))
+            lua_pushfstring(L, "RekeyRttUnder%dMs", 8 << bucket);
+        else
+            lua_pushfstring(L, "RekeyRttOver%dMs", 4 << bucket);
+        lua_pushnumber(L, key_stats->rekey_rtt[bucket]);
+        lua_settable(L, -3);
+    }
 
     L_KEY_STAT(KeyRawShannonPerByteL, key_raw_entl);
     L_KEY_STAT(KeyRawShannonPerByteR, key_raw_entr);
@@ -141,6 +202,8 @@ l_stat_ekey(lua_State *L)
     L_KEY_STAT(KeyDbsdShannonPerByteL, key_dbsd_entl);
     L_KEY_STAT(KeyDbsdShannonPerByteR, key_dbsd_entr);
 
+    L_KEY_STAT(KeyHealth, key_health);
+
     lua_pushliteral(L, "ConnectionTime");
     lua_pushnumber(L, (time(NULL) - key_stats->con_start));
     lua_settable(L, -3);
@@ -154,6 +217,60 @@ l_stat_ekey(lua_State *L)
     return 1;
 }
 
+static int
+l_trace_ekey(lua_State *L)
+{
+    OpaqueEkey *ekey = (OpaqueEkey *)lua_touserdata(L, 1);
+    char *dump;
+    size_t len;
+
+    if (ekey == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Unable to trace a NULL ekey.");
+        return 2;
+    }
+
+    dump = get_key_trace(ekey, &len);
+    if (dump == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Unable to get trace.");
+        return 2;
+    }
+
+    lua_pushlstring(L, dump, len);
+    free(dump);
+
+    return 1;
+}
+
+static int
+l_io_stats(lua_State *L)
+{
+#ifdef EKEY_IO_URING
+    const ekey_uring_stats_t *key_stats;
+
+    if (ekey_uring_active()) {
+        key_stats = ekey_uring_stats();
+
+        lua_newtable(L);
+
+        L_KEY_STAT(Submits, submits);
+        L_KEY_STAT(SubmissionEntries, sqes);
+        L_KEY_STAT(CompletionEntries, cqes);
+        L_KEY_STAT(Polls, polls);
+        L_KEY_STAT(Reads, reads);
+        L_KEY_STAT(BytesRead, read_bytes);
+        L_KEY_STAT(Writes, writes);
+        L_KEY_STAT(BytesWritten, write_bytes);
+
+        return 1;
+    }
+#endif
+    lua_pushnil(L);
+    lua_pushliteral(L, "io_uring backend not in use.");
+    return 2;
+}
+
 static int
 l_query_ekey(lua_State *L)
 {
@@ -232,7 +349,13 @@ l_query_ekey(lua_State *L)
 static int
 l_load_keys(lua_State *L)
 {
-    lua_pushnumber(L, read_keyring(luaL_checkstring(L, 1)));
+    int keys = read_keyring(luaL_checkstring(L, 1));
+
+    /* keep the keyring current as provisioning tools update it */
+    if (keys >= 0)
+        watch_keyring(luaL_checkstring(L, 1));
+
+    lua_pushnumber(L, keys);
     return 1;
 }
 
@@ -250,15 +373,106 @@ l_open_file_output(lua_State *L)
     return 2;
 }
 
+/* Fetch a numeric option from the table at index 2, or a default. */
+static lua_Number
+l_optfield(lua_State *L, const char *name, lua_Number def)
+{
+    lua_Number val;
+
+    lua_getfield(L, 2, name);
+    val = luaL_optnumber(L, -1, def);
+    lua_pop(L, 1);
+    return val;
+}
+
+static int
+l_open_sink_output(lua_State *L)
+{
+    filesink_config_t config;
+
+    memset(&config, 0, sizeof(config));
+    config.path = luaL_checkstring(L, 1);
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        config.buffer_size = l_optfield(L, "buffer", 0);
+        config.rotate_bytes = l_optfield(L, "rotate_size", 0);
+        config.rotate_secs = l_optfield(L, "rotate_time", 0);
+        config.fsync_secs = l_optfield(L, "fsync", 0);
+        lua_getfield(L, 2, "direct");
+        config.direct = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "preallocate");
+        config.preallocate = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+    }
+
+    if (open_sink_output(&config)) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_pushnil(L);
+    lua_pushfstring(L, "Cannot open %s: errno %d (%s)",
+                    config.path, errno, strerror(errno));
+    return 2;
+}
+
+static int
+l_sink_stats(lua_State *L)
+{
+    const filesink_stats_t *key_stats = filesink_stats();
+    uint64_t elapsed;
+
+    if (key_stats == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "File sink output not in use.");
+        return 2;
+    }
+
+    lua_newtable(L);
+
+    L_KEY_STAT(BytesWritten, bytes);
+    L_KEY_STAT(Writes, writes);
+    L_KEY_STAT(Fsyncs, fsyncs);
+    L_KEY_STAT(Rotations, rotations);
+    L_KEY_STAT(WriteErrors, errors);
+    L_KEY_STAT(BytesDropped, dropped);
+    L_KEY_STAT(BufferSize, buffer_size);
+    L_KEY_STAT(BufferOccupancy, buffered);
+
+    lua_pushliteral(L, "WriteMs");
+    lua_pushnumber(L, key_stats->write_us / 1000);
+    lua_settable(L, -3);
+
+    /* bytes per second overall and while in write calls */
+    elapsed = monotonic_ms() - key_stats->opened_ms;
+    lua_pushliteral(L, "Throughput");
+    lua_pushnumber(L, elapsed ? (key_stats->bytes * 1000) / elapsed : 0);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "WriteThroughput");
+    lua_pushnumber(L, key_stats->write_us ?
+                   (key_stats->bytes * 1000000) / key_stats->write_us : 0);
+    lua_settable(L, -3);
+
+    return 1;
+}
+
 static int
 l_open_kernel_output(lua_State *L)
 {
-    if (open_kernel_output(luaL_optnumber(L, 1, 4))) {
+    int bpb = luaL_optnumber(L, 1, 4);
+    int min_bpb = -1;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        min_bpb = l_optfield(L, "minimum", -1);
+    }
+
+    if (open_kernel_output(bpb, min_bpb)) {
+        lua_pushboolean(L, 1);
         return 1;
     }
     lua_pushnil(L);
     lua_pushfstring(L, "Cannot open kernel output for %d bits per byte: errno %d (%s)",
-                    luaL_optnumber(L, 1, 4), errno, strerror(errno));
+                    bpb, errno, strerror(errno));
     return 2;
 }
 
@@ -282,6 +496,71 @@ l_daemonise(lua_State *L)
     return 0;
 }
 
+static int
+l_flow_control(lua_State *L)
+{
+    set_flow_control(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int
+l_key_recovery(lua_State *L)
+{
+    set_key_recovery(lua_toboolean(L, 1), luaL_optnumber(L, 2, -1));
+    return 0;
+}
+
+static int
+l_seed_file(lua_State *L)
+{
+    const char *fname = luaL_optstring(L, 1, NULL);
+    int len;
+
+    len = use_seed_file(fname, luaL_optnumber(L, 2, 0), lua_toboolean(L, 3));
+    if (len >= 0) {
+        lua_pushnumber(L, len);
+        return 1;
+    }
+    lua_pushnil(L);
+    lua_pushfstring(L, "Cannot use seed file %s: errno %d (%s)",
+                    (fname != NULL) ? fname : "(none)", errno, strerror(errno));
+    return 2;
+}
+
+static int
+l_upgrade(lua_State *L)
+{
+    lua_pushboolean(L, request_upgrade());
+    return 1;
+}
+
+static int
+l_inherited_socket(lua_State *L)
+{
+    int fd;
+
+    if (!handoff_take(HANDOFF_SOCKET, luaL_checkstring(L, 1), NULL, NULL, &fd))
+        return 0;
+
+    lua_pushnumber(L, fd);
+    return 1;
+}
+
+static int
+l_inherited_keys(lua_State *L)
+{
+    const char *path;
+    unsigned int idx = 0;
+
+    lua_newtable(L);
+    while ((path = handoff_remaining(HANDOFF_KEY, idx)) != NULL) {
+        lua_pushstring(L, path);
+        lua_rawseti(L, -2, ++idx);
+    }
+
+    return 1;
+}
+
 static int
 l_unlink(lua_State *L)
 {
@@ -386,6 +665,146 @@ l_enumerate(lua_State *L)
     return 1;
 }
 
+static int
+l_watch_dir(lua_State *L)
+{
+#ifdef EKEY_OS_LINUX
+    const char *path = luaL_checkstring(L, 1);
+    int fd;
+    int err;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ((fd == -1) ||
+        (inotify_add_watch(fd, path,
+                           IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM |
+                           IN_DELETE_SELF | IN_MOVE_SELF) == -1)) {
+        err = errno;
+        if (fd != -1)
+            close(fd);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(err));
+        return 2;
+    }
+
+    lua_pushnumber(L, fd);
+    return 1;
+#else
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(ENOSYS));
+    return 2;
+#endif
+}
+
+static int
+l_read_watch(lua_State *L)
+{
+#ifdef EKEY_OS_LINUX
+    int fd = luaL_checkinteger(L, 1);
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    const char *op;
+    ssize_t len;
+    char *pos;
+    int i = 1;
+
+    lua_newtable(L);
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (pos = buf; pos < buf + len;
+             pos += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)pos;
+
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                op = "add";
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                op = "remove";
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                op = "gone";
+            } else {
+                continue;
+            }
+
+            /* each event is a table of { operation, name } */
+            lua_pushnumber(L, i++);
+            lua_newtable(L);
+            lua_pushnumber(L, 1);
+            lua_pushstring(L, op);
+            lua_settable(L, -3);
+            lua_pushnumber(L, 2);
+            lua_pushstring(L, (event->len > 0) ? event->name : "");
+            lua_settable(L, -3);
+            lua_settable(L, -3);
+        }
+    }
+#else
+    lua_newtable(L);
+#endif
+    return 1;
+}
+
+static int
+l_close_watch(lua_State *L)
+{
+    close(luaL_checkinteger(L, 1));
+    return 0;
+}
+
+static int
+l_peercred(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+#if defined(EKEY_OS_LINUX)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushnumber(L, cred.uid);
+    lua_pushnumber(L, cred.gid);
+    lua_pushnumber(L, cred.pid);
+    return 3;
+#elif defined(EKEY_OS_FREEBSD) || defined(EKEY_OS_OPENBSD) || \
+      defined(EKEY_OS_NETBSD) || defined(EKEY_OS_MIRBSD)
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    /* the peer's process id is not available */
+    lua_pushnumber(L, uid);
+    lua_pushnumber(L, gid);
+    return 2;
+#else
+    (void)fd;
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(ENOSYS));
+    return 2;
+#endif
+}
+
+static int
+l_user_id(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    struct passwd *pw;
+
+    if ((pw = getpwnam(name)) == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Unknown user '%s'", name);
+        return 2;
+    }
+
+    lua_pushnumber(L, pw->pw_uid);
+    return 1;
+}
+
 static const luaL_Reg lstate_funcs[] = {
     /* FD routines */
     {"_addfd", l_addfd},
@@ -395,21 +814,38 @@ static const luaL_Reg lstate_funcs[] = {
     /* EKey routines */
     {"_add_ekey", l_add_ekey},
     {"_del_ekey", l_del_ekey},
+    {"_record_ekey", l_record_ekey},
     {"_query_ekey", l_query_ekey},
     {"_stat_ekey", l_stat_ekey},
+    {"_trace_ekey", l_trace_ekey},
+    /* I/O backend routines */
+    {"_io_stats", l_io_stats},
     /* Keyring routines */
     {"_load_keys", l_load_keys},
     /* Output routines */
     {"_open_output_file", l_open_file_output},
     {"_open_kernel_output", l_open_kernel_output},
+    {"_open_sink_output", l_open_sink_output},
+    {"_sink_stats", l_sink_stats},
     {"_open_foldback_output", l_open_foldback_output},
     /* Daemon features */
     {"_daemonise", l_daemonise},
+    {"_flow_control", l_flow_control},
+    {"_key_recovery", l_key_recovery},
+    {"_seed_file", l_seed_file},
+    {"_upgrade", l_upgrade},
+    {"_inherited_socket", l_inherited_socket},
+    {"_inherited_keys", l_inherited_keys},
     /* OS access routines */
     {"_unlink", l_unlink},
     {"_chmod", l_chmod},
     {"_chown", l_chown},
     {"_enumerate", l_enumerate},
+    {"_watch_dir", l_watch_dir},
+    {"_read_watch", l_read_watch},
+    {"_close_watch", l_close_watch},
+    {"_peercred", l_peercred},
+    {"_user_id", l_user_id},
     /* Terminator */
     {NULL, NULL}
 };
@@ -466,6 +902,46 @@ lstate_runconfig(const char *conffile)
     return true;
 }
 
+bool
+lstate_reload(void)
+{
+    lua_State *L = L_conf;
+    lua_getglobal(L, "RELOAD");
+    if (lua_pcall(L, 0, 1, 0) != 0) {
+        syslog(LOG_ERR, "Unable to reload configuration: %s",
+               lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return false;
+    }
+    syslog(LOG_INFO, "%s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return true;
+}
+
+bool
+lstate_handoff_sockets(int sock)
+{
+    lua_State *L = L_conf;
+    bool ok = true;
+
+    lua_getglobal(L, "LISTENERS");
+    if (lua_pcall(L, 0, 1, 0) != 0) {
+        lua_pop(L, 1);
+        return false;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        if (ok && !handoff_send(sock, HANDOFF_SOCKET, lua_tostring(L, -2),
+                                NULL, 0, (int)lua_tonumber(L, -1)))
+            ok = false;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    return ok;
+}
+
 void
 lstate_controlbytes(void)
 {
@@ -499,3 +975,32 @@ lstate_foldback_entropy(const unsigned char *eblock, unsigned int ecount)
 
     return ecount;
 }
+
+int
+lstate_timer(void)
+{
+    lua_State *L = L_conf;
+    int timeout = -1;
+
+    lua_getglobal(L, "TIMER");
+    if (lua_pcall(L, 0, 1, 0) == 0)
+        timeout = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    return timeout;
+}
+
+bool
+lstate_foldback_demand(bool resuming)
+{
+    lua_State *L = L_conf;
+    bool demand = true;
+
+    lua_getglobal(L, "DEMAND");
+    lua_pushboolean(L, resuming);
+    if (lua_pcall(L, 1, 1, 0) == 0)
+        demand = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    return demand;
+}
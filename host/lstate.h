@@ -51,6 +51,25 @@ extern void lstate_finalise(void);
  */
 extern bool lstate_runconfig(const char *conffile);
 
+/**
+ * Reload the configuration file.
+ *
+ * The file given to ::lstate_runconfig is run again and the keys,
+ * listeners and other settings brought into line with it, leaving
+ * unchanged keys connected.  The outcome is reported to syslog.
+ *
+ * @return true on success, false if the reload failed in whole or part.
+ */
+extern bool lstate_reload(void);
+
+/**
+ * Hand the listening control and EGD sockets to an upgraded daemon.
+ *
+ * @param sock The handoff socket.
+ * @return true on success, false if any could not be sent.
+ */
+extern bool lstate_handoff_sockets(int sock);
+
 /**
  * Pass in some bytes to a control interface.
  *
@@ -101,6 +120,24 @@ extern bool lstate_request_daemonise(void);
  */
 extern ssize_t lstate_foldback_entropy(const unsigned char *eblock, unsigned int ecount);
 
+/**
+ * Ask the state whether it wants more foldback entropy.
+ *
+ * @param resuming true if input is paused for lack of demand.
+ * @return true if entropy passed to lstate_foldback_entropy() would be used.
+ *
+ * @note The state must previously have requested foldback output.
+ */
+extern bool lstate_foldback_demand(bool resuming);
+
+/**
+ * Run any work the state has scheduled for now.
+ *
+ * @return The poll timeout in milliseconds before this should be called
+ *         again, -1 if nothing is scheduled.
+ */
+extern int lstate_timer(void);
+
 /************************************** Callbacks ***************************/
 
 /**
@@ -0,0 +1,329 @@
+/* daemon/netstream.c
+ *
+ * Entropy Key stream over TCP
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "stream.h"
+#include "netstream.h"
+#include "util.h"
+
+/** Seconds of idle before keepalives start, between them and how many
+ * may be lost, so a dead peer is noticed in under a minute.
+ */
+#define NETSTREAM_KEEPIDLE 30
+#define NETSTREAM_KEEPINTVL 5
+#define NETSTREAM_KEEPCNT 4
+
+/* exported interface, documented in netstream.h */
+void
+netstream_tune(int fd)
+{
+    int one = 1;
+    int size = NETSTREAM_BUFFER;
+#ifdef TCP_KEEPIDLE
+    int idle = NETSTREAM_KEEPIDLE;
+    int intvl = NETSTREAM_KEEPINTVL;
+    int cnt = NETSTREAM_KEEPCNT;
+#endif
+
+    /* failures leave the defaults, which work but react more slowly */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef TCP_KEEPIDLE
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+#endif
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/** Addresses of a key server, resolved once. */
+typedef struct netstream_server_s {
+    struct netstream_server_s *next;
+    char *name; /**< The host and port as opened. */
+    struct addrinfo *addrs; /**< The server's addresses. */
+    struct addrinfo *addr; /**< The address connected to next. */
+} netstream_server_t;
+
+static netstream_server_t *servers;
+
+/** Return streams still connecting. */
+static bool netstream_async;
+
+/** Find or resolve the addresses of a key server. */
+static netstream_server_t *
+netstream_server(const char *name)
+{
+    netstream_server_t *server;
+    struct addrinfo hints;
+    char *host;
+    char *port;
+    int err;
+
+    for (server = servers; server != NULL; server = server->next) {
+        if (strcmp(server->name, name) == 0)
+            return server;
+    }
+
+    if (!split_hostport(name, NULL, &host, &port))
+        return NULL;
+
+    server = calloc(1, sizeof(*server));
+    if ((server == NULL) || ((server->name = strdup(name)) == NULL)) {
+        free(server);
+        free(host);
+        free(port);
+        return NULL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(host, port, &hints, &server->addrs);
+    free(host);
+    free(port);
+    if (err != 0) {
+        free(server->name);
+        free(server);
+        errno = (err == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return NULL;
+    }
+
+    server->addr = server->addrs;
+    server->next = servers;
+    servers = server;
+
+    return server;
+}
+
+/** Move a server on to its next address after a failed connect. */
+static void
+netstream_next_addr(const char *name)
+{
+    netstream_server_t *server;
+
+    for (server = servers; server != NULL; server = server->next) {
+        if (strcmp(server->name, name) == 0) {
+            server->addr = server->addr->ai_next;
+            if (server->addr == NULL)
+                server->addr = server->addrs;
+            return;
+        }
+    }
+}
+
+/** Start connecting to an address.
+ *
+ * @return The socket, in non-blocking mode, or -1 and errno set.
+ */
+static int
+tcp_start(const struct addrinfo *addr, bool *connecting)
+{
+    int fd;
+    int err;
+
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd == -1)
+        return -1;
+
+    /* a server which does not answer must not stall every other key */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    *connecting = false;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+        if (errno != EINPROGRESS) {
+            err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        *connecting = true;
+    }
+
+    return fd;
+}
+
+/** Finish a connect, leaving the socket in blocking mode.
+ *
+ * @return true once connected, false and errno set if the connect failed.
+ */
+static bool
+tcp_finish(int fd)
+{
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    if (err != 0) {
+        errno = err;
+        return false;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    netstream_tune(fd);
+
+    return true;
+}
+
+/** Connect to an address, waiting at most NETSTREAM_CONNECT_MS.
+ *
+ * @return The connected socket, in blocking mode, or -1 and errno set.
+ */
+static int
+tcp_connect(const struct addrinfo *addr)
+{
+    struct pollfd pfd;
+    bool connecting;
+    int fd;
+
+    fd = tcp_start(addr, &connecting);
+    if (fd == -1)
+        return -1;
+
+    if (connecting) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, NETSTREAM_CONNECT_MS) != 1) {
+            close(fd);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    if (!tcp_finish(fd)) {
+        int err = errno;
+
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+/* exported interface, documented in netstream.h */
+void
+netstream_set_async(bool async)
+{
+    netstream_async = async;
+}
+
+/* exported interface, documented in netstream.h */
+bool
+netstream_connected(estream_state_t *state, bool ready)
+{
+    if (!ready || !tcp_finish(state->fd)) {
+        int err = ready ? errno : ETIMEDOUT;
+
+        netstream_next_addr(state->uri + strlen(NETSTREAM_PREFIX));
+        errno = err;
+        return false;
+    }
+    state->connecting = false;
+    state->passable = true;
+
+    return true;
+}
+
+/* exported interface, documented in netstream.h */
+void
+netstream_forget(const char *name)
+{
+    netstream_server_t **prev;
+    netstream_server_t *server;
+
+    for (prev = &servers; (server = *prev) != NULL; prev = &server->next) {
+        if (strcmp(server->name, name) == 0) {
+            *prev = server->next;
+            freeaddrinfo(server->addrs);
+            free(server->name);
+            free(server);
+            return;
+        }
+    }
+}
+
+/* exported interface, documented in netstream.h */
+estream_state_t *
+estream_tcp_open(const char *name)
+{
+    estream_state_t *stream_state;
+    netstream_server_t *server;
+    struct addrinfo *addr;
+    bool connecting = false;
+    int fd = -1;
+    int err = ECONNREFUSED;
+
+    server = netstream_server(name);
+    if (server == NULL)
+        return NULL;
+
+    /* each address is tried once, from the one which last worked */
+    addr = server->addr;
+    do {
+        if (!netstream_async) {
+            fd = tcp_connect(server->addr);
+        } else {
+            fd = tcp_start(server->addr, &connecting);
+            if ((fd != -1) && !connecting && !tcp_finish(fd)) {
+                err = errno;
+                close(fd);
+                errno = err;
+                fd = -1;
+            }
+        }
+        if (fd != -1)
+            break;
+        err = errno;
+        netstream_next_addr(name);
+    } while (server->addr != addr);
+
+    if (fd == -1) {
+        errno = err;
+        return NULL;
+    }
+
+    stream_state = calloc(1, sizeof(estream_state_t));
+    if (stream_state == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    stream_state->uri = malloc(strlen(NETSTREAM_PREFIX) + strlen(name) + 1);
+    if (stream_state->uri == NULL) {
+        free(stream_state);
+        close(fd);
+        return NULL;
+    }
+    strcpy(stream_state->uri, NETSTREAM_PREFIX);
+    strcat(stream_state->uri, name);
+
+    stream_state->fd = fd;
+    stream_state->estream_read = read;
+    stream_state->estream_write = write;
+    stream_state->estream_close = close;
+    /* a half open connection cannot be handed on */
+    stream_state->connecting = connecting;
+    stream_state->passable = !connecting;
+
+    return stream_state;
+}
@@ -0,0 +1,75 @@
+/* daemon/netstream.h
+ *
+ * Entropy Key stream over TCP
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_NETSTREAM_H
+#define DAEMON_NETSTREAM_H
+
+#include "stream.h"
+
+/** Prefix of stream names which connect to a key server over TCP. */
+#define NETSTREAM_PREFIX "tcp://"
+
+/** Socket buffer size requested for key connections. */
+#define NETSTREAM_BUFFER (256 * 1024)
+
+/** Longest time to wait for a key server to accept a connection. */
+#define NETSTREAM_CONNECT_MS 5000
+
+/** Open an Entropy Key served over TCP by ekey-netd.
+ *
+ * The name is of the form host:port, with a numeric IPv6 address given in
+ * brackets.  The connection carries the key's byte stream unaltered, the
+ * key's MAC and session encryption protecting it end to end.
+ *
+ * The name is resolved the first time it is opened and the addresses
+ * kept, so reopening the key never waits on the resolver.  Unless
+ * ::netstream_set_async has been called the connect is waited for.
+ *
+ * @param name The host and port of the key server.
+ * @return The stream handle or NULL and errno set.
+ */
+extern estream_state_t *estream_tcp_open(const char *name);
+
+/** Return TCP streams while their connect is still in progress.
+ *
+ * Such a stream has connecting set.  The poll loop must wait for its file
+ * descriptor to become writable and then call ::netstream_connected before
+ * reading or writing it.  A connect which fails moves on to the server's
+ * next address when the stream is next opened.
+ *
+ * @param async true to return streams still connecting.
+ */
+extern void netstream_set_async(bool async);
+
+/** Finish connecting a stream.
+ *
+ * @param state A stream returned still connecting.
+ * @param ready true once the stream is writable, false if the connect has
+ *              taken too long and is to be abandoned.
+ * @return true once connected, false and errno set if the connect failed.
+ */
+extern bool netstream_connected(estream_state_t *state, bool ready);
+
+/** Forget the addresses kept for a key server.
+ *
+ * @param name The host and port the stream was opened with.
+ */
+extern void netstream_forget(const char *name);
+
+/** Set the socket options used for key connections.
+ *
+ * Nagle's algorithm is disabled so key and host packets are sent at once,
+ * keepalives are enabled so a vanished peer is noticed, and large socket
+ * buffers requested.
+ *
+ * @param fd The connected socket.
+ */
+extern void netstream_tune(int fd);
+
+#endif
@@ -35,6 +35,40 @@ close_nonce(void)
 {
 }
 
+#elif defined(EKEY_OS_LINUX) && defined(EKEY_ENGINE)
+
+#include <sys/random.h>
+
+/* the engine library keeps no descriptor open, each nonce is read from
+ * the kernel directly
+ */
+
+/* exported interface documented in nonce.h */
+bool
+fill_nonce(uint8_t *buff, size_t count)
+{
+    size_t done = 0;
+    ssize_t rd;
+
+    while (done < count) {
+        rd = getrandom(buff + done, count - done, 0);
+        if (rd == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Error %s reading nonce data", strerror(errno));
+            return false;
+        }
+        done += rd;
+    }
+    return true;
+}
+
+/* exported interface documented in nonce.h */
+void
+close_nonce(void)
+{
+}
+
 #else
 
 /** File descriptor for the urandom device. */
@@ -57,7 +57,7 @@ epkt_close(epkt_state_t *state)
 
 /* exported interface documented in packet.h */
 void
-epkt_setsessionkey(epkt_state_t *state, uint8_t *snum, uint8_t *sessionkey)
+epkt_setsessionkey(epkt_state_t *state, const uint8_t *snum, const uint8_t *sessionkey)
 {
     if (snum == NULL)
         return;
@@ -136,6 +136,7 @@ verify_packet(epkt_state_t *state)
 
     if (verify_mac(state) == false) {
         state->pkt_error++;
+        trace_event_stamped(state->frame->trace, TRACE_MAC_FAIL, frame[2], 0);
         state->pkt_type = PKTTYPE_KEYREJECTED; /* packet failed mac */
     }  else {
         state->pkt_ok++;
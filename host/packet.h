@@ -83,6 +83,6 @@ extern short epkt_get_pemsubcode(epkt_state_t *state);
 
 /** Set the session key to be used for MAC generation.
  */
-extern void epkt_setsessionkey(epkt_state_t *state, uint8_t *snum, uint8_t *sharedkey);
+extern void epkt_setsessionkey(epkt_state_t *state, const uint8_t *snum, const uint8_t *sharedkey);
 
 #endif /* DAEMON_PACKET_H */
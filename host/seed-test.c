@@ -0,0 +1,171 @@
+/* daemon/seed-test.c
+ *
+ * Check a seed is used once and refreshed from diverted entropy.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "seed.h"
+#include "check.h"
+
+static bool
+test_write(const char *path, const uint8_t *data, size_t len, mode_t mode)
+{
+    int fd;
+    bool ok;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd == -1)
+        return false;
+    ok = (write(fd, data, len) == (ssize_t)len) && (fchmod(fd, mode) == 0);
+    close(fd);
+    return ok;
+}
+
+static off_t
+test_size(const char *path)
+{
+    struct stat sbuf;
+
+    return (stat(path, &sbuf) == 0) ? sbuf.st_size : -1;
+}
+
+/* A seed is credited once, and only from a file private to the daemon */
+static void
+test_consume(const char *dir)
+{
+    uint8_t seedbuf[SEED_LEN];
+    uint8_t buf[SEED_LEN];
+    char path[256];
+    char link[256];
+    int idx;
+
+    for (idx = 0; idx < SEED_LEN; idx++)
+        seedbuf[idx] = idx * 7;
+
+    snprintf(path, sizeof(path), "%s/seed", dir);
+    CHECK(seed_consume(path, buf, sizeof(buf)) == 0);
+
+    CHECK(test_write(path, seedbuf, SEED_LEN, S_IRUSR | S_IWUSR));
+    CHECK(seed_consume(path, buf, sizeof(buf)) == SEED_LEN);
+    CHECK(memcmp(buf, seedbuf, SEED_LEN) == 0);
+    CHECK(test_size(path) == 0);
+    CHECK(seed_consume(path, buf, sizeof(buf)) == 0);
+
+    /* a seed others can read is refused and left alone */
+    CHECK(test_write(path, seedbuf, SEED_LEN, S_IRUSR | S_IWUSR | S_IRGRP));
+    CHECK((seed_consume(path, buf, sizeof(buf)) == -1) && (errno == EPERM));
+    CHECK(test_size(path) == SEED_LEN);
+
+    /* as is one reached through a link */
+    CHECK(test_write(path, seedbuf, SEED_LEN, S_IRUSR | S_IWUSR));
+    snprintf(link, sizeof(link), "%s/link", dir);
+    CHECK(symlink(path, link) == 0);
+    CHECK(seed_consume(link, buf, sizeof(buf)) == -1);
+    CHECK(test_size(path) == SEED_LEN);
+
+    unlink(link);
+    unlink(path);
+}
+
+/* A refresh takes a seed's worth of entropy and replaces the file */
+static void
+test_refresh(const char *dir)
+{
+    uint8_t pkt[48]; /* not a whole fraction of the seed */
+    uint8_t want[SEED_LEN];
+    uint8_t buf[SEED_LEN];
+    char path[256];
+    char tmp[256];
+    struct stat sbuf;
+    size_t offered = 0;
+    size_t taken;
+    size_t partial = 0;
+    int wait;
+    int idx;
+
+    snprintf(path, sizeof(path), "%s/seed", dir);
+    snprintf(tmp, sizeof(tmp), "%s/seed.new", dir);
+    CHECK(test_write(path, (const uint8_t *)"old", 3, S_IRUSR | S_IWUSR));
+
+    CHECK(seed_divert(pkt, sizeof(pkt)) == 0);
+    CHECK(seed_refresh(path, 1));
+    CHECK(seed_check() == -1);
+
+    /* packets are taken until the seed is full, the rest of the one which
+     * fills it and those after go to the output
+     */
+    for (idx = 0; idx < 20; idx++) {
+        memset(pkt, idx, sizeof(pkt));
+        taken = seed_divert(pkt, sizeof(pkt));
+        if ((taken != 0) && (taken != sizeof(pkt)))
+            partial++;
+        memcpy(want + offered, pkt, taken);
+        offered += taken;
+    }
+    CHECK(offered == SEED_LEN);
+    CHECK(partial == 1);
+    CHECK(test_size(path) == 3);
+
+    wait = seed_check();
+    CHECK((wait > 0) && (wait <= 1000));
+    CHECK(seed_consume(path, buf, sizeof(buf)) == SEED_LEN);
+    CHECK(memcmp(buf, want, SEED_LEN) == 0);
+    CHECK(access(tmp, F_OK) == -1);
+    CHECK((stat(path, &sbuf) == 0) &&
+          ((sbuf.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)) == (S_IRUSR | S_IWUSR)));
+    CHECK(seed_divert(pkt, sizeof(pkt)) == 0);
+
+    /* the next refresh starts when its interval is up */
+    usleep((wait + 10) * 1000);
+    CHECK(seed_check() == -1);
+    CHECK(seed_divert(pkt, sizeof(pkt)) == sizeof(pkt));
+
+    /* a seed which cannot be saved is retried next interval */
+    snprintf(path, sizeof(path), "%s/missing/seed", dir);
+    CHECK(seed_refresh(path, 1));
+    CHECK(seed_check() == -1);
+    while (seed_divert(pkt, sizeof(pkt)) != 0)
+        ;
+    wait = seed_check();
+    CHECK((wait > 0) && (wait <= 1000));
+    CHECK(test_size(path) == -1);
+
+    CHECK(seed_refresh(NULL, 0));
+    CHECK(seed_check() == -1);
+    CHECK(seed_divert(pkt, sizeof(pkt)) == 0);
+
+    snprintf(path, sizeof(path), "%s/seed", dir);
+    unlink(path);
+}
+
+int
+main(int argc, char **argv)
+{
+    char dir[] = "/tmp/seed-test.XXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    test_consume(dir);
+    test_refresh(dir);
+
+    rmdir(dir);
+
+    return check_result("seed");
+}
@@ -0,0 +1,211 @@
+/* daemon/seed.c
+ *
+ * Seed file carrying key entropy across restarts
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "seed.h"
+#include "util.h"
+
+/** Longest wait returned by seed_check. */
+#define SEED_CHECK_MAX_MS (60 * 60 * 1000)
+
+/** The seed file being refreshed. */
+static struct {
+    char *path; /**< The seed file, NULL if it is not refreshed. */
+    uint64_t refresh_ms; /**< Interval between refreshes. */
+    uint64_t due_ms; /**< Time the next refresh starts. */
+    bool gathering; /**< Entropy is being taken from the keys. */
+    size_t used; /**< Bytes of the seed gathered. */
+    uint8_t buf[SEED_LEN]; /**< The seed being gathered. */
+} seed;
+
+/* exported interface documented in seed.h */
+ssize_t
+seed_consume(const char *path, uint8_t *buf, size_t len)
+{
+    struct stat sbuf;
+    size_t got = 0;
+    ssize_t rd = 0;
+    int fd;
+
+    fd = open(path, O_RDWR | O_NOCTTY | O_NOFOLLOW);
+    if (fd == -1)
+        return (errno == ENOENT) ? 0 : -1;
+
+    /* anyone else able to read the seed knows what was credited */
+    if ((fstat(fd, &sbuf) == -1) || !S_ISREG(sbuf.st_mode) ||
+        (sbuf.st_uid != geteuid()) ||
+        ((sbuf.st_mode & (S_IRWXG | S_IRWXO)) != 0)) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+
+    while (got < len) {
+        rd = read(fd, buf + got, len - got);
+        if (rd == 0)
+            break;
+        if (rd == -1) {
+            if (errno == EINTR)
+                continue;
+            got = 0;
+            break;
+        }
+        got += rd;
+    }
+
+    /* a seed which cannot be removed would be used again next time */
+    if ((rd == -1) || (ftruncate(fd, 0) == -1) || (fsync(fd) == -1)) {
+        memset(buf, 0, len);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return got;
+}
+
+/** Replace the seed file with the gathered seed.
+ *
+ * The seed is written to a temporary file which is renamed over the old
+ * one so a crash never leaves a partial seed behind.
+ */
+static bool
+seed_save(void)
+{
+    size_t tmplen = strlen(seed.path) + 5;
+    char *tmp;
+    size_t done = 0;
+    ssize_t wr;
+    int fd;
+
+    tmp = malloc(tmplen);
+    if (tmp == NULL)
+        return false;
+    snprintf(tmp, tmplen, "%s.new", seed.path);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY | O_NOFOLLOW,
+              S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        free(tmp);
+        return false;
+    }
+    fchmod(fd, S_IRUSR | S_IWUSR);
+
+    while (done < SEED_LEN) {
+        wr = write(fd, seed.buf + done, SEED_LEN - done);
+        if (wr == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        done += wr;
+    }
+
+    if ((done != SEED_LEN) || (fsync(fd) == -1) || (close(fd) == -1) ||
+        (rename(tmp, seed.path) == -1)) {
+        int err = errno;
+
+        if (done != SEED_LEN)
+            close(fd);
+        unlink(tmp);
+        free(tmp);
+        errno = err;
+        return false;
+    }
+
+    free(tmp);
+
+    return true;
+}
+
+/* exported interface documented in seed.h */
+bool
+seed_refresh(const char *path, unsigned int refresh_s)
+{
+    char *newpath = NULL;
+
+    if (path != NULL) {
+        newpath = strdup(path);
+        if (newpath == NULL)
+            return false;
+    }
+
+    free(seed.path);
+    seed.path = newpath;
+    seed.refresh_ms = (uint64_t)refresh_s * 1000;
+    seed.due_ms = monotonic_ms();
+    seed.gathering = false;
+    seed.used = 0;
+
+    return true;
+}
+
+/* exported interface documented in seed.h */
+size_t
+seed_divert(const uint8_t *buf, size_t count)
+{
+    if (!seed.gathering || (seed.used == SEED_LEN))
+        return 0;
+
+    if (count > (SEED_LEN - seed.used))
+        count = SEED_LEN - seed.used;
+
+    memcpy(seed.buf + seed.used, buf, count);
+    seed.used += count;
+
+    return count;
+}
+
+/* exported interface documented in seed.h */
+int
+seed_check(void)
+{
+    uint64_t now;
+
+    if (seed.path == NULL)
+        return -1;
+
+    if (seed.used == SEED_LEN) {
+        if (!seed_save())
+            syslog(LOG_WARNING, "Unable to refresh seed file %s: %s",
+                   seed.path, strerror(errno));
+        memset(seed.buf, 0, SEED_LEN);
+        seed.used = 0;
+        seed.gathering = false;
+        seed.due_ms = monotonic_ms() + seed.refresh_ms;
+    }
+
+    /* the keys finish a refresh, not a timer */
+    if (seed.gathering)
+        return -1;
+
+    now = monotonic_ms();
+    if (now >= seed.due_ms) {
+        seed.gathering = true;
+        return -1;
+    }
+
+    /* long intervals are waited out in steps the poll timeout can hold */
+    if ((seed.due_ms - now) > SEED_CHECK_MAX_MS)
+        return SEED_CHECK_MAX_MS;
+
+    return (int)(seed.due_ms - now);
+}
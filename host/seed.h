@@ -0,0 +1,67 @@
+/* daemon/seed.h
+ *
+ * Seed file carrying key entropy across restarts
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_SEED_H
+#define DAEMON_SEED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Size of the seed file. */
+#define SEED_LEN 512
+
+/** Default interval between refreshes of the seed file. */
+#define SEED_REFRESH_S 3600
+
+/** Read and consume a seed file.
+ *
+ * The file is only used if it is a regular file owned by the daemon's user
+ * and private to it.  It is emptied, and the emptying synced to disc,
+ * before its contents are returned so a seed is never used twice.
+ *
+ * @param path The seed file.
+ * @param buf Buffer to read the seed into.
+ * @param len The length of \a buf.
+ * @return The length of the seed, 0 if there is none, or -1 and errno set.
+ */
+extern ssize_t seed_consume(const char *path, uint8_t *buf, size_t len);
+
+/** Keep a seed file refreshed from the keys.
+ *
+ * A fresh seed is gathered straight away, replacing the one consumed at
+ * startup, and then every \a refresh_s seconds.
+ *
+ * @param path The seed file, or NULL to stop refreshing.
+ * @param refresh_s Seconds between refreshes.
+ * @return true on success, false and errno set on failure.
+ */
+extern bool seed_refresh(const char *path, unsigned int refresh_s);
+
+/** Offer entropy from a healthy key for the seed file.
+ *
+ * Entropy taken for the seed must not also be sent to the output, or the
+ * next start would credit it a second time.
+ *
+ * @param buf The entropy.
+ * @param count The length of \a buf.
+ * @return The number of bytes taken from the start of \a buf, the rest
+ *         is for the output.  0 if no seed is being gathered.
+ */
+extern size_t seed_divert(const uint8_t *buf, size_t count);
+
+/** Write a gathered seed out and schedule the next refresh.
+ *
+ * @return Milliseconds until the seed file next needs attention, or -1
+ *         if it is not being refreshed.
+ */
+extern int seed_check(void);
+
+#endif /* DAEMON_SEED_H */
@@ -10,6 +10,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ekeyd.h"
 #include "stream.h"
@@ -17,12 +18,15 @@
 #include "packet.h"
 #include "connection.h"
 #include "stats.h"
+#include "util.h"
 
 /* exported interface, documented in stats.h */
 connection_stats_t *
 get_key_stats(OpaqueEkey *ekey)
 {
     connection_stats_t *stats;
+    uint32_t rekeys = 0;
+    int bucket;
 
     if (ekey == NULL)
         return NULL;
@@ -34,11 +38,29 @@ get_key_stats(OpaqueEkey *ekey)
 
     /* values held in ekey structure we already checked is valid */
     stats->con_start = ekey->con_start;
+    stats->con_first_entropy = ekey->con_first_entropy;
     stats->con_pkts = ekey->con_pkts;
     stats->con_reset = ekey->con_reset;
     stats->con_nonces = ekey->con_nonces;
     stats->con_rekeys = ekey->con_rekeys;
     stats->con_entropy = ekey->con_entropy;
+    stats->con_lost_entropy = ekey->con_lost_entropy;
+    stats->con_reopens = ekey->con_reopens;
+    stats->con_stalls = ekey->con_stalls;
+    stats->con_downtime_ms = ekey->con_downtime_ms;
+    if (ekey->down_since_ms != 0)
+        stats->con_downtime_ms += monotonic_ms() - ekey->down_since_ms;
+
+    memcpy(stats->state_ms, ekey->state_ms, sizeof(stats->state_ms));
+    stats->state_ms[ekey->current_state] += monotonic_ms() - ekey->state_since_ms;
+
+    memcpy(stats->rekey_rtt, ekey->rekey_rtt, sizeof(stats->rekey_rtt));
+    stats->rekey_rtt_last = ekey->rekey_rtt_last;
+    stats->rekey_rtt_max = ekey->rekey_rtt_max;
+    for (bucket = 0; bucket < ECON_RTT_BUCKETS; bucket++)
+        rekeys += ekey->rekey_rtt[bucket];
+    if (rekeys > 0)
+        stats->rekey_rtt_mean = ekey->rekey_rtt_total / rekeys;
 
     stats->key_temp = ekey->key_temp;
     stats->key_voltage = ekey->key_voltage;
@@ -52,6 +74,8 @@ get_key_stats(OpaqueEkey *ekey)
     stats->key_dbsd_entl = ekey->key_dbsd_entl;
     stats->key_dbsd_entr = ekey->key_dbsd_entr;
 
+    stats->key_health = ekey->key_health;
+
     /* stats held in stream structure */
     if (ekey->key_stream != NULL) {
         stats->stream_bytes_read = ekey->key_stream->bytes_read;
@@ -73,3 +97,22 @@ get_key_stats(OpaqueEkey *ekey)
 
     return stats;
 }
+
+/* exported interface, documented in stats.h */
+char *
+get_key_trace(OpaqueEkey *ekey, size_t *len)
+{
+    char *serial;
+    char *dump;
+
+    if ((ekey == NULL) || (ekey->eframer == NULL) ||
+        (ekey->eframer->trace == NULL))
+        return NULL;
+
+    serial = econ_getsnum(ekey);
+    dump = trace_dump(ekey->eframer->trace,
+                      (serial != NULL) ? serial : "UnknownKey", len);
+    free(serial);
+
+    return dump;
+}
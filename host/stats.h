@@ -10,6 +10,8 @@
 #ifndef DAEMON_STATS_H
 #define DAEMON_STATS_H
 
+#include "connection.h"
+
 /** Unified statistics. */
 typedef struct {
     uint64_t stream_bytes_read; /**< Number of bytes read from the stream. */
@@ -23,12 +25,24 @@ typedef struct {
     uint32_t pkt_ok; /**< Number of ok packets. */
 
     time_t con_start; /**< Time the connection was started. */
+    uint32_t con_first_entropy; /**< Milliseconds from connection to first entropy. */
 
     uint32_t con_pkts; /**< Number of processed packets. */
     uint32_t con_reset; /**< The number of times the connection has encounterd a reset condition. */
     uint32_t con_nonces; /**< The number of times a nonce has been sent. */
     uint32_t con_rekeys; /**< The number of times the session key has been set. */
     uint64_t con_entropy; /**< The number of bytes of entropy recived. */
+    uint64_t con_lost_entropy; /**< Bytes of entropy discarded while not keyed. */
+    uint32_t con_reopens; /**< Times the input stream has been reopened. */
+    uint32_t con_stalls; /**< Times the key stopped sending and was reset. */
+    uint64_t con_downtime_ms; /**< Milliseconds between the key failing and its entropy resuming. */
+
+    uint64_t state_ms[ESTATE_SIZE]; /**< Milliseconds spent in each connection state. */
+
+    uint32_t rekey_rtt[ECON_RTT_BUCKETS]; /**< Histogram of rekey round trip times. */
+    uint32_t rekey_rtt_last; /**< Last rekey round trip time in milliseconds. */
+    uint32_t rekey_rtt_max; /**< Longest rekey round trip time in milliseconds. */
+    uint32_t rekey_rtt_mean; /**< Mean rekey round trip time in milliseconds. */
 
     int key_temp; /**< Last reported key temerature in deci-kelvin. */
     int key_voltage; /**< Last internal supply voltage reported by key. */
@@ -43,6 +57,8 @@ typedef struct {
     uint32_t key_dbsd_entl; /**< debiased shanons per bit of left input. */
     uint32_t key_dbsd_entr; /**< debiased shanons per bit of right input. */
 
+    uint32_t key_health; /**< Health in percent derived from the estimates. */
+
 } connection_stats_t;
 
 /** Create a unified statistics structure from an entropy key connection state.
@@ -54,4 +70,14 @@ typedef struct {
  */
 connection_stats_t *get_key_stats(OpaqueEkey *ekey);
 
+/** Dump the event trace of an entropy key connection.
+ *
+ * @note The returned dump must be freed by the caller.
+ *
+ * @param ekey The connection context.
+ * @param len Updated with the length of the dump.
+ * @return The dump, in the format described in trace.h, or NULL.
+ */
+char *get_key_trace(OpaqueEkey *ekey, size_t *len);
+
 #endif /* DAEMON_STATS_H */
@@ -21,6 +21,11 @@
 #include <syslog.h>
 
 #include "stream.h"
+#include "capture.h"
+#include "netstream.h"
+#ifdef EKEY_USB_STREAM
+#include "usbstream.h"
+#endif
 
 /*  POSIX.1g requires <sys/un.h> to define a SUN_LEN macro for determining the
  *  length of sockaddr_un. Of course its not available everywhere. This is the
@@ -39,6 +44,22 @@ estream_open(const char *uri)
     struct stat sbuf;
     struct termios settings;
 
+#if defined(EKEY_USB_STREAM) && !defined(EKEY_ENGINE)
+    if (strncmp(uri, USBSTREAM_PREFIX, strlen(USBSTREAM_PREFIX)) == 0)
+        return estream_usb_open(uri + strlen(USBSTREAM_PREFIX));
+#endif
+
+    if (strncmp(uri, NETSTREAM_PREFIX, strlen(NETSTREAM_PREFIX)) == 0)
+        return estream_tcp_open(uri + strlen(NETSTREAM_PREFIX));
+
+#ifndef EKEY_ENGINE
+    if (strncmp(uri, REPLAY_PREFIX, strlen(REPLAY_PREFIX)) == 0)
+        return estream_replay_open(uri + strlen(REPLAY_PREFIX), false);
+
+    if (strncmp(uri, REPLAY_FAST_PREFIX, strlen(REPLAY_FAST_PREFIX)) == 0)
+        return estream_replay_open(uri + strlen(REPLAY_FAST_PREFIX), true);
+#endif
+
     /* Attempt to stat the file */
     if (stat(uri, &sbuf) == -1) {
         return NULL;
@@ -76,8 +97,11 @@ estream_open(const char *uri)
             }
         }
     } else if (S_ISCHR(sbuf.st_mode)) {
-        /* Open the file as a character device/tty */
-        fd = open(uri, O_RDWR | O_NOCTTY);
+        /* Open the file as a character device/tty.  The open is non
+         * blocking so that a key which has not yet raised carrier cannot
+         * stall the daemon (and every other key) before CLOCAL is set.
+         */
+        fd = open(uri, O_RDWR | O_NOCTTY | O_NONBLOCK);
         if ((fd != -1) && (isatty(fd))) {
             if (tcgetattr(fd, &settings) == 0 ) {
                 settings.c_cflag &= ~(CSIZE | CSTOPB | PARENB | CLOCAL |
@@ -107,6 +131,8 @@ estream_open(const char *uri)
             }
             tcflush(fd, TCIOFLUSH);
         }
+        if (fd != -1)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
     } else {
         /* open the file as a plain file and seek to the end */
         fd = open(uri, O_RDWR | O_NOCTTY);
@@ -124,6 +150,33 @@ estream_open(const char *uri)
     stream_state->fd = fd;
     stream_state->estream_read = read;
     stream_state->estream_write = write;
+    stream_state->estream_close = close;
+    stream_state->passable = true;
+
+    return stream_state;
+}
+
+/* exported function documented in stream.h */
+estream_state_t *
+estream_adopt(const char *uri, int fd)
+{
+    estream_state_t *stream_state;
+
+    stream_state = calloc(1, sizeof(estream_state_t));
+    if (stream_state == NULL)
+        return NULL;
+
+    stream_state->uri = strdup(uri);
+    if (stream_state->uri == NULL) {
+        free(stream_state);
+        return NULL;
+    }
+
+    stream_state->fd = fd;
+    stream_state->estream_read = read;
+    stream_state->estream_write = write;
+    stream_state->estream_close = close;
+    stream_state->passable = true;
 
     return stream_state;
 }
@@ -145,17 +198,41 @@ estream_write(estream_state_t *state, void *buf, size_t count)
     ssize_t wr = state->estream_write(state->fd, buf, count);
     if (wr > 0) {
         state->bytes_written += wr;
-    } else {
+        if (state->write_failing) {
+            syslog(LOG_INFO, "Writes to %s recovered", state->uri);
+            state->write_failing = false;
+        }
+    } else if (!state->write_failing) {
+        /* only the first of a run of failures is logged */
         syslog(LOG_ERR, "Write error %zd on %s ", wr, state->uri);
+        state->write_failing = true;
     }
     return wr;
 }
 
+/* exported function documented in stream.h */
+bool
+estream_demand(estream_state_t *state, bool resuming)
+{
+    if (state->estream_demand == NULL)
+        return true;
+    return state->estream_demand(state->fd, resuming);
+}
+
+/* exported function documented in stream.h */
+void
+estream_health(estream_state_t *state, unsigned int health)
+{
+    if (state->estream_health != NULL)
+        state->estream_health(state->fd, health);
+}
+
 /* exported function documented in stream.h */
 int
 estream_close(estream_state_t *state)
 {
-    close(state->fd);
+    if (state->estream_close != NULL)
+        state->estream_close(state->fd);
     free(state->uri);
     free(state);
     return 0;
@@ -10,10 +10,15 @@
 #ifndef DAEMON_STREAM_H
 #define DAEMON_STREAM_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
 typedef ssize_t (estream_read_fn)(int fd, void *buf, size_t count);
 typedef ssize_t (estream_write_fn)(int fd, const void *buf, size_t count);
+typedef int (estream_close_fn)(int fd);
+typedef bool (estream_demand_fn)(int fd, bool resuming);
+typedef void (estream_health_fn)(int fd, unsigned int health);
 
 typedef struct {
     char *uri;
@@ -21,11 +26,20 @@ typedef struct {
     /* stream info */
     estream_read_fn *estream_read; /** Stream read function. */
     estream_write_fn *estream_write; /** Stream write function. */
+    estream_close_fn *estream_close; /** Stream close function. */
+    estream_demand_fn *estream_demand; /** Output demand function, NULL if output is always wanted. */
+    estream_health_fn *estream_health; /** Source health function, NULL if the output does not credit entropy. */
+    short demand_events; /** poll events on fd which signal renewed demand, 0 for none */
     int fd; /** file descriptor passed to functions */
+    const uint8_t *nonce; /** nonce the next keying request must use, NULL for a fresh one */
+    bool passable; /** the descriptor alone carries the stream, so it may be passed to another process */
+    bool simulated; /** the stream replays a capture or simulates a key, so its entropy must not be credited */
+    bool connecting; /** a TCP connect is still in progress, see netstream_connected() */
 
     /* statistics */
     uint64_t bytes_read; /** number of bytes read from the stream */
     uint64_t bytes_written; /** number of bytes written to the stream */
+    bool write_failing; /** writes are failing and this has been logged */
 } estream_state_t;
 
 /** Open a stream.
@@ -35,6 +49,14 @@ typedef struct {
  */
 extern estream_state_t *estream_open(const char *uri);
 
+/** Take over a stream from a descriptor passed by another process.
+ *
+ * @param uri The name the stream was opened with.
+ * @param fd The stream's descriptor, owned by the stream on success.
+ * @return Initialised stream object or NULL on error.
+ */
+extern estream_state_t *estream_adopt(const char *uri, int fd);
+
 /** Read from a stream.
  *
  * @param state Stream state.
@@ -53,6 +75,28 @@ extern ssize_t estream_read(estream_state_t *state, void *buf, size_t count);
  */
 extern ssize_t estream_write(estream_state_t *state, void *buf, size_t count);
 
+/** Ask an output stream whether it wants more entropy.
+ *
+ * Demand has hysteresis: a stream reports no demand once it is full but,
+ * when \a resuming, only reports demand again once it has drained to its
+ * refill level so the keys are not paused and resumed continually.
+ *
+ * @param state Stream state.
+ * @param resuming true if input is currently paused for lack of demand.
+ * @return true if entropy written to the stream would be used.
+ */
+extern bool estream_demand(estream_state_t *state, bool resuming);
+
+/** Tell an output how healthy the source of the following writes is.
+ *
+ * Outputs which credit entropy may scale the credit they claim by it,
+ * others ignore it.
+ *
+ * @param state The stream to tell.
+ * @param health The source health in percent.
+ */
+extern void estream_health(estream_state_t *state, unsigned int health);
+
 /** Close a stream.
  *
  * Closes a stream and frees any assciated resources.
@@ -0,0 +1,97 @@
+/* daemon/trace.c
+ *
+ * Per key binary event trace ring
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+/* timestamp and monotonic time of the first ring opened, used to find
+ * the timestamp rate when a ring is dumped
+ */
+static uint64_t trace_base_ticks;
+static uint64_t trace_base_ns;
+
+static uint64_t
+trace_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* exported interface, documented in trace.h */
+trace_ring_t *
+trace_open(void)
+{
+    if (trace_base_ns == 0) {
+        trace_base_ns = trace_now_ns();
+        trace_base_ticks = trace_ticks();
+    }
+
+    return calloc(1, sizeof(trace_ring_t));
+}
+
+/* exported interface, documented in trace.h */
+void
+trace_close(trace_ring_t *ring)
+{
+    free(ring);
+}
+
+/* exported interface, documented in trace.h */
+char *
+trace_dump(const trace_ring_t *ring, const char *name, size_t *len)
+{
+    /* a header and the longest possible event lines */
+    size_t size = 128 + strlen(name) + (TRACE_EVENTS * 36);
+    uint32_t count = (ring->head < TRACE_EVENTS) ? ring->head : TRACE_EVENTS;
+    uint64_t now = trace_ticks();
+    uint64_t ns = trace_now_ns() - trace_base_ns;
+    uint64_t per_ms;
+    uint64_t prev;
+    const trace_event_t *ev;
+    uint32_t first;
+    uint32_t idx;
+    char *dump;
+    size_t used;
+
+    dump = malloc(size);
+    if (dump == NULL)
+        return NULL;
+
+    /* timestamp rate over the life of the daemon */
+    per_ms = (ns > 0) ? (((now - trace_base_ticks) * 1000000.0) / ns) : 0;
+
+    prev = (count > 0) ? ring->events[(ring->head - count) & (TRACE_EVENTS - 1)].ticks : now;
+    used = snprintf(dump, size, "ekey-trace %d %s %llu %lu %llx %u\n",
+                    TRACE_DUMP_VERSION, name, (unsigned long long)per_ms,
+                    (unsigned long)time(NULL),
+                    (unsigned long long)((count > 0) ?
+                                         now - ring->events[(ring->head - 1) & (TRACE_EVENTS - 1)].ticks : 0),
+                    count);
+
+    first = ring->head - count;
+    for (idx = first; idx != ring->head; idx++) {
+        ev = &ring->events[idx & (TRACE_EVENTS - 1)];
+        used += snprintf(dump + used, size - used, "%llx:%x:%x:%x%c",
+                         (unsigned long long)(ev->ticks - prev),
+                         ev->event, ev->a16, ev->arg,
+                         ((((idx + 1 - first) % TRACE_DUMP_PER_LINE) == 0) ||
+                          ((idx + 1) == ring->head)) ? '\n' : ' ');
+        prev = ev->ticks;
+    }
+
+    *len = used;
+    return dump;
+}
@@ -0,0 +1,939 @@
+/* daemon/uring.c
+ *
+ * Entropy key io_uring I/O backend.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "stream.h"
+#include "uring.h"
+
+/** Number of submission queue entries. */
+#define URING_ENTRIES 256
+
+/** Maximum number of file descriptors polled, matches the poll backend. */
+#define URING_MAX_POLL 256
+
+/** Number of key streams which may be read through registered buffers. */
+#define URING_MAX_READERS 32
+
+/** Size of each key stream read buffer. */
+#define URING_READBUF 1024
+
+/** Number of sink streams which may be written through io_uring. */
+#define URING_MAX_WRITERS 4
+
+/** Number of registered write buffers. */
+#define URING_WRSLOTS 8
+
+/** Size of each write buffer. */
+#define URING_WRBUF 8192
+
+/** Longest time data may sit in a partially filled write buffer. */
+#define URING_WRFLUSH_MS 100
+
+/* Completion user data is the operation, a generation count and a table
+ * index so stale completions for recycled table entries can be ignored.
+ */
+#define UD_OP_POLL 1
+#define UD_OP_READ 2
+#define UD_OP_WRITE 3
+#define UD_OP_CANCEL 4
+
+#define UD(op, gen, idx) (((uint64_t)(op) << 56) |                 \
+                          ((uint64_t)((gen) & 0xffffff) << 32) |    \
+                          (uint32_t)(idx))
+#define UD_OP(ud) ((int)((ud) >> 56))
+#define UD_GEN(ud) ((uint32_t)(((ud) >> 32) & 0xffffff))
+#define UD_IDX(ud) ((int)((ud) & 0xffffffff))
+
+/** A file descriptor being polled. */
+typedef struct {
+    int fd; /**< File descriptor or -1 if the entry is free. */
+    short events; /**< Events the outstanding poll request is waiting for. */
+    short revents; /**< Events reported but not yet delivered. */
+    uint32_t gen; /**< Generation of the outstanding poll request. */
+    bool armed; /**< A poll request is outstanding. */
+} uring_pollent_t;
+
+/** A key stream read through a registered buffer. */
+typedef struct {
+    int fd; /**< File descriptor, -1 if free or -2 while a cancel is pending. */
+    uint32_t gen; /**< Generation of the outstanding read. */
+    bool inflight; /**< A read is outstanding. */
+    bool eof; /**< The stream has ended. */
+    int error; /**< Error to report on the next read. */
+    size_t len; /**< Number of bytes in the buffer. */
+    size_t off; /**< Number of bytes already consumed from the buffer. */
+    uint8_t *buf; /**< Registered buffer. */
+} uring_reader_t;
+
+/** A sink stream written through registered buffers. */
+typedef struct {
+    int fd; /**< File descriptor or -1 if free. */
+    off_t offset; /**< File offset of the next write. */
+    int slot; /**< Write buffer currently being filled or -1. */
+    struct timespec filled; /**< Time the current buffer started filling. */
+} uring_writer_t;
+
+/** A registered write buffer. */
+typedef struct {
+    int writer; /**< Writer filling this buffer or -1. */
+    bool busy; /**< A write from this buffer is outstanding. */
+    size_t used; /**< Number of bytes in the buffer. */
+    uint8_t *buf; /**< Registered buffer. */
+} uring_wrslot_t;
+
+static int ring_fd = -1;
+
+static void *sq_ring;
+static size_t sq_ring_sz;
+static unsigned *sq_head;
+static unsigned *sq_tail;
+static unsigned *sq_mask;
+static unsigned *sq_array;
+static struct io_uring_sqe *sqes;
+static size_t sqes_sz;
+static unsigned to_submit;
+
+static void *cq_ring;
+static size_t cq_ring_sz;
+static unsigned *cq_head;
+static unsigned *cq_tail;
+static unsigned *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static uint8_t *arena;
+static size_t arena_sz;
+
+static uring_pollent_t uring_polls[URING_MAX_POLL];
+static uring_reader_t uring_readers[URING_MAX_READERS];
+static uring_writer_t uring_writers[URING_MAX_WRITERS];
+static uring_wrslot_t uring_wrslots[URING_WRSLOTS];
+
+static ekey_uring_stats_t uring_stats;
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(unsigned submit, unsigned min_complete, unsigned flags,
+                   struct io_uring_getevents_arg *arg)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, submit, min_complete,
+                   flags | IORING_ENTER_EXT_ARG, arg, sizeof(*arg));
+}
+
+static int
+sys_io_uring_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static long
+ms_since(const struct timespec *then)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - then->tv_sec) * 1000) +
+        ((now.tv_nsec - then->tv_nsec) / 1000000);
+}
+
+/** Enter the kernel to submit queued entries and optionally wait.
+ *
+ * @param min_complete The number of completions to wait for.
+ * @param timeout Milliseconds to wait, -1 for ever.
+ * @return zero on success or -1 and errno set.
+ */
+static int
+uring_enter(unsigned min_complete, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    int ret;
+
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+
+    ret = sys_io_uring_enter(to_submit, min_complete, flags, &arg);
+    if (ret < 0) {
+        if (errno == ETIME)
+            return 0;
+        return -1;
+    }
+
+    if (to_submit > 0) {
+        uring_stats.submits++;
+        uring_stats.sqes += ret;
+        to_submit -= ((unsigned)ret > to_submit) ? to_submit : (unsigned)ret;
+    }
+    return 0;
+}
+
+/** Obtain a cleared submission queue entry. */
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+    unsigned head;
+    unsigned tail = *sq_tail;
+    struct io_uring_sqe *sqe;
+
+    head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    while ((tail - head) >= URING_ENTRIES) {
+        /* submission queue is full, push it to the kernel */
+        if (uring_enter(0, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    sqe = &sqes[tail & *sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/** Publish the entry most recently returned by ::uring_get_sqe. */
+static void
+uring_queue_sqe(void)
+{
+    unsigned tail = *sq_tail;
+
+    sq_array[tail & *sq_mask] = tail & *sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+}
+
+static void
+uring_queue_cancel(int opcode, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = UD(UD_OP_CANCEL, 0, 0);
+    uring_queue_sqe();
+}
+
+static void
+uring_queue_poll(int idx)
+{
+    uring_pollent_t *ent = &uring_polls[idx];
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    uint32_t events = (unsigned short)ent->events;
+
+    if (sqe == NULL)
+        return;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ent->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = UD(UD_OP_POLL, ent->gen, idx);
+    uring_queue_sqe();
+    ent->armed = true;
+}
+
+static void
+uring_queue_read(int idx)
+{
+    uring_reader_t *rdr = &uring_readers[idx];
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = rdr->fd;
+    sqe->off = (uint64_t)-1; /* current position, streams are not seekable */
+    sqe->addr = (uint64_t)(uintptr_t)rdr->buf;
+    sqe->len = URING_READBUF;
+    sqe->buf_index = idx;
+    sqe->user_data = UD(UD_OP_READ, rdr->gen, idx);
+    uring_queue_sqe();
+    rdr->inflight = true;
+}
+
+static void
+uring_queue_write(int widx)
+{
+    uring_writer_t *wtr = &uring_writers[widx];
+    uring_wrslot_t *slot;
+    struct io_uring_sqe *sqe;
+
+    if (wtr->slot < 0)
+        return;
+
+    slot = &uring_wrslots[wtr->slot];
+    if (slot->used == 0)
+        return;
+
+    sqe = uring_get_sqe();
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = wtr->fd;
+    sqe->off = wtr->offset;
+    sqe->addr = (uint64_t)(uintptr_t)slot->buf;
+    sqe->len = slot->used;
+    sqe->buf_index = URING_MAX_READERS + wtr->slot;
+    sqe->user_data = UD(UD_OP_WRITE, slot->used, wtr->slot);
+    uring_queue_sqe();
+
+    wtr->offset += slot->used;
+    slot->busy = true;
+    slot->writer = -1;
+    wtr->slot = -1;
+}
+
+/** Process every completion currently in the completion queue. */
+static void
+uring_reap(void)
+{
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+    uring_pollent_t *ent;
+    uring_reader_t *rdr;
+    uring_wrslot_t *slot;
+    int idx;
+
+    while (head != tail) {
+        cqe = &cqes[head & *cq_mask];
+        idx = UD_IDX(cqe->user_data);
+        uring_stats.cqes++;
+
+        switch (UD_OP(cqe->user_data)) {
+        case UD_OP_POLL:
+            uring_stats.polls++;
+            ent = &uring_polls[idx];
+            if ((ent->fd < 0) || (ent->gen & 0xffffff) != UD_GEN(cqe->user_data))
+                break; /* stale completion for a forgotten fd */
+            ent->armed = false;
+            if (cqe->res > 0) {
+                ent->revents |= cqe->res;
+            } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+                ent->revents |= (cqe->res == -EBADF) ? POLLNVAL : POLLERR;
+            }
+            break;
+
+        case UD_OP_READ:
+            rdr = &uring_readers[idx];
+            if (rdr->fd == -2) {
+                /* reader was detached, the buffer is now free */
+                rdr->fd = -1;
+                rdr->inflight = false;
+                break;
+            }
+            rdr->inflight = false;
+            if (cqe->res > 0) {
+                rdr->len = cqe->res;
+                rdr->off = 0;
+                uring_stats.reads++;
+                uring_stats.read_bytes += cqe->res;
+            } else if (cqe->res == 0) {
+                rdr->eof = true;
+            } else if ((cqe->res != -EINTR) && (cqe->res != -EAGAIN)) {
+                rdr->error = -cqe->res;
+            }
+            break;
+
+        case UD_OP_WRITE:
+            slot = &uring_wrslots[idx];
+            if (cqe->res < 0) {
+                syslog(LOG_ERR, "Write error %s on io_uring sink",
+                       strerror(-cqe->res));
+            } else {
+                if ((uint32_t)cqe->res != UD_GEN(cqe->user_data)) {
+                    syslog(LOG_ERR, "Short write (%d/%u) on io_uring sink",
+                           cqe->res, UD_GEN(cqe->user_data));
+                }
+                uring_stats.writes++;
+                uring_stats.write_bytes += cqe->res;
+            }
+            slot->busy = false;
+            slot->used = 0;
+            break;
+
+        default:
+            break;
+        }
+        head++;
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+static uring_pollent_t *
+uring_find_poll(int fd, int *idx_out)
+{
+    int idx;
+    int freeidx = -1;
+
+    for (idx = 0; idx < URING_MAX_POLL; idx++) {
+        if (uring_polls[idx].fd == fd) {
+            *idx_out = idx;
+            return &uring_polls[idx];
+        }
+        if ((freeidx < 0) && (uring_polls[idx].fd < 0))
+            freeidx = idx;
+    }
+
+    if (freeidx < 0)
+        return NULL;
+
+    /* allocate a fresh entry, the generation carries on so stale
+     * completions for the previous user are ignored.
+     */
+    uring_polls[freeidx].fd = fd;
+    uring_polls[freeidx].events = 0;
+    uring_polls[freeidx].revents = 0;
+    uring_polls[freeidx].armed = false;
+    *idx_out = freeidx;
+    return &uring_polls[freeidx];
+}
+
+static uring_reader_t *
+uring_find_reader(int fd)
+{
+    int idx;
+
+    if (fd < 0)
+        return NULL;
+
+    for (idx = 0; idx < URING_MAX_READERS; idx++) {
+        if (uring_readers[idx].fd == fd)
+            return &uring_readers[idx];
+    }
+    return NULL;
+}
+
+static int
+uring_find_writer(int fd)
+{
+    int idx;
+
+    if (fd < 0)
+        return -1;
+
+    for (idx = 0; idx < URING_MAX_WRITERS; idx++) {
+        if (uring_writers[idx].fd == fd)
+            return idx;
+    }
+    return -1;
+}
+
+static bool
+uring_reader_ready(uring_reader_t *rdr)
+{
+    return (rdr->off < rdr->len) || rdr->eof || (rdr->error != 0);
+}
+
+/** Wait for every outstanding write, optionally only for one writer. */
+static void
+uring_drain_writes(int widx)
+{
+    int slot;
+    bool busy;
+
+    if (widx >= 0)
+        uring_queue_write(widx);
+
+    do {
+        busy = false;
+        for (slot = 0; slot < URING_WRSLOTS; slot++) {
+            if (uring_wrslots[slot].busy)
+                busy = true;
+        }
+        if (busy) {
+            if ((uring_enter(1, -1) < 0) && (errno != EINTR))
+                break;
+            uring_reap();
+        }
+    } while (busy);
+}
+
+static ssize_t
+uring_read(int fd, void *buf, size_t count)
+{
+    uring_reader_t *rdr = uring_find_reader(fd);
+    size_t avail;
+
+    if (rdr == NULL)
+        return read(fd, buf, count);
+
+    if (rdr->off < rdr->len) {
+        avail = rdr->len - rdr->off;
+        if (count > avail)
+            count = avail;
+        memcpy(buf, rdr->buf + rdr->off, count);
+        rdr->off += count;
+        return count;
+    }
+
+    if (rdr->error != 0) {
+        errno = rdr->error;
+        rdr->error = 0;
+        return -1;
+    }
+
+    if (rdr->eof)
+        return 0;
+
+    errno = EWOULDBLOCK;
+    return -1;
+}
+
+static ssize_t
+uring_write(int fd, const void *buf, size_t count)
+{
+    int widx = uring_find_writer(fd);
+    uring_writer_t *wtr;
+    uring_wrslot_t *slot;
+    const uint8_t *src = buf;
+    size_t left = count;
+    size_t chunk;
+    int sidx;
+
+    if (widx < 0)
+        return write(fd, buf, count);
+
+    wtr = &uring_writers[widx];
+
+    while (left > 0) {
+        if (wtr->slot < 0) {
+            /* find an idle buffer, waiting for a write to finish if needed */
+            for (;;) {
+                for (sidx = 0; sidx < URING_WRSLOTS; sidx++) {
+                    if (!uring_wrslots[sidx].busy &&
+                        (uring_wrslots[sidx].writer < 0))
+                        break;
+                }
+                if (sidx < URING_WRSLOTS)
+                    break;
+                if ((uring_enter(1, -1) < 0) && (errno != EINTR))
+                    return -1;
+                uring_reap();
+            }
+            uring_wrslots[sidx].writer = widx;
+            uring_wrslots[sidx].used = 0;
+            wtr->slot = sidx;
+            clock_gettime(CLOCK_MONOTONIC, &wtr->filled);
+        }
+
+        slot = &uring_wrslots[wtr->slot];
+        chunk = URING_WRBUF - slot->used;
+        if (chunk > left)
+            chunk = left;
+        memcpy(slot->buf + slot->used, src, chunk);
+        slot->used += chunk;
+        src += chunk;
+        left -= chunk;
+
+        if (slot->used == URING_WRBUF)
+            uring_queue_write(widx);
+    }
+
+    return count;
+}
+
+static int
+uring_close(int fd)
+{
+    uring_reader_t *rdr = uring_find_reader(fd);
+    int widx = uring_find_writer(fd);
+
+    ekey_uring_forget(fd);
+
+    if (rdr != NULL) {
+        if (rdr->inflight) {
+            /* the buffer stays reserved until the cancelled read completes */
+            uring_queue_cancel(IORING_OP_ASYNC_CANCEL,
+                               UD(UD_OP_READ, rdr->gen, rdr - uring_readers));
+            rdr->fd = -2;
+            uring_enter(0, 0);
+        } else {
+            rdr->fd = -1;
+        }
+    }
+
+    if (widx >= 0) {
+        uring_drain_writes(widx);
+        uring_writers[widx].fd = -1;
+    }
+
+    return close(fd);
+}
+
+/* exported interface, documented in uring.h */
+bool
+ekey_uring_attach_reader(estream_state_t *stream)
+{
+    uring_reader_t *rdr;
+    int idx;
+
+    if ((ring_fd < 0) || (stream->estream_read != read))
+        return false; /* only plain descriptors can be read by the kernel */
+
+    for (idx = 0; idx < URING_MAX_READERS; idx++) {
+        if (uring_readers[idx].fd == -1)
+            break;
+    }
+
+    if (idx == URING_MAX_READERS)
+        return false; /* all buffers in use, stay on the poll path */
+
+    rdr = &uring_readers[idx];
+
+    ekey_uring_forget(stream->fd);
+
+    rdr->fd = stream->fd;
+    rdr->gen++;
+    rdr->inflight = false;
+    rdr->eof = false;
+    rdr->error = 0;
+    rdr->len = 0;
+    rdr->off = 0;
+
+    stream->estream_read = uring_read;
+    stream->estream_close = uring_close;
+
+    return true;
+}
+
+/* exported interface, documented in uring.h */
+bool
+ekey_uring_attach_writer(estream_state_t *stream)
+{
+    struct stat sbuf;
+    int widx;
+
+    if ((ring_fd < 0) || (stream->estream_write != write))
+        return false;
+
+    if ((fstat(stream->fd, &sbuf) == -1) || !S_ISREG(sbuf.st_mode))
+        return false;
+
+    for (widx = 0; widx < URING_MAX_WRITERS; widx++) {
+        if (uring_writers[widx].fd == -1)
+            break;
+    }
+    if (widx == URING_MAX_WRITERS)
+        return false;
+
+    uring_writers[widx].fd = stream->fd;
+    uring_writers[widx].offset = lseek(stream->fd, 0, SEEK_CUR);
+    uring_writers[widx].slot = -1;
+
+    stream->estream_write = uring_write;
+    stream->estream_close = uring_close;
+
+    return true;
+}
+
+/* exported interface, documented in uring.h */
+void
+ekey_uring_forget(int fd)
+{
+    int idx;
+    uring_pollent_t *ent;
+
+    if (ring_fd < 0)
+        return;
+
+    for (idx = 0; idx < URING_MAX_POLL; idx++) {
+        ent = &uring_polls[idx];
+        if (ent->fd != fd)
+            continue;
+        if (ent->armed) {
+            uring_queue_cancel(IORING_OP_POLL_REMOVE,
+                               UD(UD_OP_POLL, ent->gen, idx));
+        }
+        ent->fd = -1;
+        ent->gen++;
+        ent->armed = false;
+        ent->revents = 0;
+    }
+}
+
+/** Perform one submit and wait cycle.
+ *
+ * The timeout may be shortened to flush write buffers so a zero return
+ * does not mean the callers timeout expired.
+ */
+static int
+uring_wait_once(struct pollfd *fds, int nfds, int timeout)
+{
+    int loop;
+    int idx;
+    int ready = 0;
+    long age;
+    uring_pollent_t *ent;
+    uring_reader_t *rdr;
+
+    /* make sure every fd has an outstanding poll or read */
+    for (loop = 0; loop < nfds; loop++) {
+        rdr = uring_find_reader(fds[loop].fd);
+        if (rdr != NULL) {
+            /* a reader without POLLIN is paused, leave its data queued */
+            if ((fds[loop].events & POLLIN) == 0)
+                continue;
+            if (!rdr->inflight && !uring_reader_ready(rdr))
+                uring_queue_read(rdr - uring_readers);
+            if (uring_reader_ready(rdr))
+                ready++;
+            continue;
+        }
+
+        ent = uring_find_poll(fds[loop].fd, &idx);
+        if (ent == NULL)
+            continue; /* table full, cannot happen with MAX_EKEY_POLLFD */
+
+        if (ent->armed && ent->events != fds[loop].events) {
+            uring_queue_cancel(IORING_OP_POLL_REMOVE,
+                               UD(UD_OP_POLL, ent->gen, idx));
+            ent->gen++;
+            ent->armed = false;
+        }
+        ent->events = fds[loop].events;
+
+        if (ent->revents != 0) {
+            ready++;
+        } else if (!ent->armed) {
+            uring_queue_poll(idx);
+        }
+    }
+
+    /* push out partially filled write buffers which have waited too long */
+    for (idx = 0; idx < URING_MAX_WRITERS; idx++) {
+        if ((uring_writers[idx].fd < 0) || (uring_writers[idx].slot < 0))
+            continue;
+        age = ms_since(&uring_writers[idx].filled);
+        if (age >= URING_WRFLUSH_MS) {
+            uring_queue_write(idx);
+        } else if ((timeout < 0) || (timeout > (URING_WRFLUSH_MS - age))) {
+            timeout = URING_WRFLUSH_MS - age;
+        }
+    }
+
+    if ((ready == 0) || (to_submit > 0)) {
+        if (uring_enter((ready == 0) ? 1 : 0, timeout) < 0)
+            return -1;
+    }
+    uring_reap();
+
+    /* translate completions into poll results */
+    ready = 0;
+    for (loop = 0; loop < nfds; loop++) {
+        fds[loop].revents = 0;
+        rdr = uring_find_reader(fds[loop].fd);
+        if (rdr != NULL) {
+            if ((fds[loop].events & POLLIN) && uring_reader_ready(rdr))
+                fds[loop].revents = POLLIN;
+        } else {
+            for (idx = 0; idx < URING_MAX_POLL; idx++) {
+                if (uring_polls[idx].fd == fds[loop].fd)
+                    break;
+            }
+            if (idx < URING_MAX_POLL) {
+                ent = &uring_polls[idx];
+                fds[loop].revents = ent->revents &
+                    (fds[loop].events | POLLERR | POLLHUP | POLLNVAL);
+                ent->revents = 0;
+            }
+        }
+        if (fds[loop].revents != 0)
+            ready++;
+    }
+
+    return ready;
+}
+
+/* exported interface, documented in uring.h */
+int
+ekey_uring_wait(struct pollfd *fds, int nfds, int timeout)
+{
+    int ready;
+
+    do {
+        ready = uring_wait_once(fds, nfds, timeout);
+    } while ((ready == 0) && (timeout < 0));
+
+    return ready;
+}
+
+/* exported interface, documented in uring.h */
+bool
+ekey_uring_init(void)
+{
+    struct io_uring_params params;
+    struct iovec iov[URING_MAX_READERS + URING_WRSLOTS];
+    int idx;
+
+    if (ring_fd >= 0)
+        return true;
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring_fd < 0)
+        return false; /* kernel lacks io_uring or it is disabled */
+
+    if ((params.features & IORING_FEAT_EXT_ARG) == 0)
+        goto fail_close; /* pre 5.11 kernel, stay on poll */
+
+    sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_sz > sq_ring_sz)
+            sq_ring_sz = cq_ring_sz;
+        cq_ring_sz = sq_ring_sz;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+        goto fail_close;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(NULL, cq_ring_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+
+    sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_sz, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto fail_cq;
+
+    sq_head = (unsigned *)((uint8_t *)sq_ring + params.sq_off.head);
+    sq_tail = (unsigned *)((uint8_t *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned *)((uint8_t *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((uint8_t *)sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)((uint8_t *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)((uint8_t *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned *)((uint8_t *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((uint8_t *)cq_ring + params.cq_off.cqes);
+
+    /* one arena holds every read and write buffer so they can all be
+     * registered with the kernel in a single call. It is shared so the
+     * pinned pages stay the same after daemonising forks.
+     */
+    arena_sz = (URING_MAX_READERS * URING_READBUF) + (URING_WRSLOTS * URING_WRBUF);
+    arena = mmap(NULL, arena_sz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED)
+        goto fail_sqes;
+
+    for (idx = 0; idx < URING_MAX_READERS; idx++) {
+        uring_readers[idx].fd = -1;
+        uring_readers[idx].buf = arena + (idx * URING_READBUF);
+        iov[idx].iov_base = uring_readers[idx].buf;
+        iov[idx].iov_len = URING_READBUF;
+    }
+    for (idx = 0; idx < URING_WRSLOTS; idx++) {
+        uring_wrslots[idx].writer = -1;
+        uring_wrslots[idx].buf = arena + (URING_MAX_READERS * URING_READBUF) +
+            (idx * URING_WRBUF);
+        iov[URING_MAX_READERS + idx].iov_base = uring_wrslots[idx].buf;
+        iov[URING_MAX_READERS + idx].iov_len = URING_WRBUF;
+    }
+    for (idx = 0; idx < URING_MAX_WRITERS; idx++)
+        uring_writers[idx].fd = -1;
+    for (idx = 0; idx < URING_MAX_POLL; idx++)
+        uring_polls[idx].fd = -1;
+
+    if (sys_io_uring_register(IORING_REGISTER_BUFFERS, iov,
+                              URING_MAX_READERS + URING_WRSLOTS) < 0)
+        goto fail_arena; /* typically RLIMIT_MEMLOCK is too small */
+
+    return true;
+
+fail_arena:
+    munmap(arena, arena_sz);
+fail_sqes:
+    munmap(sqes, sqes_sz);
+fail_cq:
+    if (cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_sz);
+fail_sq:
+    munmap(sq_ring, sq_ring_sz);
+fail_close:
+    close(ring_fd);
+    ring_fd = -1;
+    return false;
+}
+
+/* exported interface, documented in uring.h */
+void
+ekey_uring_finalise(void)
+{
+    if (ring_fd < 0)
+        return;
+
+    uring_drain_writes(-1);
+
+    munmap(sqes, sqes_sz);
+    if (cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_sz);
+    munmap(sq_ring, sq_ring_sz);
+    close(ring_fd);
+    munmap(arena, arena_sz);
+    ring_fd = -1;
+}
+
+/* exported interface, documented in uring.h */
+bool
+ekey_uring_active(void)
+{
+    return (ring_fd >= 0);
+}
+
+/* exported interface, documented in uring.h */
+const ekey_uring_stats_t *
+ekey_uring_stats(void)
+{
+    return &uring_stats;
+}
@@ -0,0 +1,93 @@
+/* daemon/uring.h
+ *
+ * Interface to the io_uring I/O backend
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_URING_H
+#define DAEMON_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+
+#include "stream.h"
+
+/** io_uring backend statistics. */
+typedef struct {
+    uint64_t submits; /**< Number of io_uring_enter calls which submitted work. */
+    uint64_t sqes; /**< Number of submission queue entries submitted. */
+    uint64_t cqes; /**< Number of completion queue entries reaped. */
+    uint64_t polls; /**< Number of completed poll requests. */
+    uint64_t reads; /**< Number of completed stream reads. */
+    uint64_t read_bytes; /**< Number of bytes read from key streams. */
+    uint64_t writes; /**< Number of completed sink writes. */
+    uint64_t write_bytes; /**< Number of bytes written to sinks. */
+} ekey_uring_stats_t;
+
+/** Set up the io_uring backend.
+ *
+ * The backend is only used if the running kernel supports all the
+ * features it relies upon, otherwise the poll backend remains in use.
+ *
+ * @return true if the io_uring backend is now active, else false.
+ */
+extern bool ekey_uring_init(void);
+
+/** Flush outstanding writes and shut the io_uring backend down. */
+extern void ekey_uring_finalise(void);
+
+/** Find out if the io_uring backend is in use.
+ *
+ * @return true if the io_uring backend is active.
+ */
+extern bool ekey_uring_active(void);
+
+/** Wait for events on a set of file descriptors.
+ *
+ * This is a drop in replacement for poll() which submits and reaps all
+ * queued io_uring work in a single system call.
+ *
+ * @param fds The file descriptors to wait on.
+ * @param nfds The number of entries in \a fds.
+ * @param timeout How long to wait in milliseconds, -1 for ever.
+ * @return The number of entries in \a fds with events or -1 and errno set.
+ */
+extern int ekey_uring_wait(struct pollfd *fds, int nfds, int timeout);
+
+/** Stop tracking a file descriptor.
+ *
+ * Must be called before a file descriptor passed to ::ekey_uring_wait is
+ * closed.
+ *
+ * @param fd The file descriptor to forget.
+ */
+extern void ekey_uring_forget(int fd);
+
+/** Read a stream through a registered buffer kept permanently in flight.
+ *
+ * @param stream The stream to attach.
+ * @return true if the stream reads are now serviced by io_uring.
+ */
+extern bool ekey_uring_attach_reader(estream_state_t *stream);
+
+/** Batch writes to a stream into registered buffers.
+ *
+ * Only regular files can be attached as write ordering is maintained
+ * through explicit file offsets.
+ *
+ * @param stream The stream to attach.
+ * @return true if the stream writes are now serviced by io_uring.
+ */
+extern bool ekey_uring_attach_writer(estream_state_t *stream);
+
+/** Obtain the backend statistics.
+ *
+ * @return The current statistics.
+ */
+extern const ekey_uring_stats_t *ekey_uring_stats(void);
+
+#endif /* DAEMON_URING_H */
@@ -0,0 +1,196 @@
+/* daemon/usbstream-test.c
+ *
+ * Check a USB stream over the simulated transport.
+ *
+ * The doorbell must be silent until the transport delivers data, ring
+ * while data is buffered and fall silent again once it has been read.
+ * Writes must reach the simulated key, which answers a reset and a
+ * keying request, and the simulated transport must report the part of a
+ * write it could not queue.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "stream.h"
+#include "usbstream.h"
+#include "usbtrans.h"
+#include "check.h"
+
+/** Room for everything a stream can have buffered. */
+#define TEST_BUFFER (16 * 1024)
+
+static void
+test_fdadd(int fd, short events, void *pw)
+{
+}
+
+static void
+test_fdrm(int fd, void *pw)
+{
+}
+
+static void
+test_rx(usbtrans_dev_t *dev, const uint8_t *buf, size_t len, void *pw)
+{
+}
+
+static void
+test_gone(usbtrans_dev_t *dev, int error, void *pw)
+{
+}
+
+/** Whether a stream's doorbell is ringing. */
+static bool
+bell_rung(estream_state_t *stream)
+{
+    struct pollfd pfd = { .fd = stream->fd, .events = POLLIN };
+
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/** Read everything buffered on a stream.
+ *
+ * @return The number of bytes read.
+ */
+static size_t
+drain(estream_state_t *stream, uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t rd;
+
+    while (done < len) {
+        rd = estream_read(stream, buf + done, len - done);
+        if (rd <= 0)
+            break;
+        done += rd;
+    }
+    return done;
+}
+
+int
+main(void)
+{
+    estream_state_t *stream;
+    estream_state_t *slow;
+    uint8_t buf[TEST_BUFFER];
+    size_t len;
+    usbtrans_dev_t *dev;
+    size_t txmax;
+    size_t idx;
+    int timeout;
+
+    /* reads must not block for the checks of an idle doorbell */
+    estream_usb_set_poll(test_fdadd, test_fdrm, NULL);
+
+    stream = estream_open("usb:fake/0");
+    CHECK(stream != NULL);
+    if (stream == NULL)
+        return 1;
+    CHECK(strcmp(stream->uri, "usb:fake/0") == 0);
+
+    /* nothing arrives until the transport is serviced */
+    CHECK(!bell_rung(stream));
+    CHECK(estream_read(stream, buf, sizeof(buf)) == -1);
+    CHECK(errno == EWOULDBLOCK);
+
+    /* an unkeyed key sends its serial number and asks to be keyed */
+    CHECK(estream_usb_timeout() == 0);
+    estream_usb_handle_events();
+    CHECK(bell_rung(stream));
+    len = drain(stream, buf, sizeof(buf));
+    CHECK(len == 128);
+    CHECK(memcmp(buf, "* S!", 4) == 0);
+    CHECK(memcmp(buf + 64, "* k!", 4) == 0);
+    CHECK(!bell_rung(stream));
+
+    /* it then waits, asking again about once a second */
+    estream_usb_handle_events();
+    CHECK(!bell_rung(stream));
+    timeout = estream_usb_timeout();
+    CHECK((timeout > 0) && (timeout <= 1000));
+
+    /* a reset starts it again */
+    CHECK(estream_write(stream, "\003", 1) == 1);
+    estream_usb_handle_events();
+    CHECK(bell_rung(stream));
+    len = drain(stream, buf, sizeof(buf));
+    CHECK(len == 128);
+    CHECK(memcmp(buf, "* S!", 4) == 0);
+
+    /* a nonce, split over two writes, keys it and entropy follows */
+    CHECK(estream_write(stream, "KAAAAAAAA", 9) == 9);
+    CHECK(estream_write(stream, "AAAAAAAA.", 9) == 9);
+    estream_usb_handle_events();
+    CHECK(bell_rung(stream));
+    len = drain(stream, buf, 3 * 64);
+    CHECK(len == 3 * 64);
+    CHECK(memcmp(buf, "* K!", 4) == 0);
+    CHECK(memcmp(buf + 64, "* I>", 4) == 0);
+    CHECK(memcmp(buf + 128, "* E!", 4) == 0);
+
+    /* data left unread keeps the doorbell ringing */
+    CHECK(bell_rung(stream));
+    drain(stream, buf, sizeof(buf));
+    CHECK(!bell_rung(stream));
+
+    /* a reader which falls behind pauses the key rather than lose data */
+    for (idx = 0; idx < 64; idx++)
+        estream_usb_handle_events();
+    len = drain(stream, buf, sizeof(buf));
+    CHECK((len > 0) && (len <= sizeof(buf)) && ((len % 64) == 0));
+    for (idx = 0; idx < len; idx += 64)
+        if (memcmp(buf + idx, "* ", 2) != 0)
+            break;
+    CHECK(idx == len);
+    estream_usb_handle_events();
+    CHECK(bell_rung(stream));
+    drain(stream, buf, sizeof(buf));
+
+    estream_close(stream);
+
+    /* a rate limited key sends a frame when its timeout expires */
+    slow = estream_open("usb:fake1/640");
+    CHECK(slow != NULL);
+    if (slow == NULL)
+        return 1;
+    estream_usb_handle_events();
+    CHECK(drain(slow, buf, sizeof(buf)) == 64);
+    CHECK(!bell_rung(slow));
+    timeout = estream_usb_timeout();
+    CHECK((timeout > 0) && (timeout <= 100));
+    estream_usb_handle_events();
+    CHECK(!bell_rung(slow));
+    poll(NULL, 0, timeout);
+    estream_usb_handle_events();
+    CHECK(bell_rung(slow));
+    CHECK(drain(slow, buf, sizeof(buf)) == 64);
+    CHECK(memcmp(buf, "* k!", 4) == 0);
+    estream_close(slow);
+
+    /* a write larger than the free transfers is only partly queued */
+    dev = usbtrans_fake.open("fake2", "0", test_rx, test_gone, NULL);
+    CHECK(dev != NULL);
+    if (dev == NULL)
+        return 1;
+    memset(buf, 0, sizeof(buf));
+    txmax = USBTRANS_TX_SIZE * USBTRANS_TX_TRANSFERS;
+    CHECK(usbtrans_fake.write(dev, buf, txmax + 1) == (ssize_t)txmax);
+    CHECK(usbtrans_fake.write(dev, buf, 1) == -1);
+    CHECK(errno == EWOULDBLOCK);
+    CHECK(usbtrans_fake.stats(dev)->tx_busy == 1);
+    usbtrans_fake.handle_events();
+    CHECK(usbtrans_fake.write(dev, buf, 1) == 1);
+    CHECK(usbtrans_fake.stats(dev)->tx_bytes == txmax + 1);
+    usbtrans_fake.close(dev);
+
+    return check_result("usbstream");
+}
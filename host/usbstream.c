@@ -0,0 +1,392 @@
+/* daemon/usbstream.c
+ *
+ * Direct USB Entropy Key stream
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+
+#include "stream.h"
+#include "usbstream.h"
+
+/** Data buffered from the device between reads by the framer. */
+#define USBSTREAM_BUFFER (16 * 1024)
+
+/** Maximum number of transport file descriptors tracked. */
+#define USBSTREAM_MAX_FD 32
+
+/** Number of times a write is retried while every transfer is busy. */
+#define USBSTREAM_WRITE_RETRIES 50
+
+typedef struct usbstream_s {
+    struct usbstream_s *next;
+    const usbtrans_ops_t *ops; /**< Transport the device is on. */
+    usbtrans_dev_t *dev; /**< Transport device handle. */
+    int bell[2]; /**< Pipe readable while data is buffered, [0] is the stream fd. */
+    bool rung; /**< A byte is in the doorbell pipe. */
+    bool gone; /**< The device has failed, reads return end of file. */
+    bool paused; /**< The device is not read until the framer catches up. */
+    uint8_t buf[USBSTREAM_BUFFER]; /**< Data from the device. */
+    size_t head; /**< Offset of the first unread byte in buf. */
+    size_t len; /**< Number of unread bytes in buf. */
+} usbstream_t;
+
+static const usbtrans_ops_t *transports[] = {
+    &usbtrans_libusb,
+    &usbtrans_fake,
+};
+#define NTRANSPORTS (sizeof(transports) / sizeof(transports[0]))
+
+static bool transport_ready[NTRANSPORTS];
+static usbstream_t *usbstreams;
+
+static usbtrans_fdadd_fn *poll_fdadd;
+static usbtrans_fdrm_fn *poll_fdrm;
+static void *poll_pw;
+
+static struct pollfd usb_fds[USBSTREAM_MAX_FD];
+static int usb_nfds;
+
+static void
+usb_fdadd(int fd, short events, void *pw)
+{
+    if (usb_nfds < USBSTREAM_MAX_FD) {
+        usb_fds[usb_nfds].fd = fd;
+        usb_fds[usb_nfds].events = events;
+        usb_nfds++;
+    }
+    if (poll_fdadd != NULL)
+        poll_fdadd(fd, events, poll_pw);
+}
+
+static void
+usb_fdrm(int fd, void *pw)
+{
+    int idx;
+
+    for (idx = 0; idx < usb_nfds; idx++) {
+        if (usb_fds[idx].fd == fd) {
+            usb_fds[idx] = usb_fds[--usb_nfds];
+            break;
+        }
+    }
+    if (poll_fdrm != NULL)
+        poll_fdrm(fd, poll_pw);
+}
+
+/** Block until the transports have had a chance to make progress. */
+static void
+usb_wait_events(int limit)
+{
+    int timeout = estream_usb_timeout();
+
+    if ((timeout < 0) || (timeout > limit))
+        timeout = limit;
+
+    poll(usb_fds, usb_nfds, timeout);
+    estream_usb_handle_events();
+}
+
+static usbstream_t *
+find_stream(int fd)
+{
+    usbstream_t *stream;
+
+    for (stream = usbstreams; stream != NULL; stream = stream->next) {
+        if (stream->bell[0] == fd)
+            return stream;
+    }
+    return NULL;
+}
+
+static void
+ring_bell(usbstream_t *stream)
+{
+    if (!stream->rung) {
+        if (write(stream->bell[1], "", 1) == 1)
+            stream->rung = true;
+    }
+}
+
+static void
+usb_rx(usbtrans_dev_t *dev, const uint8_t *buf, size_t len, void *pw)
+{
+    usbstream_t *stream = pw;
+    size_t tail;
+    size_t chunk;
+
+    while (len > 0) {
+        tail = (stream->head + stream->len) % USBSTREAM_BUFFER;
+        chunk = USBSTREAM_BUFFER - tail;
+        if (chunk > len)
+            chunk = len;
+        memcpy(stream->buf + tail, buf, chunk);
+        stream->len += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+
+    /* stop reading while the reads in flight might not fit */
+    if (!stream->paused &&
+        ((USBSTREAM_BUFFER - stream->len) < USBTRANS_RX_INFLIGHT)) {
+        stream->ops->pause(stream->dev, true);
+        stream->paused = true;
+    }
+
+    ring_bell(stream);
+}
+
+static void
+usb_gone(usbtrans_dev_t *dev, int error, void *pw)
+{
+    usbstream_t *stream = pw;
+
+    syslog(LOG_ERR, "USB Entropy Key failed: %s", strerror(error));
+    stream->gone = true;
+    ring_bell(stream);
+}
+
+static ssize_t
+usb_read(int fd, void *buf, size_t count)
+{
+    usbstream_t *stream = find_stream(fd);
+    uint8_t dummy;
+    size_t chunk;
+
+    if (stream == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* without a poll loop behave like a blocking descriptor */
+    while ((poll_fdadd == NULL) && (stream->len == 0) && !stream->gone)
+        usb_wait_events(1000);
+
+    if (stream->len == 0) {
+        if (stream->gone)
+            return 0;
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    chunk = USBSTREAM_BUFFER - stream->head;
+    if (chunk > stream->len)
+        chunk = stream->len;
+    if (chunk > count)
+        chunk = count;
+
+    memcpy(buf, stream->buf + stream->head, chunk);
+    stream->head = (stream->head + chunk) % USBSTREAM_BUFFER;
+    stream->len -= chunk;
+
+    if (stream->paused && !stream->gone &&
+        ((USBSTREAM_BUFFER - stream->len) >= USBTRANS_RX_INFLIGHT)) {
+        stream->ops->pause(stream->dev, false);
+        stream->paused = false;
+    }
+
+    if ((stream->len == 0) && stream->rung && !stream->gone) {
+        /* drained, silence the doorbell */
+        if (read(stream->bell[0], &dummy, 1) == 1)
+            stream->rung = false;
+    }
+
+    return chunk;
+}
+
+static ssize_t
+usb_write(int fd, const void *buf, size_t count)
+{
+    usbstream_t *stream = find_stream(fd);
+    const uint8_t *src = buf;
+    size_t done = 0;
+    ssize_t r;
+    int retries = USBSTREAM_WRITE_RETRIES;
+
+    if (stream == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* writes are rare and tiny, wait for a free transfer rather than
+     * make every caller cope with short writes.
+     */
+    while (done < count) {
+        r = stream->ops->write(stream->dev, src + done, count - done);
+        if (r < 0) {
+            if ((errno != EWOULDBLOCK) || (--retries == 0))
+                return (done > 0) ? (ssize_t)done : -1;
+            usb_wait_events(10);
+            continue;
+        }
+        done += r;
+    }
+
+    return done;
+}
+
+static int
+usb_close(int fd)
+{
+    usbstream_t *stream = find_stream(fd);
+    usbstream_t **prev;
+
+    if (stream == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    for (prev = &usbstreams; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == stream) {
+            *prev = stream->next;
+            break;
+        }
+    }
+
+    stream->ops->close(stream->dev);
+    close(stream->bell[1]);
+    close(stream->bell[0]);
+    free(stream);
+
+    return 0;
+}
+
+/* exported function documented in usbstream.h */
+estream_state_t *
+estream_usb_open(const char *name)
+{
+    estream_state_t *stream_state;
+    usbstream_t *stream;
+    const usbtrans_ops_t *ops = &usbtrans_libusb;
+    char *bus;
+    char *devnum;
+    unsigned int tidx;
+    int saved_errno;
+
+    bus = strdup(name);
+    if (bus == NULL)
+        return NULL;
+
+    devnum = strchr(bus, '/');
+    if (devnum == NULL) {
+        free(bus);
+        errno = EINVAL;
+        return NULL;
+    }
+    *devnum++ = 0;
+
+    if (strncmp(bus, "fake", 4) == 0)
+        ops = &usbtrans_fake;
+
+    for (tidx = 0; transports[tidx] != ops; tidx++);
+
+    if (!transport_ready[tidx]) {
+        if (ops->init(usb_fdadd, usb_fdrm, NULL) == false) {
+            free(bus);
+            return NULL;
+        }
+        transport_ready[tidx] = true;
+    }
+
+    stream = calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        free(bus);
+        return NULL;
+    }
+
+    if (pipe(stream->bell) == -1) {
+        free(stream);
+        free(bus);
+        return NULL;
+    }
+    fcntl(stream->bell[0], F_SETFL, fcntl(stream->bell[0], F_GETFL) | O_NONBLOCK);
+    fcntl(stream->bell[1], F_SETFL, fcntl(stream->bell[1], F_GETFL) | O_NONBLOCK);
+
+    stream->ops = ops;
+    stream->dev = ops->open(bus, devnum, usb_rx, usb_gone, stream);
+    free(bus);
+    if (stream->dev == NULL) {
+        saved_errno = errno;
+        close(stream->bell[0]);
+        close(stream->bell[1]);
+        free(stream);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    stream_state = calloc(1, sizeof(estream_state_t));
+    if (stream_state == NULL) {
+        ops->close(stream->dev);
+        close(stream->bell[0]);
+        close(stream->bell[1]);
+        free(stream);
+        return NULL;
+    }
+
+    stream->next = usbstreams;
+    usbstreams = stream;
+
+    stream_state->uri = malloc(strlen(USBSTREAM_PREFIX) + strlen(name) + 1);
+    if (stream_state->uri != NULL) {
+        strcpy(stream_state->uri, USBSTREAM_PREFIX);
+        strcat(stream_state->uri, name);
+    }
+    stream_state->fd = stream->bell[0];
+    stream_state->estream_read = usb_read;
+    stream_state->estream_write = usb_write;
+    stream_state->estream_close = usb_close;
+    stream_state->simulated = (ops == &usbtrans_fake);
+
+    return stream_state;
+}
+
+/* exported function documented in usbstream.h */
+void
+estream_usb_set_poll(usbtrans_fdadd_fn *fdadd, usbtrans_fdrm_fn *fdrm, void *pw)
+{
+    poll_fdadd = fdadd;
+    poll_fdrm = fdrm;
+    poll_pw = pw;
+}
+
+/* exported function documented in usbstream.h */
+int
+estream_usb_timeout(void)
+{
+    unsigned int tidx;
+    int timeout = -1;
+    int ttimeout;
+
+    for (tidx = 0; tidx < NTRANSPORTS; tidx++) {
+        if (!transport_ready[tidx])
+            continue;
+        ttimeout = transports[tidx]->timeout();
+        if ((ttimeout >= 0) && ((timeout < 0) || (ttimeout < timeout)))
+            timeout = ttimeout;
+    }
+
+    return timeout;
+}
+
+/* exported function documented in usbstream.h */
+void
+estream_usb_handle_events(void)
+{
+    unsigned int tidx;
+
+    for (tidx = 0; tidx < NTRANSPORTS; tidx++) {
+        if (transport_ready[tidx])
+            transports[tidx]->handle_events();
+    }
+}
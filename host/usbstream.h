@@ -0,0 +1,53 @@
+/* daemon/usbstream.h
+ *
+ * Direct USB Entropy Key stream
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_USBSTREAM_H
+#define DAEMON_USBSTREAM_H
+
+#include "usbtrans.h"
+
+/** Prefix of stream names which are opened directly over USB. */
+#define USBSTREAM_PREFIX "usb:"
+
+/** Open an Entropy Key directly over USB.
+ *
+ * The name is of the form bus/device, a bus starting "fake" selects the
+ * simulated transport.
+ *
+ * The returned stream file descriptor becomes readable whenever data has
+ * arrived from the device. If no poll hooks have been set with
+ * ::estream_usb_set_poll reads block until data arrives.
+ *
+ * @param name The bus and device number of the key.
+ * @return The stream handle or NULL and errno set.
+ */
+extern estream_state_t *estream_usb_open(const char *name);
+
+/** Set the hooks used to add USB transport file descriptors to a poll loop.
+ *
+ * Must be called before any USB stream is opened. When the poll loop finds
+ * one of the file descriptors ready, or the timeout returned by
+ * ::estream_usb_timeout expires, it must call ::estream_usb_handle_events.
+ *
+ * @param fdadd Called when a file descriptor must be polled.
+ * @param fdrm Called when a file descriptor is no longer required.
+ * @param pw Private word passed to \a fdadd and \a fdrm.
+ */
+extern void estream_usb_set_poll(usbtrans_fdadd_fn *fdadd, usbtrans_fdrm_fn *fdrm, void *pw);
+
+/** Time until the USB transports next need servicing.
+ *
+ * @return The timeout in milliseconds or -1 for none.
+ */
+extern int estream_usb_timeout(void);
+
+/** Process USB transport events without blocking. */
+extern void estream_usb_handle_events(void);
+
+#endif
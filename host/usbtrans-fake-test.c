@@ -0,0 +1,84 @@
+/* daemon/usbtrans-fake-test.c
+ *
+ * Drive a simulated key through keying and two sessions of entropy.
+ *
+ * make check builds and runs this, a key path may be given to check
+ * another stream carrying a simulated key, such as one from ekey-netd.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "stream.h"
+#include "keydb.h"
+#include "connection.h"
+#include "usbtrans.h"
+#include "util.h"
+
+/** Least entropy delivered by a session of 4096 packets. */
+#define SESSION_BYTES (4096 * 32)
+
+static void
+test_entropy(econ_state_t *econ, const uint8_t *buf, size_t count, void *pw)
+{
+    uint64_t *total = pw;
+
+    *total += count;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "usb:fake/0";
+    static const uint8_t ltkey[32] = USBTRANS_FAKE_LTKEY;
+    uint8_t snum[12];
+    econ_state_t *econ;
+    uint64_t total = 0;
+    uint64_t deadline = monotonic_ms() + 30 * 1000;
+    ekey_state_t state;
+    int idx;
+
+    /* every simulated key shares a long term key */
+    memcpy(snum, USBTRANS_FAKE_SERIAL, sizeof(snum));
+    for (idx = 0; idx < 256; idx++) {
+        snum[11] = idx;
+        add_ltkey(snum, ltkey);
+    }
+
+    econ = econ_open(path, NULL);
+    if (econ == NULL) {
+        perror(path);
+        return 1;
+    }
+    econ->entropy_fn = test_entropy;
+    econ->entropy_pw = &total;
+
+    /* the stream has no poll loop, reads wait for the simulated key */
+    while ((total < 2 * SESSION_BYTES) || (econ->con_rekeys < 2)) {
+        econ_run(econ);
+        state = econ_state(econ);
+        if ((state == ESTATE_CLOSE) || (state == ESTATE_UNTRUSTED) ||
+            (state == ESTATE_KEYED_BAD)) {
+            fprintf(stderr, "%s: failed in state %d\n", path, state);
+            return 1;
+        }
+        if (monotonic_ms() > deadline) {
+            fprintf(stderr, "%s: timed out in state %d with %llu bytes\n",
+                    path, state, (unsigned long long)total);
+            return 1;
+        }
+    }
+
+    printf("%s: keyed %u times, %llu bytes of entropy at health %u%%\n",
+           path, econ->con_rekeys, (unsigned long long)total,
+           econ->key_health);
+
+    econ_close(econ);
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+/* daemon/usbtrans.h
+ *
+ * Interface to the Entropy Key USB transports.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#ifndef DAEMON_USBTRANS_H
+#define DAEMON_USBTRANS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Entropy Key USB vendor ID. */
+#define EKEY_USB_VENDOR 0x20df
+
+/** Entropy Key USB product ID. */
+#define EKEY_USB_PRODUCT 0x0001
+
+/** Interface carrying the pseudo serial data. */
+#define EKEY_IFACE 1
+
+/** Bulk endpoint from the device to the host. */
+#define EKEY_EP_TOHOST 1
+
+/** Bulk endpoint from the host to the device. */
+#define EKEY_EP_TODEVICE 3
+
+/** Number of reads kept in flight for each device. */
+#define USBTRANS_RX_TRANSFERS 4
+
+/** Size of each read. */
+#define USBTRANS_RX_SIZE 1024
+
+/** Most data which can arrive from a device after it is paused. */
+#define USBTRANS_RX_INFLIGHT (USBTRANS_RX_TRANSFERS * USBTRANS_RX_SIZE)
+
+/** Number of writes which may be in flight for each device. */
+#define USBTRANS_TX_TRANSFERS 2
+
+/** Size of each write. */
+#define USBTRANS_TX_SIZE 1024
+
+/** Serial number of simulated keys, the last byte numbers the key. */
+#define USBTRANS_FAKE_SERIAL "FAKEEKEY\0\0\0\0"
+
+/** Long term key shared by every simulated key. */
+#define USBTRANS_FAKE_LTKEY "simulated entropy key long term!"
+
+/** Opaque USB transport device handle. */
+typedef struct usbtrans_dev_s usbtrans_dev_t;
+
+/** Data arrived from a device.
+ *
+ * @param dev The device the data was read from.
+ * @param buf The data.
+ * @param len The length of \a buf.
+ * @param pw The private word passed to open.
+ */
+typedef void (usbtrans_rx_fn)(usbtrans_dev_t *dev, const uint8_t *buf, size_t len, void *pw);
+
+/** A device has failed or been removed.
+ *
+ * The device must not be closed from within this callback, it should be
+ * closed once the call to handle_events returns.
+ *
+ * @param dev The device which has gone.
+ * @param error The errno value describing the failure.
+ * @param pw The private word passed to open.
+ */
+typedef void (usbtrans_gone_fn)(usbtrans_dev_t *dev, int error, void *pw);
+
+/** The transport needs a file descriptor polled.
+ *
+ * @param fd The file descriptor.
+ * @param events The poll events required.
+ * @param pw The private word passed to init.
+ */
+typedef void (usbtrans_fdadd_fn)(int fd, short events, void *pw);
+
+/** The transport no longer needs a file descriptor polled.
+ *
+ * @param fd The file descriptor.
+ * @param pw The private word passed to init.
+ */
+typedef void (usbtrans_fdrm_fn)(int fd, void *pw);
+
+/** Per device transport statistics. */
+typedef struct {
+    uint64_t rx_transfers; /**< Number of completed reads. */
+    uint64_t rx_bytes; /**< Number of bytes read. */
+    uint64_t tx_transfers; /**< Number of completed writes. */
+    uint64_t tx_bytes; /**< Number of bytes written. */
+    uint64_t tx_busy; /**< Number of writes refused as every transfer was busy. */
+} usbtrans_stats_t;
+
+/** USB transport operations. */
+typedef struct {
+    /** Name of the transport. */
+    const char *name;
+
+    /** Initialise the transport.
+     *
+     * @param fdadd Called when a file descriptor must be polled.
+     * @param fdrm Called when a file descriptor is no longer required.
+     * @param pw Private word passed to \a fdadd and \a fdrm.
+     * @return true on success else false and errno set.
+     */
+    bool (*init)(usbtrans_fdadd_fn *fdadd, usbtrans_fdrm_fn *fdrm, void *pw);
+
+    /** Shut the transport down, all devices must already be closed. */
+    void (*finalise)(void);
+
+    /** Open an Entropy Key and start reading from it.
+     *
+     * @param bus The bus number the device is on.
+     * @param devnum The device number on the bus.
+     * @param rx Called with each block of data read from the device.
+     * @param gone Called if the device fails.
+     * @param pw Private word passed to the callbacks.
+     * @return The device handle or NULL and errno set.
+     */
+    usbtrans_dev_t *(*open)(const char *bus, const char *devnum,
+                            usbtrans_rx_fn *rx, usbtrans_gone_fn *gone,
+                            void *pw);
+
+    /** Cancel outstanding transfers and close a device. */
+    void (*close)(usbtrans_dev_t *dev);
+
+    /** Queue data to be written to a device.
+     *
+     * @param dev The device to write to.
+     * @param buf The data to write.
+     * @param count The length of \a buf.
+     * @return The number of bytes queued or -1 and errno set, EWOULDBLOCK
+     *         indicates every write transfer is busy.
+     */
+    ssize_t (*write)(usbtrans_dev_t *dev, const void *buf, size_t count);
+
+    /** Stop or restart reading from a device.
+     *
+     * Reads already in flight still complete, so up to
+     * ::USBTRANS_RX_INFLIGHT bytes may be delivered after pausing.
+     *
+     * @param dev The device.
+     * @param paused true to stop reading, false to read again.
+     */
+    void (*pause)(usbtrans_dev_t *dev, bool paused);
+
+    /** Time in milliseconds before handle_events must be called even if no
+     * file descriptor is ready, or -1 if there is no such deadline.
+     */
+    int (*timeout)(void);
+
+    /** Process completed transfers without blocking. */
+    void (*handle_events)(void);
+
+    /** Obtain the statistics for a device. */
+    const usbtrans_stats_t *(*stats)(usbtrans_dev_t *dev);
+} usbtrans_ops_t;
+
+/** Transport using asynchronous libusb-1.0 bulk transfers. */
+extern const usbtrans_ops_t usbtrans_libusb;
+
+/** Transport simulating Entropy Keys without hardware.
+ *
+ * Each simulated key sends framed and MAC'd packets as the key's firmware
+ * does, so a host must key it with ::USBTRANS_FAKE_LTKEY before it sends
+ * entropy.  The serial number is ::USBTRANS_FAKE_SERIAL with the last byte
+ * taken from any number in the bus name, so "fake" and "fake1" are
+ * different keys.  The device number is the simulated data rate in bytes
+ * per second, zero produces data as fast as it is consumed.
+ */
+extern const usbtrans_ops_t usbtrans_fake;
+
+#endif /* DAEMON_USBTRANS_H */
@@ -0,0 +1,504 @@
+/* daemon/usbtrans_fake.c
+ *
+ * Simulated Entropy Key USB transport for testing without hardware.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "usbtrans.h"
+#include "pem.h"
+#include "skeinwrap.h"
+
+/** Length of a frame. */
+#define FAKE_FRAME_LEN 64
+
+/** Number of frames which may wait to be sent ahead of the entropy. */
+#define FAKE_PENDING 4
+
+/** Entropy frames between information frames. */
+#define FAKE_INFO_INTERVAL 1024
+
+/** Nanoseconds between requests to be keyed while the host is silent. */
+#define FAKE_KEYREQ_NS 1000000000ULL
+
+/** Length of a keying request from the host, 'K', the nonce and a terminator. */
+#define FAKE_KEYREQ_LEN 18
+
+/** Shannon estimates reported by a simulated key, those of a healthy key. */
+#define FAKE_INFO "S4096,30720,30720,30720,4096,12288,4096,12288,0"
+
+/** Simulated key state. */
+typedef enum {
+    FAKE_WAITING, /**< Waiting for the host to send a nonce. */
+    FAKE_KEYED, /**< Sending entropy under a session key. */
+} fake_state_t;
+
+struct usbtrans_dev_s {
+    struct usbtrans_dev_s *next;
+    unsigned long rate; /**< Bytes per second, zero for unlimited. */
+    uint64_t due_ns; /**< Monotonic time the next frame is due. */
+    uint64_t asked_ns; /**< Monotonic time the key last asked to be keyed. */
+    uint32_t seed; /**< Simulated data generator state. */
+    bool paused; /**< The reader has no room, send nothing. */
+    unsigned int tx_inflight; /**< Write transfers not yet completed. */
+
+    fake_state_t state; /**< What the simulated key is doing. */
+    uint8_t snum[12]; /**< Serial number. */
+    EKeySkein mac; /**< MAC skein for the current session. */
+    EKeySkein ees; /**< Entropy encryption skein for the current session. */
+    short seq; /**< Sequence number of the next entropy frame. */
+    unsigned int since_info; /**< Entropy frames since the last information frame. */
+    uint8_t pending[FAKE_PENDING][FAKE_FRAME_LEN]; /**< Frames to send before any entropy. */
+    unsigned int npending; /**< Number of frames in pending. */
+    char cmd[FAKE_KEYREQ_LEN]; /**< Partial command from the host. */
+    size_t cmd_len; /**< Length of cmd. */
+
+    usbtrans_rx_fn *rx_cb;
+    usbtrans_gone_fn *gone_cb;
+    void *pw;
+    usbtrans_stats_t stats;
+};
+
+static usbtrans_dev_t *fake_devs;
+static uint32_t fake_seed = 1;
+
+static const uint8_t fake_ltkey[32] = USBTRANS_FAKE_LTKEY;
+static const uint8_t fake_nullkey[32];
+
+static uint64_t
+fake_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void
+fake_fill(usbtrans_dev_t *dev, uint8_t *buf, size_t len)
+{
+    size_t idx;
+
+    /* xorshift, cheap and good enough to look like entropy to a client */
+    for (idx = 0; idx < len; idx++) {
+        dev->seed ^= dev->seed << 13;
+        dev->seed ^= dev->seed >> 17;
+        dev->seed ^= dev->seed << 5;
+        buf[idx] = dev->seed;
+    }
+}
+
+/** Build a frame as the key's firmware does, MAC'd with the session skein.
+ *
+ * @param dev The simulated key.
+ * @param frame Where to build the frame.
+ * @param type The packet type.
+ * @param class ::PKT_CLASS_BINARY with a 36 byte payload, otherwise an
+ *              ASCII payload of up to 50 characters.
+ * @param subcode The binary packet subcode.
+ * @param payload The packet data.
+ */
+static void
+fake_frame(usbtrans_dev_t *dev, uint8_t *frame, char type, char class,
+           short subcode, const uint8_t *payload)
+{
+    EKeySkein mac;
+    uint8_t macbuf[32];
+    size_t len;
+
+    frame[0] = '*';
+    frame[1] = ' ';
+    frame[2] = type;
+    frame[3] = class;
+    if (class == '!') {
+        pem64_encode_12bits(subcode, (char *)frame + 4);
+        pem64_encode_bytes(payload, 36, (char *)frame + 6);
+    } else {
+        len = strlen((const char *)payload);
+        memset(frame + 4, ' ', 50);
+        memcpy(frame + 4, payload, (len > 50) ? 50 : len);
+    }
+
+    memcpy(&mac, &dev->mac, sizeof(mac));
+    Skein_256_Update(&mac, frame + 2, 52);
+    Skein_256_Final_Pad(&mac, macbuf);
+    pem64_encode_bytes(macbuf, 3, (char *)frame + 54);
+    pem64_encode_bytes(macbuf + 29, 3, (char *)frame + 58);
+
+    frame[62] = '\r';
+    frame[63] = '\n';
+}
+
+/** Queue a frame to be sent ahead of any entropy. */
+static void
+fake_queue(usbtrans_dev_t *dev, char type, char class, short subcode,
+           const uint8_t *payload)
+{
+    if (dev->npending < FAKE_PENDING)
+        fake_frame(dev, dev->pending[dev->npending++], type, class, subcode,
+                   payload);
+}
+
+/** Ask the host for a session key, as the key repeats until it gets one. */
+static void
+fake_askkey(usbtrans_dev_t *dev)
+{
+    uint8_t payload[36];
+
+    memset(payload, 0, sizeof(payload));
+    fake_queue(dev, 'k', '!', 0, payload);
+    dev->asked_ns = fake_now_ns();
+}
+
+/** Start the simulated key afresh, as on power up or a reset. */
+static void
+fake_reset(usbtrans_dev_t *dev)
+{
+    uint8_t payload[36];
+
+    dev->state = FAKE_WAITING;
+    dev->npending = 0;
+    PrepareSkein(&dev->mac, dev->snum, fake_nullkey,
+                 EKEY_SKEIN_PERSONALISATION_PMS);
+
+    /* announce the serial number and ask to be keyed */
+    memset(payload, 0, sizeof(payload));
+    memcpy(payload, dev->snum, sizeof(dev->snum));
+    fake_queue(dev, 'S', '!', 0, payload);
+    fake_askkey(dev);
+}
+
+/** Start a session with the nonce the host sent. */
+static void
+fake_rekey(usbtrans_dev_t *dev, const char *pem_nonce)
+{
+    uint8_t nonce[12 + 1];
+    uint8_t payload[36];
+    uint8_t session_key[32];
+    EKeySkein rekeying;
+
+    pem64_decode_bytes(pem_nonce, 16, nonce);
+    fake_fill(dev, payload, sizeof(payload));
+
+    /* the key's half of the session is sent under the old MAC */
+    fake_queue(dev, 'K', '!', 12, payload);
+
+    PrepareSkein(&rekeying, dev->snum, fake_ltkey,
+                 EKEY_SKEIN_PERSONALISATION_RS);
+    Skein_256_Update(&rekeying, payload, 32);
+    Skein_256_Update(&rekeying, nonce, 12);
+    Skein_256_Final(&rekeying, session_key);
+
+    PrepareSkein(&dev->mac, dev->snum, session_key,
+                 EKEY_SKEIN_PERSONALISATION_PMS);
+    PrepareSkein(&dev->ees, dev->snum, session_key,
+                 EKEY_SKEIN_PERSONALISATION_EES);
+
+    fake_queue(dev, 'I', '>', 0, (const uint8_t *)FAKE_INFO);
+
+    dev->state = FAKE_KEYED;
+    dev->seq = 0;
+    dev->since_info = 0;
+}
+
+/** Produce the next frame the simulated key sends.
+ *
+ * @return true if a frame was produced, false if the key is waiting.
+ */
+static bool
+fake_next(usbtrans_dev_t *dev, uint8_t *frame)
+{
+    EKeySkein ees;
+    uint8_t payload[36];
+    uint8_t keystream[32];
+    char subcode[2];
+    int idx;
+
+    if (dev->npending > 0) {
+        memcpy(frame, dev->pending[0], FAKE_FRAME_LEN);
+        dev->npending--;
+        memmove(dev->pending[0], dev->pending[1],
+                dev->npending * FAKE_FRAME_LEN);
+        return true;
+    }
+
+    if (dev->state != FAKE_KEYED)
+        return false;
+
+    if (dev->since_info++ == FAKE_INFO_INTERVAL) {
+        dev->since_info = 0;
+        fake_frame(dev, frame, 'I', '>', 0, (const uint8_t *)FAKE_INFO);
+        return true;
+    }
+
+    fake_fill(dev, payload, sizeof(payload));
+    pem64_encode_12bits(dev->seq, subcode);
+    memcpy(&ees, &dev->ees, sizeof(ees));
+    Skein_256_Update(&ees, (uint8_t *)subcode, 2);
+    Skein_256_Final(&ees, keystream);
+    for (idx = 0; idx < 32; idx++)
+        payload[idx] ^= keystream[idx];
+
+    fake_frame(dev, frame, 'E', '!', dev->seq, payload);
+
+    /* the session is used up, the host sends a new nonce */
+    if (dev->seq++ == 4095)
+        dev->state = FAKE_WAITING;
+
+    return true;
+}
+
+/** Deliver up to a number of frames to the reader.
+ *
+ * @return The number of frames delivered.
+ */
+static unsigned int
+fake_deliver(usbtrans_dev_t *dev, unsigned int frames)
+{
+    uint8_t buf[USBTRANS_RX_SIZE];
+    size_t len = 0;
+    unsigned int sent = 0;
+
+    while ((sent < frames) && ((len + FAKE_FRAME_LEN) <= sizeof(buf)) &&
+           fake_next(dev, buf + len)) {
+        len += FAKE_FRAME_LEN;
+        sent++;
+    }
+
+    if (len > 0) {
+        dev->stats.rx_transfers++;
+        dev->stats.rx_bytes += len;
+        dev->rx_cb(dev, buf, len, dev->pw);
+    }
+
+    return sent;
+}
+
+/** A simulated key has something to send. */
+static bool
+fake_busy(const usbtrans_dev_t *dev)
+{
+    return (dev->npending > 0) || (dev->state == FAKE_KEYED);
+}
+
+static bool
+trans_init(usbtrans_fdadd_fn *fdadd, usbtrans_fdrm_fn *fdrm, void *pw)
+{
+    /* simulated devices are driven entirely by the timeout */
+    return true;
+}
+
+static void
+trans_finalise(void)
+{
+}
+
+static usbtrans_dev_t *
+trans_open(const char *bus, const char *devnum,
+           usbtrans_rx_fn *rx, usbtrans_gone_fn *gone, void *pw)
+{
+    usbtrans_dev_t *dev;
+
+    while ((*bus != 0) && !isdigit((unsigned char)*bus))
+        bus++;
+    while ((*devnum != 0) && !isdigit((unsigned char)*devnum))
+        devnum++;
+
+    dev = calloc(1, sizeof(*dev));
+    if (dev == NULL)
+        return NULL;
+
+    dev->rate = strtoul(devnum, NULL, 10);
+    dev->seed = fake_seed++ * 2654435761U;
+    memcpy(dev->snum, USBTRANS_FAKE_SERIAL, sizeof(dev->snum));
+    dev->snum[11] = strtoul(bus, NULL, 10);
+    dev->rx_cb = rx;
+    dev->gone_cb = gone;
+    dev->pw = pw;
+    dev->due_ns = fake_now_ns();
+    fake_reset(dev);
+
+    dev->next = fake_devs;
+    fake_devs = dev;
+
+    return dev;
+}
+
+static void
+trans_pause(usbtrans_dev_t *dev, bool paused)
+{
+    dev->paused = paused;
+}
+
+static void
+trans_close(usbtrans_dev_t *dev)
+{
+    usbtrans_dev_t **prev;
+
+    for (prev = &fake_devs; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == dev) {
+            *prev = dev->next;
+            break;
+        }
+    }
+    free(dev);
+}
+
+static ssize_t
+trans_write(usbtrans_dev_t *dev, const void *buf, size_t count)
+{
+    const char *cmd = buf;
+    unsigned int xfers;
+    size_t room;
+    size_t idx;
+
+    /* as with real transfers, each write occupies a transfer until the
+     * next time events are handled and only what fits is queued
+     */
+    if (dev->tx_inflight == USBTRANS_TX_TRANSFERS) {
+        dev->stats.tx_busy++;
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    room = (USBTRANS_TX_TRANSFERS - dev->tx_inflight) * USBTRANS_TX_SIZE;
+    if (count > room)
+        count = room;
+
+    xfers = (count + USBTRANS_TX_SIZE - 1) / USBTRANS_TX_SIZE;
+    dev->tx_inflight += xfers;
+    dev->stats.tx_transfers += xfers;
+    dev->stats.tx_bytes += count;
+
+    /* the simulated key understands a reset and a keying request, anything
+     * else is discarded
+     */
+    for (idx = 0; idx < count; idx++) {
+        if (dev->cmd_len > 0) {
+            dev->cmd[dev->cmd_len++] = cmd[idx];
+            if (dev->cmd_len == FAKE_KEYREQ_LEN) {
+                dev->cmd_len = 0;
+                if (!fake_busy(dev))
+                    dev->due_ns = fake_now_ns();
+                fake_rekey(dev, dev->cmd + 1);
+            }
+        } else if (cmd[idx] == 3) {
+            if (!fake_busy(dev))
+                dev->due_ns = fake_now_ns();
+            fake_reset(dev);
+        } else if (cmd[idx] == 'K') {
+            dev->cmd[dev->cmd_len++] = cmd[idx];
+        }
+    }
+
+    return count;
+}
+
+static int
+trans_timeout(void)
+{
+    usbtrans_dev_t *dev;
+    uint64_t now = fake_now_ns();
+    long ms;
+    long best = -1;
+
+    for (dev = fake_devs; dev != NULL; dev = dev->next) {
+        if (dev->tx_inflight > 0)
+            return 0;
+
+        if (dev->paused)
+            continue;
+
+        if (!fake_busy(dev)) {
+            ms = ((dev->asked_ns + FAKE_KEYREQ_NS) > now) ?
+                (long)((dev->asked_ns + FAKE_KEYREQ_NS - now + 999999) / 1000000) : 0;
+            if ((best < 0) || (ms < best))
+                best = ms;
+            continue;
+        }
+
+        if (dev->rate == 0)
+            return 0;
+
+        ms = (dev->due_ns > now) ? (long)((dev->due_ns - now + 999999) / 1000000) : 0;
+        if ((best < 0) || (ms < best))
+            best = ms;
+    }
+
+    return best;
+}
+
+static void
+trans_handle_events(void)
+{
+    usbtrans_dev_t *dev;
+    usbtrans_dev_t *next;
+    uint64_t now = fake_now_ns();
+    uint64_t interval;
+    int idx;
+
+    for (dev = fake_devs; dev != NULL; dev = next) {
+        next = dev->next;
+
+        /* writes complete as soon as they are serviced */
+        dev->tx_inflight = 0;
+
+        if (dev->paused)
+            continue;
+
+        if (!fake_busy(dev) && ((now - dev->asked_ns) >= FAKE_KEYREQ_NS)) {
+            dev->due_ns = now;
+            fake_askkey(dev);
+        }
+
+        if (dev->rate == 0) {
+            /* as fast as possible, one full read per transfer in flight */
+            for (idx = 0; (idx < USBTRANS_RX_TRANSFERS) && !dev->paused; idx++)
+                fake_deliver(dev, USBTRANS_RX_SIZE / FAKE_FRAME_LEN);
+            continue;
+        }
+
+        interval = (FAKE_FRAME_LEN * 1000000000ULL) / dev->rate;
+
+        if ((now > dev->due_ns) && ((now - dev->due_ns) > 1000000000)) {
+            /* far behind, do not try to catch up */
+            dev->due_ns = now;
+        }
+
+        while ((dev->due_ns <= now) && !dev->paused &&
+               (fake_deliver(dev, 1) == 1))
+            dev->due_ns += interval;
+
+        /* an idle key starts sending again as soon as it has cause to */
+        if (!fake_busy(dev) && (dev->due_ns < now))
+            dev->due_ns = now;
+    }
+}
+
+static const usbtrans_stats_t *
+trans_stats(usbtrans_dev_t *dev)
+{
+    return &dev->stats;
+}
+
+/* exported interface, documented in usbtrans.h */
+const usbtrans_ops_t usbtrans_fake = {
+    .name = "fake",
+    .init = trans_init,
+    .finalise = trans_finalise,
+    .open = trans_open,
+    .close = trans_close,
+    .write = trans_write,
+    .pause = trans_pause,
+    .timeout = trans_timeout,
+    .handle_events = trans_handle_events,
+    .stats = trans_stats,
+};
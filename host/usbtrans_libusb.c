@@ -0,0 +1,546 @@
+/* daemon/usbtrans_libusb.c
+ *
+ * Entropy Key USB transport using asynchronous libusb-1.0 transfers.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+#include <libusb.h>
+
+#include "usbtrans.h"
+
+struct usbtrans_dev_s {
+    libusb_device_handle *handle;
+    struct libusb_transfer *rx[USBTRANS_RX_TRANSFERS];
+    struct libusb_transfer *tx[USBTRANS_TX_TRANSFERS];
+    bool tx_busy[USBTRANS_TX_TRANSFERS];
+    bool rx_idle[USBTRANS_RX_TRANSFERS]; /**< Read held back while paused. */
+    bool paused; /**< Completed reads are not resubmitted. */
+    int pending; /**< Number of transfers submitted and not yet complete. */
+    bool gone; /**< The device has failed, do not resubmit. */
+    bool closing; /**< The device is being closed. */
+    usbtrans_rx_fn *rx_cb;
+    usbtrans_gone_fn *gone_cb;
+    void *pw;
+    usbtrans_stats_t stats;
+};
+
+static libusb_context *usb_ctx;
+static usbtrans_fdadd_fn *usb_fdadd;
+static usbtrans_fdrm_fn *usb_fdrm;
+static void *usb_fdpw;
+
+static void
+libusb_pollfd_added(int fd, short events, void *user_data)
+{
+    usb_fdadd(fd, events, usb_fdpw);
+}
+
+static void
+libusb_pollfd_removed(int fd, void *user_data)
+{
+    usb_fdrm(fd, usb_fdpw);
+}
+
+/** Convert a libusb error into an errno value. */
+static int
+libusb_to_errno(int err)
+{
+    switch (err) {
+    case LIBUSB_ERROR_IO:
+        return EIO;
+    case LIBUSB_ERROR_INVALID_PARAM:
+        return EINVAL;
+    case LIBUSB_ERROR_ACCESS:
+        return EACCES;
+    case LIBUSB_ERROR_NO_DEVICE:
+    case LIBUSB_ERROR_NOT_FOUND:
+        return ENODEV;
+    case LIBUSB_ERROR_BUSY:
+        return EBUSY;
+    case LIBUSB_ERROR_TIMEOUT:
+        return ETIMEDOUT;
+    case LIBUSB_ERROR_PIPE:
+        return EPIPE;
+    case LIBUSB_ERROR_INTERRUPTED:
+        return EINTR;
+    case LIBUSB_ERROR_NO_MEM:
+        return ENOMEM;
+    case LIBUSB_ERROR_NOT_SUPPORTED:
+        return ENOSYS;
+    default:
+        return EIO;
+    }
+}
+
+/** Parse a bus or device number, skipping any leading path such as /dev/usb */
+static int
+parse_number(const char *str)
+{
+    while ((*str != 0) && !isdigit((unsigned char)*str))
+        str++;
+
+    if (*str == 0)
+        return -1;
+
+    return strtol(str, NULL, 10);
+}
+
+static void
+device_failed(usbtrans_dev_t *dev, int error)
+{
+    if (dev->gone || dev->closing)
+        return;
+
+    dev->gone = true;
+    if (dev->gone_cb != NULL)
+        dev->gone_cb(dev, error, dev->pw);
+}
+
+static void LIBUSB_CALL
+rx_complete(struct libusb_transfer *xfer)
+{
+    usbtrans_dev_t *dev = xfer->user_data;
+    int idx;
+    int r;
+
+    dev->pending--;
+
+    switch (xfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        if (xfer->actual_length > 0) {
+            dev->stats.rx_transfers++;
+            dev->stats.rx_bytes += xfer->actual_length;
+            if (!dev->closing)
+                dev->rx_cb(dev, xfer->buffer, xfer->actual_length, dev->pw);
+        }
+        break;
+
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        break;
+
+    case LIBUSB_TRANSFER_CANCELLED:
+        return;
+
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        device_failed(dev, ENODEV);
+        return;
+
+    default:
+        device_failed(dev, EIO);
+        return;
+    }
+
+    if (dev->gone || dev->closing)
+        return;
+
+    if (dev->paused) {
+        /* the reader is full, hold the read until it has room */
+        for (idx = 0; idx < USBTRANS_RX_TRANSFERS; idx++) {
+            if (dev->rx[idx] == xfer)
+                dev->rx_idle[idx] = true;
+        }
+        return;
+    }
+
+    /* keep the read in flight */
+    r = libusb_submit_transfer(xfer);
+    if (r != 0) {
+        device_failed(dev, libusb_to_errno(r));
+    } else {
+        dev->pending++;
+    }
+}
+
+static void LIBUSB_CALL
+tx_complete(struct libusb_transfer *xfer)
+{
+    usbtrans_dev_t *dev = xfer->user_data;
+    int idx;
+
+    dev->pending--;
+
+    for (idx = 0; idx < USBTRANS_TX_TRANSFERS; idx++) {
+        if (dev->tx[idx] == xfer)
+            dev->tx_busy[idx] = false;
+    }
+
+    switch (xfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        dev->stats.tx_transfers++;
+        dev->stats.tx_bytes += xfer->actual_length;
+        break;
+
+    case LIBUSB_TRANSFER_CANCELLED:
+        break;
+
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        device_failed(dev, ENODEV);
+        break;
+
+    default:
+        device_failed(dev, EIO);
+        break;
+    }
+}
+
+static void
+free_transfers(usbtrans_dev_t *dev)
+{
+    int idx;
+
+    for (idx = 0; idx < USBTRANS_RX_TRANSFERS; idx++) {
+        if (dev->rx[idx] != NULL) {
+            free(dev->rx[idx]->buffer);
+            libusb_free_transfer(dev->rx[idx]);
+        }
+    }
+    for (idx = 0; idx < USBTRANS_TX_TRANSFERS; idx++) {
+        if (dev->tx[idx] != NULL) {
+            free(dev->tx[idx]->buffer);
+            libusb_free_transfer(dev->tx[idx]);
+        }
+    }
+}
+
+/** Wait for every submitted transfer on a device to complete. */
+static void
+wait_transfers(usbtrans_dev_t *dev)
+{
+    struct timeval tv = { 0, 100000 };
+
+    while (dev->pending > 0) {
+        if (libusb_handle_events_timeout(usb_ctx, &tv) != 0)
+            break;
+    }
+}
+
+static bool
+trans_init(usbtrans_fdadd_fn *fdadd, usbtrans_fdrm_fn *fdrm, void *pw)
+{
+    const struct libusb_pollfd **pollfds;
+    int idx;
+    int r;
+
+    r = libusb_init(&usb_ctx);
+    if (r != 0) {
+        errno = libusb_to_errno(r);
+        return false;
+    }
+
+    usb_fdadd = fdadd;
+    usb_fdrm = fdrm;
+    usb_fdpw = pw;
+
+    libusb_set_pollfd_notifiers(usb_ctx, libusb_pollfd_added,
+                                libusb_pollfd_removed, NULL);
+
+    pollfds = libusb_get_pollfds(usb_ctx);
+    if (pollfds != NULL) {
+        for (idx = 0; pollfds[idx] != NULL; idx++)
+            fdadd(pollfds[idx]->fd, pollfds[idx]->events, pw);
+        free(pollfds);
+    }
+
+    return true;
+}
+
+static void
+trans_finalise(void)
+{
+    const struct libusb_pollfd **pollfds;
+    int idx;
+
+    if (usb_ctx == NULL)
+        return;
+
+    pollfds = libusb_get_pollfds(usb_ctx);
+    if (pollfds != NULL) {
+        for (idx = 0; pollfds[idx] != NULL; idx++)
+            usb_fdrm(pollfds[idx]->fd, usb_fdpw);
+        free(pollfds);
+    }
+
+    libusb_set_pollfd_notifiers(usb_ctx, NULL, NULL, NULL);
+    libusb_exit(usb_ctx);
+    usb_ctx = NULL;
+}
+
+static usbtrans_dev_t *
+trans_open(const char *bus, const char *devnum,
+           usbtrans_rx_fn *rx, usbtrans_gone_fn *gone, void *pw)
+{
+    libusb_device **list;
+    libusb_device *found = NULL;
+    struct libusb_device_descriptor desc;
+    usbtrans_dev_t *dev;
+    uint8_t drain[USBTRANS_RX_SIZE];
+    int busnum = parse_number(bus);
+    int devaddr = parse_number(devnum);
+    ssize_t cnt;
+    ssize_t idx;
+    int transferred;
+    int r;
+
+    cnt = libusb_get_device_list(usb_ctx, &list);
+    if (cnt < 0) {
+        errno = libusb_to_errno(cnt);
+        return NULL;
+    }
+
+    for (idx = 0; idx < cnt; idx++) {
+        if ((libusb_get_bus_number(list[idx]) == busnum) &&
+            (libusb_get_device_address(list[idx]) == devaddr)) {
+            found = list[idx];
+            break;
+        }
+    }
+
+    if (found == NULL) {
+        libusb_free_device_list(list, 1);
+        errno = ENODEV;
+        return NULL;
+    }
+
+    if ((libusb_get_device_descriptor(found, &desc) != 0) ||
+        (desc.idVendor != EKEY_USB_VENDOR) ||
+        (desc.idProduct != EKEY_USB_PRODUCT)) {
+        /* Found the device, but it's not an Entropy Key */
+        libusb_free_device_list(list, 1);
+        errno = ENXIO;
+        return NULL;
+    }
+
+    dev = calloc(1, sizeof(*dev));
+    if (dev == NULL) {
+        libusb_free_device_list(list, 1);
+        return NULL;
+    }
+
+    r = libusb_open(found, &dev->handle);
+    libusb_free_device_list(list, 1);
+    if (r != 0) {
+        free(dev);
+        errno = libusb_to_errno(r);
+        return NULL;
+    }
+
+    if (libusb_kernel_driver_active(dev->handle, EKEY_IFACE) == 1) {
+        r = libusb_detach_kernel_driver(dev->handle, EKEY_IFACE);
+        if ((r != 0) && (r != LIBUSB_ERROR_NOT_FOUND)) {
+            libusb_close(dev->handle);
+            free(dev);
+            errno = libusb_to_errno(r);
+            return NULL;
+        }
+    }
+
+    r = libusb_claim_interface(dev->handle, EKEY_IFACE);
+    if (r != 0) {
+        libusb_close(dev->handle);
+        free(dev);
+        errno = (r == LIBUSB_ERROR_BUSY) ? EBUSY : libusb_to_errno(r);
+        return NULL;
+    }
+
+    /* Drain input buffer */
+    while (libusb_bulk_transfer(dev->handle,
+                                LIBUSB_ENDPOINT_IN | EKEY_EP_TOHOST,
+                                drain, sizeof(drain), &transferred, 500) == 0) {
+        if (transferred == 0)
+            break;
+    }
+
+    dev->rx_cb = rx;
+    dev->gone_cb = gone;
+    dev->pw = pw;
+
+    for (idx = 0; idx < USBTRANS_RX_TRANSFERS; idx++) {
+        dev->rx[idx] = libusb_alloc_transfer(0);
+        if (dev->rx[idx] == NULL)
+            goto fail;
+        libusb_fill_bulk_transfer(dev->rx[idx], dev->handle,
+                                  LIBUSB_ENDPOINT_IN | EKEY_EP_TOHOST,
+                                  malloc(USBTRANS_RX_SIZE), USBTRANS_RX_SIZE,
+                                  rx_complete, dev, 0);
+        if (dev->rx[idx]->buffer == NULL)
+            goto fail;
+    }
+
+    for (idx = 0; idx < USBTRANS_TX_TRANSFERS; idx++) {
+        dev->tx[idx] = libusb_alloc_transfer(0);
+        if (dev->tx[idx] == NULL)
+            goto fail;
+        libusb_fill_bulk_transfer(dev->tx[idx], dev->handle,
+                                  LIBUSB_ENDPOINT_OUT | EKEY_EP_TODEVICE,
+                                  malloc(USBTRANS_TX_SIZE), 0,
+                                  tx_complete, dev, 0);
+        if (dev->tx[idx]->buffer == NULL)
+            goto fail;
+    }
+
+    /* Several reads are kept in flight so the device is never waiting
+     * for the host to queue the next one.
+     */
+    for (idx = 0; idx < USBTRANS_RX_TRANSFERS; idx++) {
+        r = libusb_submit_transfer(dev->rx[idx]);
+        if (r != 0) {
+            dev->closing = true;
+            for (idx--; idx >= 0; idx--)
+                libusb_cancel_transfer(dev->rx[idx]);
+            wait_transfers(dev);
+            errno = libusb_to_errno(r);
+            goto fail;
+        }
+        dev->pending++;
+    }
+
+    return dev;
+
+fail:
+    r = errno;
+    free_transfers(dev);
+    libusb_release_interface(dev->handle, EKEY_IFACE);
+    libusb_close(dev->handle);
+    free(dev);
+    errno = (r == 0) ? ENOMEM : r;
+    return NULL;
+}
+
+static void
+trans_pause(usbtrans_dev_t *dev, bool paused)
+{
+    int idx;
+    int r;
+
+    dev->paused = paused;
+    if (paused)
+        return;
+
+    for (idx = 0; idx < USBTRANS_RX_TRANSFERS; idx++) {
+        if (!dev->rx_idle[idx] || dev->gone)
+            continue;
+        dev->rx_idle[idx] = false;
+        r = libusb_submit_transfer(dev->rx[idx]);
+        if (r != 0) {
+            device_failed(dev, libusb_to_errno(r));
+            return;
+        }
+        dev->pending++;
+    }
+}
+
+static void
+trans_close(usbtrans_dev_t *dev)
+{
+    int idx;
+
+    dev->closing = true;
+
+    for (idx = 0; idx < USBTRANS_RX_TRANSFERS; idx++)
+        libusb_cancel_transfer(dev->rx[idx]);
+    for (idx = 0; idx < USBTRANS_TX_TRANSFERS; idx++) {
+        if (dev->tx_busy[idx])
+            libusb_cancel_transfer(dev->tx[idx]);
+    }
+
+    wait_transfers(dev);
+
+    free_transfers(dev);
+    libusb_release_interface(dev->handle, EKEY_IFACE);
+    libusb_close(dev->handle);
+    free(dev);
+}
+
+static ssize_t
+trans_write(usbtrans_dev_t *dev, const void *buf, size_t count)
+{
+    const uint8_t *src = buf;
+    size_t done = 0;
+    size_t chunk;
+    int idx;
+    int r;
+
+    if (dev->gone) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    for (idx = 0; (idx < USBTRANS_TX_TRANSFERS) && (done < count); idx++) {
+        if (dev->tx_busy[idx])
+            continue;
+
+        chunk = count - done;
+        if (chunk > USBTRANS_TX_SIZE)
+            chunk = USBTRANS_TX_SIZE;
+
+        memcpy(dev->tx[idx]->buffer, src + done, chunk);
+        dev->tx[idx]->length = chunk;
+
+        r = libusb_submit_transfer(dev->tx[idx]);
+        if (r != 0) {
+            if (done > 0)
+                break;
+            errno = libusb_to_errno(r);
+            return -1;
+        }
+        dev->tx_busy[idx] = true;
+        dev->pending++;
+        done += chunk;
+    }
+
+    if (done == 0) {
+        dev->stats.tx_busy++;
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    return done;
+}
+
+static int
+trans_timeout(void)
+{
+    struct timeval tv;
+
+    if (libusb_get_next_timeout(usb_ctx, &tv) != 1)
+        return -1;
+
+    return (tv.tv_sec * 1000) + ((tv.tv_usec + 999) / 1000);
+}
+
+static void
+trans_handle_events(void)
+{
+    struct timeval tv = { 0, 0 };
+
+    libusb_handle_events_timeout(usb_ctx, &tv);
+}
+
+static const usbtrans_stats_t *
+trans_stats(usbtrans_dev_t *dev)
+{
+    return &dev->stats;
+}
+
+/* exported interface, documented in usbtrans.h */
+const usbtrans_ops_t usbtrans_libusb = {
+    .name = "libusb",
+    .init = trans_init,
+    .finalise = trans_finalise,
+    .open = trans_open,
+    .close = trans_close,
+    .write = trans_write,
+    .pause = trans_pause,
+    .timeout = trans_timeout,
+    .handle_events = trans_handle_events,
+    .stats = trans_stats,
+};
@@ -0,0 +1,76 @@
+/* daemon/util-test.c
+ *
+ * Check network addresses are split into host and port.
+ *
+ * Copyright 2026 agent
+ *
+ * For licence terms refer to the COPYING file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "util.h"
+#include "check.h"
+
+/** Whether an address splits into the expected host and port. */
+static bool
+splits(const char *spec, const char *defport, const char *host,
+       const char *port)
+{
+    char *gothost;
+    char *gotport;
+    bool ok;
+
+    if (!split_hostport(spec, defport, &gothost, &gotport))
+        return false;
+
+    ok = (strcmp(gothost, host) == 0) && (strcmp(gotport, port) == 0);
+    free(gothost);
+    free(gotport);
+    return ok;
+}
+
+/** Whether an address is refused as malformed. */
+static bool
+refused(const char *spec, const char *defport)
+{
+    char *host;
+    char *port;
+
+    if (split_hostport(spec, defport, &host, &port)) {
+        free(host);
+        free(port);
+        return false;
+    }
+    return errno == EINVAL;
+}
+
+int
+main(void)
+{
+    CHECK(splits("localhost:8888", NULL, "localhost", "8888"));
+    CHECK(splits("10.0.0.1:egd", NULL, "10.0.0.1", "egd"));
+    CHECK(splits("[::1]:8888", NULL, "::1", "8888"));
+
+    /* the default port stands in for a missing or empty one */
+    CHECK(splits("localhost", "8888", "localhost", "8888"));
+    CHECK(splits("localhost:", "8888", "localhost", "8888"));
+    CHECK(splits("[fe80::1]", "8888", "fe80::1", "8888"));
+    CHECK(splits("fe80::1", "8888", "fe80::1", "8888"));
+
+    /* more than one colon is a bare IPv6 address, never a port */
+    CHECK(refused("fe80::1:8888", NULL));
+    CHECK(refused("localhost", NULL));
+    CHECK(refused("localhost:", NULL));
+    CHECK(refused(":8888", NULL));
+    CHECK(refused("[]:8888", NULL));
+    CHECK(refused("[::1", "8888"));
+    CHECK(refused("[::1]8888", NULL));
+
+    return check_result("util");
+}
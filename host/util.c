@@ -8,9 +8,16 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #include "util.h"
 
+#ifndef EKEY_ENGINE
+/* phex returns a shared buffer, so it is left out of the engine library */
 static char hexa[16] = "0123456789ABCDEF";
 
 /* exported interface, documented in util.h */
@@ -26,3 +33,60 @@ phex(uint8_t *c, int l)
     text[loop*2] = 0;
     return text;
 }
+#endif
+
+/* exported interface, documented in util.h */
+uint64_t
+monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* exported interface, documented in util.h */
+bool
+split_hostport(const char *spec, const char *defport, char **host, char **port)
+{
+    const char *end;
+    const char *colon = NULL;
+    size_t len;
+
+    if (*spec == '[') {
+        /* bracketed numeric IPv6 address */
+        end = strchr(spec, ']');
+        if ((end == NULL) || ((end[1] != 0) && (end[1] != ':'))) {
+            errno = EINVAL;
+            return false;
+        }
+        spec++;
+        len = end - spec;
+        if (end[1] == ':')
+            colon = end + 1;
+    } else {
+        /* a single colon separates the port, more is a bare IPv6 address */
+        colon = strchr(spec, ':');
+        if ((colon != NULL) && (strchr(colon + 1, ':') != NULL))
+            colon = NULL;
+        len = (colon != NULL) ? (size_t)(colon - spec) : strlen(spec);
+    }
+
+    if ((colon != NULL) && (colon[1] != 0))
+        defport = colon + 1;
+    if ((len == 0) || (defport == NULL)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    *host = strndup(spec, len);
+    if (*host == NULL)
+        return false;
+    *port = strdup(defport);
+    if (*port == NULL) {
+        free(*host);
+        return false;
+    }
+
+    return true;
+}
@@ -20,4 +20,27 @@
  */
 extern char *phex(uint8_t *c, int l);
 
+/** Obtain the current time from a monotonic clock.
+ *
+ * @return The time in milliseconds from an arbitrary fixed point.
+ */
+extern uint64_t monotonic_ms(void);
+
+/** Split a network address into its host and port.
+ *
+ * The address is of the form host[:port] where the host is a name, a
+ * numeric IPv4 address or a numeric IPv6 address in brackets.  A bare IPv6
+ * address, which has more than one colon, is taken to have no port.
+ *
+ * @param spec The address to split.
+ * @param defport The port to use if the address has none, or NULL if a port
+ *                must be given.
+ * @param host Updated with the host, which the caller must free.
+ * @param port Updated with the port, which the caller must free.
+ * @return true on success else false and errno set, EINVAL indicates the
+ *         address is malformed.
+ */
+extern bool split_hostport(const char *spec, const char *defport,
+                           char **host, char **port);
+
 #endif /* DAEMON_UTIL_H */